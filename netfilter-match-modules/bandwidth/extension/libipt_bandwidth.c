@@ -30,6 +30,8 @@
 #include <time.h>
 #include <sys/time.h>
 #include <limits.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 /*
  * in iptables 1.4.0 and higher, iptables.h includes xtables.h, which
@@ -61,17 +63,34 @@
 int get_minutes_west(void);
 void set_kernel_timezone(void);
 int parse_sub(char* subnet_string, uint32_t* subnet, uint32_t* subnet_mask);
+int parse_sub6(char* subnet_string, uint32_t* subnet, uint32_t* subnet_mask);
+int parse_hires(char* hires_string, uint32_t* interval, uint32_t* slots, uint32_t* hosts);
+int parse_remote_prefix(char* prefix_string, uint32_t* prefix, uint32_t* max_prefixes);
 static unsigned long get_pow(unsigned long base, unsigned long pow);
 static void param_problem_exit_error(char* msg);
 
 
+/*
+ * libip6t_bandwidth.c defines BANDWIDTH_IPV6 and includes this file,
+ * the ip6tables extension only differs in how --subnet is parsed/printed
+ * and in how long a --remote_prefix may be
+ */
+#ifdef BANDWIDTH_IPV6
+	#define BANDWIDTH_SUBNET_USAGE	"a:b:c::d/mask] (0 < mask < 128)"
+	#define BANDWIDTH_MAX_PREFIX	128
+#else
+	#define BANDWIDTH_SUBNET_USAGE	"a.b.c.d/mask] (0 < mask < 32)"
+	#define BANDWIDTH_MAX_PREFIX	32
+#endif
+
+
 /* Function which prints out usage message. */
 static void help(void)
 {
 	printf("bandwidth options:\n");
 	printf("  --id [unique identifier for querying bandwidth]\n");
 	printf("  --type [combined|individual_src|individual_dst|individual_local|individual_remote]\n");
-	printf("  --subnet [a.b.c.d/mask] (0 < mask < 32)\n");
+	printf("  --subnet [" BANDWIDTH_SUBNET_USAGE "\n");
 	printf("  --greater_than [BYTES]\n");
 	printf("  --less_than [BYTES]\n");
 	printf("  --current_bandwidth [BYTES]\n");
@@ -79,6 +98,12 @@ static void help(void)
 	printf("  --reset_time [OFFSET IN SECONDS]\n");
 	printf("  --intervals_to_save [NUMBER OF PREVIOS INTERVALS TO STORE IN MEMORY]\n");
 	printf("  --last_backup_time [UTC SECONDS SINCE 1970]\n");
+	printf("  --precise Always update totals immediately, never count on per-cpu slots\n");
+	printf("  --slack [BYTES] Bytes each cpu may count per ip before updating totals (quotas only, default 0)\n");
+	printf("  --hires [SECONDS[s]:SLOTS[:HOSTS]] Also count bytes per SECONDS over the last SLOTS intervals, for up to HOSTS ips at a time (default %d)\n", BANDWIDTH_HIRES_DEFAULT_HOSTS);
+	printf("  --topk [K] Keep track of the K ips with the highest totals (individual types only, at most %d)\n", BANDWIDTH_TOPK_MAX);
+	printf("  --remote_prefix [LENGTH[:MAX]] Count remote ips by prefixes of LENGTH bits, keeping at most MAX of them (individual_remote only)\n");
+	printf("  --prealloc [NUMBER] Allocate entries for NUMBER ips up front, e.g. the number of hosts in --subnet (at most %d)\n", BANDWIDTH_PREALLOC_MAX);
 	printf("  --bcheck Check another bandwidth rule without incrementing it\n");
 	printf("  --bcheck_with_src_dst_swap Check another bandwidth rule without incrementing it, swapping src & dst ips for check\n");
 }
@@ -95,6 +120,12 @@ static struct option opts[] =
 	{ .name = "reset_time",			.has_arg = 1, .flag = 0, .val = BANDWIDTH_RESET_TIME },
 	{ .name = "intervals_to_save",		.has_arg = 1, .flag = 0, .val = BANDWIDTH_NUM_INTERVALS },
 	{ .name = "last_backup_time",		.has_arg = 1, .flag = 0, .val = BANDWIDTH_LAST_BACKUP},
+	{ .name = "precise",			.has_arg = 0, .flag = 0, .val = BANDWIDTH_PRECISE },
+	{ .name = "slack",			.has_arg = 1, .flag = 0, .val = BANDWIDTH_SLACK },
+	{ .name = "hires",			.has_arg = 1, .flag = 0, .val = BANDWIDTH_HIRES },
+	{ .name = "topk",			.has_arg = 1, .flag = 0, .val = BANDWIDTH_TOPK },
+	{ .name = "remote_prefix",		.has_arg = 1, .flag = 0, .val = BANDWIDTH_REMOTE_PREFIX },
+	{ .name = "prealloc",			.has_arg = 1, .flag = 0, .val = BANDWIDTH_PREALLOC },
 	{ .name = "bcheck",	 		.has_arg = 0, .flag = 0, .val = BANDWIDTH_CHECK_NOSWAP },
 	{ .name = "bcheck_with_src_dst_swap",	.has_arg = 0, .flag = 0, .val = BANDWIDTH_CHECK_SWAP },
 	{ .name = 0 }
@@ -134,6 +165,8 @@ static int parse(	int c,
 		info->check_type = BANDWIDTH_CHECK_NOSWAP;
 		info->local_subnet = 0;
 		info->local_subnet_mask = 0;
+		memset(info->local_subnet6, 0, sizeof(info->local_subnet6));
+		memset(info->local_subnet6_mask, 0, sizeof(info->local_subnet6_mask));
 		info->cmp = BANDWIDTH_MONITOR; /* don't test greater/less than, just monitor bandwidth */
 		info->current_bandwidth = 0;
 		info->reset_is_constant_interval = 0;
@@ -144,10 +177,24 @@ static int parse(	int c,
 		
 		info->num_intervals_to_save=0;
 
+		info->precise = 0;
+		info->slack = 0;
+
+		info->hires_interval = 0;
+		info->hires_slots = 0;
+		info->hires_hosts = 0;
+
+		info->topk = 0;
+
+		info->remote_prefix = 0;
+		info->remote_max = 0;
+
+		info->prealloc = 0;
+
 		info->non_const_self = NULL;
 		info->ref_count = NULL;
 
-		*flags = *flags + BANDWIDTH_INITIALIZED;
+		*flags |= BANDWIDTH_INITIALIZED;
 	}
 
 	switch (c)
@@ -177,12 +224,12 @@ static int parse(	int c,
 			else if(strcmp(optarg, "individual_local") == 0)
 			{
 				info->type = BANDWIDTH_INDIVIDUAL_LOCAL;
-				*flags = *flags + BANDWIDTH_REQUIRES_SUBNET;
+				*flags |= BANDWIDTH_REQUIRES_SUBNET;
 			}
 			else if(strcmp(optarg, "individual_remote") == 0)
 			{
 				info->type = BANDWIDTH_INDIVIDUAL_REMOTE;
-				*flags = *flags + BANDWIDTH_REQUIRES_SUBNET;
+				*flags |= BANDWIDTH_REQUIRES_SUBNET;
 			}
 			else
 			{
@@ -193,7 +240,14 @@ static int parse(	int c,
 			break;
 
 		case BANDWIDTH_SUBNET:
-			valid_arg =  parse_sub(optarg, &(info->local_subnet), &(info->local_subnet_mask));
+			if( (*flags & BANDWIDTH_SUBNET) == 0 )
+			{
+#ifdef BANDWIDTH_IPV6
+				valid_arg =  parse_sub6(optarg, info->local_subnet6, info->local_subnet6_mask);
+#else
+				valid_arg =  parse_sub(optarg, &(info->local_subnet), &(info->local_subnet_mask));
+#endif
+			}
 			break;
 		case BANDWIDTH_LT:
 			num_read = sscanf(argv[optind-1], "%lld", &read_64);
@@ -235,14 +289,14 @@ static int parse(	int c,
 			break;
 		case BANDWIDTH_CURRENT:
 			num_read = sscanf(argv[optind-1], "%lld", &read_64);
-			if(num_read > 0 )
+			if(num_read > 0 && (*flags & BANDWIDTH_CURRENT) == 0)
 			{
 				info->current_bandwidth = read_64;
 				valid_arg = 1;
 			}
 			break;
 		case BANDWIDTH_RESET_INTERVAL:
-			valid_arg = 1;
+			valid_arg = (*flags & BANDWIDTH_RESET_INTERVAL) == 0 ? 1 : 0;
 			if(strcmp(argv[optind-1],"minute") ==0)
 			{
 				info->reset_interval = BANDWIDTH_MINUTE;
@@ -292,7 +346,7 @@ static int parse(	int c,
 			break;
 		case BANDWIDTH_RESET_TIME:
 			num_read = sscanf(argv[optind-1], "%ld", &read_time);
-			if(num_read > 0 )
+			if(num_read > 0 && (*flags & BANDWIDTH_RESET_TIME) == 0)
 			{
 				info->reset_time = read_time;
 				valid_arg = 1;
@@ -300,14 +354,55 @@ static int parse(	int c,
 			break;
 		case BANDWIDTH_LAST_BACKUP:
 			num_read = sscanf(argv[optind-1], "%ld", &read_time);
-			if(num_read > 0 )
+			if(num_read > 0 && (*flags & BANDWIDTH_LAST_BACKUP) == 0)
 			{
 				info->last_backup_time = read_time;
 				valid_arg = 1;
 			}
 			break;
+		case BANDWIDTH_PRECISE:
+			if( (*flags & BANDWIDTH_PRECISE) == 0 )
+			{
+				info->precise = 1;
+				valid_arg = 1;
+			}
+			break;
+		case BANDWIDTH_SLACK:
+			num_read = sscanf(argv[optind-1], "%lld", &read_64);
+			if(num_read > 0 && (*flags & BANDWIDTH_SLACK) == 0)
+			{
+				info->slack = read_64;
+				valid_arg = 1;
+			}
+			break;
+		case BANDWIDTH_HIRES:
+			if( (*flags & BANDWIDTH_HIRES) == 0 )
+			{
+				valid_arg = parse_hires(argv[optind-1], &(info->hires_interval), &(info->hires_slots), &(info->hires_hosts));
+			}
+			break;
+		case BANDWIDTH_TOPK:
+			if( sscanf(argv[optind-1], "%ld", &num_read) > 0 && num_read > 0 && num_read <= BANDWIDTH_TOPK_MAX && (*flags & BANDWIDTH_TOPK) == 0)
+			{
+				info->topk = num_read;
+				valid_arg = 1;
+			}
+			break;
+		case BANDWIDTH_REMOTE_PREFIX:
+			if( (*flags & BANDWIDTH_REMOTE_PREFIX) == 0 )
+			{
+				valid_arg = parse_remote_prefix(argv[optind-1], &(info->remote_prefix), &(info->remote_max));
+			}
+			break;
+		case BANDWIDTH_PREALLOC:
+			if( sscanf(argv[optind-1], "%ld", &num_read) > 0 && num_read > 0 && num_read <= BANDWIDTH_PREALLOC_MAX && (*flags & BANDWIDTH_PREALLOC) == 0)
+			{
+				info->prealloc = num_read;
+				valid_arg = 1;
+			}
+			break;
 	}
-	*flags = *flags + (unsigned int)c;
+	*flags |= (unsigned int)c;
 
 
 	//if we have both reset_interval & reset_time, check reset_time is in valid range
@@ -395,6 +490,19 @@ static void print_bandwidth_args( struct ipt_bandwidth_info* info )
 			}
 			printf("--subnet %u.%u.%u.%u/%u ", (unsigned char)sub[0], (unsigned char)sub[1], (unsigned char)sub[2], (unsigned char)sub[3], msk_bits); 
 		}
+		if(info->local_subnet6_mask[0] != 0 || info->local_subnet6_mask[1] != 0 || info->local_subnet6_mask[2] != 0 || info->local_subnet6_mask[3] != 0)
+		{
+			char sub6[INET6_ADDRSTRLEN];
+			unsigned char* msk = (unsigned char*)(info->local_subnet6_mask);
+			int msk_bits=0;
+			int bit;
+			for(bit=0; bit<128; bit++)
+			{
+				msk_bits = (msk[bit/8] & (0x80 >> (bit%8))) ? msk_bits+1 : msk_bits;
+			}
+			inet_ntop(AF_INET6, info->local_subnet6, sub6, sizeof(sub6));
+			printf("--subnet %s/%u ", sub6, msk_bits);
+		}
 		if(info->cmp == BANDWIDTH_GT)
 		{
 			printf("--greater_than %lld ", info->bandwidth_cutoff);
@@ -453,6 +561,37 @@ static void print_bandwidth_args( struct ipt_bandwidth_info* info )
 		{
 			printf("--intervals_to_save %d ", info->num_intervals_to_save);
 		}
+		if(info->precise)
+		{
+			printf("--precise ");
+		}
+		else if(info->slack > 0)
+		{
+			printf("--slack %lld ", info->slack);
+		}
+		if(info->hires_interval > 0)
+		{
+			printf("--hires %us:%u:%u ", info->hires_interval, info->hires_slots, info->hires_hosts);
+		}
+		if(info->topk > 0)
+		{
+			printf("--topk %u ", info->topk);
+		}
+		if(info->remote_prefix > 0)
+		{
+			if(info->remote_max > 0)
+			{
+				printf("--remote_prefix %u:%u ", info->remote_prefix, info->remote_max);
+			}
+			else
+			{
+				printf("--remote_prefix %u ", info->remote_prefix);
+			}
+		}
+		if(info->prealloc > 0)
+		{
+			printf("--prealloc %u ", info->prealloc);
+		}
 	}
 }
 
@@ -471,7 +610,11 @@ static void final_check(unsigned int flags)
 	}
 	if( (flags & BANDWIDTH_REQUIRES_SUBNET) == BANDWIDTH_REQUIRES_SUBNET && (flags & BANDWIDTH_SUBNET) == 0 )
 	{
-		param_problem_exit_error("You must specify a local subnet (--subnet a.b.c.d/mask) to match individual local/remote IPs ");
+		param_problem_exit_error("You must specify a local subnet (--subnet " BANDWIDTH_SUBNET_USAGE ") to match individual local/remote IPs ");
+	}
+	if( (flags & BANDWIDTH_PRECISE) != 0 && (flags & BANDWIDTH_SLACK) != 0 )
+	{
+		param_problem_exit_error("You may not specify both '--precise' and '--slack' ");
 	}
 
 	/* update timezone minutes_west in kernel to match userspace*/
@@ -606,6 +749,96 @@ int parse_sub(char* subnet_string, uint32_t* subnet, uint32_t* subnet_mask)
 	return valid;
 }
 
+/* subnet_string is a:b:c::d/bits, subnet and subnet_mask are 4 words in network order */
+int parse_sub6(char* subnet_string, uint32_t* subnet, uint32_t* subnet_mask)
+{
+	int valid = 0;
+	char addr_string[INET6_ADDRSTRLEN];
+	struct in6_addr addr;
+	unsigned int mask = 128;
+	char* slash = strchr(subnet_string, '/');
+	size_t addr_length = slash == NULL ? strlen(subnet_string) : (size_t)(slash - subnet_string);
+
+	if(addr_length < sizeof(addr_string))
+	{
+		memcpy(addr_string, subnet_string, addr_length);
+		addr_string[addr_length] = '\0';
+		valid = inet_pton(AF_INET6, addr_string, &addr) == 1 ? 1 : 0;
+		if(valid && slash != NULL)
+		{
+			valid = sscanf(slash+1, "%u", &mask) == 1 && mask <= 128 ? 1 : 0;
+		}
+	}
+	if(valid)
+	{
+		unsigned char* sub = (unsigned char*)(subnet);
+		unsigned char* msk = (unsigned char*)(subnet_mask);
+		int byte_index;
+		memcpy(sub, &addr, 16);
+		for(byte_index=0; byte_index < 16; byte_index++)
+		{
+			unsigned int byte_bits = mask > byte_index*8 ? mask - byte_index*8 : 0;
+			msk[byte_index] = byte_bits >= 8 ? 0xFF : (unsigned char)(0xFF << (8-byte_bits));
+			sub[byte_index] = sub[byte_index] & msk[byte_index];
+		}
+	}
+	return valid;
+}
+
+
+/* 
+ * hires_string is SECONDS[s]:SLOTS[:HOSTS], e.g. 10s:360 keeps the
+ * last hour in 10 second slots for the default number of hosts
+ */
+int parse_hires(char* hires_string, uint32_t* interval, uint32_t* slots, uint32_t* hosts)
+{
+	unsigned int read_interval = 0;
+	unsigned int read_slots = 0;
+	unsigned int read_hosts = BANDWIDTH_HIRES_DEFAULT_HOSTS;
+	char unit[2];
+	int valid = 0;
+
+	if(sscanf(hires_string, "%u:%u:%u", &read_interval, &read_slots, &read_hosts) >= 2)
+	{
+		valid = 1;
+	}
+	else if(sscanf(hires_string, "%u%1[s]:%u:%u", &read_interval, unit, &read_slots, &read_hosts) >= 3)
+	{
+		valid = 1;
+	}
+	valid = valid && read_interval > 0 && read_slots > 0 && read_hosts > 0 ? 1 : 0;
+	if(valid && ((uint64_t)read_slots)*read_hosts > BANDWIDTH_HIRES_MAX_COUNTERS)
+	{
+		param_problem_exit_error("Parameter for '--hires' is too large, SLOTS*HOSTS may be at most 1048576");
+	}
+	if(valid)
+	{
+		*interval = read_interval;
+		*slots = read_slots;
+		*hosts = read_hosts;
+	}
+	return valid;
+}
+
+
+/* prefix_string is LENGTH[:MAX], e.g. 24:4096 */
+int parse_remote_prefix(char* prefix_string, uint32_t* prefix, uint32_t* max_prefixes)
+{
+	unsigned int read_prefix = 0;
+	unsigned int read_max = 0;
+	int valid = sscanf(prefix_string, "%u:%u", &read_prefix, &read_max) >= 1 ? 1 : 0;
+	valid = valid && read_prefix > 0 && read_prefix <= BANDWIDTH_MAX_PREFIX ? 1 : 0;
+	if(valid && read_max > BANDWIDTH_REMOTE_MAX_PREFIXES)
+	{
+		param_problem_exit_error("Parameter for '--remote_prefix' is too large, MAX may be at most 65536");
+	}
+	if(valid)
+	{
+		*prefix = read_prefix;
+		*max_prefixes = read_max;
+	}
+	return valid;
+}
 
 
 int get_minutes_west(void)
@@ -644,6 +877,8 @@ void set_kernel_timezone(void)
 	struct timeval tv;
 	struct timezone old_tz;
 	struct timezone new_tz;
+	int32_t minutes_west;
+	int sockfd;
 
 	new_tz.tz_minuteswest = get_minutes_west();;
 	new_tz.tz_dsttime = 0;
@@ -654,4 +889,13 @@ void set_kernel_timezone(void)
 
 	/* set timezone */
 	settimeofday(&tv, &new_tz);
+
+	/* and tell the module directly, if it's loaded, rather than waiting for it to notice */
+	minutes_west = new_tz.tz_minuteswest;
+	sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	if(sockfd >= 0)
+	{
+		setsockopt(sockfd, IPPROTO_IP, BANDWIDTH_SET_TIMEZONE, &minutes_west, sizeof(minutes_west));
+		close(sockfd);
+	}
 }
@@ -32,6 +32,12 @@
 #define BANDWIDTH_RESET_INTERVAL	  32
 #define BANDWIDTH_RESET_TIME		  64
 #define BANDWIDTH_LAST_BACKUP		 128
+#define BANDWIDTH_PRECISE		 256
+#define BANDWIDTH_SLACK			 512
+#define BANDWIDTH_HIRES			1024
+#define BANDWIDTH_TOPK			2048
+#define BANDWIDTH_REMOTE_PREFIX		4096
+#define BANDWIDTH_PREALLOC		8192
 
 
 /* parameter defs that don't map to flag bits */
@@ -66,6 +72,41 @@
 #define BANDWIDTH_SET 			2048
 #define BANDWIDTH_GET 			2049
 
+/* same as above, but every ip in requests/responses is 16 bytes (IPv4 addresses are sent v4-mapped) */
+#define BANDWIDTH_SET6 			2050
+#define BANDWIDTH_GET6 			2051
+
+/* all ips of one or more rules in a single call, see get_snapshot in ipt_bandwidth.c */
+#define BANDWIDTH_GET_SNAPSHOT		2052
+#define BANDWIDTH_SNAPSHOT_HISTORY	   1
+#define BANDWIDTH_SNAPSHOT_IP6		   2
+#define BANDWIDTH_SNAPSHOT_COUNTERS	   4 /* rx/tx bytes & packets after each ip's total */
+
+/* sub-minute per-ip byte counts of a --hires rule, see get_hires in ipt_bandwidth.c */
+#define BANDWIDTH_GET_HIRES		2053
+
+/* the --topk ips with the highest current totals, see get_topk in ipt_bandwidth.c */
+#define BANDWIDTH_GET_TOPK		2054
+#define BANDWIDTH_TOPK_MAX		1024
+
+/* set the local timezone (an int32_t of minutes west of UTC), which the module applies on its own time */
+#define BANDWIDTH_SET_TIMEZONE		2055
+
+/* 
+ * individual_remote rules with --remote_prefix count remote ips per prefix,
+ * and once remote_max prefixes are kept, the least recently used one is
+ * folded into the bucket for the all-ones address (255.255.255.255 or
+ * ffff:ffff:...:ffff), which holds everything that has been evicted
+ */
+#define BANDWIDTH_REMOTE_MAX_PREFIXES	65536
+
+/* max number of per-ip entries a rule can --prealloc */
+#define BANDWIDTH_PREALLOC_MAX		65536
+
+/* --hires defaults & limits */
+#define BANDWIDTH_HIRES_DEFAULT_HOSTS	  32
+#define BANDWIDTH_HIRES_MAX_COUNTERS	(1024*1024) /* hires_slots*hires_hosts */
+
 /* max id length */
 #define BANDWIDTH_MAX_ID_LENGTH		  50
 
@@ -81,6 +122,8 @@ struct ipt_bandwidth_info
 	unsigned char check_type;
 	uint32_t local_subnet;
 	uint32_t local_subnet_mask;
+	uint32_t local_subnet6[4]; //used instead of local_subnet by ip6tables rules
+	uint32_t local_subnet6_mask[4];
 
 	unsigned char cmp;
 	unsigned char reset_is_constant_interval;
@@ -94,7 +137,22 @@ struct ipt_bandwidth_info
 
 	uint32_t num_intervals_to_save;
 
+	unsigned char precise; //if set, never use per-cpu accumulation for this rule
+	uint64_t slack; //bytes each cpu may count per ip before folding them into totals, 0 = quota rules are precise
+
+	uint32_t hires_interval; //seconds per high resolution slot, 0 = no high resolution history
+	uint32_t hires_slots; //number of slots in each ip's ring
+	uint32_t hires_hosts; //number of ips that can have a ring at once
+
+	uint32_t topk; //number of ips with the highest totals to keep track of, 0 = none
+
+	uint32_t remote_prefix; //individual_remote rules count remote ips by prefixes of this length, 0 = each ip on its own
+	uint32_t remote_max; //max number of remote prefixes kept at once, 0 = no limit
+
+	uint32_t prealloc; //number of per-ip entries to allocate when rule is inserted (e.g. hosts in local subnet), 0 = none
+
 
+	unsigned char family; //NFPROTO_IPV4 or NFPROTO_IPV6, set by kernel when rule is inserted
 	unsigned long hashed_id;
 	void* iam;
 	uint64_t* combined_bw;
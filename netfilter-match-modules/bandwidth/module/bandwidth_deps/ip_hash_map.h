@@ -0,0 +1,461 @@
+/*  ip_hash_map --	open addressing hash table keyed by IPv4 or IPv6 address
+ *  			Used by ipt_bandwidth to find per-ip records without
+ *  			walking (and allocating) tree nodes in the packet path
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Keys and value pointers live side by side in one flat array, so a lookup
+ * is a hash and (usually) a single cache line.  Collisions are resolved by
+ * linear probing, and removal shifts later entries of the same run back
+ * instead of leaving tombstones.  A slot is empty when its value is NULL,
+ * which means NULL values can't be stored, but 0 is a perfectly good key
+ * (ipt_bandwidth uses it for combined totals).
+ *
+ * Keys are 128 bits, held as two 64 bit words so comparing them is two
+ * integer compares rather than a memcmp.  An IPv4 address goes in the
+ * low word with the high word zero, and is hashed exactly as a plain
+ * 32 bit key would be, so IPv4 lookups cost the same as they always did.
+ * An IPv6 address is stored as its raw bytes.  Use ipv4_ip_key and
+ * ipv6_ip_key to build keys.
+ *
+ * Unlike long_map, iteration order is arbitrary -- call
+ * get_sorted_ip_hash_map_keys when order matters.  As with long_map, the
+ * map must not be modified from within apply_to_every_ip_hash_map_value.
+ * To walk the map a piece at a time, or to remove elements as you go, use
+ * get_next_ip_hash_map_element with a slot index that you keep yourself.
+ *
+ * Like everything else in ipt_bandwidth this is called with bandwidth_lock
+ * held, so growing a table from set_ip_hash_map_element is a GFP_ATOMIC
+ * allocation, and is only tried while the table is small.  Larger tables
+ * are vmalloc'd where we can sleep: initialize_ip_hash_map sizes a table
+ * up front, and ipt_bandwidth's reset worker grows any table that
+ * get_ip_hash_map_wanted_capacity says is getting full, swapping the new
+ * slots in with replace_ip_hash_map_slots.  Once a table is 3/4 full and
+ * can't grow, sets of new keys fail rather than let probe runs get long.
+ * Since slots may be vmalloc'd, destroy_ip_hash_map must be called
+ * without bandwidth_lock held.
+ */
+
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/sort.h>
+
+#define IP_HASH_MAP_MIN_CAPACITY	16
+
+/* largest table (in slots) that is kmalloc'd, and grown with an atomic allocation when it fills up */
+#define IP_HASH_MAP_MAX_ATOMIC_CAPACITY	4096
+
+typedef struct ip_key_struct
+{
+	uint64_t hi;
+	uint64_t lo;
+} ip_key;
+
+typedef struct ip_hash_map_slot_struct
+{
+	ip_key key;
+	void* value;
+} ip_hash_map_slot;
+
+typedef struct
+{
+	ip_hash_map_slot* slots;
+	uint32_t capacity; /* always a power of 2 */
+	uint32_t seed;
+	unsigned long num_elements;
+} ip_hash_map;
+
+
+static ip_hash_map* initialize_ip_hash_map(unsigned long num_elements);
+static void* get_ip_hash_map_element(ip_hash_map* map, ip_key key);
+static void* set_ip_hash_map_element(ip_hash_map* map, ip_key key, void* value);
+static void* remove_ip_hash_map_element(ip_hash_map* map, ip_key key);
+static uint32_t get_ip_hash_map_wanted_capacity(ip_hash_map* map);
+static ip_hash_map_slot* alloc_ip_hash_map_slots(uint32_t capacity, int can_sleep);
+static void free_ip_hash_map_slots(ip_hash_map_slot* slots, uint32_t capacity);
+static ip_hash_map_slot* replace_ip_hash_map_slots(ip_hash_map* map, ip_hash_map_slot* new_slots, uint32_t new_capacity);
+static ip_key* get_sorted_ip_hash_map_keys(ip_hash_map* map, unsigned long* num_keys_returned);
+static void apply_to_every_ip_hash_map_value(ip_hash_map* map, void (*apply_func)(ip_key key, void* value));
+static void* get_next_ip_hash_map_element(ip_hash_map* map, uint32_t* index, ip_key* key);
+static void** clear_ip_hash_map(ip_hash_map* map, int destruction_type, unsigned long* num_destroyed);
+static void** destroy_ip_hash_map(ip_hash_map* map, int destruction_type, unsigned long* num_destroyed);
+
+static uint32_t find_ip_hash_map_slot(ip_hash_map* map, ip_key key);
+static int grow_ip_hash_map(ip_hash_map* map);
+static int compare_ip_hash_map_keys(const void* a, const void* b);
+
+
+static inline ip_key ipv4_ip_key(uint32_t ip)
+{
+	ip_key key;
+	key.hi = 0;
+	key.lo = (uint64_t)ip;
+	return key;
+}
+
+/* addr points to the 16 bytes of an in6_addr, in network order */
+static inline ip_key ipv6_ip_key(const void* addr)
+{
+	ip_key key;
+	memcpy(&(key.hi), addr, 8);
+	memcpy(&(key.lo), ((const unsigned char*)addr)+8, 8);
+	return key;
+}
+
+static inline int ip_keys_equal(ip_key a, ip_key b)
+{
+	return a.hi == b.hi && a.lo == b.lo;
+}
+
+static inline int ip_key_is_zero(ip_key key)
+{
+	return key.hi == 0 && key.lo == 0;
+}
+
+static inline uint32_t hash_ip_key(ip_key key, uint32_t seed)
+{
+	if(key.hi == 0 && (key.lo >> 32) == 0)
+	{
+		return jhash_1word((uint32_t)key.lo, seed);
+	}
+	return jhash_3words((uint32_t)key.lo, (uint32_t)(key.lo >> 32), ((uint32_t)key.hi) ^ ((uint32_t)(key.hi >> 32)), seed);
+}
+
+
+
+/*
+ * can_sleep allocations may be vmalloc'd, and must be made without
+ * bandwidth_lock held.  Tables bigger than IP_HASH_MAP_MAX_ATOMIC_CAPACITY
+ * can only be allocated that way
+ */
+static ip_hash_map_slot* alloc_ip_hash_map_slots(uint32_t capacity, int can_sleep)
+{
+	unsigned long size = ((unsigned long)capacity)*sizeof(ip_hash_map_slot);
+	ip_hash_map_slot* slots = NULL;
+	if(capacity <= IP_HASH_MAP_MAX_ATOMIC_CAPACITY)
+	{
+		slots = (ip_hash_map_slot*)kmalloc(size, can_sleep ? GFP_KERNEL : GFP_ATOMIC);
+	}
+	else if(can_sleep)
+	{
+		slots = (ip_hash_map_slot*)vmalloc(size);
+	}
+	if(slots != NULL)
+	{
+		memset(slots, 0, size);
+	}
+	return slots;
+}
+
+/* vfree can't be called with bandwidth_lock held, so neither can this for a large table */
+static void free_ip_hash_map_slots(ip_hash_map_slot* slots, uint32_t capacity)
+{
+	if(capacity <= IP_HASH_MAP_MAX_ATOMIC_CAPACITY)
+	{
+		kfree(slots);
+	}
+	else
+	{
+		vfree(slots);
+	}
+}
+
+/* room for num_elements without growing, may sleep so call it unlocked */
+static ip_hash_map* initialize_ip_hash_map(unsigned long num_elements)
+{
+	ip_hash_map* map = (ip_hash_map*)kmalloc(sizeof(ip_hash_map), GFP_KERNEL);
+	if(map != NULL)
+	{
+		uint32_t capacity = IP_HASH_MAP_MIN_CAPACITY;
+		while( num_elements*4 > ((unsigned long)capacity)*3 )
+		{
+			capacity = capacity*2;
+		}
+		map->slots = alloc_ip_hash_map_slots(capacity, 1);
+		if(map->slots == NULL)
+		{
+			kfree(map);
+			return NULL;
+		}
+		map->capacity = capacity;
+		map->num_elements = 0;
+		get_random_bytes(&(map->seed), sizeof(map->seed));
+	}
+	return map;
+}
+
+/* returns slot holding key, or the empty slot where key would go */
+static uint32_t find_ip_hash_map_slot(ip_hash_map* map, ip_key key)
+{
+	uint32_t mask = map->capacity - 1;
+	uint32_t index = hash_ip_key(key, map->seed) & mask;
+	while(map->slots[index].value != NULL && !ip_keys_equal(map->slots[index].key, key))
+	{
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+static void* get_ip_hash_map_element(ip_hash_map* map, ip_key key)
+{
+	return map->slots[ find_ip_hash_map_slot(map, key) ].value;
+}
+
+/*
+ * returns the value previously stored for key (or NULL if there wasn't one).
+ * returns value itself if the table is 3/4 full and couldn't be grown here,
+ * so callers that care about allocation failure can test for that
+ */
+static void* set_ip_hash_map_element(ip_hash_map* map, ip_key key, void* value)
+{
+	uint32_t index;
+	void* old_value;
+	if(value == NULL)
+	{
+		return remove_ip_hash_map_element(map, key);
+	}
+
+	/* keep load factor at or below 3/4 */
+	if( (map->num_elements+1)*4 > ((unsigned long)map->capacity)*3 )
+	{
+		if(grow_ip_hash_map(map) != 0)
+		{
+			if(get_ip_hash_map_element(map, key) == NULL)
+			{
+				return value;
+			}
+		}
+	}
+
+	index = find_ip_hash_map_slot(map, key);
+	old_value = map->slots[index].value;
+	map->slots[index].key = key;
+	map->slots[index].value = value;
+	if(old_value == NULL)
+	{
+		map->num_elements = map->num_elements + 1;
+	}
+	return old_value;
+}
+
+static void* remove_ip_hash_map_element(ip_hash_map* map, ip_key key)
+{
+	uint32_t mask = map->capacity - 1;
+	uint32_t hole = find_ip_hash_map_slot(map, key);
+	uint32_t next;
+	void* old_value = map->slots[hole].value;
+	if(old_value == NULL)
+	{
+		return NULL;
+	}
+
+	/*
+	 * shift back any later entries in this run that would no longer
+	 * be reachable from their home slot once this one is empty
+	 */
+	next = hole;
+	while(1)
+	{
+		uint32_t home;
+		next = (next + 1) & mask;
+		if(map->slots[next].value == NULL)
+		{
+			break;
+		}
+		home = hash_ip_key(map->slots[next].key, map->seed) & mask;
+		if( ((next - home) & mask) >= ((next - hole) & mask) )
+		{
+			map->slots[hole] = map->slots[next];
+			hole = next;
+		}
+	}
+	map->slots[hole].value = NULL;
+	map->slots[hole].key.hi = 0;
+	map->slots[hole].key.lo = 0;
+	map->num_elements = map->num_elements - 1;
+
+	return old_value;
+}
+
+/*
+ * moves every element into new_slots, which must be empty and larger than
+ * the current table, and returns the old slots, which the caller frees with
+ * free_ip_hash_map_slots once it has dropped bandwidth_lock
+ */
+static ip_hash_map_slot* replace_ip_hash_map_slots(ip_hash_map* map, ip_hash_map_slot* new_slots, uint32_t new_capacity)
+{
+	ip_hash_map_slot* old_slots = map->slots;
+	uint32_t old_capacity = map->capacity;
+	uint32_t old_index;
+
+	map->slots = new_slots;
+	map->capacity = new_capacity;
+	for(old_index = 0; old_index < old_capacity; old_index++)
+	{
+		if(old_slots[old_index].value != NULL)
+		{
+			map->slots[ find_ip_hash_map_slot(map, old_slots[old_index].key) ] = old_slots[old_index];
+		}
+	}
+	return old_slots;
+}
+
+/* doubles a small table in place with an atomic allocation, returns 0 on success */
+static int grow_ip_hash_map(ip_hash_map* map)
+{
+	uint32_t old_capacity = map->capacity;
+	ip_hash_map_slot* new_slots;
+	if(2*old_capacity > IP_HASH_MAP_MAX_ATOMIC_CAPACITY)
+	{
+		return 1;
+	}
+	new_slots = alloc_ip_hash_map_slots(2*old_capacity, 0);
+	if(new_slots == NULL)
+	{
+		return 1;
+	}
+	free_ip_hash_map_slots(replace_ip_hash_map_slots(map, new_slots, 2*old_capacity), old_capacity);
+	return 0;
+}
+
+/*
+ * capacity the table should be grown to from where we can sleep, or 0
+ * if it has room.  Growing once it's half full leaves room for whatever
+ * arrives before the next chance to grow it
+ */
+static uint32_t get_ip_hash_map_wanted_capacity(ip_hash_map* map)
+{
+	if(map->num_elements*2 > (unsigned long)map->capacity && map->capacity < 0x80000000)
+	{
+		return map->capacity*2;
+	}
+	return 0;
+}
+
+static int compare_ip_hash_map_keys(const void* a, const void* b)
+{
+	const ip_key* ka = (const ip_key*)a;
+	const ip_key* kb = (const ip_key*)b;
+	if(ka->hi != kb->hi)
+	{
+		return ka->hi < kb->hi ? -1 : 1;
+	}
+	return ka->lo < kb->lo ? -1 : (ka->lo > kb->lo ? 1 : 0);
+}
+
+/* IPv4 keys come back sorted in the same order get_sorted_long_map_keys would return them */
+static ip_key* get_sorted_ip_hash_map_keys(ip_hash_map* map, unsigned long* num_keys_returned)
+{
+	ip_key* key_list = (ip_key*)kmalloc((map->num_elements+1)*sizeof(ip_key), GFP_ATOMIC);
+	unsigned long next_key_index = 0;
+	uint32_t index;
+	*num_keys_returned = 0;
+	if(key_list == NULL)
+	{
+		return NULL;
+	}
+	for(index = 0; index < map->capacity; index++)
+	{
+		if(map->slots[index].value != NULL)
+		{
+			key_list[next_key_index] = map->slots[index].key;
+			next_key_index++;
+		}
+	}
+	sort(key_list, next_key_index, sizeof(ip_key), compare_ip_hash_map_keys, NULL);
+	*num_keys_returned = next_key_index;
+	return key_list;
+}
+
+static void apply_to_every_ip_hash_map_value(ip_hash_map* map, void (*apply_func)(ip_key key, void* value))
+{
+	uint32_t index;
+	for(index = 0; index < map->capacity; index++)
+	{
+		if(map->slots[index].value != NULL)
+		{
+			apply_func(map->slots[index].key, map->slots[index].value);
+		}
+	}
+}
+
+/*
+ * returns first element stored at or after slot *index, setting *index to that
+ * slot and *key to its key, or NULL once we've reached the end of the table.
+ * Removing the element just returned may shift a later element back into
+ * its slot, so look at the same index again after a removal.  If the
+ * table grows (capacity changes) slots get re-ordered and a walk has to
+ * start over.
+ */
+static void* get_next_ip_hash_map_element(ip_hash_map* map, uint32_t* index, ip_key* key)
+{
+	while(*index < map->capacity)
+	{
+		if(map->slots[*index].value != NULL)
+		{
+			*key = map->slots[*index].key;
+			return map->slots[*index].value;
+		}
+		*index = *index + 1;
+	}
+	return NULL;
+}
+
+/* removes every element, handling values according to destruction_type like destroy_long_map does */
+static void** clear_ip_hash_map(ip_hash_map* map, int destruction_type, unsigned long* num_destroyed)
+{
+	void** return_values = NULL;
+	unsigned long next_value_index = 0;
+	uint32_t index;
+	if(destruction_type == DESTROY_MODE_RETURN_VALUES)
+	{
+		return_values = (void**)kmalloc((map->num_elements+1)*sizeof(void*), GFP_ATOMIC);
+	}
+	for(index = 0; index < map->capacity; index++)
+	{
+		void* value = map->slots[index].value;
+		if(value != NULL)
+		{
+			if(destruction_type == DESTROY_MODE_FREE_VALUES)
+			{
+				kfree(value);
+			}
+			else if(return_values != NULL)
+			{
+				return_values[next_value_index] = value;
+			}
+			next_value_index++;
+		}
+		map->slots[index].value = NULL;
+		map->slots[index].key.hi = 0;
+		map->slots[index].key.lo = 0;
+	}
+	if(return_values != NULL)
+	{
+		return_values[next_value_index] = NULL;
+	}
+	*num_destroyed = (destruction_type == DESTROY_MODE_RETURN_VALUES && return_values == NULL) ? 0 : next_value_index;
+	map->num_elements = 0;
+	return return_values;
+}
+
+static void** destroy_ip_hash_map(ip_hash_map* map, int destruction_type, unsigned long* num_destroyed)
+{
+	void** return_values = clear_ip_hash_map(map, destruction_type, num_destroyed);
+	free_ip_hash_map_slots(map->slots, map->capacity);
+	kfree(map);
+	return return_values;
+}
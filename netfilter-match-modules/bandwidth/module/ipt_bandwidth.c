@@ -30,15 +30,23 @@
 
 #include <linux/time.h>
 
-#include <linux/semaphore.h> 
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/list.h>
 
 
 #include "bandwidth_deps/tree_map.h"
+#include "bandwidth_deps/ip_hash_map.h"
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netfilter_ipv4/ipt_bandwidth.h>
 
 
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/netfilter/x_tables.h>
 
 
@@ -48,28 +56,217 @@
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Eric Bishop");
 MODULE_DESCRIPTION("Match bandwidth used, designed for use with Gargoyle web interface (www.gargoyle-router.com)");
+MODULE_ALIAS("ipt_bandwidth");
+MODULE_ALIAS("ip6t_bandwidth");
 
 /* 
  * WARNING: accessing the sys_tz variable takes FOREVER, and kills performance 
  * keep a local variable that gets updated from the extern variable 
+ *
+ * Timezone changes come in through BANDWIDTH_SET_TIMEZONE, or are noticed
+ * when sys_tz changes under us (settimeofday), and are only ever applied by
+ * check_for_timezone_shift, from reset_worker or checkentry.  match never
+ * looks for them, it just uses local_seconds_west.  Backwards clock jumps
+ * are likewise only caught by reset_worker.
  */
 extern struct timezone sys_tz; 
 static int local_minutes_west;
 static int local_seconds_west;
-static time_t last_local_mw_update;
+static int requested_minutes_west; /* what local_minutes_west will be once the shift is applied */
+static int sys_minutes_west; /* sys_tz.tz_minuteswest as of last check */
 
 
 static spinlock_t bandwidth_lock = __SPIN_LOCK_UNLOCKED(bandwidth_lock);
-DEFINE_SEMAPHORE(userspace_lock);
+
+/* 
+ * readers (BANDWIDTH_GET*) share userspace_lock, while sets and rule
+ * insertion/removal hold it exclusively.  All data is still protected by
+ * bandwidth_lock, userspace_lock only keeps writers from running mid-read
+ */
+static DECLARE_RWSEM(userspace_lock);
 
 static string_map* id_map = NULL;
 
 
+/*
+ * Unless a rule is precise, packets are counted in a per-cpu cache of
+ * slots without taking bandwidth_lock.  Each slot holds the total for
+ * one ip as of the last time this cpu took the locked path for it
+ * (base) and the bytes this cpu has seen since (pending).  The cache is
+ * set associative, BANDWIDTH_PCPU_WAYS slots per set, and a cpu only
+ * ever folds its own slots on the locked path: when its slot for an ip
+ * has to make way for another, or when pending would exceed the rule's
+ * slack.  Each fold bumps a version for the ip's stripe, which sends
+ * other cpus comparing a quota against that ip back through the locked
+ * path to refresh base, so no cpu's view of an ip is more than about
+ * (cpus-1)*slack bytes behind.  Queries, sets, resets and --bcheck
+ * rules fold the slots of every cpu first.
+ *
+ * Slots are only changed by their own cpu with bandwidth_lock held, or
+ * by other cpus holding both bandwidth_lock and the slots' lock, so the
+ * locked path can use its own cpu's slots without taking their lock.
+ */
+#define BANDWIDTH_PCPU_SETS	64
+#define BANDWIDTH_PCPU_WAYS	4
+#define BANDWIDTH_PCPU_SLOTS	(BANDWIDTH_PCPU_SETS*BANDWIDTH_PCPU_WAYS)
+#define BANDWIDTH_PCPU_STRIPES	64
+
+typedef struct bw_pcpu_slot_struct
+{
+	ip_key ip;
+	uint64_t base;
+	uint64_t pending;
+	uint64_t pending_tx; /* part of pending the ip sent */
+	uint64_t pending_packets;
+	uint64_t pending_tx_packets;
+	unsigned long refresh; /* jiffies after which remote rules fold the slot, so the prefix's lru position keeps up */
+	uint32_t tick; /* hires tick pending bytes belong to, see record_hires */
+	uint32_t version; /* of the ip's stripe when base was read */
+	uint32_t used; /* value of the cpu's clock when last used, to pick which way to evict */
+	unsigned char in_use;
+} bw_pcpu_slot;
+
+typedef struct bw_pcpu_struct
+{
+	spinlock_t lock;
+	uint32_t clock;
+	bw_pcpu_slot combined; /* combined total (ip 0) */
+	bw_pcpu_slot slots[BANDWIDTH_PCPU_SLOTS];
+} bw_pcpu;
+
+
+/*
+ * --hires rules also count bytes per ip in a ring of hires_slots
+ * counters, each covering hires_interval seconds.  The rings are
+ * allocated in checkentry, hires_hosts of them per rule, and handed
+ * out to ips as they send traffic so the packet path never allocates.
+ * Once every ring is taken, the ring that has been idle the longest is
+ * taken over as soon as all of its slots have expired, so the rings
+ * end up following the busiest hosts.
+ *
+ * A tick is UTC seconds / hires_interval, and a slot holds the count
+ * for tick t if ticks[t % hires_slots] == t.
+ */
+struct bw_entry_struct;
+struct bw_hires_struct;
+
+typedef struct bw_hires_ring_struct
+{
+	struct list_head lru;
+	struct bw_hires_struct* pool;
+	struct bw_entry_struct* owner; /* NULL if free */
+	ip_key ip; /* of owner */
+	uint32_t newest_tick;
+	uint32_t* ticks;
+	uint64_t* bytes;
+} bw_hires_ring;
+
+typedef struct bw_hires_struct
+{
+	uint32_t num_slots;
+	uint32_t num_rings;
+	struct list_head lru; /* most recently active first, free rings last */
+	bw_hires_ring* rings;
+	uint32_t* ticks;
+	uint64_t* bytes;
+} bw_hires;
+
+
+/*
+ * --topk rules keep the ips with the highest current totals in a
+ * min-heap of topk items, so the busiest hosts can be read without
+ * dumping every ip.  Totals only go up between resets, so offering an
+ * entry to the heap every time its total grows is enough: an ip that
+ * isn't in the heap can never be above the smallest total in it.
+ * Resets empty the heap, and sets, which can lower totals, rebuild it.
+ */
+typedef struct bw_topk_item_struct
+{
+	ip_key ip;
+	struct bw_entry_struct* entry;
+} bw_topk_item;
+
+typedef struct bw_topk_struct
+{
+	uint32_t max_items;
+	uint32_t num_items;
+	bw_topk_item* items;
+} bw_topk;
+
+
+/*
+ * --remote_prefix rules (individual_remote only) count remote ips by
+ * prefix rather than one by one.  If they have a limit, remote_max nodes
+ * are allocated in checkentry and every prefix's entry holds one, so
+ * the table can't grow without bound under P2P or CDN traffic.  When a
+ * new prefix shows up and every node is taken, the prefix that has gone
+ * the longest without traffic is evicted: its bytes move to the entry
+ * for other_ip, and the new prefix takes its node.
+ */
+struct bw_remote_struct;
+
+typedef struct bw_remote_node_struct
+{
+	struct list_head lru;
+	struct bw_remote_struct* pool;
+	struct bw_entry_struct* owner; /* NULL if free */
+	ip_key ip; /* of owner */
+} bw_remote_node;
+
+typedef struct bw_remote_struct
+{
+	ip_key mask;
+	ip_key other_ip;
+	uint32_t num_nodes; /* 0 = no limit */
+	struct list_head lru; /* most recently active first, free nodes last */
+	bw_remote_node* nodes;
+} bw_remote;
+
+/*
+ * Each ip's entry is a single record.  If the rule saves history, its
+ * bw_history and history nodes follow the bw_entry in the same record,
+ * so a new ip costs one allocation rather than three.  Rules with
+ * history get a cache of their own, sized for num_intervals_to_save,
+ * the rest share bw_entry_cache.
+ *
+ * Records come off the pool's free list first.  --prealloc fills it in
+ * checkentry, and freed records go back on it until it holds that many
+ * again, so a rule preallocated for its subnet doesn't have to allocate
+ * in softirq when hosts come and go.
+ */
+typedef struct bw_entry_pool_struct
+{
+	struct kmem_cache* cache; /* NULL if cache couldn't be created, records are kmalloced then */
+	unsigned char own_cache;
+	size_t record_size;
+	uint32_t num_intervals; /* history nodes in each record, not counting the current one */
+	uint32_t num_free;
+	uint32_t max_free;
+	struct bw_entry_struct* free_list;
+	char cache_name[48];
+} bw_entry_pool;
+
 typedef struct info_and_maps_struct
 {
 	struct ipt_bandwidth_info* info;
-	long_map* ip_map;
-	long_map* ip_history_map;
+	ip_hash_map* ip_map; /* values are bw_entry */
+	bw_pcpu __percpu* pcpu; /* NULL for precise rules */
+	atomic_t pcpu_versions[BANDWIDTH_PCPU_STRIPES]; /* see bw_pcpu */
+	bw_hires* hires; /* NULL unless rule has --hires */
+	bw_topk* topk; /* NULL unless rule has --topk */
+	bw_remote* remote; /* NULL unless rule has --remote_prefix */
+	bw_entry_pool* pool;
+
+	/* interval reset state, see begin_interval_reset */
+	uint32_t epoch;
+	unsigned char reset_pending;
+	uint32_t reset_cursor;
+	uint32_t reset_cursor_capacity;
+	uint32_t reset_num_intervals;
+	time_t reset_first_start;
+	time_t reset_first_end;
+	unsigned char reset_drop_empty;
+	unsigned char reset_wipe;
 }info_and_maps;
 
 typedef struct history_struct
@@ -84,11 +281,107 @@ typedef struct history_struct
 	uint64_t* history_data;
 } bw_history;
 
+/* 
+ * one of these per ip, allocated from the rule's bw_entry_pool. If the rule
+ * saves history the current total is the current node of history, otherwise
+ * it is kept in bw.  Use get_entry_bw to get at it either way.
+ *
+ * The current total is also split up by direction, in bytes and packets.
+ * tx is what the ip sent and rx what it received.  For the combined total
+ * tx is what was sent by the ips the rule counts, or for combined rules,
+ * from the local subnet (everything, if the rule doesn't have one).
+ * These are zeroed along with the total at every reset.
+ */
+typedef struct bw_entry_struct
+{
+	uint64_t bw;
+	bw_history* history;
+	uint32_t epoch; /* rule epoch this entry has been rolled over to */
+	bw_hires_ring* hires;
+	uint32_t topk_index; /* 1 + position in rule's topk heap, 0 if not in it */
+	bw_remote_node* remote;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	bw_entry_pool* pool;
+	struct bw_entry_struct* next_free; /* only used on pool's free list */
+} bw_entry;
+
+static struct kmem_cache* bw_entry_cache = NULL;
+
+static inline uint64_t* get_entry_bw(bw_entry* entry)
+{
+	return entry->history == NULL ? &(entry->bw) : (entry->history->history_data + entry->history->current_index);
+}
+
+static inline void zero_entry_counters(bw_entry* entry)
+{
+	entry->rx_bytes = 0;
+	entry->tx_bytes = 0;
+	entry->rx_packets = 0;
+	entry->tx_packets = 0;
+}
+
+/* combined totals are stored under the all-zero address, for IPv4 and IPv6 rules alike */
+static const ip_key combined_ip = { 0, 0 };
+
+/* only the top bits are well mixed */
+static inline uint32_t pcpu_ip_hash(ip_key ip)
+{
+	uint32_t folded = (uint32_t)(ip.lo ^ (ip.lo >> 32) ^ ip.hi ^ (ip.hi >> 32));
+	return folded * 0x9E3779B1;
+}
+
+static inline atomic_t* pcpu_version(info_and_maps* iam, ip_key ip)
+{
+	return &(iam->pcpu_versions[ (pcpu_ip_hash(ip) >> 16) & (BANDWIDTH_PCPU_STRIPES-1) ]);
+}
+
+/* first of the BANDWIDTH_PCPU_WAYS slots ip can be in */
+static inline bw_pcpu_slot* pcpu_set(bw_pcpu* pcpu, ip_key ip)
+{
+	return &(pcpu->slots[ ((pcpu_ip_hash(ip) >> 24) & (BANDWIDTH_PCPU_SETS-1)) * BANDWIDTH_PCPU_WAYS ]);
+}
+
+/* this cpu's slot holding ip, or NULL.  The combined total has a slot of its own */
+static inline bw_pcpu_slot* find_pcpu_slot(bw_pcpu* pcpu, ip_key ip)
+{
+	bw_pcpu_slot* set;
+	uint32_t way;
+	if(ip_key_is_zero(ip))
+	{
+		return pcpu->combined.in_use ? &(pcpu->combined) : NULL;
+	}
+	set = pcpu_set(pcpu, ip);
+	for(way = 0; way < BANDWIDTH_PCPU_WAYS; way++)
+	{
+		if(set[way].in_use && ip_keys_equal(set[way].ip, ip))
+		{
+			return set + way;
+		}
+	}
+	return NULL;
+}
+
 
 
 static unsigned char set_in_progress = 0;
 static char set_id[BANDWIDTH_MAX_ID_LENGTH] = "";
 
+/*
+ * a set can span several BANDWIDTH_SET calls, and belongs to the process
+ * that started it until it completes.  If that process dies part way
+ * through, the set is abandoned once BANDWIDTH_SET_TIMEOUT passes
+ * without another call.  Abandoned sets are only expired under
+ * bandwidth_lock, by the reset worker or the next set
+ */
+#define BANDWIDTH_SET_TIMEOUT (5*HZ)
+static pid_t set_owner = 0;
+static unsigned long set_last_call = 0;
+static unsigned char set_in_progress_for_id(char* id);
+static void expire_abandoned_set(void);
+
 /* 
  * function prototypes
  *
@@ -98,12 +391,12 @@ static char set_id[BANDWIDTH_MAX_ID_LENGTH] = "";
 */
 
 
-static void adjust_ip_for_backwards_time_shift(unsigned long key, void* value);
+static void adjust_ip_for_backwards_time_shift(ip_key key, void* value);
 static void adjust_id_for_backwards_time_shift(char* key, void* value);
 static void check_for_backwards_time_shift(time_t now);
 
 
-static void shift_timezone_of_ip(unsigned long key, void* value);
+static void shift_timezone_of_ip(ip_key key, void* value);
 static void shift_timezone_of_id(char* key, void* value);
 static void check_for_timezone_shift(time_t now, int already_locked);
 
@@ -114,9 +407,12 @@ static unsigned char update_history(bw_history* history, time_t interval_start,
 
 
 
-static void do_reset(unsigned long key, void* value);
-static void set_bandwidth_to_zero(unsigned long key, void* value);
-static void handle_interval_reset(info_and_maps* iam, time_t now);
+static unsigned char roll_entry(info_and_maps* iam, bw_entry* entry);
+static void set_bandwidth_to_zero(ip_key key, void* value);
+static void begin_interval_reset(info_and_maps* iam, time_t now);
+static unsigned char continue_interval_reset(info_and_maps* iam, uint32_t max_entries);
+static void run_resets_for_id(char* key, void* value);
+static void reset_worker(struct work_struct* work);
 
 static uint64_t pow64(uint64_t base, uint64_t pow);
 static uint64_t get_bw_record_max(void); /* called by init to set global variable */
@@ -125,7 +421,50 @@ static inline int is_leap(unsigned int y);
 static time_t get_next_reset_time(struct ipt_bandwidth_info *info, time_t now, time_t previous_reset);
 static time_t get_nominal_previous_reset_time(struct ipt_bandwidth_info *info, time_t current_next_reset);
 
-static uint64_t* initialize_map_entries_for_ip(info_and_maps* iam, unsigned long ip, uint64_t initial_bandwidth);
+static uint64_t* initialize_map_entries_for_ip(info_and_maps* iam, ip_key ip, uint64_t initial_bandwidth);
+static bw_entry* get_entry_for_ip(info_and_maps* iam, ip_key ip);
+static uint64_t* get_bw_for_ip(info_and_maps* iam, ip_key ip);
+static bw_history* get_history_for_ip(info_and_maps* iam, ip_key ip);
+static void free_entry(bw_entry* entry);
+static void free_all_entries(ip_hash_map* ip_map);
+
+static bw_entry_pool* initialize_entry_pool(struct ipt_bandwidth_info* info);
+static void free_entry_pool(bw_entry_pool* pool);
+static bw_entry* alloc_entry(bw_entry_pool* pool);
+static void reset_entry_history(bw_entry* entry);
+
+static bw_hires* initialize_hires(uint32_t num_slots, uint32_t num_rings);
+static void free_hires(bw_hires* hires);
+static void release_hires_ring(bw_hires_ring* ring);
+static void record_hires(info_and_maps* iam, ip_key ip, uint32_t tick, uint64_t len);
+
+static bw_topk* initialize_topk(uint32_t max_items);
+static void free_topk(bw_topk* topk);
+static void clear_topk(bw_topk* topk);
+static void sift_topk_up(bw_topk* topk, uint32_t index);
+static void sift_topk_down(bw_topk* topk, uint32_t index);
+static void update_topk(info_and_maps* iam, ip_key ip, bw_entry* entry);
+static void rebuild_topk(info_and_maps* iam);
+static void remove_from_topk(bw_topk* topk, bw_entry* entry);
+
+static bw_remote* initialize_remote(unsigned char family, uint32_t prefix, uint32_t num_nodes);
+static void free_remote(bw_remote* remote);
+static inline ip_key get_remote_prefix(bw_remote* remote, ip_key ip);
+static inline int is_remote_prefix(bw_remote* remote, ip_key ip);
+static void touch_remote_entry(bw_entry* entry);
+static void release_remote_node(bw_remote_node* node);
+static void make_room_for_remote_ip(info_and_maps* iam, ip_key ip);
+
+static unsigned char ip_is_local(struct ipt_bandwidth_info* info, unsigned char family, ip_key ip);
+static unsigned char get_ips_for_packet(struct ipt_bandwidth_info* info, unsigned char family, const struct sk_buff* skb, unsigned char do_src_dst_swap, ip_key* bw_ips);
+static void add_to_entry_counters(bw_entry* entry, uint64_t bytes, uint64_t tx_bytes, uint64_t packets, uint64_t tx_packets);
+static bw_entry* get_pcpu_slot_entry(info_and_maps* iam, ip_key* ip);
+static void add_pcpu_pending(info_and_maps* iam, bw_pcpu_slot* slot);
+static void fold_pcpu_slot(info_and_maps* iam, ip_key ip);
+static void fold_local_pcpu_slot(info_and_maps* iam, ip_key ip);
+static void claim_local_pcpu_slot(info_and_maps* iam, ip_key ip, uint64_t* total, uint32_t tick);
+static void fold_all_pcpu_slots(info_and_maps* iam);
+static int pcpu_match(info_and_maps* iam, ip_key bw_ip, uint64_t len, unsigned char is_tx, uint32_t tick, int* match_found);
 
 
 
@@ -136,6 +475,22 @@ static time_t backwards_adjust_info_previous_reset = 0;
 static time_t backwards_adjust_ips_zeroed = 0;
 static info_and_maps* backwards_adjust_iam = NULL;
 
+/* id == NULL checks whether any set is in progress */
+static unsigned char set_in_progress_for_id(char* id)
+{
+	return set_in_progress == 1 && (id == NULL || strcmp(id, set_id) == 0);
+}
+
+/* must be called with bandwidth_lock held, set state only changes under it */
+static void expire_abandoned_set(void)
+{
+	if(set_in_progress == 1 && time_after(jiffies, set_last_call + BANDWIDTH_SET_TIMEOUT))
+	{
+		printk("ipt_bandwidth: set of \"%s\" was abandoned, discarding it\n", set_id);
+		set_in_progress = 0;
+	}
+}
+
 /*
 static char print_out_buf[25000];
 static void print_to_buf(char* outdat);
@@ -169,17 +524,21 @@ static void do_print_buf(void)
 }
 */
 
-static void adjust_ip_for_backwards_time_shift(unsigned long key, void* value)
+static void adjust_ip_for_backwards_time_shift(ip_key key, void* value)
 {
-	bw_history* old_history = (bw_history*)value;
-	
+	bw_history* old_history = ((bw_entry*)value)->history;
+
+	if(old_history == NULL) /* should never be null, but let's be sure */
+	{
+		return;
+	}
 	if(old_history->num_nodes == 1)
 	{
 		if(backwards_adjust_info_previous_reset > backwards_adjust_current_time)
 		{
 			if(backwards_adjust_ips_zeroed == 0)
 			{
-				apply_to_every_long_map_value(backwards_adjust_iam->ip_map, set_bandwidth_to_zero);
+				apply_to_every_ip_hash_map_value(backwards_adjust_iam->ip_map, set_bandwidth_to_zero);
 				backwards_adjust_iam->info->next_reset = get_next_reset_time(backwards_adjust_iam->info, backwards_adjust_current_time, backwards_adjust_current_time);
 				backwards_adjust_iam->info->previous_reset = backwards_adjust_current_time;
 				backwards_adjust_iam->info->current_bandwidth = 0;
@@ -201,7 +560,7 @@ static void adjust_ip_for_backwards_time_shift(unsigned long key, void* value)
 		 */
 		uint32_t next_old_index;
 		time_t old_next_start =  old_history->first_start == 0 ? backwards_adjust_info_previous_reset : old_history->first_start; /* first time point in old history */
-		bw_history* new_history = initialize_history(old_history->max_nodes);
+		bw_history* new_history = initialize_history(old_history->max_nodes-1);
 		if(new_history == NULL)
 		{
 			printk("ipt_bandwidth: warning, kmalloc failure!\n");
@@ -238,27 +597,21 @@ static void adjust_ip_for_backwards_time_shift(unsigned long key, void* value)
 		
 
 
-		/* set old_history to be new_history */	
-		kfree(old_history->history_data);
-		old_history->history_data   = new_history->history_data;
+		/* set old_history to be new_history, old_history's nodes are part of the entry so copy them over */	
+		memcpy(old_history->history_data, new_history->history_data, old_history->max_nodes*sizeof(uint64_t));
 		old_history->first_start    = new_history->first_start;
 		old_history->first_end      = new_history->first_end;
 		old_history->last_end       = new_history->last_end;
 		old_history->num_nodes      = new_history->num_nodes;
 		old_history->non_zero_nodes = new_history->non_zero_nodes;
 		old_history->current_index  = new_history->current_index;
-		set_long_map_element(backwards_adjust_iam->ip_map, key, (void*)(old_history->history_data + old_history->current_index) );
-		if(key == 0)
+		if(ip_key_is_zero(key))
 		{
 			backwards_adjust_iam->info->combined_bw = (uint64_t*)(old_history->history_data + old_history->current_index);
 		}
 		
-		/* 
-		 * free new history  (which was just temporary) 
-		 * note that we don't need to free history_data from new_history
-		 * we freed the history_data from old history, and set that to the history_data from new_history
-		 * so, this cleanup has already been handled
-		 */
+		/* free new history (which was just temporary) */
+		kfree(new_history->history_data);
 		kfree(new_history);
 		
 	}
@@ -280,11 +633,13 @@ static void adjust_id_for_backwards_time_shift(char* key, void* value)
 	{
 		return;
 	}
-	if(iam->ip_history_map != NULL)
+	continue_interval_reset(iam, 0);
+	fold_all_pcpu_slots(iam);
+	if(iam->info->num_intervals_to_save > 0 && iam->ip_map != NULL)
 	{
 		backwards_adjust_info_previous_reset = iam->info->previous_reset;
 		backwards_adjust_ips_zeroed = 0;
-		apply_to_every_long_map_value(iam->ip_history_map, adjust_ip_for_backwards_time_shift);
+		apply_to_every_ip_hash_map_value(iam->ip_map, adjust_ip_for_backwards_time_shift);
 	}
 	else
 	{
@@ -305,12 +660,9 @@ static void check_for_backwards_time_shift(time_t now)
 		printk("ipt_bandwidth: backwards time shift detected, adjusting\n");
 
 		/* adjust */
-		down(&userspace_lock);
-
 		/* This function is always called with absolute time, not time adjusted for timezone. Correct that before adjusting. */
 		backwards_adjust_current_time = now - local_seconds_west;
 		apply_to_every_string_map_value(id_map, adjust_id_for_backwards_time_shift);
-		up(&userspace_lock);
 	}
 	backwards_check = now;
 	spin_unlock_bh(&bandwidth_lock);
@@ -322,15 +674,14 @@ static int old_minutes_west;
 static time_t shift_timezone_current_time;
 static time_t shift_timezone_info_previous_reset;
 static info_and_maps* shift_timezone_iam = NULL;
-static void shift_timezone_of_ip(unsigned long key, void* value)
+static void shift_timezone_of_ip(ip_key key, void* value)
 {
 	#ifdef BANDWIDTH_DEBUG
-		unsigned long* ip = &key;
-		printk("shifting ip = %u.%u.%u.%u\n", *((char*)ip), *(((char*)ip)+1), *(((char*)ip)+2), *(((char*)ip)+3) );
+		printk("shifting ip = %016llx%016llx\n", key.hi, key.lo );
 	#endif
 
 
-	bw_history* history = (bw_history*)value;
+	bw_history* history = ((bw_entry*)value)->history;
 	int32_t timezone_adj = (old_minutes_west-local_minutes_west)*60;
 	#ifdef BANDWIDTH_DEBUG
 		printk("  before jump:\n");
@@ -422,14 +773,16 @@ static void shift_timezone_of_id(char* key, void* value)
 	{
 		return;
 	}
+	continue_interval_reset(iam, 0);
+	fold_all_pcpu_slots(iam);
 
-	if(iam->ip_history_map != NULL)
+	if(iam->info->num_intervals_to_save > 0 && iam->ip_map != NULL)
 	{
-		if(iam->ip_history_map->num_elements > 0)
+		if(iam->ip_map->num_elements > 0)
 		{
 			history_found = 1;
 			shift_timezone_info_previous_reset = iam->info->previous_reset;
-			apply_to_every_long_map_value(iam->ip_history_map, shift_timezone_of_ip);
+			apply_to_every_ip_hash_map_value(iam->ip_map, shift_timezone_of_ip);
 		}
 	}
 	if(history_found == 0)
@@ -453,45 +806,68 @@ static void shift_timezone_of_id(char* key, void* value)
 	shift_timezone_iam = NULL;
 }
 
+/* 
+ * swaps in requested_minutes_west, shifting every rule to match.
+ * Not called from match, the shift walks every id & ip under bandwidth_lock
+ */
 static void check_for_timezone_shift(time_t now, int already_locked)
 {
+	int new_minutes_west;
 	
 	if(already_locked == 0) { spin_lock_bh(&bandwidth_lock); }
-	if(now != last_local_mw_update ) /* make sure nothing changed while waiting for lock */
+	if(sys_tz.tz_minuteswest != sys_minutes_west)
 	{
-		local_minutes_west = sys_tz.tz_minuteswest;
-		local_seconds_west = 60*local_minutes_west;
-		last_local_mw_update = now;
-		if(local_seconds_west > last_local_mw_update)
-		{
-			/* we can't let adjusted time be < 0 -- pretend timezone is still UTC */
-			local_minutes_west = 0;
-			local_seconds_west = 0;
-		}
-
-		if(local_minutes_west != old_minutes_west)
-		{
-			int adj_minutes = old_minutes_west-local_minutes_west;
-			adj_minutes = adj_minutes < 0 ? adj_minutes*-1 : adj_minutes;	
-			
-			if(already_locked == 0) { down(&userspace_lock); }
+		sys_minutes_west = sys_tz.tz_minuteswest;
+		requested_minutes_west = sys_minutes_west;
+	}
+	new_minutes_west = requested_minutes_west;
+	if(60*new_minutes_west > now)
+	{
+		/* we can't let adjusted time be < 0 -- pretend timezone is still UTC */
+		new_minutes_west = 0;
+	}
 
-			printk("ipt_bandwidth: timezone shift of %d minutes detected, adjusting\n", adj_minutes);
-			printk("               old minutes west=%d, new minutes west=%d\n", old_minutes_west, local_minutes_west);
-			
-			/* this function is always called with absolute time, not time adjusted for timezone.  Correct that before adjusting */
-			shift_timezone_current_time = now - local_seconds_west;
-			apply_to_every_string_map_value(id_map, shift_timezone_of_id);
+	if(new_minutes_west != local_minutes_west)
+	{
+		int adj_minutes = local_minutes_west-new_minutes_west;
+		adj_minutes = adj_minutes < 0 ? adj_minutes*-1 : adj_minutes;	
 
-			old_minutes_west = local_minutes_west;
+		printk("ipt_bandwidth: timezone shift of %d minutes detected, adjusting\n", adj_minutes);
+		printk("               old minutes west=%d, new minutes west=%d\n", local_minutes_west, new_minutes_west);
+		
+		local_minutes_west = new_minutes_west;
+		local_seconds_west = 60*local_minutes_west;
 
+		/* this function is always called with absolute time, not time adjusted for timezone.  Correct that before adjusting */
+		shift_timezone_current_time = now - local_seconds_west;
+		apply_to_every_string_map_value(id_map, shift_timezone_of_id);
 
-			if(already_locked == 0) { up(&userspace_lock); }
-		}
+		old_minutes_west = local_minutes_west;
 	}
 	if(already_locked == 0) { spin_unlock_bh(&bandwidth_lock); }
 }
 
+/* BANDWIDTH_SET_TIMEZONE, user holds an int32_t of minutes west of UTC */
+static int set_timezone(void* user, u_int32_t len)
+{
+	int32_t minutes_west;
+	if(len < sizeof(int32_t))
+	{
+		return -EINVAL;
+	}
+	copy_from_user(&minutes_west, user, sizeof(int32_t));
+	if(minutes_west < -24*60 || minutes_west > 24*60)
+	{
+		return -EINVAL;
+	}
+
+	/* reset_worker picks this up within a second */
+	spin_lock_bh(&bandwidth_lock);
+	requested_minutes_west = minutes_west;
+	spin_unlock_bh(&bandwidth_lock);
+	return 0;
+}
+
 
 
 static bw_history* initialize_history(uint32_t max_nodes)
@@ -514,7 +890,7 @@ static bw_history* initialize_history(uint32_t max_nodes)
 			new_history->num_nodes = 1;
 			new_history->non_zero_nodes = 0; /* counts non_zero nodes other than current, so initialize to 0 */
 			new_history->current_index = 0;
-			memset(new_history->history_data, 0, max_nodes*sizeof(uint64_t));
+			memset(new_history->history_data, 0, (1+max_nodes)*sizeof(uint64_t));
 		}
 	}
 	return new_history; /* in case of malloc failure new_history will be NULL, this should be safe */
@@ -570,85 +946,101 @@ static unsigned char update_history(bw_history* history, time_t interval_start,
 }
 
 
-static struct ipt_bandwidth_info* do_reset_info = NULL;
-static long_map* do_reset_ip_map = NULL;
-static long_map* do_reset_delete_ips = NULL;
-static time_t do_reset_interval_start = 0;
-static time_t do_reset_interval_end = 0;
-static void do_reset(unsigned long key, void* value)
+/*
+ * Interval resets are done in two steps so the packet path never has to
+ * walk every ip.  begin_interval_reset is called by whoever first notices
+ * next_reset has passed -- the reset worker, which match kicks as soon as
+ * it sees one, or a query -- and only advances the reset times, records which
+ * intervals just ended and bumps the rule's epoch.  Each entry remembers
+ * the epoch it's current for, and is caught up by roll_entry, either in
+ * batches by the reset worker or as soon as something looks it up.
+ * A reset always finishes the one before it, so entries are never more
+ * than one epoch behind.
+ */
+
+/* number of ip_map slots the reset worker handles per rule each time it runs */
+#define BANDWIDTH_RESET_BATCH	256
+
+static DECLARE_DELAYED_WORK(reset_work, reset_worker);
+static time_t reset_worker_now = 0;
+static unsigned char reset_work_remaining = 0;
+static unsigned char reset_work_kicked = 0;
+
+/*
+ * called by match, with bandwidth_lock held, when a rule's next_reset has
+ * passed, so reset_worker runs now rather than at its next second.  Until
+ * it does, packets still count toward the interval that is ending
+ */
+static void kick_reset_worker(void)
 {
-	bw_history* history = (bw_history*)value;
-	if(history != NULL && do_reset_info != NULL) /* should never be null.. but let's be sure */
+	if(!reset_work_kicked)
 	{
-		unsigned char history_contains_data = update_history(history, do_reset_interval_start, do_reset_interval_end, do_reset_info);
-		if(history_contains_data == 0 || do_reset_ip_map == NULL)
-		{
-			//schedule data for ip to be deleted (can't delete history while we're traversing history tree data structure!)
-			if(do_reset_delete_ips != NULL) /* should never be null.. but let's be sure */
-			{
-				set_long_map_element(do_reset_delete_ips, key, (void*)(history->history_data + history->current_index));
-			}
-		}
-		else
+		reset_work_kicked = 1;
+		if(cancel_delayed_work(&reset_work))
 		{
-			set_long_map_element(do_reset_ip_map, key, (void*)(history->history_data + history->current_index) );
+			schedule_delayed_work(&reset_work, 0);
 		}
 	}
 }
 
-long_map* clear_ip_map = NULL;
-long_map* clear_ip_history_map = NULL;
-static void clear_ips(unsigned long key, void* value)
+/* returns 1 if entry's history is now empty and it can be dropped */
+static unsigned char roll_entry(info_and_maps* iam, bw_entry* entry)
 {
-	if(clear_ip_history_map != NULL && clear_ip_map != NULL)
+	unsigned char history_is_nonzero = 1;
+	if(entry->epoch == iam->epoch)
 	{
-		bw_history* history;
-		
-		#ifdef BANDWIDTH_DEBUG
-			unsigned long* ip = &key;
-			printk("clearing ip = %u.%u.%u.%u\n", *((char*)ip), *(((char*)ip)+1), *(((char*)ip)+2), *(((char*)ip)+3) );
-		#endif
+		return 0;
+	}
+	entry->epoch = iam->epoch;
+	zero_entry_counters(entry);
 
-		remove_long_map_element(clear_ip_map, key);
-		history = (bw_history*)remove_long_map_element(clear_ip_history_map, key);
-		if(history != NULL)
+	if(entry->history == NULL)
+	{
+		entry->bw = 0;
+	}
+	else
+	{
+		bw_history* bh = entry->history;
+		time_t interval_start = iam->reset_first_start;
+		time_t interval_end = iam->reset_first_end;
+		uint32_t interval_index;
+		for(interval_index=0; interval_index < iam->reset_num_intervals; interval_index++)
+		{
+			if(interval_index > 0)
+			{
+				interval_start = interval_end;
+				interval_end = get_next_reset_time(iam->info, interval_start, interval_start);
+			}
+			history_is_nonzero = update_history(bh, interval_start, interval_end, iam->info);
+		}
+		if(iam->reset_wipe)
 		{
-			kfree(history->history_data);
-			kfree(history);
+			bh->first_start = 0;
+			bh->first_end = 0;
+			bh->last_end = 0; 
+			bh->num_nodes = 1;
+			bh->non_zero_nodes = 1;
+			bh->current_index = 0;
+			(bh->history_data)[0] = 0;
+			history_is_nonzero = 1;
 		}
 	}
+	return (iam->reset_drop_empty && history_is_nonzero == 0) ? 1 : 0;
 }
 
-static void set_bandwidth_to_zero(unsigned long key, void* value)
-{
-	*((uint64_t*)value) = 0;
-}
-
-
-long_map* reset_histories_ip_map = NULL;
-static void reset_histories(unsigned long key, void* value)
+static void set_bandwidth_to_zero(ip_key key, void* value)
 {
-	bw_history* bh = (bw_history*)value;
-	bh->first_start = 0;
-	bh->first_end = 0;
-	bh->last_end = 0; 
-	bh->num_nodes = 1;
-	bh->non_zero_nodes = 1;
-	bh->current_index = 0;
-	(bh->history_data)[0] = 0;
-	if(reset_histories_ip_map != NULL)
-	{
-		set_long_map_element(reset_histories_ip_map, key, bh->history_data);
-	}
+	*(get_entry_bw((bw_entry*)value)) = 0;
+	zero_entry_counters((bw_entry*)value);
 }
 
-
-static void handle_interval_reset(info_and_maps* iam, time_t now)
+static void begin_interval_reset(info_and_maps* iam, time_t now)
 {
 	struct ipt_bandwidth_info* info;
+	bw_entry* combined;
 
 	#ifdef BANDWIDTH_DEBUG
-		printk("now, handling interval reset\n");
+		printk("now, beginning interval reset\n");
 	#endif
 	if(iam == NULL)
 	{
@@ -674,12 +1066,18 @@ static void handle_interval_reset(info_and_maps* iam, time_t now)
 	}
 
 	info = iam->info;
+
+	/* entries may only ever be one epoch behind */
+	continue_interval_reset(iam, 0);
+
+	/* make sure bytes counted on other cpus end up in the interval that is ending */
+	fold_all_pcpu_slots(iam);
+
+	iam->reset_num_intervals = 0;
+	iam->reset_drop_empty = 0;
+	iam->reset_wipe = 0;
 	if(info->num_intervals_to_save == 0)
 	{
-		#ifdef BANDWIDTH_DEBUG
-			printk("doing reset for case where no intervals are saved\n");
-		#endif
-
 		if(info->next_reset <= now)
 		{
 			info->next_reset = get_next_reset_time(info, info->previous_reset, info->previous_reset);
@@ -688,83 +1086,25 @@ static void handle_interval_reset(info_and_maps* iam, time_t now)
 				info->next_reset = get_next_reset_time(info, now, info->previous_reset);
 			}
 		}
-		apply_to_every_long_map_value(iam->ip_map, set_bandwidth_to_zero);
 	}
 	else
 	{
-		unsigned long num_updates;
-		#ifdef BANDWIDTH_DEBUG
-			printk("doing reset for case where at least one interval is saved\n");
-		#endif
-
-
-		if(iam->ip_history_map == NULL)
-		{
-			#ifdef BANDWIDTH_DEBUG
-				printk("error: doing reset, history_map is null when num_intervals_to_save > 0\n");
-			#endif
-			return;
-		}
-		
-		do_reset_info = info;
-		do_reset_ip_map = iam->ip_map;
-		clear_ip_map = iam->ip_map;
-		clear_ip_history_map = iam->ip_history_map;
-		
-
 		/* 
 		 * at most update as many times as we have intervals to save -- prevents
 		 * rediculously long loop if interval length is 2 seconds and time was 
 		 * reset to 5 years in the future
 		 */
-		num_updates = 0;
-		while(info->next_reset <= now && num_updates < info->num_intervals_to_save)
+		iam->reset_first_start = info->previous_reset;
+		iam->reset_first_end = info->next_reset;
+		while(info->next_reset <= now && iam->reset_num_intervals < info->num_intervals_to_save)
 		{
-			do_reset_delete_ips = initialize_long_map();
-			/* 
-			 * don't check for malloc failure here -- we 
-			 * include tests for whether do_reset_delete_ips 
-			 * is null below (reset should still be able to procede)
-			 */
-
-			do_reset_interval_start = info->previous_reset;
-			do_reset_interval_end = info->next_reset;
-			
-			apply_to_every_long_map_value(iam->ip_history_map, do_reset);
-			
-
 			info->previous_reset = info->next_reset;
 			info->next_reset = get_next_reset_time(info, info->previous_reset, info->previous_reset);
-
-			/* free all data for ips whose entire histories contain only zeros to conserve space */
-			if(do_reset_delete_ips != NULL)
-			{
-				unsigned long num_destroyed;
-
-				/* only clear ips if this is the last iteration of this update */
-				if(info->next_reset >= now)
-				{
-					/* 
-					 * no need to reset iam->info->combined_bw if it gets deleted here.
-					 * below, at end of function it will get set to NULL if it gets wiped
-					 */
-
-					apply_to_every_long_map_value(do_reset_delete_ips, clear_ips);
-				}
-
-				/* but clear do_reset_delete_ips no matter what, values are just pointers to history data so we can ignore them */
-				destroy_long_map(do_reset_delete_ips, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
-				do_reset_delete_ips = NULL;
-			}
-			num_updates++;
+			iam->reset_num_intervals++;
 		}
-		do_reset_info = NULL;
-		do_reset_ip_map = NULL;
-		clear_ip_map = NULL;
-		clear_ip_history_map = NULL;
 
-		do_reset_interval_start = 0;
-		do_reset_interval_end = 0;
+		/* free data for ips whose entire histories contain only zeros to conserve space, but only if we've caught up */
+		iam->reset_drop_empty = info->next_reset >= now ? 1 : 0;
 
 		/* 
 		 * test if we've cycled past all existing data -- if so wipe all existing histories
@@ -773,67 +1113,246 @@ static void handle_interval_reset(info_and_maps* iam, time_t now)
 		 */
 		if(info->next_reset <= now)
 		{
-			reset_histories_ip_map = iam->ip_map;
-			apply_to_every_long_map_value(iam->ip_history_map, reset_histories);
-			reset_histories_ip_map = NULL;
-
+			iam->reset_wipe = 1;
 			info->previous_reset = now;
 			info->next_reset = get_next_reset_time(info, now, info->previous_reset);
 		}
 	}
-	info->combined_bw = (uint64_t*)get_long_map_element(iam->ip_map, 0);
+
+	iam->epoch++;
+	iam->reset_pending = 1;
+	clear_topk(iam->topk);
+	iam->reset_cursor = 0;
+	iam->reset_cursor_capacity = iam->ip_map->capacity;
+
+	/* combined total is looked at by every packet, so roll it now */
+	combined = (bw_entry*)get_ip_hash_map_element(iam->ip_map, combined_ip);
+	if(combined != NULL && roll_entry(iam, combined))
+	{
+		free_entry( (bw_entry*)remove_ip_hash_map_element(iam->ip_map, combined_ip) );
+	}
+	info->combined_bw = get_bw_for_ip(iam, combined_ip);
 	info->current_bandwidth = 0;
 }
 
 /* 
- * set max bandwidth to be max possible using 63 of the
- * 64 bits in our record.  In some systems uint64_t is treated
- * like signed, so to prevent errors, use only 63 bits
+ * roll over up to max_entries more slots of ip_map (0 = all of them),
+ * returns 1 if there is still work left to do
  */
-static uint64_t pow64(uint64_t base, uint64_t pow)
+static unsigned char continue_interval_reset(info_and_maps* iam, uint32_t max_entries)
 {
-	uint64_t val = 1;
-	if(pow > 0)
+	uint32_t num_checked = 0;
+	if(iam->reset_pending == 0 || iam->ip_map == NULL)
 	{
-		val = base*pow64(base, pow-1);
+		iam->reset_pending = 0;
+		return 0;
 	}
-	return val;
+	if(iam->reset_cursor_capacity != iam->ip_map->capacity)
+	{
+		/* table grew and got re-ordered since we started, so start over -- entries we already did get skipped quickly */
+		iam->reset_cursor = 0;
+		iam->reset_cursor_capacity = iam->ip_map->capacity;
+	}
+	while(max_entries == 0 || num_checked < max_entries)
+	{
+		ip_key ip;
+		bw_entry* entry = (bw_entry*)get_next_ip_hash_map_element(iam->ip_map, &(iam->reset_cursor), &ip);
+		if(entry == NULL)
+		{
+			iam->reset_pending = 0;
+			break;
+		}
+		if(roll_entry(iam, entry))
+		{
+			#ifdef BANDWIDTH_DEBUG
+				printk("clearing ip = %016llx%016llx\n", ip.hi, ip.lo );
+			#endif
+
+			/* removing may shift a later entry back into this slot, so don't advance cursor */
+			free_entry( (bw_entry*)remove_ip_hash_map_element(iam->ip_map, ip) );
+			if(ip_key_is_zero(ip))
+			{
+				iam->info->combined_bw = NULL;
+			}
+		}
+		else
+		{
+			iam->reset_cursor++;
+		}
+		num_checked++;
+	}
+	return iam->reset_pending;
 }
-static uint64_t get_bw_record_max(void) /* called by init to set global variable */
+
+static void run_resets_for_id(char* key, void* value)
 {
-	return  (pow64(2,62)) + (pow64(2,62)-1);
+	info_and_maps* iam = (info_and_maps*)value;
+	if(iam == NULL || iam->info == NULL || iam->ip_map == NULL) /* should never be null, but let's be sure */
+	{
+		return;
+	}
+	if(set_in_progress_for_id(key))
+	{
+		return;
+	}
+	if(iam->info->reset_interval != BANDWIDTH_NEVER && iam->info->next_reset < reset_worker_now)
+	{
+		begin_interval_reset(iam, reset_worker_now);
+	}
+	if(continue_interval_reset(iam, BANDWIDTH_RESET_BATCH))
+	{
+		reset_work_remaining = 1;
+	}
 }
-static uint64_t bandwidth_record_max;
-
-
-#define ADD_UP_TO_MAX(original,add,is_check) (bandwidth_record_max - original > add && is_check== 0) ? original+add : (is_check ? original : bandwidth_record_max);
-
 
 /*
- * Shamelessly yoinked from xt_time.c
- * "That is so amazingly amazing, I think I'd like to steal it." 
- *      -- Zaphod Beeblebrox
+ * ip maps too large to grow with an atomic allocation in match are grown
+ * here, where we can sleep.  Holding userspace_lock keeps rules from being
+ * added or removed while bandwidth_lock is dropped for the allocation
  */
+#define BANDWIDTH_GROW_BATCH	8
 
-static const u_int16_t days_since_year[] = {
-	0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334,
-};
+static info_and_maps* grow_iam = NULL;
+static uint32_t grow_capacity = 0;
 
-static const u_int16_t days_since_leapyear[] = {
-	0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335,
-};
+static void find_ip_map_to_grow(char* key, void* value)
+{
+	info_and_maps* iam = (info_and_maps*)value;
+	if(grow_iam == NULL && iam != NULL && iam->ip_map != NULL)
+	{
+		grow_capacity = get_ip_hash_map_wanted_capacity(iam->ip_map);
+		grow_iam = grow_capacity > 0 ? iam : NULL;
+	}
+}
 
-/*
- * Since time progresses forward, it is best to organize this array in reverse,
- * to minimize lookup time.  These are days since epoch since start of each year,
- * going back to 1970
- */
-#define DSE_FIRST 2039
-static const u_int16_t days_since_epoch_for_each_year_start[] = {
-	/* 2039 - 2030 */
-	25202, 24837, 24472, 24106, 23741, 23376, 23011, 22645, 22280, 21915,
-	/* 2029 - 2020 */
-	21550, 21184, 20819, 20454, 20089, 19723, 19358, 18993, 18628, 18262,
+static void grow_ip_maps(void)
+{
+	int grown;
+	down_read(&userspace_lock);
+	for(grown = 0; grown < BANDWIDTH_GROW_BATCH; grown++)
+	{
+		info_and_maps* iam;
+		uint32_t capacity;
+		uint32_t old_capacity = 0;
+		ip_hash_map_slot* slots;
+		ip_hash_map_slot* old_slots = NULL;
+
+		spin_lock_bh(&bandwidth_lock);
+		grow_iam = NULL;
+		if(id_map != NULL)
+		{
+			apply_to_every_string_map_value(id_map, find_ip_map_to_grow);
+		}
+		iam = grow_iam;
+		capacity = grow_capacity;
+		spin_unlock_bh(&bandwidth_lock);
+		if(iam == NULL)
+		{
+			break;
+		}
+
+		slots = alloc_ip_hash_map_slots(capacity, 1);
+		if(slots == NULL)
+		{
+			break;
+		}
+		spin_lock_bh(&bandwidth_lock);
+		if(iam->ip_map->capacity < capacity)
+		{
+			old_capacity = iam->ip_map->capacity;
+			old_slots = replace_ip_hash_map_slots(iam->ip_map, slots, capacity);
+		}
+		else
+		{
+			/* grew in match meanwhile */
+			old_capacity = capacity;
+			old_slots = slots;
+		}
+		spin_unlock_bh(&bandwidth_lock);
+		free_ip_hash_map_slots(old_slots, old_capacity);
+	}
+	up_read(&userspace_lock);
+}
+
+/* 
+ * runs once a second, or every tick while rollovers are in progress,
+ * so rules reset on time whether or not they see any packets
+ */
+static void reset_worker(struct work_struct* work)
+{
+	time_t now = get_seconds();
+	unsigned long delay;
+
+	/* the only place (besides checkentry) that time changes get applied, so match never has to */
+	check_for_timezone_shift(now, 0);
+	check_for_backwards_time_shift(now);
+
+	grow_ip_maps();
+
+	spin_lock_bh(&bandwidth_lock);
+	expire_abandoned_set();
+	reset_worker_now = now - local_seconds_west;
+	reset_work_remaining = 0;
+	reset_work_kicked = 0;
+	if(id_map != NULL)
+	{
+		apply_to_every_string_map_value(id_map, run_resets_for_id);
+	}
+	delay = reset_work_remaining ? 1 : HZ;
+	spin_unlock_bh(&bandwidth_lock);
+
+	schedule_delayed_work(&reset_work, delay);
+}
+
+/* 
+ * set max bandwidth to be max possible using 63 of the
+ * 64 bits in our record.  In some systems uint64_t is treated
+ * like signed, so to prevent errors, use only 63 bits
+ */
+static uint64_t pow64(uint64_t base, uint64_t pow)
+{
+	uint64_t val = 1;
+	if(pow > 0)
+	{
+		val = base*pow64(base, pow-1);
+	}
+	return val;
+}
+static uint64_t get_bw_record_max(void) /* called by init to set global variable */
+{
+	return  (pow64(2,62)) + (pow64(2,62)-1);
+}
+static uint64_t bandwidth_record_max;
+
+
+#define ADD_UP_TO_MAX(original,add,is_check) (bandwidth_record_max - original > add && is_check== 0) ? original+add : (is_check ? original : bandwidth_record_max);
+
+
+/*
+ * Shamelessly yoinked from xt_time.c
+ * "That is so amazingly amazing, I think I'd like to steal it." 
+ *      -- Zaphod Beeblebrox
+ */
+
+static const u_int16_t days_since_year[] = {
+	0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334,
+};
+
+static const u_int16_t days_since_leapyear[] = {
+	0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335,
+};
+
+/*
+ * Since time progresses forward, it is best to organize this array in reverse,
+ * to minimize lookup time.  These are days since epoch since start of each year,
+ * going back to 1970
+ */
+#define DSE_FIRST 2039
+static const u_int16_t days_since_epoch_for_each_year_start[] = {
+	/* 2039 - 2030 */
+	25202, 24837, 24472, 24106, 23741, 23376, 23011, 22645, 22280, 21915,
+	/* 2029 - 2020 */
+	21550, 21184, 20819, 20454, 20089, 19723, 19358, 18993, 18628, 18262,
 	/* 2019 - 2010 */
 	17897, 17532, 17167, 16801, 16436, 16071, 15706, 15340, 14975, 14610,
 	/* 2009 - 2000 */
@@ -1026,7 +1545,7 @@ static time_t get_next_reset_time(struct ipt_bandwidth_info *info, time_t now, t
 
 
 
-static uint64_t* initialize_map_entries_for_ip(info_and_maps* iam, unsigned long ip, uint64_t initial_bandwidth)
+static uint64_t* initialize_map_entries_for_ip(info_and_maps* iam, ip_key ip, uint64_t initial_bandwidth)
 {
 	#ifdef BANDWIDTH_DEBUG
 		printk("initializing entry for ip, bw=%lld\n", initial_bandwidth);
@@ -1041,8 +1560,7 @@ static uint64_t* initialize_map_entries_for_ip(info_and_maps* iam, unsigned long
 	if(iam != NULL) /* should never happen, but let's be certain */
 	{
 		struct ipt_bandwidth_info *info = iam->info;
-		long_map* ip_map = iam->ip_map;
-		long_map* ip_history_map = iam->ip_history_map;
+		ip_hash_map* ip_map = iam->ip_map;
 
 		#ifdef BANDWIDTH_DEBUG
 			if(info == NULL){ printk("error in initialization: info is null!\n"); }
@@ -1050,290 +1568,1246 @@ static uint64_t* initialize_map_entries_for_ip(info_and_maps* iam, unsigned long
 		#endif
 
 
-		if(info != NULL && ip_map != NULL) /* again... should never happen but let's be sure */
+		if(info != NULL && ip_map != NULL && iam->pool != NULL) /* again... should never happen but let's be sure */
 		{
-			if(info->num_intervals_to_save == 0 || ip_history_map == NULL)
-			{
-				#ifdef BANDWIDTH_DEBUG
-					printk("  initializing entry for ip without history\n");
-				#endif
-				new_bw = (uint64_t*)kmalloc(sizeof(uint64_t), GFP_ATOMIC);
-			}
-			else
-			{
-				#ifdef BANDWIDTH_DEBUG
-					printk("  initializing entry for ip with history\n");
-				#endif
+			bw_entry* entry = (bw_entry*)get_ip_hash_map_element(ip_map, ip);
+			unsigned char is_new_entry = entry == NULL ? 1 : 0;
 
-				bw_history *new_history = initialize_history(info->num_intervals_to_save);
-				if(new_history != NULL) /* check for kmalloc failure */
+			/* make_room_for_remote_ip has to be called first if every node is taken */
+			bw_remote_node* node = NULL;
+			if(is_new_entry && iam->remote != NULL && iam->remote->num_nodes > 0 && is_remote_prefix(iam->remote, ip))
+			{
+				node = list_entry(iam->remote->lru.prev, bw_remote_node, lru);
+				if(node->owner != NULL)
 				{
-					bw_history* old_history;
-					#ifdef BANDWIDTH_DEBUG
-						printk("  malloc succeeded, new history is non-null\n");
-					#endif
-
-					new_bw = (uint64_t*)(new_history->history_data + new_history->current_index);
-					old_history = set_long_map_element(ip_history_map, ip, (void*)new_history);
-					if(old_history != NULL)
-					{
-						#ifdef BANDWIDTH_DEBUG
-							printk("  after initialization old_history not null!  (something is FUBAR)\n");
-						#endif
-						kfree(old_history->history_data);
-						kfree(old_history);
-					}
-
-					#ifdef BANDWIDTH_DEBUG
-						
-					#endif
+					return NULL;
 				}
 			}
-			if(new_bw != NULL) /* check for kmalloc failure */
+
+			if(is_new_entry)
 			{
-				uint64_t* old_bw;
-				*new_bw = initial_bandwidth;
-			       	old_bw = set_long_map_element(ip_map, ip, (void*)new_bw );
-				
-				/* only free old_bw if num_intervals_to_save is zero -- otherwise it already got freed above when we wiped the old history */
-				if(old_bw != NULL && info->num_intervals_to_save == 0)
+				entry = alloc_entry(iam->pool);
+				if(entry == NULL) /* check for kmalloc failure */
 				{
-					free(old_bw);
+					return NULL;
 				}
-
-				if(ip == 0)
+				entry->hires = NULL;
+				entry->topk_index = 0;
+				entry->remote = NULL;
+				if(set_ip_hash_map_element(ip_map, ip, (void*)entry) == (void*)entry) /* table full and can't grow */
 				{
-					info->combined_bw = new_bw;
+					free_entry(entry);
+					return NULL;
 				}
-
-				#ifdef BANDWIDTH_DEBUG
-					uint64_t *test = (uint64_t*)get_long_map_element(ip_map, ip);
-					if(test == NULL)
-					{
-						printk("  after initialization bw is null!\n");
-					}
-					else
-					{
-						printk("  after initialization bw is %lld\n", *new_bw);
-						printk("  after initialization test is %lld\n", *test);
-					}
-				#endif
+				if(node != NULL)
+				{
+					node->owner = entry;
+					node->ip = ip;
+					entry->remote = node;
+					list_move(&(node->lru), &(iam->remote->lru));
+				}
+			}
+			/* history lives in the entry's record, so (re-)initializing just wipes it */
+			reset_entry_history(entry);
+			entry->epoch = iam->epoch;
+			zero_entry_counters(entry);
+
+			new_bw = get_entry_bw(entry);
+			*new_bw = initial_bandwidth;
+			if(ip_key_is_zero(ip))
+			{
+				info->combined_bw = new_bw;
 			}
+
+			#ifdef BANDWIDTH_DEBUG
+				printk("  after initialization bw is %lld\n", *new_bw);
+			#endif
 		}
 	}
 
 	return new_bw;
 }
 
-
-static bool match(const struct sk_buff *skb, struct xt_action_param *par)
+/* looks up entry for ip, rolling it over first if the reset worker hasn't gotten to it yet */
+static bw_entry* get_entry_for_ip(info_and_maps* iam, ip_key ip)
 {
-
-	struct ipt_bandwidth_info *info = ((const struct ipt_bandwidth_info*)(par->matchinfo))->non_const_self;
-	
-	time_t now;
-	int match_found;
-
-
-	unsigned char is_check = info->cmp == BANDWIDTH_CHECK ? 1 : 0;
-	unsigned char do_src_dst_swap = 0;
-	info_and_maps* iam = NULL;
-	long_map* ip_map = NULL;
-	
-	uint64_t* bws[2] = {NULL, NULL};
-
-	/* if we're currently setting this id, ignore new data until set is complete */
-	if(set_in_progress == 1)
+	bw_entry* entry = (bw_entry*)get_ip_hash_map_element(iam->ip_map, ip);
+	if(entry != NULL && entry->epoch != iam->epoch)
 	{
-		if(strcmp(info->id, set_id) == 0)
+		if(roll_entry(iam, entry))
 		{
-			return 0;
+			/* 
+			 * it would have been dropped as empty but we're about to use it, 
+			 * so start it over as if it had been dropped and re-created
+			 */
+			bw_history* bh = entry->history;
+			bh->first_start = 0;
+			bh->first_end = 0;
+			bh->last_end = 0; 
+			bh->num_nodes = 1;
+			bh->non_zero_nodes = 0;
+			bh->current_index = 0;
+			(bh->history_data)[0] = 0;
 		}
 	}
-	
-
-	
+	return entry;
+}
 
-	/* 
-	 * BEFORE we lock, check for timezone shift 
-	 * this will almost always be be very,very quick,
-	 * but in the event there IS a shift this
-	 * function will lock both kernel update spinlock 
-	 * and userspace i/o semaphore,  and do a lot of 
-	 * number crunching so we shouldn't 
-	 * already be locked.
-	 */
-	now = get_seconds();
-	
+/* returns current total for ip, or NULL if there isn't an entry for it yet */
+static uint64_t* get_bw_for_ip(info_and_maps* iam, ip_key ip)
+{
+	bw_entry* entry = get_entry_for_ip(iam, ip);
+	return entry == NULL ? NULL : get_entry_bw(entry);
+}
 
-	if(now != last_local_mw_update )
-	{
-		check_for_timezone_shift(now, 0);
-		check_for_backwards_time_shift(now);
-	}
-	now = now -  local_seconds_west;  /* Adjust for local timezone */
+static bw_history* get_history_for_ip(info_and_maps* iam, ip_key ip)
+{
+	bw_entry* entry = get_entry_for_ip(iam, ip);
+	return entry == NULL ? NULL : entry->history;
+}
 
-	spin_lock_bh(&bandwidth_lock);
-	
-	if(is_check)
+static void free_entry(bw_entry* entry)
+{
+	if(entry != NULL)
 	{
-		info_and_maps* check_iam;
-		do_src_dst_swap = info->check_type == BANDWIDTH_CHECK_SWAP ? 1 : 0;
-		check_iam = (info_and_maps*)get_string_map_element_with_hashed_key(id_map, info->hashed_id);
-		if(check_iam == NULL)
+		bw_entry_pool* pool = entry->pool;
+		if(entry->hires != NULL)
 		{
-			spin_unlock_bh(&bandwidth_lock);
-			return 0;
+			release_hires_ring(entry->hires);
 		}
-		info = check_iam->info;
-	}
-
-
-
-
-	if(info->reset_interval != BANDWIDTH_NEVER)
-	{
-		if(info->next_reset < now)
+		if(entry->remote != NULL)
 		{
-			//do reset
-			//iam = (info_and_maps*)get_string_map_element_with_hashed_key(id_map, info->hashed_id);
-			iam = (info_and_maps*)info->iam;
-			if(iam != NULL) /* should never be null, but let's be sure */
-			{
-				handle_interval_reset(iam, now);
-				ip_map = iam->ip_map;
-			}
-			else
-			{
-				/* even in case of malloc failure or weird error we can update these params */
-				info->current_bandwidth = 0;
-				info->next_reset = get_next_reset_time(info, now, info->previous_reset);
-			}
+			release_remote_node(entry->remote);
 		}
-	}
-
-	if(info->type == BANDWIDTH_COMBINED)
-	{
-		if(iam == NULL)
+		if(pool->num_free < pool->max_free)
 		{
-			//iam = (info_and_maps*)get_string_map_element_with_hashed_key(id_map, info->hashed_id);
-			iam = (info_and_maps*)info->iam;
-			if(iam != NULL)
-			{
-				ip_map = iam->ip_map;
-			}
+			entry->next_free = pool->free_list;
+			pool->free_list = entry;
+			pool->num_free++;
 		}
-		if(ip_map != NULL) /* if this ip_map != NULL iam can never be NULL, so we don't need to check this */
+		else if(pool->cache != NULL)
 		{
-			
-			if(info->combined_bw == NULL)
-			{
-				bws[0] = initialize_map_entries_for_ip(iam, 0, skb->len);
-			}
-			else
-			{
-				bws[0] = info->combined_bw;
-				*(bws[0]) = ADD_UP_TO_MAX(*(bws[0]), (uint64_t)skb->len, is_check);
-			}
+			kmem_cache_free(pool->cache, entry);
 		}
 		else
 		{
-			#ifdef BANDWIDTH_DEBUG
-				printk("error: ip_map is null in match!\n");
-			#endif
+			kfree(entry);
 		}
-		info->current_bandwidth = ADD_UP_TO_MAX(info->current_bandwidth, (uint64_t)skb->len, is_check);
 	}
-	else
+}
+
+static void free_all_entries(ip_hash_map* ip_map)
+{
+	unsigned long num_destroyed;
+	unsigned long entry_index;
+	bw_entry** entries = (bw_entry**)clear_ip_hash_map(ip_map, DESTROY_MODE_RETURN_VALUES, &num_destroyed);
+
+	/* num_destroyed will be 0 if entries is null after malloc failure, so this is safe */
+	for(entry_index = 0; entry_index < num_destroyed; entry_index++)
 	{
-		uint32_t bw_ip, bw_ip_index;
-		uint32_t bw_ips[2] = {0, 0};
-		struct iphdr* iph = (struct iphdr*)(skb_network_header(skb));
-		if(info->type == BANDWIDTH_INDIVIDUAL_SRC)
-		{
-			//src ip
-			bw_ips[0] = iph->saddr;
-			if(do_src_dst_swap)
-			{
-				bw_ips[0] = iph->daddr;
-			}
-		}
-		else if (info->type == BANDWIDTH_INDIVIDUAL_DST)
+		free_entry(entries[entry_index]);
+	}
+	if(entries != NULL)
+	{
+		kfree(entries);
+	}
+}
+
+
+/* called from checkentry, before we lock, since creating a cache can sleep */
+static bw_entry_pool* initialize_entry_pool(struct ipt_bandwidth_info* info)
+{
+	bw_entry_pool* pool = (bw_entry_pool*)kmalloc(sizeof(bw_entry_pool), GFP_KERNEL);
+	if(pool != NULL)
+	{
+		pool->cache = bw_entry_cache;
+		pool->own_cache = 0;
+		pool->record_size = sizeof(bw_entry);
+		pool->num_intervals = info->num_intervals_to_save;
+		pool->num_free = 0;
+		pool->max_free = info->prealloc <= BANDWIDTH_PREALLOC_MAX ? info->prealloc : BANDWIDTH_PREALLOC_MAX;
+		pool->free_list = NULL;
+		pool->cache_name[0] = '\0';
+		if(pool->num_intervals > 0)
 		{
-			//dst ip
-			bw_ips[0] = iph->daddr;
-			if(do_src_dst_swap)
-			{
-				bw_ips[0] = iph->saddr;
-			}
+			pool->record_size = sizeof(bw_entry) + sizeof(bw_history) + (1+pool->num_intervals)*sizeof(uint64_t); /* number to save +1 for current */
+			sprintf(pool->cache_name, "ipt_bandwidth_%u_%lx", pool->num_intervals, info->hashed_id);
+			pool->cache = kmem_cache_create(pool->cache_name, pool->record_size, 0, 0, NULL);
+			pool->own_cache = pool->cache == NULL ? 0 : 1;
 		}
-		else if(info->type ==  BANDWIDTH_INDIVIDUAL_LOCAL ||  info->type == BANDWIDTH_INDIVIDUAL_REMOTE)
+		while(pool->num_free < pool->max_free)
 		{
-			//remote or local ip -- need to test both src && dst
-			uint32_t src_ip = iph->saddr;
-			uint32_t dst_ip = iph->daddr;
-			if(info->type == BANDWIDTH_INDIVIDUAL_LOCAL)
-			{
-				bw_ips[0] = ((info->local_subnet_mask & src_ip) == info->local_subnet) ? src_ip : 0;
-				bw_ips[1] = ((info->local_subnet_mask & dst_ip) == info->local_subnet) ? dst_ip : 0;
-			}
-			else if(info->type == BANDWIDTH_INDIVIDUAL_REMOTE)
+			bw_entry* entry = (bw_entry*)(pool->cache != NULL ? kmem_cache_alloc(pool->cache, GFP_KERNEL) : kmalloc(pool->record_size, GFP_KERNEL));
+			if(entry == NULL)
 			{
-				bw_ips[0] = ((info->local_subnet_mask & src_ip) != info->local_subnet ) ? src_ip : 0;
-				bw_ips[1] = ((info->local_subnet_mask & dst_ip) != info->local_subnet ) ? dst_ip : 0;
+				printk("ipt_bandwidth: warning, could only preallocate %u entries for \"%s\"\n", pool->num_free, info->id);
+				break;
 			}
+			entry->next_free = pool->free_list;
+			pool->free_list = entry;
+			pool->num_free++;
 		}
-		
-		if(ip_map == NULL)
-		{
-			//iam = (info_and_maps*)get_string_map_element_with_hashed_key(id_map, info->hashed_id);
-			iam = (info_and_maps*)info->iam;
-			if(iam != NULL)
-			{
-				ip_map = iam->ip_map;
-			}	
-		}
-		if(!is_check && info->cmp == BANDWIDTH_MONITOR)
+	}
+	return pool;
+}
+
+/* every entry must have been freed first, and since destroying a cache can sleep, call this unlocked */
+static void free_entry_pool(bw_entry_pool* pool)
+{
+	if(pool != NULL)
+	{
+		while(pool->free_list != NULL)
 		{
-			uint64_t* combined_oldval = info->combined_bw;
-			if(combined_oldval == NULL)
+			bw_entry* entry = pool->free_list;
+			pool->free_list = entry->next_free;
+			if(pool->cache != NULL)
 			{
-				combined_oldval = initialize_map_entries_for_ip(iam, 0, (uint64_t)skb->len);
+				kmem_cache_free(pool->cache, entry);
 			}
 			else
 			{
-				*combined_oldval = ADD_UP_TO_MAX(*combined_oldval, (uint64_t)skb->len, is_check);
+				kfree(entry);
 			}
 		}
-		bw_ip_index = bw_ips[0] == 0 ? 1 : 0;
-		bw_ip = bw_ips[bw_ip_index];
-		if(bw_ip != 0 && ip_map != NULL)
+		if(pool->own_cache)
 		{
-			uint64_t* oldval = get_long_map_element(ip_map, (unsigned long)bw_ip);
-			if(oldval == NULL)
-			{
-				if(!is_check)
-				{
-					/* may return NULL on malloc failure but that's ok */
-					oldval = initialize_map_entries_for_ip(iam, (unsigned long)bw_ip, (uint64_t)skb->len);
-				}
-			}
-			else
-			{
-				*oldval = ADD_UP_TO_MAX(*oldval, (uint64_t)skb->len, is_check);
-			}
-			
-			/* this is fine, setting bws[bw_ip_index] to NULL on check for undefined value or kmalloc failure won't crash anything */
-			bws[bw_ip_index] = oldval;
+			kmem_cache_destroy(pool->cache);
 		}
-		
+		kfree(pool);
 	}
+}
 
-
-	match_found = 0;
-	if(info->cmp != BANDWIDTH_MONITOR)
+static bw_entry* alloc_entry(bw_entry_pool* pool)
+{
+	bw_entry* entry = pool->free_list;
+	if(entry != NULL)
 	{
-		if(info->cmp == BANDWIDTH_GT)
+		pool->free_list = entry->next_free;
+		pool->num_free--;
+	}
+	else
+	{
+		entry = (bw_entry*)(pool->cache != NULL ? kmem_cache_alloc(pool->cache, GFP_ATOMIC) : kmalloc(pool->record_size, GFP_ATOMIC));
+	}
+	if(entry != NULL)
+	{
+		entry->pool = pool;
+		entry->history = pool->num_intervals > 0 ? (bw_history*)(entry+1) : NULL;
+	}
+	return entry;
+}
+
+static void reset_entry_history(bw_entry* entry)
+{
+	bw_history* history = entry->history;
+	if(history != NULL)
+	{
+		history->history_data = (uint64_t*)(history+1);
+		history->first_start = 0;
+		history->first_end = 0;
+		history->last_end = 0;
+		history->max_nodes = entry->pool->num_intervals+1; /*number to save +1 for current */
+		history->num_nodes = 1;
+		history->non_zero_nodes = 0; /* counts non_zero nodes other than current, so initialize to 0 */
+		history->current_index = 0;
+		memset(history->history_data, 0, history->max_nodes*sizeof(uint64_t));
+	}
+}
+
+
+/* called from checkentry, before we lock, so we can use vmalloc */
+static bw_hires* initialize_hires(uint32_t num_slots, uint32_t num_rings)
+{
+	bw_hires* hires = (bw_hires*)kmalloc(sizeof(bw_hires), GFP_KERNEL);
+	uint32_t ring_index;
+	if(hires == NULL)
+	{
+		return NULL;
+	}
+	hires->num_slots = num_slots;
+	hires->num_rings = num_rings;
+	hires->rings = (bw_hires_ring*)vmalloc(num_rings*sizeof(bw_hires_ring));
+	hires->ticks = (uint32_t*)vmalloc(num_rings*num_slots*sizeof(uint32_t));
+	hires->bytes = (uint64_t*)vmalloc(num_rings*num_slots*sizeof(uint64_t));
+	if(hires->rings == NULL || hires->ticks == NULL || hires->bytes == NULL)
+	{
+		free_hires(hires);
+		return NULL;
+	}
+	memset(hires->ticks, 0, num_rings*num_slots*sizeof(uint32_t));
+	INIT_LIST_HEAD(&(hires->lru));
+	for(ring_index=0; ring_index < num_rings; ring_index++)
+	{
+		bw_hires_ring* ring = hires->rings + ring_index;
+		ring->pool = hires;
+		ring->owner = NULL;
+		ring->newest_tick = 0;
+		ring->ticks = hires->ticks + (ring_index*num_slots);
+		ring->bytes = hires->bytes + (ring_index*num_slots);
+		list_add_tail(&(ring->lru), &(hires->lru));
+	}
+	return hires;
+}
+
+/* entries must be freed first, so no entry points to a ring */
+static void free_hires(bw_hires* hires)
+{
+	if(hires != NULL)
+	{
+		if(hires->rings != NULL) { vfree(hires->rings); }
+		if(hires->ticks != NULL) { vfree(hires->ticks); }
+		if(hires->bytes != NULL) { vfree(hires->bytes); }
+		kfree(hires);
+	}
+}
+
+/* 
+ * give ring back to the pool, it's wiped since its slots may not 
+ * have expired yet, which would make them look like they belong
+ * to the next ip to take it
+ */
+static void release_hires_ring(bw_hires_ring* ring)
+{
+	bw_hires* pool = ring->pool;
+	memset(ring->ticks, 0, pool->num_slots*sizeof(uint32_t));
+	ring->owner->hires = NULL;
+	ring->owner = NULL;
+	ring->newest_tick = 0;
+	list_move_tail(&(ring->lru), &(pool->lru));
+}
+
+/* 
+ * add len bytes to ip's slot for tick, taking a ring for ip if it 
+ * doesn't have one yet.  Must be called with bandwidth_lock held
+ */
+static void record_hires(info_and_maps* iam, ip_key ip, uint32_t tick, uint64_t len)
+{
+	bw_hires* pool = iam->hires;
+	bw_entry* entry;
+	bw_hires_ring* ring;
+	uint32_t slot_index;
+	if(pool == NULL || len == 0)
+	{
+		return;
+	}
+	entry = get_entry_for_ip(iam, ip);
+	if(entry == NULL)
+	{
+		return;
+	}
+
+	ring = entry->hires;
+	if(ring == NULL)
+	{
+		ring = list_entry(pool->lru.prev, bw_hires_ring, lru);
+		if(ring->owner != NULL)
+		{
+			if(ring->newest_tick + pool->num_slots > tick)
+			{
+				/* every ring is in use */
+				return;
+			}
+			/* all of the old owner's slots have expired, so nothing needs to be wiped */
+			ring->owner->hires = NULL;
+		}
+		ring->owner = entry;
+		ring->ip = ip;
+		ring->newest_tick = tick;
+		entry->hires = ring;
+		list_move(&(ring->lru), &(pool->lru));
+	}
+	else if(tick > ring->newest_tick)
+	{
+		ring->newest_tick = tick;
+		list_move(&(ring->lru), &(pool->lru));
+	}
+	else if(tick + pool->num_slots <= ring->newest_tick)
+	{
+		/* clock went back further than the whole ring, start over */
+		memset(ring->ticks, 0, pool->num_slots*sizeof(uint32_t));
+		ring->newest_tick = tick;
+	}
+
+	slot_index = tick % pool->num_slots;
+	if(ring->ticks[slot_index] < tick)
+	{
+		ring->ticks[slot_index] = tick;
+		ring->bytes[slot_index] = 0;
+	}
+	if(ring->ticks[slot_index] == tick)
+	{
+		ring->bytes[slot_index] = ADD_UP_TO_MAX(ring->bytes[slot_index], len, 0);
+	}
+}
+
+
+/* called from checkentry, before we lock */
+static bw_topk* initialize_topk(uint32_t max_items)
+{
+	bw_topk* topk = (bw_topk*)kmalloc(sizeof(bw_topk), GFP_KERNEL);
+	if(topk == NULL)
+	{
+		return NULL;
+	}
+	topk->items = (bw_topk_item*)kmalloc(max_items*sizeof(bw_topk_item), GFP_KERNEL);
+	if(topk->items == NULL)
+	{
+		kfree(topk);
+		return NULL;
+	}
+	topk->max_items = max_items;
+	topk->num_items = 0;
+	return topk;
+}
+
+static void free_topk(bw_topk* topk)
+{
+	if(topk != NULL)
+	{
+		kfree(topk->items);
+		kfree(topk);
+	}
+}
+
+static void clear_topk(bw_topk* topk)
+{
+	uint32_t item_index;
+	if(topk == NULL)
+	{
+		return;
+	}
+	for(item_index=0; item_index < topk->num_items; item_index++)
+	{
+		topk->items[item_index].entry->topk_index = 0;
+	}
+	topk->num_items = 0;
+}
+
+static inline uint64_t topk_item_bw(bw_topk* topk, uint32_t index)
+{
+	return *(get_entry_bw(topk->items[index].entry));
+}
+
+static inline void swap_topk_items(bw_topk* topk, uint32_t a, uint32_t b)
+{
+	bw_topk_item tmp = topk->items[a];
+	topk->items[a] = topk->items[b];
+	topk->items[b] = tmp;
+	topk->items[a].entry->topk_index = a+1;
+	topk->items[b].entry->topk_index = b+1;
+}
+
+static void sift_topk_up(bw_topk* topk, uint32_t index)
+{
+	while(index > 0 && topk_item_bw(topk, (index-1)/2) > topk_item_bw(topk, index))
+	{
+		swap_topk_items(topk, index, (index-1)/2);
+		index = (index-1)/2;
+	}
+}
+
+static void sift_topk_down(bw_topk* topk, uint32_t index)
+{
+	while(1)
+	{
+		uint32_t smallest = index;
+		uint32_t left = (2*index)+1;
+		uint32_t right = left+1;
+		if(left < topk->num_items && topk_item_bw(topk, left) < topk_item_bw(topk, smallest))
+		{
+			smallest = left;
+		}
+		if(right < topk->num_items && topk_item_bw(topk, right) < topk_item_bw(topk, smallest))
+		{
+			smallest = right;
+		}
+		if(smallest == index)
+		{
+			break;
+		}
+		swap_topk_items(topk, index, smallest);
+		index = smallest;
+	}
+}
+
+/* 
+ * call whenever total of ip's entry has gone up, keeps it in the heap 
+ * if it's now among the highest.  Must be called with bandwidth_lock held
+ */
+static void update_topk(info_and_maps* iam, ip_key ip, bw_entry* entry)
+{
+	bw_topk* topk = iam->topk;
+	if(topk == NULL || entry == NULL || ip_key_is_zero(ip))
+	{
+		return;
+	}
+	if(entry->topk_index > 0)
+	{
+		sift_topk_down(topk, entry->topk_index-1);
+	}
+	else if(topk->num_items < topk->max_items)
+	{
+		uint32_t index = topk->num_items;
+		topk->num_items++;
+		topk->items[index].ip = ip;
+		topk->items[index].entry = entry;
+		entry->topk_index = index+1;
+		sift_topk_up(topk, index);
+	}
+	else if(*(get_entry_bw(entry)) > topk_item_bw(topk, 0))
+	{
+		topk->items[0].entry->topk_index = 0;
+		topk->items[0].ip = ip;
+		topk->items[0].entry = entry;
+		entry->topk_index = 1;
+		sift_topk_down(topk, 0);
+	}
+}
+
+/* start heap over from every entry, they must all have been rolled over to the current epoch */
+static void rebuild_topk(info_and_maps* iam)
+{
+	uint32_t cursor = 0;
+	bw_entry* entry;
+	ip_key ip;
+	if(iam->topk == NULL)
+	{
+		return;
+	}
+	clear_topk(iam->topk);
+	while( (entry = (bw_entry*)get_next_ip_hash_map_element(iam->ip_map, &cursor, &ip)) != NULL )
+	{
+		update_topk(iam, ip, entry);
+		cursor++;
+	}
+}
+
+/* call before entry is freed */
+static void remove_from_topk(bw_topk* topk, bw_entry* entry)
+{
+	uint32_t index;
+	if(topk == NULL || entry->topk_index == 0)
+	{
+		return;
+	}
+	index = entry->topk_index-1;
+	entry->topk_index = 0;
+	topk->num_items--;
+	if(index < topk->num_items)
+	{
+		topk->items[index] = topk->items[topk->num_items];
+		topk->items[index].entry->topk_index = index+1;
+		sift_topk_up(topk, index);
+		sift_topk_down(topk, topk->items[index].entry->topk_index-1);
+	}
+}
+
+
+/* called from checkentry, before we lock, so we can use vmalloc */
+static bw_remote* initialize_remote(unsigned char family, uint32_t prefix, uint32_t num_nodes)
+{
+	bw_remote* remote = (bw_remote*)kmalloc(sizeof(bw_remote), GFP_KERNEL);
+	uint32_t node_index;
+	if(remote == NULL)
+	{
+		return NULL;
+	}
+	if(family == NFPROTO_IPV6)
+	{
+		unsigned char mask[16];
+		uint32_t byte_index;
+		for(byte_index=0; byte_index < 16; byte_index++)
+		{
+			uint32_t byte_bits = prefix > byte_index*8 ? prefix - (byte_index*8) : 0;
+			mask[byte_index] = byte_bits >= 8 ? 0xFF : (unsigned char)(0xFF << (8-byte_bits));
+		}
+		remote->mask = ipv6_ip_key(mask);
+		remote->other_ip.hi = ~((uint64_t)0);
+		remote->other_ip.lo = ~((uint64_t)0);
+	}
+	else
+	{
+		remote->mask = ipv4_ip_key( prefix >= 32 ? 0xFFFFFFFF : htonl(~(0xFFFFFFFF >> prefix)) );
+		remote->other_ip = ipv4_ip_key(0xFFFFFFFF);
+	}
+
+	remote->num_nodes = num_nodes;
+	remote->nodes = NULL;
+	INIT_LIST_HEAD(&(remote->lru));
+	if(num_nodes > 0)
+	{
+		remote->nodes = (bw_remote_node*)vmalloc(num_nodes*sizeof(bw_remote_node));
+		if(remote->nodes == NULL)
+		{
+			kfree(remote);
+			return NULL;
+		}
+	}
+	for(node_index=0; node_index < num_nodes; node_index++)
+	{
+		remote->nodes[node_index].pool = remote;
+		remote->nodes[node_index].owner = NULL;
+		list_add_tail(&(remote->nodes[node_index].lru), &(remote->lru));
+	}
+	return remote;
+}
+
+/* entries must be freed first, so no entry points to a node */
+static void free_remote(bw_remote* remote)
+{
+	if(remote != NULL)
+	{
+		if(remote->nodes != NULL) { vfree(remote->nodes); }
+		kfree(remote);
+	}
+}
+
+static inline ip_key get_remote_prefix(bw_remote* remote, ip_key ip)
+{
+	ip.hi = ip.hi & remote->mask.hi;
+	ip.lo = ip.lo & remote->mask.lo;
+	return ip;
+}
+
+/* everything but the combined total and other_ip */
+static inline int is_remote_prefix(bw_remote* remote, ip_key ip)
+{
+	return !ip_key_is_zero(ip) && !ip_keys_equal(ip, remote->other_ip);
+}
+
+static void touch_remote_entry(bw_entry* entry)
+{
+	if(entry != NULL && entry->remote != NULL)
+	{
+		list_move(&(entry->remote->lru), &(entry->remote->pool->lru));
+	}
+}
+
+static void release_remote_node(bw_remote_node* node)
+{
+	node->owner->remote = NULL;
+	node->owner = NULL;
+	list_move_tail(&(node->lru), &(node->pool->lru));
+}
+
+/* 
+ * if ip is a new prefix and every node is taken, evict the least recently
+ * used prefix into other_ip.  Must be called with bandwidth_lock held
+ */
+static void make_room_for_remote_ip(info_and_maps* iam, ip_key ip)
+{
+	bw_remote* remote = iam->remote;
+	bw_remote_node* node;
+	bw_entry* evicted;
+	bw_entry* other;
+	ip_key evicted_ip;
+	if(remote == NULL || remote->num_nodes == 0 || !is_remote_prefix(remote, ip))
+	{
+		return;
+	}
+	node = list_entry(remote->lru.prev, bw_remote_node, lru);
+	if(node->owner == NULL || get_ip_hash_map_element(iam->ip_map, ip) != NULL)
+	{
+		return;
+	}
+
+	evicted_ip = node->ip;
+	if(iam->pcpu != NULL)
+	{
+		/* bytes cpus still have pending for it go to other_ip when folded, see get_pcpu_slot_entry */
+		atomic_inc(pcpu_version(iam, evicted_ip));
+	}
+	evicted = get_entry_for_ip(iam, evicted_ip);
+
+	other = get_entry_for_ip(iam, remote->other_ip);
+	if(other == NULL && initialize_map_entries_for_ip(iam, remote->other_ip, 0) != NULL)
+	{
+		other = (bw_entry*)get_ip_hash_map_element(iam->ip_map, remote->other_ip);
+	}
+	if(other != NULL)
+	{
+		uint64_t* other_bw = get_entry_bw(other);
+		*other_bw = ADD_UP_TO_MAX(*other_bw, *(get_entry_bw(evicted)), 0);
+		add_to_entry_counters(other, evicted->rx_bytes + evicted->tx_bytes, evicted->tx_bytes, evicted->rx_packets + evicted->tx_packets, evicted->tx_packets);
+		update_topk(iam, remote->other_ip, other);
+	}
+
+	#ifdef BANDWIDTH_DEBUG
+		printk("evicting remote prefix = %016llx%016llx\n", evicted_ip.hi, evicted_ip.lo );
+	#endif
+	remove_from_topk(iam->topk, evicted);
+	free_entry( (bw_entry*)remove_ip_hash_map_element(iam->ip_map, evicted_ip) );
+	if(iam->reset_pending)
+	{
+		/*
+		 * removing may have shifted an entry the reset hasn't rolled yet back
+		 * behind reset_cursor, so start over -- entries already done get skipped quickly
+		 */
+		iam->reset_cursor = 0;
+	}
+}
+
+
+static unsigned char ip_is_local(struct ipt_bandwidth_info* info, unsigned char family, ip_key ip)
+{
+	if(family == NFPROTO_IPV6)
+	{
+		ip_key subnet = ipv6_ip_key(info->local_subnet6);
+		ip_key mask = ipv6_ip_key(info->local_subnet6_mask);
+		return (ip.hi & mask.hi) == subnet.hi && (ip.lo & mask.lo) == subnet.lo ? 1 : 0;
+	}
+	return (info->local_subnet_mask & (uint32_t)ip.lo) == info->local_subnet ? 1 : 0;
+}
+
+/* 
+ * fills bw_ips with the ips packet is counted for, see match,
+ * and returns 1 if the packet is tx for the ip that gets counted
+ */
+static unsigned char get_ips_for_packet(struct ipt_bandwidth_info* info, unsigned char family, const struct sk_buff* skb, unsigned char do_src_dst_swap, ip_key* bw_ips)
+{
+	ip_key src_ip;
+	ip_key dst_ip;
+	unsigned char is_tx = 0;
+	if(family == NFPROTO_IPV6)
+	{
+		struct ipv6hdr* ip6h = ipv6_hdr(skb);
+		src_ip = ipv6_ip_key(&(ip6h->saddr));
+		dst_ip = ipv6_ip_key(&(ip6h->daddr));
+	}
+	else
+	{
+		struct iphdr* iph = (struct iphdr*)(skb_network_header(skb));
+		src_ip = ipv4_ip_key(iph->saddr);
+		dst_ip = ipv4_ip_key(iph->daddr);
+	}
+	bw_ips[0] = combined_ip;
+	bw_ips[1] = combined_ip;
+	if(info->type == BANDWIDTH_INDIVIDUAL_SRC)
+	{
+		//src ip
+		bw_ips[0] = do_src_dst_swap ? dst_ip : src_ip;
+		is_tx = 1;
+	}
+	else if (info->type == BANDWIDTH_INDIVIDUAL_DST)
+	{
+		//dst ip
+		bw_ips[0] = do_src_dst_swap ? src_ip : dst_ip;
+	}
+	else if(info->type ==  BANDWIDTH_INDIVIDUAL_LOCAL ||  info->type == BANDWIDTH_INDIVIDUAL_REMOTE)
+	{
+		//remote or local ip -- need to test both src && dst
+		unsigned char want_local = info->type == BANDWIDTH_INDIVIDUAL_LOCAL ? 1 : 0;
+		bw_ips[0] = ip_is_local(info, family, src_ip) == want_local ? src_ip : combined_ip;
+		bw_ips[1] = ip_is_local(info, family, dst_ip) == want_local ? dst_ip : combined_ip;
+		is_tx = ip_key_is_zero(bw_ips[0]) ? 0 : 1;
+		if(info->iam != NULL && ((info_and_maps*)info->iam)->remote != NULL)
+		{
+			bw_remote* remote = ((info_and_maps*)info->iam)->remote;
+			bw_ips[0] = get_remote_prefix(remote, bw_ips[0]);
+			bw_ips[1] = get_remote_prefix(remote, bw_ips[1]);
+		}
+	}
+	else
+	{
+		is_tx = ip_is_local(info, family, src_ip);
+	}
+	return is_tx;
+}
+
+static void add_to_entry_counters(bw_entry* entry, uint64_t bytes, uint64_t tx_bytes, uint64_t packets, uint64_t tx_packets)
+{
+	entry->tx_bytes = ADD_UP_TO_MAX(entry->tx_bytes, tx_bytes, 0);
+	entry->rx_bytes = ADD_UP_TO_MAX(entry->rx_bytes, bytes - tx_bytes, 0);
+	entry->tx_packets = ADD_UP_TO_MAX(entry->tx_packets, tx_packets, 0);
+	entry->rx_packets = ADD_UP_TO_MAX(entry->rx_packets, packets - tx_packets, 0);
+}
+
+
+/* 
+ * per-cpu slot handling -- all of these except pcpu_match 
+ * must be called with bandwidth_lock held
+ */
+
+/*
+ * entry the bytes pending for ip go to, setting ip to its key: ip's own,
+ * or other_ip's for a remote prefix evicted since the slot was claimed
+ */
+static bw_entry* get_pcpu_slot_entry(info_and_maps* iam, ip_key* ip)
+{
+	bw_entry* entry = get_entry_for_ip(iam, *ip);
+	if(entry == NULL && iam->remote != NULL && is_remote_prefix(iam->remote, *ip))
+	{
+		*ip = iam->remote->other_ip;
+		entry = get_entry_for_ip(iam, *ip);
+	}
+	if(entry == NULL && initialize_map_entries_for_ip(iam, *ip, 0) != NULL)
+	{
+		entry = (bw_entry*)get_ip_hash_map_element(iam->ip_map, *ip);
+	}
+	return entry;
+}
+
+/* add what slot has pending to its entry (on kmalloc failure those bytes are lost) and empty it */
+static void add_pcpu_pending(info_and_maps* iam, bw_pcpu_slot* slot)
+{
+	ip_key ip = slot->ip;
+	bw_entry* entry;
+	if(slot->pending == 0)
+	{
+		return;
+	}
+	entry = get_pcpu_slot_entry(iam, &ip);
+	if(entry != NULL)
+	{
+		uint64_t* total = get_entry_bw(entry);
+		*total = ADD_UP_TO_MAX(*total, slot->pending, 0);
+		add_to_entry_counters(entry, slot->pending, slot->pending_tx, slot->pending_packets, slot->pending_tx_packets);
+		update_topk(iam, ip, entry);
+		touch_remote_entry(entry);
+	}
+	if(ip_key_is_zero(slot->ip) && iam->info->type == BANDWIDTH_COMBINED)
+	{
+		iam->info->current_bandwidth = ADD_UP_TO_MAX(iam->info->current_bandwidth, slot->pending, 0);
+	}
+	record_hires(iam, ip, slot->tick, slot->pending);
+	atomic_inc(pcpu_version(iam, slot->ip));
+	slot->pending = 0;
+	slot->pending_tx = 0;
+	slot->pending_packets = 0;
+	slot->pending_tx_packets = 0;
+}
+
+/* add bytes pending on every cpu for ip to its total, for --bcheck rules */
+static void fold_pcpu_slot(info_and_maps* iam, ip_key ip)
+{
+	int cpu;
+	for_each_possible_cpu(cpu)
+	{
+		bw_pcpu* pcpu = per_cpu_ptr(iam->pcpu, cpu);
+		bw_pcpu_slot* slot;
+		spin_lock(&(pcpu->lock));
+		slot = find_pcpu_slot(pcpu, ip);
+		if(slot != NULL)
+		{
+			add_pcpu_pending(iam, slot);
+		}
+		spin_unlock(&(pcpu->lock));
+	}
+}
+
+/* add what this cpu has pending for ip to its total, before the locked path counts a packet for it */
+static void fold_local_pcpu_slot(info_and_maps* iam, ip_key ip)
+{
+	bw_pcpu_slot* slot = find_pcpu_slot(this_cpu_ptr(iam->pcpu), ip);
+	if(slot != NULL)
+	{
+		add_pcpu_pending(iam, slot);
+	}
+}
+
+/* 
+ * hand ip, whose total is now *total, to a slot of this cpu so the next
+ * packets can skip the lock, evicting the least recently used way of
+ * its set if need be
+ */
+static void claim_local_pcpu_slot(info_and_maps* iam, ip_key ip, uint64_t* total, uint32_t tick)
+{
+	bw_pcpu* pcpu = this_cpu_ptr(iam->pcpu);
+	bw_pcpu_slot* slot;
+	if(total == NULL)
+	{
+		return;
+	}
+	slot = find_pcpu_slot(pcpu, ip);
+	if(slot == NULL && ip_key_is_zero(ip))
+	{
+		slot = &(pcpu->combined);
+	}
+	else if(slot == NULL)
+	{
+		bw_pcpu_slot* set = pcpu_set(pcpu, ip);
+		uint32_t way;
+		slot = set;
+		for(way = 0; way < BANDWIDTH_PCPU_WAYS; way++)
+		{
+			if(!set[way].in_use)
+			{
+				slot = set + way;
+				break;
+			}
+			if(pcpu->clock - set[way].used > pcpu->clock - slot->used)
+			{
+				slot = set + way;
+			}
+		}
+	}
+	if(slot->in_use)
+	{
+		add_pcpu_pending(iam, slot);
+	}
+	slot->ip = ip;
+	slot->in_use = 1;
+	slot->base = *total;
+	slot->tick = tick;
+	slot->version = (uint32_t)atomic_read(pcpu_version(iam, ip));
+	slot->used = ++(pcpu->clock);
+	slot->refresh = jiffies + HZ;
+}
+
+/* fold every pending byte for this rule and empty all slots */
+static void fold_all_pcpu_slots(info_and_maps* iam)
+{
+	int cpu;
+	if(iam->pcpu == NULL)
+	{
+		return;
+	}
+	for_each_possible_cpu(cpu)
+	{
+		bw_pcpu* pcpu = per_cpu_ptr(iam->pcpu, cpu);
+		uint32_t slot_index;
+		spin_lock(&(pcpu->lock));
+		for(slot_index=0; slot_index <= BANDWIDTH_PCPU_SLOTS; slot_index++)
+		{
+			bw_pcpu_slot* slot = slot_index == BANDWIDTH_PCPU_SLOTS ? &(pcpu->combined) : &(pcpu->slots[slot_index]);
+			if(slot->in_use)
+			{
+				add_pcpu_pending(iam, slot);
+			}
+			slot->in_use = 0;
+		}
+		spin_unlock(&(pcpu->lock));
+	}
+}
+
+/*
+ * whether a packet of len bytes can be counted in slot: for --hires rules
+ * the first packet of every tick can't, so pending bytes all belong to
+ * the slot's tick, for quotas nor can the first after another cpu has
+ * folded the ip, and for remote rules the first after a second or so
+ */
+static inline int pcpu_slot_usable(info_and_maps* iam, bw_pcpu_slot* slot, uint64_t len, uint64_t limit, uint32_t tick)
+{
+	return	slot->in_use && limit - slot->pending > len &&
+		(iam->hires == NULL || slot->tick == tick) &&
+		(iam->info->cmp == BANDWIDTH_MONITOR || slot->version == (uint32_t)atomic_read(pcpu_version(iam, slot->ip))) &&
+		(iam->remote == NULL || time_before(jiffies, slot->refresh));
+}
+
+/* 
+ * returns 1 if packet was counted in this cpu's slots, in which case match_found is set
+ * returns 0 if we need to take the locked path
+ */
+static int pcpu_match(info_and_maps* iam, ip_key bw_ip, uint64_t len, unsigned char is_tx, uint32_t tick, int* match_found)
+{
+	struct ipt_bandwidth_info* info = iam->info;
+	bw_pcpu* pcpu = this_cpu_ptr(iam->pcpu);
+	bw_pcpu_slot* combined = (info->type == BANDWIDTH_COMBINED || info->cmp == BANDWIDTH_MONITOR) ? &(pcpu->combined) : NULL;
+	unsigned char use_slot = (info->type != BANDWIDTH_COMBINED && !ip_key_is_zero(bw_ip)) ? 1 : 0;
+	bw_pcpu_slot* slot;
+	uint64_t limit = info->slack > 0 ? info->slack : bandwidth_record_max;
+	int counted = 0;
+
+	/*
+	 * only this cpu claims its slots, so if ip has none the locked path
+	 * is needed whatever other cpus are doing, and there's no need to
+	 * take the slots' lock to find that out
+	 */
+	if(use_slot && find_pcpu_slot(pcpu, bw_ip) == NULL)
+	{
+		return 0;
+	}
+
+	spin_lock(&(pcpu->lock));
+	slot = use_slot ? find_pcpu_slot(pcpu, bw_ip) : NULL;
+	if(	(combined == NULL || pcpu_slot_usable(iam, combined, len, limit, tick)) &&
+		(!use_slot || (slot != NULL && pcpu_slot_usable(iam, slot, len, limit, tick)))
+		)
+	{
+		*match_found = 0;
+		if(combined != NULL)
+		{
+			combined->pending = combined->pending + len;
+			combined->pending_tx = combined->pending_tx + (is_tx ? len : 0);
+			combined->pending_packets++;
+			combined->pending_tx_packets = combined->pending_tx_packets + is_tx;
+		}
+		if(slot != NULL)
+		{
+			slot->pending = slot->pending + len;
+			slot->pending_tx = slot->pending_tx + (is_tx ? len : 0);
+			slot->pending_packets++;
+			slot->pending_tx_packets = slot->pending_tx_packets + is_tx;
+			slot->used = ++(pcpu->clock);
+		}
+		if(info->cmp != BANDWIDTH_MONITOR)
+		{
+			/* for combined rules current_bandwidth tracks the combined total */
+			unsigned char have_bw = info->type == BANDWIDTH_COMBINED || slot != NULL;
+			uint64_t bw = info->type == BANDWIDTH_COMBINED ? combined->base + combined->pending : (slot != NULL ? slot->base + slot->pending : 0);
+			uint64_t current_bandwidth = info->type == BANDWIDTH_COMBINED ? bw : info->current_bandwidth;
+			if(info->cmp == BANDWIDTH_GT)
+			{
+				*match_found = (have_bw && bw > info->bandwidth_cutoff) || current_bandwidth > info->bandwidth_cutoff ? 1 : 0;
+			}
+			else if(info->cmp == BANDWIDTH_LT)
+			{
+				*match_found = (have_bw && bw < info->bandwidth_cutoff) || current_bandwidth < info->bandwidth_cutoff ? 1 : 0;
+			}
+		}
+		counted = 1;
+	}
+	spin_unlock(&(pcpu->lock));
+	return counted;
+}
+
+
+static bool match(const struct sk_buff *skb, struct xt_action_param *par)
+{
+
+	struct ipt_bandwidth_info *info = ((const struct ipt_bandwidth_info*)(par->matchinfo))->non_const_self;
+	
+	time_t now;
+	int match_found;
+
+
+	unsigned char is_check = info->cmp == BANDWIDTH_CHECK ? 1 : 0;
+	unsigned char do_src_dst_swap = 0;
+	info_and_maps* iam = NULL;
+	ip_hash_map* ip_map = NULL;
+	
+	uint64_t* bws[2] = {NULL, NULL};
+	ip_key bw_ips[2] = { {0, 0}, {0, 0} };
+	ip_key bw_ip = combined_ip;
+	uint32_t bw_ip_index = 0;
+	uint32_t hires_tick = 0;
+	unsigned char is_tx;
+
+	/* if we're currently setting this id, ignore new data until set is complete */
+	if(set_in_progress_for_id(info->id))
+	{
+		return 0;
+	}
+	
+
+	
+
+	/* timezone shifts & backwards clock jumps are taken care of by reset_worker */
+	now = get_seconds();
+	if(info->hires_interval > 0)
+	{
+		/* hires ticks are in UTC, so timezone changes don't move them */
+		hires_tick = (uint32_t)(now / info->hires_interval);
+	}
+	now = now -  local_seconds_west;  /* Adjust for local timezone */
+
+
+	/* 
+	 * try to count packet in this cpu's slots without taking bandwidth_lock.
+	 * a reset that is due sends packets to the locked path below, which kicks reset_worker
+	 */
+	if(!is_check && info->iam != NULL && ((info_and_maps*)info->iam)->pcpu != NULL)
+	{
+		if(info->reset_interval == BANDWIDTH_NEVER || info->next_reset >= now)
+		{
+			is_tx = get_ips_for_packet(info, par->family, skb, 0, bw_ips);
+			bw_ip = bw_ips[ ip_key_is_zero(bw_ips[0]) ? 1 : 0 ];
+			if(pcpu_match((info_and_maps*)info->iam, bw_ip, (uint64_t)skb->len, is_tx, hires_tick, &match_found))
+			{
+				return match_found;
+			}
+		}
+	}
+
+	spin_lock_bh(&bandwidth_lock);
+	
+	if(is_check)
+	{
+		info_and_maps* check_iam;
+		do_src_dst_swap = info->check_type == BANDWIDTH_CHECK_SWAP ? 1 : 0;
+		check_iam = (info_and_maps*)get_string_map_element_with_hashed_key(id_map, info->hashed_id);
+		if(check_iam == NULL)
+		{
+			spin_unlock_bh(&bandwidth_lock);
+			return 0;
+		}
+		info = check_iam->info;
+	}
+
+
+
+
+	if(info->reset_interval != BANDWIDTH_NEVER)
+	{
+		if(info->next_reset < now)
+		{
+			/* the reset, and its walk over ip_map, is left to reset_worker */
+			if(info->iam != NULL) /* should never be null, but let's be sure */
+			{
+				kick_reset_worker();
+			}
+			else
+			{
+				/* even in case of malloc failure or weird error we can update these params */
+				info->current_bandwidth = 0;
+				info->next_reset = get_next_reset_time(info, now, info->previous_reset);
+			}
+		}
+	}
+
+	if(iam == NULL)
+	{
+		//iam = (info_and_maps*)get_string_map_element_with_hashed_key(id_map, info->hashed_id);
+		iam = (info_and_maps*)info->iam;
+		if(iam != NULL)
+		{
+			ip_map = iam->ip_map;
+		}
+	}
+
+	is_tx = get_ips_for_packet(info, par->family, skb, do_src_dst_swap, bw_ips);
+	if(info->type != BANDWIDTH_COMBINED)
+	{
+		bw_ip_index = ip_key_is_zero(bw_ips[0]) ? 1 : 0;
+		bw_ip = bw_ips[bw_ip_index];
+	}
+
+	/* 
+	 * add in what this cpu has pending for the entries we're about to use,
+	 * or for --bcheck rules what every cpu has pending for the ones checked
+	 */
+	if(ip_map != NULL && iam->pcpu != NULL && is_check)
+	{
+		if(info->type == BANDWIDTH_COMBINED)
+		{
+			fold_pcpu_slot(iam, combined_ip);
+		}
+		if(!ip_key_is_zero(bw_ip))
+		{
+			fold_pcpu_slot(iam, bw_ip);
+		}
+	}
+	else if(ip_map != NULL && iam->pcpu != NULL)
+	{
+		if(info->type == BANDWIDTH_COMBINED || info->cmp == BANDWIDTH_MONITOR)
+		{
+			fold_local_pcpu_slot(iam, combined_ip);
+		}
+		if(!ip_key_is_zero(bw_ip))
+		{
+			fold_local_pcpu_slot(iam, bw_ip);
+		}
+	}
+
+	if(info->type == BANDWIDTH_COMBINED)
+	{
+		if(ip_map != NULL) /* if this ip_map != NULL iam can never be NULL, so we don't need to check this */
+		{
+			
+			if(info->combined_bw == NULL)
+			{
+				bws[0] = initialize_map_entries_for_ip(iam, combined_ip, skb->len);
+			}
+			else
+			{
+				bws[0] = info->combined_bw;
+				*(bws[0]) = ADD_UP_TO_MAX(*(bws[0]), (uint64_t)skb->len, is_check);
+			}
+		}
+		else
+		{
+			#ifdef BANDWIDTH_DEBUG
+				printk("error: ip_map is null in match!\n");
+			#endif
+		}
+		info->current_bandwidth = ADD_UP_TO_MAX(info->current_bandwidth, (uint64_t)skb->len, is_check);
+	}
+	else
+	{
+		if(!is_check && info->cmp == BANDWIDTH_MONITOR)
+		{
+			uint64_t* combined_oldval = info->combined_bw;
+			if(combined_oldval == NULL)
+			{
+				combined_oldval = initialize_map_entries_for_ip(iam, combined_ip, (uint64_t)skb->len);
+			}
+			else
+			{
+				*combined_oldval = ADD_UP_TO_MAX(*combined_oldval, (uint64_t)skb->len, is_check);
+			}
+		}
+		if(!ip_key_is_zero(bw_ip) && ip_map != NULL)
+		{
+			bw_entry* entry = get_entry_for_ip(iam, bw_ip);
+			uint64_t* oldval = NULL;
+			if(entry == NULL)
+			{
+				if(!is_check)
+				{
+					/* may return NULL on malloc failure but that's ok */
+					make_room_for_remote_ip(iam, bw_ip);
+					oldval = initialize_map_entries_for_ip(iam, bw_ip, (uint64_t)skb->len);
+					entry = oldval == NULL ? NULL : (bw_entry*)get_ip_hash_map_element(ip_map, bw_ip);
+				}
+			}
+			else
+			{
+				oldval = get_entry_bw(entry);
+				*oldval = ADD_UP_TO_MAX(*oldval, (uint64_t)skb->len, is_check);
+			}
+			if(entry != NULL && !is_check)
+			{
+				add_to_entry_counters(entry, (uint64_t)skb->len, (is_tx ? (uint64_t)skb->len : 0), 1, is_tx);
+				update_topk(iam, bw_ip, entry);
+				touch_remote_entry(entry);
+			}
+			
+			/* this is fine, setting bws[bw_ip_index] to NULL on check for undefined value or kmalloc failure won't crash anything */
+			bws[bw_ip_index] = oldval;
+		}
+		
+	}
+
+	/* the combined total has no entry pointer handy, so look it up for its counters */
+	if(ip_map != NULL && !is_check && (info->type == BANDWIDTH_COMBINED || info->cmp == BANDWIDTH_MONITOR))
+	{
+		bw_entry* combined_entry = (bw_entry*)get_ip_hash_map_element(ip_map, combined_ip);
+		if(combined_entry != NULL)
+		{
+			add_to_entry_counters(combined_entry, (uint64_t)skb->len, (is_tx ? (uint64_t)skb->len : 0), 1, is_tx);
+		}
+	}
+
+	if(ip_map != NULL && iam->hires != NULL && !is_check)
+	{
+		if(info->type == BANDWIDTH_COMBINED || info->cmp == BANDWIDTH_MONITOR)
+		{
+			record_hires(iam, combined_ip, hires_tick, (uint64_t)skb->len);
+		}
+		if(!ip_key_is_zero(bw_ip))
+		{
+			record_hires(iam, bw_ip, hires_tick, (uint64_t)skb->len);
+		}
+	}
+
+	/* hand the entries we just updated to this cpu's slots, so the next packets can skip the lock */
+	if(ip_map != NULL && iam->pcpu != NULL && !is_check)
+	{
+		if(info->type == BANDWIDTH_COMBINED || info->cmp == BANDWIDTH_MONITOR)
+		{
+			claim_local_pcpu_slot(iam, combined_ip, info->combined_bw, hires_tick);
+		}
+		if(!ip_key_is_zero(bw_ip))
+		{
+			claim_local_pcpu_slot(iam, bw_ip, bws[bw_ip_index], hires_tick);
+		}
+	}
+
+
+	match_found = 0;
+	if(info->cmp != BANDWIDTH_MONITOR)
+	{
+		if(info->cmp == BANDWIDTH_GT)
 		{
 			match_found = bws[0] != NULL ? ( *(bws[0]) > info->bandwidth_cutoff ? 1 : match_found ) : match_found;
 			match_found = bws[1] != NULL ? ( *(bws[1]) > info->bandwidth_cutoff ? 1 : match_found ) : match_found;
@@ -1353,7 +2827,6 @@ static bool match(const struct sk_buff *skb, struct xt_action_param *par)
 
 	
 
-
 	return match_found;
 }
 
@@ -1364,8 +2837,6 @@ static bool match(const struct sk_buff *skb, struct xt_action_param *par)
 
 
 
-
-
 /**********************
  * Get functions
  *********************/
@@ -1377,33 +2848,94 @@ static bool match(const struct sk_buff *skb, struct xt_action_param *par)
 #define ERROR_BUFFER_TOO_SHORT 2
 #define ERROR_NO_HISTORY 3
 #define ERROR_UNKNOWN 4
+#define ERROR_WRONG_FAMILY 5
+#define ERROR_SET_IN_PROGRESS 6
 typedef struct get_req_struct 
 {
-	uint32_t ip;
+	unsigned char ip[16]; /* only first 4 bytes used by BANDWIDTH_GET */
 	uint32_t next_ip_index;
 	unsigned char return_history;
 	char id[BANDWIDTH_MAX_ID_LENGTH];
 } get_request;
 
-static unsigned long* output_ip_list = NULL;
+/* 
+ * ip list of a paged BANDWIDTH_GET, kept between calls.  If another
+ * reader replaces it part way through, it gets rebuilt -- ips are
+ * sorted, so the remaining pages come out as expected
+ */
+static ip_key* output_ip_list = NULL;
 static unsigned long output_ip_list_length = 0;
+static pid_t output_ip_list_owner = 0;
+static char output_ip_list_id[BANDWIDTH_MAX_ID_LENGTH] = "";
 
-static char add_ip_block(	uint32_t ip, 
+static ip_key get_ip_from_buffer(unsigned char* buffer, unsigned char ip_length, unsigned char family);
+static void put_ip_in_buffer(ip_key ip, unsigned char ip_length, unsigned char family, unsigned char* buffer);
+static char add_ip_block(	ip_key ip, 
+			unsigned char ip_length,
 			unsigned char full_history_requested,
 			info_and_maps* iam,
 			unsigned char* output_buffer, 
 			uint32_t* current_output_index, 
 			uint32_t buffer_length 
 			);
-static void parse_get_request(unsigned char* request_buffer, get_request* parsed_request);
+static void parse_get_request(unsigned char* request_buffer, unsigned char ip_length, get_request* parsed_request);
+static void prepare_rule_for_output(info_and_maps* iam, time_t now);
+static uint32_t get_ip_block_length(ip_key ip, unsigned char ip_length, unsigned char full_history_requested, info_and_maps* iam);
+static int get_snapshot(void *user, int *len);
+static int get_hires(void *user, int *len);
+static int get_topk(void *user, int *len);
 static int handle_get_failure(int ret_value, int unlock_user_sem, int unlock_bandwidth_spin, unsigned char error_code, unsigned char* out_buffer, unsigned char* free_buffer );
 
 
+/*
+ * ips are 4 bytes when they come through BANDWIDTH_GET/BANDWIDTH_SET
+ * and 16 bytes through BANDWIDTH_GET6/BANDWIDTH_SET6.  IPv4 rules
+ * can be read and written through either, in which case their
+ * addresses are sent v4-mapped (::ffff:a.b.c.d).  The combined
+ * total is always the all-zero address.
+ */
+static ip_key get_ip_from_buffer(unsigned char* buffer, unsigned char ip_length, unsigned char family)
+{
+	if(ip_length == 4)
+	{
+		return ipv4_ip_key( *((uint32_t*)buffer) );
+	}
+	if(family == NFPROTO_IPV6)
+	{
+		return ipv6_ip_key(buffer);
+	}
+	return ipv4_ip_key( *((uint32_t*)(buffer+12)) );
+}
+
+static void put_ip_in_buffer(ip_key ip, unsigned char ip_length, unsigned char family, unsigned char* buffer)
+{
+	if(ip_length == 4)
+	{
+		*( (uint32_t*)buffer ) = (uint32_t)ip.lo;
+	}
+	else if(family == NFPROTO_IPV6)
+	{
+		memcpy(buffer, &(ip.hi), 8);
+		memcpy(buffer+8, &(ip.lo), 8);
+	}
+	else
+	{
+		memset(buffer, 0, 16);
+		if(!ip_key_is_zero(ip))
+		{
+			buffer[10] = 0xff;
+			buffer[11] = 0xff;
+		}
+		*( (uint32_t*)(buffer+12) ) = (uint32_t)ip.lo;
+	}
+}
+
 /* 
  * returns whether we succeeded in adding ip block, 0= success, 
  * otherwise error code of problem that we found
  */
-static char add_ip_block(	uint32_t ip, 
+static char add_ip_block(	ip_key ip, 
+				unsigned char ip_length,
 				unsigned char full_history_requested,
 				info_and_maps* iam,
 				unsigned char* output_buffer, 
@@ -1412,16 +2944,15 @@ static char add_ip_block(	uint32_t ip,
 				)
 {
 	#ifdef BANDWIDTH_DEBUG
-		uint32_t *ipp = &ip;
-		printk("doing output for ip = %u.%u.%u.%u\n", *((unsigned char*)ipp), *(((unsigned char*)ipp)+1), *(((unsigned char*)ipp)+2), *(((unsigned char*)ipp)+3) );
+		printk("doing output for ip = %016llx%016llx\n", ip.hi, ip.lo );
 	#endif
 
 	if(full_history_requested)
 	{
 		bw_history* history = NULL;
-		if(iam->info->num_intervals_to_save > 0 && iam->ip_history_map != NULL)
+		if(iam->info->num_intervals_to_save > 0)
 		{
-			history = (bw_history*)get_long_map_element(iam->ip_history_map, ip);
+			history = get_history_for_ip(iam, ip);
 		}
 		if(history == NULL)
 		{
@@ -1430,15 +2961,15 @@ static char add_ip_block(	uint32_t ip,
 			#endif
 
 
-			uint32_t block_length = (2*4) + (3*8);
+			uint32_t block_length = ip_length + 4 + (3*8) + 8;
 			uint64_t *bw;
 
 			if(*current_output_index + block_length > output_buffer_length)
 			{
 				return ERROR_BUFFER_TOO_SHORT;
 			}
-			*( (uint32_t*)(output_buffer + *current_output_index) ) = ip;
-			*current_output_index = *current_output_index + 4;
+			put_ip_in_buffer(ip, ip_length, iam->info->family, output_buffer + *current_output_index);
+			*current_output_index = *current_output_index + ip_length;
 	
 			*( (uint32_t*)(output_buffer + *current_output_index) ) = 1;
 			*current_output_index = *current_output_index + 4;
@@ -1452,7 +2983,7 @@ static char add_ip_block(	uint32_t ip,
 			*( (uint64_t*)(output_buffer + *current_output_index) ) = (uint64_t)iam->info->previous_reset + (60 * local_minutes_west);
 			*current_output_index = *current_output_index + 8;
 
-			bw = (uint64_t*)get_long_map_element(iam->ip_map, ip);
+			bw = get_bw_for_ip(iam, ip);
 			if(bw == NULL)
 			{
 				*( (uint64_t*)(output_buffer + *current_output_index) ) = 0;
@@ -1466,7 +2997,7 @@ static char add_ip_block(	uint32_t ip,
 		}
 		else
 		{
-			uint32_t block_length = (2*4) + (3*8) + (8*history->num_nodes);
+			uint32_t block_length = ip_length + 4 + (3*8) + (8*history->num_nodes);
 			uint64_t last_reset;
 			uint32_t node_num;
 			uint32_t next_index;
@@ -1476,8 +3007,8 @@ static char add_ip_block(	uint32_t ip,
 				return ERROR_BUFFER_TOO_SHORT;
 			}
 		
-			*( (uint32_t*)(output_buffer + *current_output_index) ) = ip;
-			*current_output_index = *current_output_index + 4;
+			put_ip_in_buffer(ip, ip_length, iam->info->family, output_buffer + *current_output_index);
+			*current_output_index = *current_output_index + ip_length;
 	
 			*( (uint32_t*)(output_buffer + *current_output_index) )= history->num_nodes;
 			*current_output_index = *current_output_index + 4;
@@ -1524,79 +3055,554 @@ static char add_ip_block(	uint32_t ip,
 	else
 	{
 		uint64_t *bw;
-		if(*current_output_index + 8 > output_buffer_length)
+		if(*current_output_index + ip_length + 8 > output_buffer_length)
 		{
 			return ERROR_BUFFER_TOO_SHORT;
 		}
 
-		*( (uint32_t*)(output_buffer + *current_output_index) ) = ip;
-		*current_output_index = *current_output_index + 4;
+		put_ip_in_buffer(ip, ip_length, iam->info->family, output_buffer + *current_output_index);
+		*current_output_index = *current_output_index + ip_length;
+
+
+		bw = get_bw_for_ip(iam, ip);
+		if(bw == NULL)
+		{
+			*( (uint64_t*)(output_buffer + *current_output_index) ) = 0;
+		}
+		else
+		{
+			*( (uint64_t*)(output_buffer + *current_output_index) ) = *bw;
+		}
+		*current_output_index = *current_output_index + 8; 
+	}
+	return ERROR_NONE;
+}
+
+
+
+static uint32_t get_ip_block_length(ip_key ip, unsigned char ip_length, unsigned char full_history_requested, info_and_maps* iam)
+{
+	bw_history* history = NULL;
+	if(!full_history_requested)
+	{
+		return ip_length + 8;
+	}
+	if(iam->info->num_intervals_to_save > 0)
+	{
+		history = get_history_for_ip(iam, ip);
+	}
+	return ip_length + 4 + (3*8) + (8*(history == NULL ? 1 : history->num_nodes));
+}
+
+/*
+ * reset worker may not have gotten to this rule yet,
+ * so test if we need to reset values to zero, and
+ * make sure every entry has been rolled over before we dump them
+ */
+static void prepare_rule_for_output(info_and_maps* iam, time_t now)
+{
+	if(iam->info->reset_interval != BANDWIDTH_NEVER)
+	{
+		if(iam->info->next_reset < now)
+		{
+			//do reset
+			begin_interval_reset(iam, now);
+		}
+	}
+	continue_interval_reset(iam, 0);
+}
+
+
+/* 
+ * convenience method for cleaning crap up after failed malloc or other 
+ * error that we can't recover  from in get function
+ */
+static int handle_get_failure(int ret_value, int unlock_user_sem, int unlock_bandwidth_spin, unsigned char error_code, unsigned char* out_buffer, unsigned char* free_buffer )
+{
+	copy_to_user(out_buffer, &error_code, 1);
+	if( free_buffer != NULL ) { kfree(free_buffer); }
+	if(unlock_bandwidth_spin) { spin_unlock_bh(&bandwidth_lock); }
+	if(unlock_user_sem) { up_read(&userspace_lock); }
+	return ret_value;
+}
+
+/* 
+ * request structure: 
+ * bytes 1:4 is ip (uint32_t)
+ * bytes 4:8 is the next ip index (uint32_t)
+ * byte  9   is whether to return full history or just current usage (unsigned char)
+ * bytes 10:10+MAX_ID_LENGTH are the id (a string)
+ *
+ * for BANDWIDTH_GET6 the ip is 16 bytes instead of 4,
+ * and everything after it is shifted by 12 bytes
+ */
+static void parse_get_request(unsigned char* request_buffer, unsigned char ip_length, get_request* parsed_request)
+{
+	uint32_t* next_ip_index = (uint32_t*)(request_buffer+ip_length);
+	unsigned char* return_history = (unsigned char*)(request_buffer+ip_length+4);
+
+	
+
+	memset(parsed_request->ip, 0, 16);
+	memcpy(parsed_request->ip, request_buffer, ip_length);
+	parsed_request->next_ip_index = *next_ip_index;
+	parsed_request->return_history = *return_history;
+	memcpy(parsed_request->id, request_buffer+ip_length+5, BANDWIDTH_MAX_ID_LENGTH);
+	(parsed_request->id)[BANDWIDTH_MAX_ID_LENGTH-1] = '\0'; /* make sure id is null terminated no matter what */
+	
+	#ifdef BANDWIDTH_DEBUG
+		printk("next ip index = %d\n", *next_ip_index);
+		printk("return_history = %d\n", *return_history);
+	#endif
+}
+
+
+/*
+ * BANDWIDTH_GET_SNAPSHOT returns every ip of every requested rule in
+ * one call.  bandwidth_lock is taken for one rule at a time, and dropped
+ * every SNAPSHOT_IPS_PER_LOCK ips so a large dump doesn't hold up packets.
+ * Each rule is still consistent: if an interval reset begins while the
+ * lock is dropped, that rule is copied again.  Since nothing is kept
+ * between calls any number of readers can take snapshots at the same time.
+ * A rule that is part way through a multi-call set is reported with
+ * ERROR_SET_IN_PROGRESS, and should be asked for again shortly.
+ *
+ * request structure:
+ * byte  1   : flags, BANDWIDTH_SNAPSHOT_HISTORY or BANDWIDTH_SNAPSHOT_COUNTERS, and/or BANDWIDTH_SNAPSHOT_IP6
+ * bytes 2-5 : number of ids (uint32_t)
+ * remaining bytes are the ids, BANDWIDTH_MAX_ID_LENGTH bytes each
+ *
+ * response structure:
+ * byte  1     : error code (0 for ok, ERROR_BUFFER_TOO_SHORT if whole snapshot didn't fit)
+ * bytes 2-5   : length of the whole snapshot, if buffer was too short call again with a buffer this long
+ * bytes 6-13  : time snapshot was taken (UTC seconds)
+ * bytes 14-17 : number of rules in response
+ * remaining bytes contain one block per requested id:
+ * byte  1     : error code for this id (ERROR_NO_ID if it doesn't exist, ERROR_SET_IN_PROGRESS if it's being set)
+ * bytes 2-51  : id
+ * bytes 52-55 : number of ips for this id
+ * bytes 56-63 : reset_interval
+ * bytes 64-71 : reset_time
+ * byte  72    : reset_is_constant_interval
+ * followed by the ip blocks, in the same format BANDWIDTH_GET/BANDWIDTH_GET6 use.
+ * With BANDWIDTH_SNAPSHOT_COUNTERS (and no history) each block is followed by
+ * rx bytes, tx bytes, rx packets and tx packets (uint64_t each)
+ */
+#define SNAPSHOT_HEADER_LENGTH		17
+#define SNAPSHOT_RULE_HEADER_LENGTH	(BANDWIDTH_MAX_ID_LENGTH + 22)
+#define SNAPSHOT_MAX_LENGTH		(16*1024*1024)
+#define SNAPSHOT_IPS_PER_LOCK		1024
+static int get_snapshot(void *user, int *len)
+{
+	unsigned char* request;
+	unsigned char* buffer;
+	unsigned char flags;
+	uint32_t num_ids;
+	uint32_t id_index;
+	uint32_t buffer_length;
+	uint32_t current_output_index;
+	unsigned char ip_length;
+	unsigned char return_history;
+	unsigned char return_counters;
+	time_t utc_now;
+	time_t now;
+
+	if(*len < SNAPSHOT_HEADER_LENGTH)
+	{
+		return -EINVAL;
+	}
+
+	utc_now = get_seconds();
+	now = utc_now -  local_seconds_west;  /* Adjust for local timezone */
+
+	down_read(&userspace_lock);
+
+	request = kmalloc(5, GFP_KERNEL);
+	if(request == NULL)
+	{
+		return handle_get_failure(0, 1, 0, ERROR_UNKNOWN, user, NULL);
+	}
+	copy_from_user(request, user, 5);
+	flags = request[0];
+	num_ids = *( (uint32_t*)(request+1) );
+	kfree(request);
+	if(num_ids == 0 || num_ids > (*len - 5)/BANDWIDTH_MAX_ID_LENGTH)
+	{
+		return handle_get_failure(0, 1, 0, ERROR_BUFFER_TOO_SHORT, user, NULL);
+	}
+	request = kmalloc(num_ids*BANDWIDTH_MAX_ID_LENGTH, GFP_KERNEL);
+	if(request == NULL)
+	{
+		return handle_get_failure(0, 1, 0, ERROR_UNKNOWN, user, NULL);
+	}
+	copy_from_user(request, ((unsigned char*)user) + 5, num_ids*BANDWIDTH_MAX_ID_LENGTH);
+
+	buffer_length = *len < SNAPSHOT_MAX_LENGTH ? *len : SNAPSHOT_MAX_LENGTH;
+	buffer = vmalloc(buffer_length);
+	if(buffer == NULL)
+	{
+		return handle_get_failure(0, 1, 0, ERROR_UNKNOWN, user, request);
+	}
+	ip_length = (flags & BANDWIDTH_SNAPSHOT_IP6) ? 16 : 4;
+	return_history = (flags & BANDWIDTH_SNAPSHOT_HISTORY) ? 1 : 0;
+	return_counters = (flags & BANDWIDTH_SNAPSHOT_COUNTERS) && !return_history ? 1 : 0;
+
+	/*
+	 * keep computing the length after the buffer fills up, so
+	 * userspace knows how much room the full snapshot needs
+	 */
+	current_output_index = SNAPSHOT_HEADER_LENGTH;
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		char* id = (char*)(request + (id_index*BANDWIDTH_MAX_ID_LENGTH));
+		uint32_t rule_index = current_output_index;
+		unsigned char rule_error;
+		info_and_maps* iam;
+		ip_key* ip_list;
+		unsigned long ip_list_length;
+		unsigned long ip_index;
+		uint32_t epoch;
+		unsigned char restart;
+
+		id[BANDWIDTH_MAX_ID_LENGTH-1] = '\0';
+
+		spin_lock_bh(&bandwidth_lock);
+		do
+		{
+			restart = 0;
+			rule_error = ERROR_NONE;
+			ip_list = NULL;
+			ip_list_length = 0;
+			epoch = 0;
+			current_output_index = rule_index + SNAPSHOT_RULE_HEADER_LENGTH;
+
+			iam = (info_and_maps*)get_string_map_element(id_map, id);
+			if(iam == NULL || iam->info == NULL || iam->ip_map == NULL)
+			{
+				rule_error = ERROR_NO_ID;
+			}
+			else if(ip_length == 4 && iam->info->family == NFPROTO_IPV6 && iam->info->type != BANDWIDTH_COMBINED)
+			{
+				rule_error = ERROR_WRONG_FAMILY;
+			}
+			else if(set_in_progress_for_id(id))
+			{
+				rule_error = ERROR_SET_IN_PROGRESS;
+			}
+			else
+			{
+				prepare_rule_for_output(iam, now);
+				fold_all_pcpu_slots(iam);
+				epoch = iam->epoch;
+				if(iam->info->type == BANDWIDTH_COMBINED)
+				{
+					ip_list_length = 1;
+					ip_list = (ip_key*)kmalloc(sizeof(ip_key), GFP_ATOMIC);
+					if(ip_list != NULL) { *ip_list = combined_ip; }
+				}
+				else
+				{
+					ip_list = get_sorted_ip_hash_map_keys(iam->ip_map, &ip_list_length);
+				}
+				rule_error = ip_list == NULL && ip_list_length > 0 ? ERROR_UNKNOWN : ERROR_NONE;
+				ip_list_length = ip_list == NULL ? 0 : ip_list_length;
+			}
+
+			for(ip_index=0; ip_index < ip_list_length && !restart; ip_index++)
+			{
+				uint32_t block_length;
+				if(ip_index > 0 && ip_index % SNAPSHOT_IPS_PER_LOCK == 0)
+				{
+					/*
+					 * let packets through between batches.  The rule can't go away while
+					 * we hold userspace_lock, but if an interval reset began meanwhile
+					 * the ips already copied are from the old interval, so start over
+					 */
+					spin_unlock_bh(&bandwidth_lock);
+					spin_lock_bh(&bandwidth_lock);
+					if(iam->epoch != epoch)
+					{
+						restart = 1;
+						break;
+					}
+				}
+				block_length = get_ip_block_length(ip_list[ip_index], ip_length, return_history, iam) + (return_counters ? 32 : 0);
+				if(current_output_index + block_length <= buffer_length)
+				{
+					add_ip_block(ip_list[ip_index], ip_length, return_history, iam, buffer, &current_output_index, buffer_length);
+					if(return_counters)
+					{
+						bw_entry* entry = get_entry_for_ip(iam, ip_list[ip_index]);
+						uint64_t* counters = (uint64_t*)(buffer + current_output_index);
+						counters[0] = entry == NULL ? 0 : entry->rx_bytes;
+						counters[1] = entry == NULL ? 0 : entry->tx_bytes;
+						counters[2] = entry == NULL ? 0 : entry->rx_packets;
+						counters[3] = entry == NULL ? 0 : entry->tx_packets;
+						current_output_index = current_output_index + 32;
+					}
+				}
+				else
+				{
+					current_output_index = current_output_index + block_length;
+				}
+			}
+			if(ip_list != NULL)
+			{
+				kfree(ip_list);
+			}
+		} while(restart);
+
+		if(rule_index + SNAPSHOT_RULE_HEADER_LENGTH <= buffer_length)
+		{
+			unsigned char* rule = buffer + rule_index;
+			memset(rule, 0, SNAPSHOT_RULE_HEADER_LENGTH);
+			rule[0] = rule_error;
+			memcpy(rule+1, id, BANDWIDTH_MAX_ID_LENGTH);
+			*( (uint32_t*)(rule+51) ) = (uint32_t)ip_list_length;
+			if(rule_error == ERROR_NONE)
+			{
+				*( (uint64_t*)(rule+55) ) = (uint64_t)iam->info->reset_interval;
+				*( (uint64_t*)(rule+63) ) = (uint64_t)iam->info->reset_time;
+				rule[71] = iam->info->reset_is_constant_interval;
+			}
+		}
+		spin_unlock_bh(&bandwidth_lock);
+	}
+	kfree(request);
+
+	buffer[0] = current_output_index <= buffer_length ? ERROR_NONE : ERROR_BUFFER_TOO_SHORT;
+	*( (uint32_t*)(buffer+1) ) = current_output_index;
+	*( (uint64_t*)(buffer+5) ) = (uint64_t)utc_now;
+	*( (uint32_t*)(buffer+13) ) = num_ids;
+
+	copy_to_user(user, buffer, (buffer[0] == ERROR_NONE ? current_output_index : SNAPSHOT_HEADER_LENGTH));
+	vfree(buffer);
+
+	up_read(&userspace_lock);
+
+	return 0;
+}
+
+
+/*
+ * BANDWIDTH_GET_HIRES returns the hires ring of every ip of a --hires rule
+ * that currently has one.  The request is just the id.
+ *
+ * response:
+ * byte  0     : error code
+ * bytes 1-4   : length of full response, if the buffer is too short nothing
+ *               but the header is returned and this is the size needed
+ * bytes 5-8   : hires interval, in seconds
+ * bytes 9-12  : number of slots per ip
+ * bytes 13-16 : tick of the newest slot (UTC seconds / interval)
+ * bytes 17-20 : number of ips
+ * followed by, for each ip, the ip (16 bytes, IPv4 addresses are v4-mapped)
+ * and one uint64_t byte count per slot, oldest first.  Slots with no 
+ * traffic, or that were counted before the ip got a ring, are 0
+ */
+#define HIRES_HEADER_LENGTH		21
+static int get_hires(void *user, int *len)
+{
+	char id[BANDWIDTH_MAX_ID_LENGTH];
+	unsigned char* buffer;
+	uint32_t buffer_length;
+	uint32_t current_output_index;
+	uint32_t num_ips = 0;
+	uint32_t newest_tick = 0;
+	uint32_t num_slots = 0;
+	uint32_t interval = 0;
+	info_and_maps* iam;
+	time_t utc_now;
+	time_t now;
+
+	if(*len < HIRES_HEADER_LENGTH || *len < BANDWIDTH_MAX_ID_LENGTH)
+	{
+		return -EINVAL;
+	}
+
+	utc_now = get_seconds();
+	now = utc_now -  local_seconds_west;  /* Adjust for local timezone */
+
+	down_read(&userspace_lock);
+
+	copy_from_user(id, user, BANDWIDTH_MAX_ID_LENGTH);
+	id[BANDWIDTH_MAX_ID_LENGTH-1] = '\0';
+
+	buffer_length = *len < SNAPSHOT_MAX_LENGTH ? *len : SNAPSHOT_MAX_LENGTH;
+	buffer = vmalloc(buffer_length);
+	if(buffer == NULL)
+	{
+		return handle_get_failure(0, 1, 0, ERROR_UNKNOWN, user, NULL);
+	}
+
+	spin_lock_bh(&bandwidth_lock);
+	iam = (info_and_maps*)get_string_map_element(id_map, id);
+	if(iam == NULL || iam->info == NULL || iam->ip_map == NULL)
+	{
+		spin_unlock_bh(&bandwidth_lock);
+		vfree(buffer);
+		return handle_get_failure(0, 1, 0, ERROR_NO_ID, user, NULL);
+	}
+	if(iam->hires == NULL)
+	{
+		spin_unlock_bh(&bandwidth_lock);
+		vfree(buffer);
+		return handle_get_failure(0, 1, 0, ERROR_NO_HISTORY, user, NULL);
+	}
+	if(set_in_progress_for_id(id))
+	{
+		spin_unlock_bh(&bandwidth_lock);
+		vfree(buffer);
+		return handle_get_failure(0, 1, 0, ERROR_SET_IN_PROGRESS, user, NULL);
+	}
+
+	/* pending per-cpu bytes haven't been added to the rings yet */
+	prepare_rule_for_output(iam, now);
+	fold_all_pcpu_slots(iam);
 
+	interval = iam->info->hires_interval;
+	num_slots = iam->hires->num_slots;
+	newest_tick = (uint32_t)(utc_now / interval);
 
-		bw = (uint64_t*)get_long_map_element(iam->ip_map, ip);
-		if(bw == NULL)
-		{
-			*( (uint64_t*)(output_buffer + *current_output_index) ) = 0;
-		}
-		else
+	current_output_index = HIRES_HEADER_LENGTH;
+	{
+		struct list_head* pos;
+		list_for_each(pos, &(iam->hires->lru))
 		{
-			*( (uint64_t*)(output_buffer + *current_output_index) ) = *bw;
+			bw_hires_ring* ring = list_entry(pos, bw_hires_ring, lru);
+			uint32_t block_length = 16 + (8*num_slots);
+			if(ring->owner == NULL)
+			{
+				/* free rings are all at the end */
+				break;
+			}
+			if(current_output_index + block_length <= buffer_length)
+			{
+				uint64_t* counts = (uint64_t*)(buffer + current_output_index + 16);
+				uint32_t slot_offset;
+				put_ip_in_buffer(ring->ip, 16, iam->info->family, buffer + current_output_index);
+
+				for(slot_offset=0; slot_offset < num_slots; slot_offset++)
+				{
+					uint32_t tick = newest_tick - (num_slots - 1) + slot_offset;
+					uint32_t slot_index = tick % num_slots;
+					counts[slot_offset] = ring->ticks[slot_index] == tick ? ring->bytes[slot_index] : 0;
+				}
+			}
+			current_output_index = current_output_index + block_length;
+			num_ips++;
 		}
-		*current_output_index = *current_output_index + 8; 
 	}
-	return ERROR_NONE;
-}
+	spin_unlock_bh(&bandwidth_lock);
 
+	buffer[0] = current_output_index <= buffer_length ? ERROR_NONE : ERROR_BUFFER_TOO_SHORT;
+	*( (uint32_t*)(buffer+1) ) = current_output_index;
+	*( (uint32_t*)(buffer+5) ) = interval;
+	*( (uint32_t*)(buffer+9) ) = num_slots;
+	*( (uint32_t*)(buffer+13) ) = newest_tick;
+	*( (uint32_t*)(buffer+17) ) = num_ips;
 
+	copy_to_user(user, buffer, (buffer[0] == ERROR_NONE ? current_output_index : HIRES_HEADER_LENGTH));
+	vfree(buffer);
 
-/* 
- * convenience method for cleaning crap up after failed malloc or other 
- * error that we can't recover  from in get function
- */
-static int handle_get_failure(int ret_value, int unlock_user_sem, int unlock_bandwidth_spin, unsigned char error_code, unsigned char* out_buffer, unsigned char* free_buffer )
-{
-	copy_to_user(out_buffer, &error_code, 1);
-	if( free_buffer != NULL ) { kfree(free_buffer); }
-	if(unlock_bandwidth_spin) { spin_unlock_bh(&bandwidth_lock); }
-	if(unlock_user_sem) { up(&userspace_lock); }
-	return ret_value;
+	up_read(&userspace_lock);
+
+	return 0;
 }
 
-/* 
- * request structure: 
- * bytes 1:4 is ip (uint32_t)
- * bytes 4:8 is the next ip index (uint32_t)
- * byte  9   is whether to return full history or just current usage (unsigned char)
- * bytes 10:10+MAX_ID_LENGTH are the id (a string)
+
+/*
+ * BANDWIDTH_GET_TOPK returns the ips a --topk rule currently has the
+ * highest totals for, without walking the rest.  The request is just the id.
+ *
+ * response:
+ * byte  0     : error code
+ * bytes 1-4   : length of full response, if the buffer is too short nothing
+ *               but the header is returned and this is the size needed
+ * bytes 5-8   : number of ips
+ * followed by, for each ip, the ip (16 bytes, IPv4 addresses are v4-mapped)
+ * and its current total (uint64_t), in no particular order
  */
-static void parse_get_request(unsigned char* request_buffer, get_request* parsed_request)
+#define TOPK_HEADER_LENGTH		9
+static int get_topk(void *user, int *len)
 {
-	uint32_t* ip = (uint32_t*)(request_buffer+0);
-	uint32_t* next_ip_index = (uint32_t*)(request_buffer+4);
-	unsigned char* return_history = (unsigned char*)(request_buffer+8);
+	char id[BANDWIDTH_MAX_ID_LENGTH];
+	unsigned char* buffer;
+	uint32_t current_output_index;
+	uint32_t num_ips = 0;
+	info_and_maps* iam;
+	time_t now;
 
-	
+	if(*len < TOPK_HEADER_LENGTH || *len < BANDWIDTH_MAX_ID_LENGTH)
+	{
+		return -EINVAL;
+	}
 
-	parsed_request->ip = *ip;
-	parsed_request->next_ip_index = *next_ip_index;
-	parsed_request->return_history = *return_history;
-	memcpy(parsed_request->id, request_buffer+9, BANDWIDTH_MAX_ID_LENGTH);
-	(parsed_request->id)[BANDWIDTH_MAX_ID_LENGTH-1] = '\0'; /* make sure id is null terminated no matter what */
-	
-	#ifdef BANDWIDTH_DEBUG
-		printk("ip = %u.%u.%u.%u\n", *((char*)ip), *(((char*)ip)+1), *(((char*)ip)+2), *(((char*)ip)+3) );
-		printk("next ip index = %d\n", *next_ip_index);
-		printk("return_history = %d\n", *return_history);
-	#endif
+	now = get_seconds();
+	now = now -  local_seconds_west;  /* Adjust for local timezone */
+
+	down_read(&userspace_lock);
+
+	copy_from_user(id, user, BANDWIDTH_MAX_ID_LENGTH);
+	id[BANDWIDTH_MAX_ID_LENGTH-1] = '\0';
+
+	buffer = kmalloc(TOPK_HEADER_LENGTH + (BANDWIDTH_TOPK_MAX*24), GFP_KERNEL);
+	if(buffer == NULL)
+	{
+		return handle_get_failure(0, 1, 0, ERROR_UNKNOWN, user, NULL);
+	}
+
+	spin_lock_bh(&bandwidth_lock);
+	iam = (info_and_maps*)get_string_map_element(id_map, id);
+	if(iam == NULL || iam->info == NULL || iam->ip_map == NULL)
+	{
+		spin_unlock_bh(&bandwidth_lock);
+		return handle_get_failure(0, 1, 0, ERROR_NO_ID, user, buffer);
+	}
+	if(iam->topk == NULL)
+	{
+		spin_unlock_bh(&bandwidth_lock);
+		return handle_get_failure(0, 1, 0, ERROR_NO_HISTORY, user, buffer);
+	}
+	if(set_in_progress_for_id(id))
+	{
+		spin_unlock_bh(&bandwidth_lock);
+		return handle_get_failure(0, 1, 0, ERROR_SET_IN_PROGRESS, user, buffer);
+	}
+
+	/* bytes still pending on per-cpu slots haven't been offered to the heap yet */
+	prepare_rule_for_output(iam, now);
+	fold_all_pcpu_slots(iam);
+
+	current_output_index = TOPK_HEADER_LENGTH;
+	for(num_ips=0; num_ips < iam->topk->num_items; num_ips++)
+	{
+		put_ip_in_buffer(iam->topk->items[num_ips].ip, 16, iam->info->family, buffer + current_output_index);
+		*( (uint64_t*)(buffer + current_output_index + 16) ) = topk_item_bw(iam->topk, num_ips);
+		current_output_index = current_output_index + 24;
+	}
+	spin_unlock_bh(&bandwidth_lock);
+
+	buffer[0] = current_output_index <= *len ? ERROR_NONE : ERROR_BUFFER_TOO_SHORT;
+	*( (uint32_t*)(buffer+1) ) = current_output_index;
+	*( (uint32_t*)(buffer+5) ) = num_ips;
+
+	copy_to_user(user, buffer, (buffer[0] == ERROR_NONE ? current_output_index : TOPK_HEADER_LENGTH));
+	kfree(buffer);
+
+	up_read(&userspace_lock);
+
+	return 0;
 }
 
 
 static int ipt_bandwidth_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 {
-	/* check for timezone shift & adjust if necessary */
 	char* buffer;
 	get_request query;
+	ip_key query_ip;
 	info_and_maps* iam;
+	unsigned char ip_length = cmd == BANDWIDTH_GET6 ? 16 : 4;
 
 	unsigned char* error;
 	uint32_t* total_ips;
@@ -1606,17 +3612,35 @@ static int ipt_bandwidth_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 	uint64_t* reset_time;
 	unsigned char* reset_is_constant_interval;
 	uint32_t  current_output_index;
-	time_t now = get_seconds();
-	check_for_timezone_shift(now, 0);
-	check_for_backwards_time_shift(now);
+	time_t now;
+	unsigned char list_is_ours;
+
+	if(cmd == BANDWIDTH_GET_SNAPSHOT)
+	{
+		return get_snapshot(user, len);
+	}
+	if(cmd == BANDWIDTH_GET_HIRES)
+	{
+		return get_hires(user, len);
+	}
+	if(cmd == BANDWIDTH_GET_TOPK)
+	{
+		return get_topk(user, len);
+	}
+	if(cmd != BANDWIDTH_GET && cmd != BANDWIDTH_GET6)
+	{
+		return -EINVAL;
+	}
+
+	now = get_seconds();
 	now = now -  local_seconds_west;  /* Adjust for local timezone */
 	
 
-	down(&userspace_lock);
+	down_read(&userspace_lock);
 	
 	
 	/* first check that query buffer is big enough to hold the info needed to parse the query */
-	if(*len < BANDWIDTH_MAX_ID_LENGTH + 9)
+	if(*len < BANDWIDTH_MAX_ID_LENGTH + 5 + ip_length)
 	{
 
 		return handle_get_failure(0, 1, 0, ERROR_BUFFER_TOO_SHORT, user, NULL);
@@ -1631,7 +3655,7 @@ static int ipt_bandwidth_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 		return handle_get_failure(0, 1, 0, ERROR_UNKNOWN, user, NULL);
 	}
 	copy_from_user(buffer, user, *len);
-	parse_get_request(buffer, &query);
+	parse_get_request(buffer, ip_length, &query);
 	
 
 
@@ -1654,13 +3678,29 @@ static int ipt_bandwidth_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 	{
 		return handle_get_failure(0, 1, 1, ERROR_NO_ID, user, buffer);
 	}
-	if(iam->info->num_intervals_to_save > 0 && iam->ip_history_map == NULL)
+
+	/* IPv6 addresses don't fit in a 4 byte response */
+	if(ip_length == 4 && iam->info->family == NFPROTO_IPV6 && iam->info->type != BANDWIDTH_COMBINED)
 	{
-		return handle_get_failure(0, 1, 1, ERROR_NO_ID, user, buffer);
+		return handle_get_failure(0, 1, 1, ERROR_WRONG_FAMILY, user, buffer);
+	}
+	if(set_in_progress_for_id(query.id))
+	{
+		return handle_get_failure(0, 1, 1, ERROR_SET_IN_PROGRESS, user, buffer);
+	}
+	query_ip = get_ip_from_buffer(query.ip, ip_length, iam->info->family);
+
+	prepare_rule_for_output(iam, now);
+
+	/* only fold on first query, later queries of same list just return what's left of it */
+	if(query.next_ip_index == 0)
+	{
+		fold_all_pcpu_slots(iam);
 	}
 	
-	/* allocate ip list if this is first query */
-	if(query.next_ip_index == 0 && query.ip == 0)
+	/* allocate ip list if this is first query, or another reader replaced ours */
+	list_is_ours = output_ip_list != NULL && output_ip_list_owner == current->tgid && strcmp(output_ip_list_id, query.id) == 0;
+	if((query.next_ip_index == 0 || !list_is_ours) && ip_key_is_zero(query_ip))
 	{
 		if(output_ip_list != NULL)
 		{
@@ -1669,18 +3709,20 @@ static int ipt_bandwidth_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 		if(iam->info->type == BANDWIDTH_COMBINED)
 		{
 			output_ip_list_length = 1;
-			output_ip_list = (unsigned long*)kmalloc(sizeof(unsigned long), GFP_ATOMIC);
-			if(output_ip_list != NULL) { *output_ip_list = 0; }
+			output_ip_list = (ip_key*)kmalloc(sizeof(ip_key), GFP_ATOMIC);
+			if(output_ip_list != NULL) { *output_ip_list = combined_ip; }
 		}
 		else
 		{
-			output_ip_list = get_sorted_long_map_keys(iam->ip_map, &output_ip_list_length);
+			output_ip_list = get_sorted_ip_hash_map_keys(iam->ip_map, &output_ip_list_length);
 		}
 		
 		if(output_ip_list == NULL)
 		{
 			return handle_get_failure(0, 1, 1, ERROR_UNKNOWN, user, buffer);
 		}
+		output_ip_list_owner = current->tgid;
+		memcpy(output_ip_list_id, query.id, BANDWIDTH_MAX_ID_LENGTH);
 	}
 
 	/* if this is not first query do a sanity check -- make sure it's within bounds of allocated ip list */
@@ -1692,19 +3734,6 @@ static int ipt_bandwidth_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 
 
 
-	/*
-	// values only reset when a packet hits a rule, so 
-	// reset may have expired without data being reset.
-	// So, test if we need to reset values to zero 
-	*/
-	if(iam->info->reset_interval != BANDWIDTH_NEVER)
-	{
-		if(iam->info->next_reset < now)
-		{
-			//do reset
-			handle_interval_reset(iam, now);
-		}
-	}
 
 
 
@@ -1725,6 +3754,9 @@ static int ipt_bandwidth_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 	 * bytes 1-4 : ip
 	 * bytes 5-12 : bandwidth
 	 *
+	 * (for BANDWIDTH_GET6 ips in both formats are 16 bytes,
+	 * so everything after them is shifted by 12 bytes)
+	 *
 	 * if history WAS queried we have
 	 *   (note we are using 64 bit integers for time here
 	 *   even though time_t is 32 bits on most 32 bit systems
@@ -1750,9 +3782,10 @@ static int ipt_bandwidth_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 	*reset_is_constant_interval = iam->info->reset_is_constant_interval;
 
 	current_output_index = 30;
-	if(query.ip != 0)
+	if(!ip_key_is_zero(query_ip))
 	{
-		*error = add_ip_block(	query.ip, 
+		*error = add_ip_block(	query_ip, 
+					ip_length,
 					query.return_history,
 					iam,
 					buffer, 
@@ -1773,8 +3806,9 @@ static int ipt_bandwidth_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 		*num_ips_in_response = 0;
 		while(*error == ERROR_NONE && next_index < output_ip_list_length)
 		{
-			uint32_t next_ip = output_ip_list[next_index];
+			ip_key next_ip = output_ip_list[next_index];
 			*error = add_ip_block(	next_ip, 
+						ip_length,
 						query.return_history,
 						iam,
 						buffer, 
@@ -1806,7 +3840,7 @@ static int ipt_bandwidth_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 
 
 
-	up(&userspace_lock);
+	up_read(&userspace_lock);
 
 
 	return 0;
@@ -1833,14 +3867,18 @@ typedef struct set_header_struct
 
 static int handle_set_failure(int ret_value, int unlock_user_sem, int unlock_bandwidth_spin, unsigned char* free_buffer );
 static void parse_set_header(unsigned char* input_buffer, set_header* header);
-static void set_single_ip_data(unsigned char history_included, info_and_maps* iam, unsigned char* buffer, uint32_t* buffer_index, time_t now);
+static void set_single_ip_data(unsigned char history_included, unsigned char ip_length, info_and_maps* iam, unsigned char* buffer, uint32_t* buffer_index, time_t now);
 
 static int handle_set_failure(int ret_value, int unlock_user_sem, int unlock_bandwidth_spin, unsigned char* free_buffer )
 {
 	if( free_buffer != NULL ) { kfree(free_buffer); }
-	set_in_progress = 0;
-	if(unlock_bandwidth_spin) { spin_unlock_bh(&bandwidth_lock); }
-	if(unlock_user_sem) { up(&userspace_lock); }
+	if(unlock_bandwidth_spin)
+	{
+		/* set state only changes under bandwidth_lock */
+		set_in_progress = 0;
+		spin_unlock_bh(&bandwidth_lock);
+	}
+	if(unlock_user_sem) { up_write(&userspace_lock); }
 	return ret_value;
 }
 
@@ -1856,6 +3894,8 @@ static void parse_set_header(unsigned char* input_buffer, set_header* header)
 	 * bytes 15-22 :  last_backup time (64 bit)
 	 * bytes 23-23+BANDWIDTH_MAX_ID_LENGTH : id
 	 * bytes 23+   :  ip data
+	 *
+	 * header is the same for BANDWIDTH_SET6, only ips in the ip data are 16 bytes
 	 */
 
 	uint32_t* total_ips = (uint32_t*)(input_buffer+0);
@@ -1885,7 +3925,7 @@ static void parse_set_header(unsigned char* input_buffer, set_header* header)
 		printk("  id                = %s\n", header->id);
 	#endif
 }
-static void set_single_ip_data(unsigned char history_included, info_and_maps* iam, unsigned char* buffer, uint32_t* buffer_index, time_t now)
+static void set_single_ip_data(unsigned char history_included, unsigned char ip_length, info_and_maps* iam, unsigned char* buffer, uint32_t* buffer_index, time_t now)
 {
 	/* 
 	 * note that times stored within the module are adjusted so they are equal to seconds 
@@ -1893,22 +3933,24 @@ static void set_single_ip_data(unsigned char history_included, info_and_maps* ia
 	 * that is equal to the wall-clock time in the current time-zone.  Incoming values must 
 	 * be adjusted similarly
 	 */
-	uint32_t ip = *( (uint32_t*)(buffer + *buffer_index) );
+	ip_key ip = get_ip_from_buffer(buffer + *buffer_index, ip_length, iam->info->family);
 			
 	#ifdef BANDWIDTH_DEBUG
-		uint32_t* ipp = &ip;
-		printk("doing set for ip = %u.%u.%u.%u\n", *((unsigned char*)ipp), *(((unsigned char*)ipp)+1), *(((unsigned char*)ipp)+2), *(((unsigned char*)ipp)+3) );
+		printk("doing set for ip = %016llx%016llx\n", ip.hi, ip.lo );
 		printk("ip index = %d\n", *buffer_index);
 	#endif
 
+	/* restored prefixes are held to the same limit as counted ones */
+	make_room_for_remote_ip(iam, ip);
+
 	if(history_included)
 	{
-		uint32_t num_history_nodes = *( (uint32_t*)(buffer + *buffer_index+4));
-		if(iam->info->num_intervals_to_save > 0 && iam->ip_history_map != NULL)
+		uint32_t num_history_nodes = *( (uint32_t*)(buffer + *buffer_index+ip_length));
+		if(iam->info->num_intervals_to_save > 0)
 		{
-			time_t first_start = (time_t) *( (uint64_t*)(buffer + *buffer_index+8));
-			/* time_t first_end   = (time_t) *( (uint64_t*)(buffer + *buffer_index+16)); //not used */
-			/* time_t last_end    = (time_t) *( (uint64_t*)(buffer + *buffer_index+24)); //not used */
+			time_t first_start = (time_t) *( (uint64_t*)(buffer + *buffer_index+ip_length+4));
+			/* time_t first_end   = (time_t) *( (uint64_t*)(buffer + *buffer_index+ip_length+12)); //not used */
+			/* time_t last_end    = (time_t) *( (uint64_t*)(buffer + *buffer_index+ip_length+20)); //not used */
 			time_t next_start;
 			time_t next_end;
 			uint32_t node_index;
@@ -1921,7 +3963,7 @@ static void set_single_ip_data(unsigned char history_included, info_and_maps* ia
 			#endif
 
 
-			*buffer_index = *buffer_index + (2*4) + (3*8);
+			*buffer_index = *buffer_index + ip_length + 4 + (3*8);
 			
 			/* adjust for timezone */
 			next_start = first_start - (60 * local_minutes_west);
@@ -1942,7 +3984,7 @@ static void set_single_ip_data(unsigned char history_included, info_and_maps* ia
 				if(node_index == 0 || history == NULL)
 				{
 					initialize_map_entries_for_ip(iam, ip, next_bw);
-					history = get_long_map_element(iam->ip_history_map, (unsigned long)ip);
+					history = get_history_for_ip(iam, ip);
 				}
 				else if(next_end < now) /* if this is most recent node, don't do update since last node is current bandwidth */ 
 				{
@@ -1981,10 +4023,9 @@ static void set_single_ip_data(unsigned char history_included, info_and_maps* ia
 			}
 			if(history != NULL)
 			{
-				set_long_map_element(iam->ip_map, ip, (history->history_data + history->current_index) );
 				iam->info->previous_reset = next_start;
 				iam->info->next_reset = next_end;
-				if(ip == 0)
+				if(ip_key_is_zero(ip))
 				{
 					iam->info->current_bandwidth = (history->history_data)[history->current_index];
 				}
@@ -1993,11 +4034,11 @@ static void set_single_ip_data(unsigned char history_included, info_and_maps* ia
 		else
 		{
 			uint64_t bw;
-			*buffer_index = *buffer_index + (2*4) + (3*8) + ((num_history_nodes-1)*8);
+			*buffer_index = *buffer_index + ip_length + 4 + (3*8) + ((num_history_nodes-1)*8);
 			bw = *( (uint64_t*)(buffer + *buffer_index));
 			initialize_map_entries_for_ip(iam, ip, bw); /* automatically frees existing values if they exist */
 			*buffer_index = *buffer_index + 8;
-			if(ip == 0)
+			if(ip_key_is_zero(ip))
 			{
 				iam->info->current_bandwidth = bw;
 			}
@@ -2006,16 +4047,16 @@ static void set_single_ip_data(unsigned char history_included, info_and_maps* ia
 	}
 	else
 	{
-		uint64_t bw = *( (uint64_t*)(buffer + *buffer_index+4) );
+		uint64_t bw = *( (uint64_t*)(buffer + *buffer_index+ip_length) );
 		#ifdef BANDWIDTH_DEBUG
 			printk("  setting bw to %lld\n", bw );
 		#endif
 
 		
 		initialize_map_entries_for_ip(iam, ip, bw); /* automatically frees existing values if they exist */
-		*buffer_index = *buffer_index + 12;
+		*buffer_index = *buffer_index + ip_length + 8;
 
-		if(ip == 0)
+		if(ip_key_is_zero(ip))
 		{
 			iam->info->current_bandwidth = bw;
 		}
@@ -2026,15 +4067,24 @@ static void set_single_ip_data(unsigned char history_included, info_and_maps* ia
 
 static int ipt_bandwidth_set_ctl(struct sock *sk, int cmd, void *user, u_int32_t len)
 {
-	/* check for timezone shift & adjust if necessary */
 	char* buffer;
 	set_header header;
 	info_and_maps* iam;
 	uint32_t buffer_index;
 	uint32_t next_ip_index;
-	time_t now = get_seconds();
-	check_for_timezone_shift(now, 0);
-	check_for_backwards_time_shift(now);
+	unsigned char ip_length = cmd == BANDWIDTH_SET6 ? 16 : 4;
+	time_t now;
+
+	if(cmd == BANDWIDTH_SET_TIMEZONE)
+	{
+		return set_timezone(user, len);
+	}
+	if(cmd != BANDWIDTH_SET && cmd != BANDWIDTH_SET6)
+	{
+		return -EINVAL;
+	}
+
+	now = get_seconds();
 	now = now -  local_seconds_west;  /* Adjust for local timezone */
 
 
@@ -2047,9 +4097,8 @@ static int ipt_bandwidth_set_ctl(struct sock *sk, int cmd, void *user, u_int32_t
 		return 0;
 	}
 
-	down(&userspace_lock);
-	set_in_progress = 1;
-	
+	down_write(&userspace_lock);
+
 	buffer = kmalloc(len, GFP_ATOMIC);
 	if(buffer == NULL) /* check for malloc failure */
 	{
@@ -2066,7 +4115,21 @@ static int ipt_bandwidth_set_ctl(struct sock *sk, int cmd, void *user, u_int32_t
 	 * this is a kernel module -- it pays to be paranoid! 
 	 */
 	spin_lock_bh(&bandwidth_lock);
+
+	/* another process is part way through a set, caller should retry */
+	expire_abandoned_set();
+	if(set_in_progress_for_id(NULL) && set_owner != current->tgid)
+	{
+		spin_unlock_bh(&bandwidth_lock);
+		up_write(&userspace_lock);
+		kfree(buffer);
+		return -EBUSY;
+	}
 	
+	set_in_progress = 1;
+	set_owner = current->tgid;
+	set_last_call = jiffies;
+	memcpy(set_id, header.id, BANDWIDTH_MAX_ID_LENGTH);
 
 	iam = (info_and_maps*)get_string_map_element(id_map, header.id);
 	if(iam == NULL)
@@ -2077,11 +4140,16 @@ static int ipt_bandwidth_set_ctl(struct sock *sk, int cmd, void *user, u_int32_t
 	{
 		return handle_set_failure(0, 1, 1, buffer);
 	}
-	if(iam->info->num_intervals_to_save > 0 && iam->ip_history_map == NULL)
+	if(ip_length == 4 && iam->info->family == NFPROTO_IPV6 && iam->info->type != BANDWIDTH_COMBINED)
 	{
 		return handle_set_failure(0, 1, 1, buffer);
 	}
 
+	/* values we set replace anything counted so far, including bytes still sitting in per-cpu slots */
+	continue_interval_reset(iam, 0);
+	fold_all_pcpu_slots(iam);
+	clear_topk(iam->topk);
+
 	/* 
 	 * during set unconditionally set combined_bw to NULL 
 	 * if combined data (ip=0) exists after set exits cleanly, we will restore it
@@ -2093,31 +4161,7 @@ static int ipt_bandwidth_set_ctl(struct sock *sk, int cmd, void *user, u_int32_t
 	if(header.zero_unset_ips && header.next_ip_index == 0)
 	{
 		//clear data
-		if(iam->info->num_intervals_to_save > 0)
-		{
-			while(iam->ip_map->num_elements > 0)
-			{
-				unsigned long key;
-				remove_smallest_long_map_element(iam->ip_map, &key);
-				/* ignore return value -- it's actually malloced in history, not here */
-			}
-			while(iam->ip_history_map->num_elements > 0)
-			{
-				unsigned long key;
-				bw_history* history = remove_smallest_long_map_element(iam->ip_history_map, &key);
-				kfree(history->history_data);
-				kfree(history);
-			}
-		}
-		else
-		{
-			while(iam->ip_map->num_elements > 0)
-			{
-				unsigned long key;
-				uint64_t *bw = remove_smallest_long_map_element(iam->ip_map, &key);
-				kfree(bw);
-			}
-		}
+		free_all_entries(iam->ip_map);
 	}
 
 	/* 
@@ -2143,9 +4187,9 @@ static int ipt_bandwidth_set_ctl(struct sock *sk, int cmd, void *user, u_int32_t
 	buffer_index = (3*4) + 1 + 1 + 8 + BANDWIDTH_MAX_ID_LENGTH;
 	next_ip_index = header.next_ip_index;
 	
-	while(next_ip_index < header.num_ips_in_buffer)
+	while(next_ip_index < header.next_ip_index + header.num_ips_in_buffer)
 	{
-		set_single_ip_data(header.history_included, iam, buffer, &buffer_index, now);
+		set_single_ip_data(header.history_included, ip_length, iam, buffer, &buffer_index, now);
 		next_ip_index++;
 	}
 
@@ -2155,11 +4199,12 @@ static int ipt_bandwidth_set_ctl(struct sock *sk, int cmd, void *user, u_int32_t
 	}
 
 	/* set combined_bw */
-	iam->info->combined_bw = (uint64_t*)get_long_map_element(iam->ip_map, 0);
+	iam->info->combined_bw = get_bw_for_ip(iam, combined_ip);
+	rebuild_topk(iam);
 
 	kfree(buffer);
 	spin_unlock_bh(&bandwidth_lock);
-	up(&userspace_lock);
+	up_write(&userspace_lock);
 	return 0;
 }
 static int checkentry(const struct xt_mtchk_param *par)
@@ -2191,6 +4236,7 @@ static int checkentry(const struct xt_mtchk_param *par)
 		*(info->ref_count) = 1;
 		info->non_const_self = master_info;
 		info->hashed_id = sdbm_string_hash(info->id);
+		info->family = par->family;
 		info->iam = NULL;
 		info->combined_bw = NULL;
 
@@ -2199,6 +4245,8 @@ static int checkentry(const struct xt_mtchk_param *par)
 		master_info->check_type                 = info->check_type;
 		master_info->local_subnet               = info->local_subnet;
 		master_info->local_subnet_mask          = info->local_subnet_mask;
+		memcpy(master_info->local_subnet6, info->local_subnet6, sizeof(info->local_subnet6));
+		memcpy(master_info->local_subnet6_mask, info->local_subnet6_mask, sizeof(info->local_subnet6_mask));
 		master_info->cmp                        = info->cmp;
 		master_info->reset_is_constant_interval = info->reset_is_constant_interval;
 		master_info->reset_interval             = info->reset_interval;
@@ -2209,7 +4257,17 @@ static int checkentry(const struct xt_mtchk_param *par)
 		master_info->previous_reset             = info->previous_reset;
 		master_info->last_backup_time           = info->last_backup_time;
 		master_info->num_intervals_to_save      = info->num_intervals_to_save;
+		master_info->precise                    = info->precise;
+		master_info->slack                      = info->slack;
+		master_info->hires_interval             = info->hires_interval;
+		master_info->hires_slots                = info->hires_slots;
+		master_info->hires_hosts                = info->hires_hosts;
+		master_info->topk                       = info->topk;
+		master_info->remote_prefix              = info->remote_prefix;
+		master_info->remote_max                 = info->remote_max;
+		master_info->prealloc                   = info->prealloc;
 		
+		master_info->family                     = info->family;
 		master_info->hashed_id                  = info->hashed_id;
 		master_info->iam                        = info->iam;
 		master_info->combined_bw                = info->combined_bw;
@@ -2223,8 +4281,89 @@ static int checkentry(const struct xt_mtchk_param *par)
 		if(info->cmp != BANDWIDTH_CHECK)
 		{
 			info_and_maps *iam;
+			bw_pcpu __percpu* pcpu = NULL;
+			bw_hires* hires = NULL;
+			bw_topk* topk = NULL;
+			bw_remote* remote = NULL;
+			bw_entry_pool* pool = NULL;
+			ip_hash_map* ip_map = NULL;
+			unsigned long num_destroyed;
+			int stripe;
+
+			/* 
+			 * monitors and quotas with some slack count on per-cpu slots,
+			 * allocate those before we lock since alloc_percpu can sleep
+			 */
+			if(info->precise == 0 && (info->cmp == BANDWIDTH_MONITOR || info->slack > 0))
+			{
+				pcpu = alloc_percpu(bw_pcpu);
+				if(pcpu != NULL)
+				{
+					int cpu;
+					for_each_possible_cpu(cpu)
+					{
+						spin_lock_init(&(per_cpu_ptr(pcpu, cpu)->lock));
+					}
+				}
+				else
+				{
+					printk("ipt_bandwidth: warning, alloc_percpu failure, \"%s\" will be precise\n", info->id);
+				}
+			}
+
+			/* same goes for hires rings, which are all allocated up front so match never has to */
+			if(info->hires_interval > 0 && info->hires_slots > 0 && info->hires_hosts > 0)
+			{
+				if(info->hires_slots * (uint64_t)info->hires_hosts <= BANDWIDTH_HIRES_MAX_COUNTERS)
+				{
+					hires = initialize_hires(info->hires_slots, info->hires_hosts);
+				}
+				if(hires == NULL)
+				{
+					printk("ipt_bandwidth: warning, can't allocate hires history for \"%s\"\n", info->id);
+				}
+			}
+			if(info->topk > 0 && info->topk <= BANDWIDTH_TOPK_MAX && info->type != BANDWIDTH_COMBINED)
+			{
+				topk = initialize_topk(info->topk);
+				if(topk == NULL)
+				{
+					printk("ipt_bandwidth: warning, can't allocate topk for \"%s\"\n", info->id);
+				}
+			}
+			if(info->remote_prefix > 0 && info->type == BANDWIDTH_INDIVIDUAL_REMOTE && info->remote_max <= BANDWIDTH_REMOTE_MAX_PREFIXES)
+			{
+				remote = initialize_remote(par->family, info->remote_prefix, info->remote_max);
+				if(remote == NULL)
+				{
+					printk("ipt_bandwidth: warning, can't allocate remote prefixes for \"%s\", remote ips will be counted one by one\n", info->id);
+				}
+			}
+			pool = initialize_entry_pool(info);
+			if(pool == NULL)
+			{
+				printk("ipt_bandwidth: kmalloc failure in checkentry!\n");
+				if(pcpu != NULL) { free_percpu(pcpu); }
+				free_hires(hires);
+				free_topk(topk);
+				free_remote(remote);
+				return 0;
+			}
+
+			/* sized for --prealloc up front, since a large table is vmalloc'd */
+			ip_map = initialize_ip_hash_map(pool->max_free);
+			if(ip_map == NULL)
+			{
+				printk("ipt_bandwidth: can't allocate a table for %u ips for \"%s\"\n", pool->max_free, info->id);
+				if(pcpu != NULL) { free_percpu(pcpu); }
+				free_hires(hires);
+				free_topk(topk);
+				free_remote(remote);
+				free_entry_pool(pool);
+				return -ENOMEM;
+			}
 		
-			down(&userspace_lock);
+			down_write(&userspace_lock);
 			spin_lock_bh(&bandwidth_lock);
 			
 
@@ -2234,19 +4373,22 @@ static int checkentry(const struct xt_mtchk_param *par)
 			{
 				printk("ipt_bandwidth: error, \"%s\" is a duplicate id\n", info->id); 
 				spin_unlock_bh(&bandwidth_lock);
-				up(&userspace_lock);
+				up_write(&userspace_lock);
+				if(pcpu != NULL) { free_percpu(pcpu); }
+				free_hires(hires);
+				free_topk(topk);
+				free_remote(remote);
+				free_entry_pool(pool);
+				destroy_ip_hash_map(ip_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
 				return 0;
 			}
 
 			if(info->reset_interval != BANDWIDTH_NEVER)
 			{
 				time_t now = get_seconds();
-				if(now != last_local_mw_update )
-				{
-					check_for_timezone_shift(now, 1);
-				}
-				
-				
+
+				/* apply any timezone change reset_worker hasn't gotten to yet, so rule starts out right */
+				check_for_timezone_shift(now, 1);
 				now = now -  (60 * local_minutes_west);  /* Adjust for local timezone */
 				info->previous_reset = now;
 				master_info->previous_reset = now;
@@ -2281,29 +4423,34 @@ static int checkentry(const struct xt_mtchk_param *par)
 			{
 				printk("ipt_bandwidth: kmalloc failure in checkentry!\n");
 				spin_unlock_bh(&bandwidth_lock);
-				up(&userspace_lock);
-				return 0;
-			}
-			iam->ip_map = initialize_long_map();
-			if(iam->ip_map == NULL) /* handle kmalloc failure */
-			{
-				printk("ipt_bandwidth: kmalloc failure in checkentry!\n");
-				spin_unlock_bh(&bandwidth_lock);
-				up(&userspace_lock);
+				up_write(&userspace_lock);
+				if(pcpu != NULL) { free_percpu(pcpu); }
+				free_hires(hires);
+				free_topk(topk);
+				free_remote(remote);
+				free_entry_pool(pool);
+				destroy_ip_hash_map(ip_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
 				return 0;
 			}
-			iam->ip_history_map = NULL;
-			if(info->num_intervals_to_save > 0)
+			iam->pcpu = pcpu;
+			for(stripe = 0; stripe < BANDWIDTH_PCPU_STRIPES; stripe++)
 			{
-				iam->ip_history_map = initialize_long_map();
-				if(iam->ip_history_map == NULL) /* handle kmalloc failure */
-				{
-					printk("ipt_bandwidth: kmalloc failure in checkentry!\n");
-					spin_unlock_bh(&bandwidth_lock);
-					up(&userspace_lock);
-					return 0;
-				}
+				atomic_set(&(iam->pcpu_versions[stripe]), 0);
 			}
+			iam->hires = hires;
+			iam->topk = topk;
+			iam->remote = remote;
+			iam->pool = pool;
+			iam->epoch = 0;
+			iam->reset_pending = 0;
+			iam->reset_cursor = 0;
+			iam->reset_cursor_capacity = 0;
+			iam->reset_num_intervals = 0;
+			iam->reset_first_start = 0;
+			iam->reset_first_end = 0;
+			iam->reset_drop_empty = 0;
+			iam->reset_wipe = 0;
+			iam->ip_map = ip_map;
 
 
 			iam->info = master_info;
@@ -2314,7 +4461,7 @@ static int checkentry(const struct xt_mtchk_param *par)
 
 
 			spin_unlock_bh(&bandwidth_lock);
-			up(&userspace_lock);
+			up_write(&userspace_lock);
 		}
 	}
 	
@@ -2333,7 +4480,7 @@ static int checkentry(const struct xt_mtchk_param *par)
 		if(info->cmp != BANDWIDTH_CHECK)
 		{
 			info_and_maps* iam;
-			down(&userspace_lock);
+			down_write(&userspace_lock);
 			spin_lock_bh(&bandwidth_lock);
 			iam = (info_and_maps*)get_string_map_element(id_map, info->id);
 			if(iam != NULL)
@@ -2341,7 +4488,7 @@ static int checkentry(const struct xt_mtchk_param *par)
 				iam->info = info;
 			}
 			spin_unlock_bh(&bandwidth_lock);
-			up(&userspace_lock);
+			up_write(&userspace_lock);
 		}
 		*/
 	}
@@ -2370,39 +4517,29 @@ static void destroy(const struct xt_mtdtor_param *par)
 	if(*(info->ref_count) == 0)
 	{
 		info_and_maps* iam;
-		down(&userspace_lock);
+		bw_hires* hires = NULL;
+		bw_remote* remote = NULL;
+		bw_entry_pool* pool = NULL;
+		bw_pcpu __percpu* pcpu = NULL;
+		ip_hash_map* ip_map = NULL;
+		unsigned long num_destroyed;
+		down_write(&userspace_lock);
 		spin_lock_bh(&bandwidth_lock);
 		
 		info->combined_bw = NULL;
 		iam = (info_and_maps*)remove_string_map_element(id_map, info->id);
 		if(iam != NULL && info->cmp != BANDWIDTH_CHECK)
 		{
-			unsigned long num_destroyed;
-			if(iam->ip_map != NULL && iam->ip_history_map != NULL)
+			if(iam->ip_map != NULL)
 			{
-				unsigned long history_index = 0;
-				bw_history** histories_to_free;
-				
-				destroy_long_map(iam->ip_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
-				
-				histories_to_free = (bw_history**)destroy_long_map(iam->ip_history_map, DESTROY_MODE_RETURN_VALUES, &num_destroyed);
-				
-				/* num_destroyed will be 0 if histories_to_free is null after malloc failure, so this is safe */
-				for(history_index = 0; history_index < num_destroyed; history_index++) 
-				{
-					bw_history* h = histories_to_free[history_index];
-					if(h != NULL)
-					{
-						kfree(h->history_data);
-						kfree(h);
-					}
-				}
-				
-			}
-			else if(iam->ip_map != NULL)
-			{
-				destroy_long_map(iam->ip_map, DESTROY_MODE_FREE_VALUES, &num_destroyed);
+				free_all_entries(iam->ip_map);
+				ip_map = iam->ip_map; /* large tables are vmalloc'd */
 			}
+			pcpu = iam->pcpu; /* free_percpu can sleep, so can't be called with bandwidth_lock held */
+			hires = iam->hires; /* nor can vfree */
+			remote = iam->remote;
+			pool = iam->pool; /* nor can a cache be destroyed */
+			free_topk(iam->topk);
 			kfree(iam);
 			/* info portion of iam gets taken care of automatically */
 		}	
@@ -2410,7 +4547,27 @@ static void destroy(const struct xt_mtdtor_param *par)
 		kfree(info->non_const_self);
 
 		spin_unlock_bh(&bandwidth_lock);
-		up(&userspace_lock);
+		up_write(&userspace_lock);
+
+		/*
+		 * iam was unlinked under bandwidth_lock, so once a reset the
+		 * worker may have under way is done nothing can reach its entries
+		 */
+		if(pool != NULL)
+		{
+			flush_delayed_work(&reset_work);
+		}
+		if(ip_map != NULL)
+		{
+			destroy_ip_hash_map(ip_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+		}
+		if(pcpu != NULL)
+		{
+			free_percpu(pcpu);
+		}
+		free_hires(hires);
+		free_remote(remote);
+		free_entry_pool(pool);
 	}
 	
 	#ifdef BANDWIDTH_DEBUG
@@ -2422,77 +4579,146 @@ static struct nf_sockopt_ops ipt_bandwidth_sockopts =
 {
 	.pf = PF_INET,
 	.set_optmin = BANDWIDTH_SET,
-	.set_optmax = BANDWIDTH_SET+1,
+	.set_optmax = BANDWIDTH_SET_TIMEZONE+1,
 	.set = ipt_bandwidth_set_ctl,
 	.get_optmin = BANDWIDTH_GET,
-	.get_optmax = BANDWIDTH_GET+1,
+	.get_optmax = BANDWIDTH_GET_TOPK+1,
 	.get = ipt_bandwidth_get_ctl
 };
 
 
-static struct xt_match bandwidth_match __read_mostly = 
+static struct xt_match bandwidth_match[] __read_mostly = 
 {
-	.name		= "bandwidth",
-	.match		= &match,
-	.family		= AF_INET,
-	.matchsize	= sizeof(struct ipt_bandwidth_info),
-	.checkentry	= &checkentry,
-	.destroy	= &destroy,
-	.me		= THIS_MODULE,
+	{
+		.name		= "bandwidth",
+		.match		= &match,
+		.family		= NFPROTO_IPV4,
+		.matchsize	= sizeof(struct ipt_bandwidth_info),
+		.checkentry	= &checkentry,
+		.destroy	= &destroy,
+		.me		= THIS_MODULE,
+	},
+	{
+		.name		= "bandwidth",
+		.match		= &match,
+		.family		= NFPROTO_IPV6,
+		.matchsize	= sizeof(struct ipt_bandwidth_info),
+		.checkentry	= &checkentry,
+		.destroy	= &destroy,
+		.me		= THIS_MODULE,
+	},
 };
 
 static int __init init(void)
 {
+	unsigned long num_destroyed;
+	int ret;
+
 	/* Register setsockopt */
 	if (nf_register_sockopt(&ipt_bandwidth_sockopts) < 0)
 	{
 		printk("ipt_bandwidth: Can't register sockopts. Aborting\n");
+		return -1;
 	}
 	bandwidth_record_max = get_bw_record_max();
-	local_minutes_west = old_minutes_west = sys_tz.tz_minuteswest;
+	local_minutes_west = requested_minutes_west = sys_minutes_west = sys_tz.tz_minuteswest;
 	local_seconds_west = local_minutes_west*60;
-	last_local_mw_update = get_seconds();
-	if(local_seconds_west > last_local_mw_update)
+	if(local_seconds_west > get_seconds())
 	{
 		/* we can't let adjusted time be < 0 -- pretend timezone is still UTC */
 		local_minutes_west = 0;
 		local_seconds_west = 0;
 	}
+	old_minutes_west = local_minutes_west;
 
 	id_map = initialize_string_map(0);
 	if(id_map == NULL) /* deal with kmalloc failure */
 	{
 		printk("id map is null, returning -1\n");
+		nf_unregister_sockopt(&ipt_bandwidth_sockopts);
+		return -1;
+	}
+
+	bw_entry_cache = kmem_cache_create("ipt_bandwidth_entries", sizeof(bw_entry), 0, 0, NULL);
+	if(bw_entry_cache == NULL)
+	{
+		printk("ipt_bandwidth: can't create entry cache, returning -1\n");
+		destroy_string_map(id_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+		id_map = NULL;
+		nf_unregister_sockopt(&ipt_bandwidth_sockopts);
 		return -1;
 	}
 
+	ret = xt_register_matches(bandwidth_match, ARRAY_SIZE(bandwidth_match));
+	if(ret < 0)
+	{
+		kmem_cache_destroy(bw_entry_cache);
+		bw_entry_cache = NULL;
+		destroy_string_map(id_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+		id_map = NULL;
+		nf_unregister_sockopt(&ipt_bandwidth_sockopts);
+		return ret;
+	}
+
+	/* only once nothing can fail, so a failed load never leaves the worker queued */
+	schedule_delayed_work(&reset_work, HZ);
 
-	return xt_register_match(&bandwidth_match);
+	return 0;
 }
 
 static void __exit fini(void)
 {
-	down(&userspace_lock);
+	info_and_maps **iams = NULL;
+	unsigned long num_returned = 0;
+	unsigned long iam_index;
+
+	cancel_delayed_work_sync(&reset_work);
+
+	down_write(&userspace_lock);
 	spin_lock_bh(&bandwidth_lock);
 	if(id_map != NULL)
 	{
-		unsigned long num_returned;
-		info_and_maps **iams = (info_and_maps**)destroy_string_map(id_map, DESTROY_MODE_RETURN_VALUES, &num_returned);
-		int iam_index;
+		iams = (info_and_maps**)destroy_string_map(id_map, DESTROY_MODE_RETURN_VALUES, &num_returned);
 		for(iam_index=0; iam_index < num_returned; iam_index++)
 		{
-			info_and_maps* iam = iams[iam_index];
-			long_map* ip_map = iam->ip_map;
-			unsigned long num_destroyed;
-			destroy_long_map(ip_map, DESTROY_MODE_FREE_VALUES, &num_destroyed);
-			kfree(iam);
-			/* info portion of iam gets taken care of automatically */
+			free_all_entries(iams[iam_index]->ip_map);
 		}
 	}
 	nf_unregister_sockopt(&ipt_bandwidth_sockopts);
-	xt_unregister_match(&bandwidth_match);
+	xt_unregister_matches(bandwidth_match, ARRAY_SIZE(bandwidth_match));
 	spin_unlock_bh(&bandwidth_lock);
-	up(&userspace_lock);
+	up_write(&userspace_lock);
+
+	/*
+	 * hires rings, remote nodes and large ip maps are vmalloced, per-cpu slots can only be freed
+	 * where we can sleep, and entry pools may have caches to destroy, so free
+	 * them now that we're unlocked.  reset_work was cancelled above, so nothing
+	 * else can be using them
+	 */
+	for(iam_index=0; iam_index < num_returned; iam_index++)
+	{
+		unsigned long num_destroyed;
+		destroy_ip_hash_map(iams[iam_index]->ip_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+		if(iams[iam_index]->pcpu != NULL)
+		{
+			free_percpu(iams[iam_index]->pcpu);
+		}
+		free_hires(iams[iam_index]->hires);
+		free_topk(iams[iam_index]->topk);
+		free_remote(iams[iam_index]->remote);
+		free_entry_pool(iams[iam_index]->pool);
+		kfree(iams[iam_index]);
+		/* info portion of iam gets taken care of automatically */
+	}
+	if(iams != NULL)
+	{
+		kfree(iams);
+	}
+
+	if(bw_entry_cache != NULL)
+	{
+		kmem_cache_destroy(bw_entry_cache);
+	}
 
 }
 
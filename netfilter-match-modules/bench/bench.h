@@ -0,0 +1,51 @@
+/*  mbench --	userspace microbenchmark for the Gargoyle netfilter match modules
+ *
+ *  Each module is compiled against the kshim stand-ins for the kernel
+ *  APIs (see kshim/include/kshim.h) and linked with mbench.c and a
+ *  bench_<module>.c file describing the rules to benchmark.
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MBENCH_H
+#define _MBENCH_H
+
+#include "kshim.h"
+
+/* synthetic traffic is built from hosts in this subnet talking to remote servers */
+#define BENCH_LOCAL_SUBNET	"192.168.1.0"
+#define BENCH_LOCAL_MASK	"255.255.255.0"
+
+typedef struct bench_scenario_struct
+{
+	const char* name;
+	const char* description;
+	void (*fill_info)(void* info); /* set up the match info the way the iptables extension would */
+	uint32_t flows; /* synthetic flows to run with instead of -f, 0 to use -f */
+} bench_scenario;
+
+typedef struct bench_module_struct
+{
+	const char* match_name;
+	unsigned short family;
+	unsigned int info_size;
+	int (*init)(void);
+	void (*exit)(void);
+	const bench_scenario* scenarios; /* terminated by an entry with a NULL name */
+} bench_module;
+
+/* defined by each bench_<module>.c */
+extern const bench_module mbench_module;
+
+#endif /*_MBENCH_H*/
@@ -0,0 +1,106 @@
+/*  mbench rules for the bandwidth match
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include <linux/netfilter_ipv4/ipt_bandwidth.h>
+
+int ipt_bandwidth_init(void);
+void ipt_bandwidth_exit(void);
+
+static void fill_common(struct ipt_bandwidth_info* info, const char* id, unsigned char type, unsigned char cmp)
+{
+	strcpy(info->id, id);
+	info->type = type;
+	info->cmp = cmp;
+	info->check_type = BANDWIDTH_CHECK_NOSWAP;
+	info->local_subnet = inet_addr(BENCH_LOCAL_SUBNET);
+	info->local_subnet_mask = inet_addr(BENCH_LOCAL_MASK);
+	info->reset_interval = BANDWIDTH_NEVER;
+}
+
+static void fill_combined(void* v)
+{
+	struct ipt_bandwidth_info* info = (struct ipt_bandwidth_info*)v;
+	fill_common(info, "bench-combined", BANDWIDTH_COMBINED, BANDWIDTH_MONITOR);
+}
+
+static void fill_quota(void* v)
+{
+	struct ipt_bandwidth_info* info = (struct ipt_bandwidth_info*)v;
+	fill_common(info, "bench-quota", BANDWIDTH_INDIVIDUAL_LOCAL, BANDWIDTH_GT);
+	info->bandwidth_cutoff = 1024*1024*1024;
+	info->reset_interval = BANDWIDTH_DAY;
+}
+
+static void fill_history(void* v)
+{
+	struct ipt_bandwidth_info* info = (struct ipt_bandwidth_info*)v;
+	fill_common(info, "bench-history", BANDWIDTH_INDIVIDUAL_LOCAL, BANDWIDTH_MONITOR);
+	info->reset_interval = 60;
+	info->reset_is_constant_interval = 1;
+	info->num_intervals_to_save = 120;
+}
+
+static void fill_remote(void* v)
+{
+	struct ipt_bandwidth_info* info = (struct ipt_bandwidth_info*)v;
+	fill_common(info, "bench-remote", BANDWIDTH_INDIVIDUAL_REMOTE, BANDWIDTH_MONITOR);
+	info->reset_interval = BANDWIDTH_HOUR;
+	info->remote_prefix = 24;
+	info->remote_max = 1024;
+	info->topk = 10;
+}
+
+static void fill_hires(void* v)
+{
+	struct ipt_bandwidth_info* info = (struct ipt_bandwidth_info*)v;
+	fill_common(info, "bench-hires", BANDWIDTH_INDIVIDUAL_LOCAL, BANDWIDTH_MONITOR);
+	info->reset_interval = BANDWIDTH_MINUTE;
+	info->hires_interval = 1;
+	info->hires_slots = 60;
+	info->hires_hosts = BANDWIDTH_HIRES_DEFAULT_HOSTS;
+	info->prealloc = 256;
+}
+
+static void fill_remote_hosts(void* v)
+{
+	struct ipt_bandwidth_info* info = (struct ipt_bandwidth_info*)v;
+	fill_common(info, "bench-remote-hosts", BANDWIDTH_INDIVIDUAL_REMOTE, BANDWIDTH_MONITOR);
+	info->reset_interval = BANDWIDTH_HOUR;
+	info->remote_prefix = 32;
+	info->remote_max = 8192;
+}
+
+static const bench_scenario bandwidth_scenarios[] =
+{
+	{ "combined",	"one total for all traffic, no resets",				fill_combined },
+	{ "quota",	"per local ip quota (--greater_than), daily reset",		fill_quota },
+	{ "history",	"per local ip, 60s intervals, 120 intervals of history",	fill_history },
+	{ "remote",	"per remote /24 (at most 1024), top 10, hourly reset",		fill_remote },
+	{ "hires",	"per local ip, 1s high resolution slots, 256 preallocated ips",	fill_hires },
+	{ "remote_hosts","per remote ip, 4096 flows: more hosts than per-cpu slots",	fill_remote_hosts,	4096 },
+	{ NULL, NULL, NULL, 0 }
+};
+
+const bench_module mbench_module =
+{
+	"bandwidth",
+	NFPROTO_IPV4,
+	sizeof(struct ipt_bandwidth_info),
+	ipt_bandwidth_init,
+	ipt_bandwidth_exit,
+	bandwidth_scenarios
+};
@@ -0,0 +1,75 @@
+/*  mbench rules for the layer7 match
+ *
+ *  Patterns are from l7-protocols, with \xHH escapes already expanded the
+ *  way the iptables extension does before handing them to the kernel.
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include <linux/netfilter_ipv4/ipt_layer7.h>
+
+int ipt_layer7_init(void);
+void ipt_layer7_exit(void);
+
+#define HTTP_PATTERN	"http/(0\\.9|1\\.0|1\\.1) [1-5][0-9][0-9] [\x09-\x0d -~]*(connection:|content-type:|content-length:|date:)|post [\x09-\x0d -~]* http/[01]\\.[019]"
+#define SSL_PATTERN	"^(.?.?\x16\x03.*\x16\x03|.?.?\x01\x03\x01?.*\x0b)"
+#define DNS_PATTERN	"^.?.?.?.?[\x01\x02].?.?.?.?.?.?[\x01-?][a-z0-9][\x01-?a-z]*[\x02-\x06][a-z][a-z][fglmoprstuvz]?[aeop]?(um)?[\x01-\x10\x1c]?[\x01\x03\x04\xFF]"
+
+static void fill_http(void* v)
+{
+	struct xt_layer7_info* info = (struct xt_layer7_info*)v;
+	strcpy(info->protocol, "http");
+	strcpy(info->pattern, HTTP_PATTERN);
+}
+
+static void fill_ssl(void* v)
+{
+	struct xt_layer7_info* info = (struct xt_layer7_info*)v;
+	strcpy(info->protocol, "ssl");
+	strcpy(info->pattern, SSL_PATTERN);
+}
+
+static void fill_dns(void* v)
+{
+	struct xt_layer7_info* info = (struct xt_layer7_info*)v;
+	strcpy(info->protocol, "dns");
+	strcpy(info->pattern, DNS_PATTERN);
+}
+
+static void fill_http_pkt(void* v)
+{
+	struct xt_layer7_info* info = (struct xt_layer7_info*)v;
+	fill_http(info);
+	info->pkt = 1;
+}
+
+static const bench_scenario layer7_scenarios[] =
+{
+	{ "http",	"--l7proto http",			fill_http },
+	{ "ssl",	"--l7proto ssl",			fill_ssl },
+	{ "dns",	"--l7proto dns",			fill_dns },
+	{ "http_pkt",	"--l7proto http --l7pkt (every packet)",fill_http_pkt },
+	{ NULL, NULL, NULL }
+};
+
+const bench_module mbench_module =
+{
+	"layer7",
+	NFPROTO_IPV4,
+	sizeof(struct xt_layer7_info),
+	ipt_layer7_init,
+	ipt_layer7_exit,
+	layer7_scenarios
+};
@@ -0,0 +1,65 @@
+/*  mbench rules for the timerange match
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include <linux/netfilter_ipv4/ipt_timerange.h>
+
+int ipt_timerange_init(void);
+void ipt_timerange_exit(void);
+
+static void fill_hours(void* v)
+{
+	struct ipt_timerange_info* info = (struct ipt_timerange_info*)v;
+	long ranges[] = { 0, 6*3600, 8*3600, 12*3600, 13*3600, 17*3600, 20*3600, 22*3600, -1 };
+	memcpy(info->ranges, ranges, sizeof(ranges));
+	info->type = HOURS;
+}
+
+static void fill_days_hours(void* v)
+{
+	struct ipt_timerange_info* info = (struct ipt_timerange_info*)v;
+	char days[7] = { 0, 1, 1, 1, 1, 1, 0 };
+	fill_hours(info);
+	memcpy(info->days, days, sizeof(days));
+	info->type = DAYS_HOURS;
+}
+
+static void fill_weekly(void* v)
+{
+	struct ipt_timerange_info* info = (struct ipt_timerange_info*)v;
+	long ranges[] = { 86400 + 9*3600, 5*86400 + 17*3600, -1 };
+	memcpy(info->ranges, ranges, sizeof(ranges));
+	info->type = WEEKLY_RANGE;
+	info->invert = 1;
+}
+
+static const bench_scenario timerange_scenarios[] =
+{
+	{ "hours",	"--hours with four ranges",				fill_hours },
+	{ "days_hours",	"--weekdays Mon-Fri with four --hours ranges",		fill_days_hours },
+	{ "weekly",	"! --weekly_ranges Mon 09:00 to Fri 17:00",		fill_weekly },
+	{ NULL, NULL, NULL }
+};
+
+const bench_module mbench_module =
+{
+	"timerange",
+	NFPROTO_IPV4,
+	sizeof(struct ipt_timerange_info),
+	ipt_timerange_init,
+	ipt_timerange_exit,
+	timerange_scenarios
+};
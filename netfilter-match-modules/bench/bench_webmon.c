@@ -0,0 +1,93 @@
+/*  mbench rules for the webmon match
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include <linux/netfilter_ipv4/ipt_webmon.h>
+
+int ipt_webmon_init(void);
+void ipt_webmon_exit(void);
+
+static void fill_all(void* v)
+{
+	struct ipt_webmon_info* info = (struct ipt_webmon_info*)v;
+	info->max_domains = 300;
+	info->max_searches = 300;
+	info->exclude_type = WEBMON_EXCLUDE;
+}
+
+static void fill_exclude(void* v)
+{
+	struct ipt_webmon_info* info = (struct ipt_webmon_info*)v;
+	uint32_t local_base = ntohl(inet_addr(BENCH_LOCAL_SUBNET));
+	uint32_t ip_index;
+	fill_all(info);
+
+	/* every other host of the first 64 excluded one by one, the last 128 by range */
+	for(ip_index = 0; ip_index < 32; ip_index++)
+	{
+		info->exclude_ranges[ip_index].start = htonl(local_base + 2 + ip_index*2);
+		info->exclude_ranges[ip_index].end = info->exclude_ranges[ip_index].start;
+	}
+	info->exclude_ranges[32].start = htonl(local_base + 128);
+	info->exclude_ranges[32].end = htonl(local_base + 254);
+	info->num_exclude_ranges = 33;
+}
+
+static void fill_exclude_max(void* v)
+{
+	struct ipt_webmon_info* info = (struct ipt_webmon_info*)v;
+	uint32_t other_base = ntohl(inet_addr("10.0.0.0"));
+	uint32_t ip_index;
+	fill_exclude(info);
+
+	/* fill the rest of the list with ips that never show up */
+	for(ip_index = info->num_exclude_ranges; ip_index < WEBMON_MAX_IP_RANGES; ip_index++)
+	{
+		info->exclude_ranges[ip_index].start = htonl(other_base + ip_index*2);
+		info->exclude_ranges[ip_index].end = info->exclude_ranges[ip_index].start;
+	}
+	info->num_exclude_ranges = WEBMON_MAX_IP_RANGES;
+}
+
+static void fill_include(void* v)
+{
+	struct ipt_webmon_info* info = (struct ipt_webmon_info*)v;
+	uint32_t local_base = ntohl(inet_addr(BENCH_LOCAL_SUBNET));
+	fill_all(info);
+	info->exclude_type = WEBMON_INCLUDE;
+	info->exclude_ranges[0].start = htonl(local_base + 2);
+	info->exclude_ranges[0].end = htonl(local_base + 33);
+	info->num_exclude_ranges = 1;
+}
+
+static const bench_scenario webmon_scenarios[] =
+{
+	{ "all",	"record every host, 300 domains & searches",		fill_all },
+	{ "exclude",	"32 excluded ips and one excluded range",		fill_exclude },
+	{ "exclude_max","exclude list filled to WEBMON_MAX_IP_RANGES",		fill_exclude_max },
+	{ "include",	"only record hosts in one range of 32 ips",		fill_include },
+	{ NULL, NULL, NULL }
+};
+
+const bench_module mbench_module =
+{
+	"webmon",
+	NFPROTO_IPV4,
+	sizeof(struct ipt_webmon_info),
+	ipt_webmon_init,
+	ipt_webmon_exit,
+	webmon_scenarios
+};
@@ -0,0 +1,168 @@
+/*  mbench rules for the weburl match
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include <linux/netfilter_ipv4/ipt_weburl.h>
+
+int ipt_weburl_init(void);
+void ipt_weburl_exit(void);
+
+static void fill_contains(void* v)
+{
+	struct ipt_weburl_info* info = (struct ipt_weburl_info*)v;
+	strcpy(info->test_str, "facebook");
+	info->match_type = WEBURL_CONTAINS_TYPE;
+	info->match_part = WEBURL_ALL_PART;
+}
+
+static void fill_domain(void* v)
+{
+	struct ipt_weburl_info* info = (struct ipt_weburl_info*)v;
+	strcpy(info->test_str, "www.youtube.com");
+	info->match_type = WEBURL_EXACT_TYPE;
+	info->match_part = WEBURL_DOMAIN_PART;
+}
+
+static void fill_regex(void* v)
+{
+	struct ipt_weburl_info* info = (struct ipt_weburl_info*)v;
+	strcpy(info->test_str, "(facebook|twitter|youtube)\\.com");
+	info->match_type = WEBURL_REGEX_TYPE;
+	info->match_part = WEBURL_ALL_PART;
+}
+
+static void fill_suffix(void* v)
+{
+	struct ipt_weburl_info* info = (struct ipt_weburl_info*)v;
+	strcpy(info->test_str, "youtube.com");
+	info->match_type = WEBURL_SUFFIX_TYPE;
+	info->match_part = WEBURL_DOMAIN_PART;
+}
+
+static unsigned int add_pattern(unsigned char* buf, unsigned int pos, unsigned char type, unsigned char part, const char* pattern)
+{
+	uint16_t length = (uint16_t)strlen(pattern);
+	buf[pos] = type;
+	buf[pos+1] = part;
+	memcpy(buf + pos + 2, &length, sizeof(uint16_t));
+	memcpy(buf + pos + 4, pattern, length);
+	return pos + 4 + length;
+}
+
+/*
+ * a blocklist of SET_SIZE patterns, a third each of domain contains,
+ * domain exact and url contains, that only catches facebook and youtube
+ */
+#define SET_SIZE 3000
+static void fill_set(void* v)
+{
+	struct ipt_weburl_info* info = (struct ipt_weburl_info*)v;
+	static unsigned char request[WEBURL_MAX_SET_NAME + sizeof(uint32_t) + SET_SIZE*64];
+	unsigned int pos = WEBURL_MAX_SET_NAME + sizeof(uint32_t);
+	uint32_t num_patterns = SET_SIZE;
+	uint32_t pattern_index;
+	char pattern[64];
+
+	memset(request, 0, WEBURL_MAX_SET_NAME);
+	strcpy((char*)request, "blocklist");
+	memcpy(request + WEBURL_MAX_SET_NAME, &num_patterns, sizeof(uint32_t));
+	pos = add_pattern(request, pos, WEBURL_CONTAINS_TYPE, WEBURL_ALL_PART, "facebook");
+	pos = add_pattern(request, pos, WEBURL_EXACT_TYPE, WEBURL_DOMAIN_PART, "youtube.com");
+	for(pattern_index = 2; pattern_index < SET_SIZE; pattern_index++)
+	{
+		switch(pattern_index % 3)
+		{
+			case 0:
+				sprintf(pattern, "ads%u.tracker.com", pattern_index);
+				pos = add_pattern(request, pos, WEBURL_CONTAINS_TYPE, WEBURL_DOMAIN_PART, pattern);
+				break;
+			case 1:
+				sprintf(pattern, "www.blocked%u.net", pattern_index);
+				pos = add_pattern(request, pos, WEBURL_EXACT_TYPE, WEBURL_DOMAIN_PART, pattern);
+				break;
+			case 2:
+				sprintf(pattern, "example.com/banner/%u", pattern_index);
+				pos = add_pattern(request, pos, WEBURL_CONTAINS_TYPE, WEBURL_ALL_PART, pattern);
+				break;
+		}
+	}
+	if(kshim_setsockopt(WEBURL_SET_PATTERNS, request, pos) != 0)
+	{
+		fprintf(stderr, "mbench_weburl: can't load set\n");
+		exit(1);
+	}
+
+	strcpy(info->test_str, "blocklist");
+	info->match_type = WEBURL_SET_TYPE;
+	info->match_part = WEBURL_ALL_PART;
+}
+
+/*
+ * an adblock style list of SUFFIX_SET_SIZE domains, which only catches
+ * facebook and youtube
+ */
+#define SUFFIX_SET_SIZE 200000
+static void fill_suffix_set(void* v)
+{
+	struct ipt_weburl_info* info = (struct ipt_weburl_info*)v;
+	static unsigned char request[WEBURL_MAX_SET_NAME + sizeof(uint32_t) + SUFFIX_SET_SIZE*40];
+	unsigned int pos = WEBURL_MAX_SET_NAME + sizeof(uint32_t);
+	uint32_t num_patterns = SUFFIX_SET_SIZE;
+	uint32_t pattern_index;
+	char pattern[64];
+
+	memset(request, 0, WEBURL_MAX_SET_NAME);
+	strcpy((char*)request, "adblock");
+	memcpy(request + WEBURL_MAX_SET_NAME, &num_patterns, sizeof(uint32_t));
+	pos = add_pattern(request, pos, WEBURL_SUFFIX_TYPE, WEBURL_DOMAIN_PART, "facebook.com");
+	pos = add_pattern(request, pos, WEBURL_SUFFIX_TYPE, WEBURL_DOMAIN_PART, "youtube.com");
+	for(pattern_index = 2; pattern_index < SUFFIX_SET_SIZE; pattern_index++)
+	{
+		static const char* tlds[] = { "com", "net", "org", "io" };
+		sprintf(pattern, "%s%u.tracker%u.%s", pattern_index % 2 ? "ads" : "pixel", pattern_index, pattern_index % 97, tlds[pattern_index % 4]);
+		pos = add_pattern(request, pos, WEBURL_SUFFIX_TYPE, WEBURL_DOMAIN_PART, pattern);
+	}
+	if(kshim_setsockopt(WEBURL_SET_PATTERNS, request, pos) != 0)
+	{
+		fprintf(stderr, "mbench_weburl: can't load set\n");
+		exit(1);
+	}
+
+	strcpy(info->test_str, "adblock");
+	info->match_type = WEBURL_SET_TYPE;
+	info->match_part = WEBURL_ALL_PART;
+}
+
+static const bench_scenario weburl_scenarios[] =
+{
+	{ "contains",	"--contains facebook",					fill_contains },
+	{ "domain",	"--domain_only --matches_exactly www.youtube.com",	fill_domain },
+	{ "regex",	"--contains_regex (facebook|twitter|youtube)\\.com",	fill_regex },
+	{ "suffix",	"--domain_suffix youtube.com",				fill_suffix },
+	{ "set",	"--set of 3000 contains & exact patterns",		fill_set },
+	{ "suffix_set",	"--set of 200000 domain suffixes",			fill_suffix_set },
+	{ NULL, NULL, NULL }
+};
+
+const bench_module mbench_module =
+{
+	"weburl",
+	NFPROTO_IPV4,
+	sizeof(struct ipt_weburl_info),
+	ipt_weburl_init,
+	ipt_weburl_exit,
+	weburl_scenarios
+};
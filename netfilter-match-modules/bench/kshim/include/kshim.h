@@ -0,0 +1,613 @@
+/*  kshim --	minimal userspace stand-ins for the kernel APIs used by
+ *  		the Gargoyle netfilter match modules, so the modules can be
+ *  		compiled and exercised outside of a kernel tree
+ */
+
+#ifndef _KSHIM_H
+#define _KSHIM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include_next <linux/types.h>
+#include_next <linux/ip.h>
+#include_next <linux/ipv6.h>
+#include_next <linux/tcp.h>
+#include_next <linux/udp.h>
+#include_next <linux/netfilter.h>
+
+/* basic types */
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t   s8;
+typedef int16_t  s16;
+typedef int32_t  s32;
+typedef int64_t  s64;
+typedef uint8_t  u_int8_t;
+typedef uint16_t u_int16_t;
+typedef uint32_t u_int32_t;
+typedef uint64_t u_int64_t;
+typedef unsigned int gfp_t;
+
+#define __user
+#define __percpu
+#define __init
+#define __exit
+#define __read_mostly
+#define __cacheline_aligned
+#define __force
+#define __must_check
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+#define ACCESS_ONCE(x)	(*(volatile __typeof__(x) *)&(x))
+#define barrier()	__asm__ __volatile__("" ::: "memory")
+#define smp_mb()	__sync_synchronize()
+#define smp_rmb()	__sync_synchronize()
+#define smp_wmb()	__sync_synchronize()
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a,b)	((a) < (b) ? (a) : (b))
+#define max(a,b)	((a) > (b) ? (a) : (b))
+#define min_t(t,a,b)	((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t,a,b)	((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define BUG_ON(c)	do { if(c) { fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__); abort(); } } while(0)
+#define WARN_ON(c)	({ int __w = !!(c); if(__w) { fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__); } __w; })
+#define L1_CACHE_BYTES	32
+#define PAGE_SIZE	4096UL
+#define PAGE_SHIFT	12
+#define PAGE_ALIGN(x)	(((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define NSEC_PER_SEC	1000000000L
+#define USEC_PER_SEC	1000000L
+
+/* printk */
+#define KERN_EMERG	""
+#define KERN_ALERT	""
+#define KERN_CRIT	""
+#define KERN_ERR	""
+#define KERN_WARNING	""
+#define KERN_NOTICE	""
+#define KERN_INFO	""
+#define KERN_DEBUG	""
+extern int kshim_quiet;
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define pr_info(fmt, args...)	printk(fmt, ##args)
+#define pr_err(fmt, args...)	printk(fmt, ##args)
+#define pr_warn(fmt, args...)	printk(fmt, ##args)
+#define pr_debug(fmt, args...)	do { } while(0)
+#define net_ratelimit()		1
+
+/* memory */
+#define GFP_ATOMIC	1
+#define GFP_KERNEL	2
+#define __GFP_ZERO	4
+#define __GFP_NOWARN	8
+extern unsigned long kshim_alloc_count;
+extern unsigned long kshim_free_count;
+void *kmalloc(size_t size, gfp_t flags);
+void *kzalloc(size_t size, gfp_t flags);
+void *kcalloc(size_t n, size_t size, gfp_t flags);
+void kfree(const void *p);
+void *vmalloc(unsigned long size);
+void *vzalloc(unsigned long size);
+void *vmalloc_user(unsigned long size);
+void vfree(const void *p);
+
+struct kmem_cache
+{
+	const char *name;
+	size_t size;
+	unsigned long in_use;
+};
+#define SLAB_HWCACHE_ALIGN	0x1
+#define SLAB_PANIC		0x2
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, unsigned long flags, void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cache);
+void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags);
+void *kmem_cache_zalloc(struct kmem_cache *cache, gfp_t flags);
+void kmem_cache_free(struct kmem_cache *cache, void *p);
+
+/* user copies */
+static inline unsigned long copy_to_user(void *to, const void *from, unsigned long n) { memcpy(to, from, n); return 0; }
+static inline unsigned long copy_from_user(void *to, const void *from, unsigned long n) { memcpy(to, from, n); return 0; }
+
+/* locking -- the harness is single threaded, so locks only track nesting */
+typedef struct { int locked; } spinlock_t;
+typedef struct { int locked; } rwlock_t;
+#define __SPIN_LOCK_UNLOCKED(name)	{ 0 }
+#define __RW_LOCK_UNLOCKED(name)	{ 0 }
+#define DEFINE_SPINLOCK(name)		spinlock_t name = { 0 }
+#define DEFINE_RWLOCK(name)		rwlock_t name = { 0 }
+#define spin_lock_init(l)		do { (l)->locked = 0; } while(0)
+#define rwlock_init(l)			do { (l)->locked = 0; } while(0)
+#define spin_lock(l)			kshim_lock(&(l)->locked)
+#define spin_unlock(l)			kshim_unlock(&(l)->locked)
+#define spin_lock_bh(l)			kshim_lock(&(l)->locked)
+#define spin_unlock_bh(l)		kshim_unlock(&(l)->locked)
+#define spin_trylock(l)			kshim_trylock(&(l)->locked)
+#define spin_trylock_bh(l)		kshim_trylock(&(l)->locked)
+#define spin_lock_irqsave(l, f)		do { (void)(f); kshim_lock(&(l)->locked); } while(0)
+#define spin_unlock_irqrestore(l, f)	do { (void)(f); kshim_unlock(&(l)->locked); } while(0)
+#define read_lock_bh(l)			kshim_lock(&(l)->locked)
+#define read_unlock_bh(l)		kshim_unlock(&(l)->locked)
+#define write_lock_bh(l)		kshim_lock(&(l)->locked)
+#define write_unlock_bh(l)		kshim_unlock(&(l)->locked)
+#define local_bh_disable()		do { } while(0)
+#define local_bh_enable()		do { } while(0)
+extern unsigned long kshim_lock_count;
+extern int kshim_lock_timing;			/* if set, time spent with at least one lock held is added to kshim_lock_hold_ns */
+extern unsigned long long kshim_lock_hold_ns;
+void kshim_lock(int *l);
+void kshim_unlock(int *l);
+int kshim_trylock(int *l);
+
+struct semaphore { int count; };
+#define DEFINE_SEMAPHORE(name)	struct semaphore name = { 1 }
+#define sema_init(s, n)		do { (s)->count = (n); } while(0)
+void down(struct semaphore *s);
+int down_trylock(struct semaphore *s);
+int down_interruptible(struct semaphore *s);
+int down_timeout(struct semaphore *s, long jiffies);
+void up(struct semaphore *s);
+
+struct rw_semaphore { int count; };
+#define DECLARE_RWSEM(name)	struct rw_semaphore name = { 0 }
+void down_read(struct rw_semaphore *s);
+void up_read(struct rw_semaphore *s);
+void down_write(struct rw_semaphore *s);
+void up_write(struct rw_semaphore *s);
+
+struct task_struct { pid_t pid; pid_t tgid; };
+extern struct task_struct kshim_current;
+#define current (&kshim_current)
+
+struct mutex { int locked; };
+#define DEFINE_MUTEX(name)	struct mutex name = { 0 }
+#define mutex_init(m)		do { (m)->locked = 0; } while(0)
+#define mutex_lock(m)		kshim_lock(&(m)->locked)
+#define mutex_unlock(m)		kshim_unlock(&(m)->locked)
+
+typedef struct { volatile int counter; } atomic_t;
+typedef struct { volatile long long counter; } atomic64_t;
+#define atomic64_read(v)	((v)->counter)
+#define atomic64_set(v, i)	((v)->counter = (i))
+#define atomic64_inc(v)		((void)__sync_add_and_fetch(&(v)->counter, 1))
+#define atomic64_add(i, v)	((void)__sync_add_and_fetch(&(v)->counter, (i)))
+#define ATOMIC_INIT(i)		{ (i) }
+#define atomic_read(v)		((v)->counter)
+#define atomic_set(v, i)	((v)->counter = (i))
+#define atomic_inc(v)		((void)__sync_add_and_fetch(&(v)->counter, 1))
+#define atomic_dec(v)		((void)__sync_sub_and_fetch(&(v)->counter, 1))
+#define atomic_add(i, v)	((void)__sync_add_and_fetch(&(v)->counter, (i)))
+#define atomic_inc_return(v)	__sync_add_and_fetch(&(v)->counter, 1)
+#define atomic_dec_and_test(v)	(__sync_sub_and_fetch(&(v)->counter, 1) == 0)
+#define atomic_cmpxchg(v, o, n)	__sync_val_compare_and_swap(&(v)->counter, (o), (n))
+
+/* per-cpu data -- the harness simulates kshim_nr_cpus cpus, and switches kshim_cpu by hand */
+extern int kshim_nr_cpus;
+extern int kshim_cpu;
+#define NR_CPUS			8
+#define alloc_percpu(type)	((type *)kzalloc(sizeof(type) * NR_CPUS, GFP_KERNEL))
+#define free_percpu(p)		kfree(p)
+#define per_cpu_ptr(p, cpu)	(&(p)[(cpu)])
+#define this_cpu_ptr(p)		(&(p)[kshim_cpu])
+#define raw_cpu_ptr(p)		(&(p)[kshim_cpu])
+#define this_cpu_add(pcp, v)	((pcp) += (v))
+#define this_cpu_inc(pcp)	((pcp)++)
+#define smp_processor_id()	(kshim_cpu)
+#define get_cpu()		(kshim_cpu)
+#define put_cpu()		do { } while(0)
+#define num_possible_cpus()	(kshim_nr_cpus)
+#define for_each_possible_cpu(cpu)	for((cpu) = 0; (cpu) < kshim_nr_cpus; (cpu)++)
+#define for_each_online_cpu(cpu)	for((cpu) = 0; (cpu) < kshim_nr_cpus; (cpu)++)
+
+/* time */
+#define HZ 100
+extern unsigned long volatile jiffies;
+extern time_t kshim_now;
+extern struct timezone sys_tz;
+static inline unsigned long get_seconds(void) { return (unsigned long)kshim_now; }
+static inline void do_gettimeofday(struct timeval *tv) { tv->tv_sec = kshim_now; tv->tv_usec = 0; }
+#define msecs_to_jiffies(ms)	((unsigned long)(((ms) * HZ + 999) / 1000))
+#define jiffies_to_msecs(j)	((unsigned int)((j) * 1000 / HZ))
+#define time_after(a, b)	((long)((b) - (a)) < 0)
+#define time_before(a, b)	time_after(b, a)
+#define time_after_eq(a, b)	((long)((a) - (b)) >= 0)
+typedef int64_t ktime_t;
+
+/* kernel version, for modules that still carry pre-2.6.35 compatibility branches */
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE	KERNEL_VERSION(3, 3, 8)
+
+/* lists */
+struct list_head { struct list_head *next, *prev; };
+#define LIST_HEAD_INIT(name)	{ &(name), &(name) }
+#define LIST_HEAD(name)		struct list_head name = LIST_HEAD_INIT(name)
+static inline void INIT_LIST_HEAD(struct list_head *l) { l->next = l; l->prev = l; }
+static inline void __list_add(struct list_head *n, struct list_head *prev, struct list_head *next) { next->prev = n; n->next = next; n->prev = prev; prev->next = n; }
+static inline void list_add(struct list_head *n, struct list_head *head) { __list_add(n, head, head->next); }
+static inline void list_add_tail(struct list_head *n, struct list_head *head) { __list_add(n, head->prev, head); }
+static inline void list_del(struct list_head *e) { e->next->prev = e->prev; e->prev->next = e->next; e->next = NULL; e->prev = NULL; }
+static inline void list_del_init(struct list_head *e) { e->next->prev = e->prev; e->prev->next = e->next; INIT_LIST_HEAD(e); }
+static inline void list_move(struct list_head *e, struct list_head *head) { e->next->prev = e->prev; e->prev->next = e->next; list_add(e, head); }
+static inline void list_move_tail(struct list_head *e, struct list_head *head) { e->next->prev = e->prev; e->prev->next = e->next; list_add_tail(e, head); }
+static inline int list_empty(const struct list_head *head) { return head->next == head; }
+#define list_entry(ptr, type, member)		container_of(ptr, type, member)
+#define list_for_each(pos, head)	for (pos = (head)->next; pos != (head); pos = pos->next)
+#define list_first_entry(ptr, type, member)	list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member)	list_entry((ptr)->prev, type, member)
+#define list_for_each_entry(pos, head, member) \
+	for(pos = list_entry((head)->next, __typeof__(*pos), member); &pos->member != (head); pos = list_entry(pos->member.next, __typeof__(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for(pos = list_entry((head)->next, __typeof__(*pos), member), n = list_entry(pos->member.next, __typeof__(*pos), member); &pos->member != (head); pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+/* deferred work -- queued items only run when the harness calls kshim_run_work() */
+struct work_struct
+{
+	void (*func)(struct work_struct *work);
+	int pending;
+	struct work_struct *next_pending;
+	unsigned long expires; /* jiffies, for delayed work */
+};
+struct delayed_work
+{
+	struct work_struct work;
+};
+struct timer_list
+{
+	void (*function)(unsigned long);
+	unsigned long data;
+	unsigned long expires;
+	int pending;
+	struct timer_list *next_pending;
+};
+struct workqueue_struct { int unused; };
+#define INIT_WORK(w, f)			do { (w)->func = (f); (w)->pending = 0; (w)->next_pending = NULL; (w)->expires = 0; } while(0)
+#define INIT_DELAYED_WORK(w, f)		INIT_WORK(&(w)->work, (f))
+#define DECLARE_WORK(n, f)		struct work_struct n = { (f), 0, NULL, 0 }
+#define DECLARE_DELAYED_WORK(n, f)	struct delayed_work n = { { (f), 0, NULL, 0 } }
+#define to_delayed_work(w)		container_of(w, struct delayed_work, work)
+int schedule_work(struct work_struct *work);
+int schedule_delayed_work(struct delayed_work *work, unsigned long delay);
+int queue_work(struct workqueue_struct *wq, struct work_struct *work);
+int queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *work, unsigned long delay);
+int cancel_work_sync(struct work_struct *work);
+int cancel_delayed_work(struct delayed_work *work);
+int cancel_delayed_work_sync(struct delayed_work *work);
+int flush_delayed_work(struct delayed_work *work);
+void flush_scheduled_work(void);
+void setup_timer(struct timer_list *timer, void (*function)(unsigned long), unsigned long data);
+int mod_timer(struct timer_list *timer, unsigned long expires);
+int del_timer_sync(struct timer_list *timer);
+void kshim_run_work(void);
+
+/* hashing / sorting */
+#define __jhash_mix(a, b, c) \
+{ \
+	a -= c;  a ^= ((c << 4) | (c >> 28));  c += b; \
+	b -= a;  b ^= ((a << 6) | (a >> 26));  a += c; \
+	c -= b;  c ^= ((b << 8) | (b >> 24));  b += a; \
+	a -= c;  a ^= ((c << 16) | (c >> 16)); c += b; \
+	b -= a;  b ^= ((a << 19) | (a >> 13)); a += c; \
+	c -= b;  c ^= ((b << 4) | (b >> 28));  b += a; \
+}
+#define __jhash_final(a, b, c) \
+{ \
+	c ^= b; c -= ((b << 14) | (b >> 18)); \
+	a ^= c; a -= ((c << 11) | (c >> 21)); \
+	b ^= a; b -= ((a << 25) | (a >> 7)); \
+	c ^= b; c -= ((b << 16) | (b >> 16)); \
+	a ^= c; a -= ((c << 4) | (c >> 28)); \
+	b ^= a; b -= ((a << 14) | (a >> 18)); \
+	c ^= b; c -= ((b << 24) | (b >> 8)); \
+}
+#define JHASH_INITVAL 0xdeadbeef
+static inline u32 jhash_3words(u32 a, u32 b, u32 c, u32 initval)
+{
+	a += JHASH_INITVAL; b += JHASH_INITVAL; c += initval;
+	__jhash_final(a, b, c);
+	return c;
+}
+static inline u32 jhash_2words(u32 a, u32 b, u32 initval) { return jhash_3words(a, b, 0, initval); }
+static inline u32 jhash_1word(u32 a, u32 initval) { return jhash_3words(a, 0, 0, initval); }
+static inline u32 jhash2(const u32 *k, u32 length, u32 initval)
+{
+	u32 a, b, c;
+	a = b = c = JHASH_INITVAL + (length << 2) + initval;
+	while(length > 3)
+	{
+		a += k[0]; b += k[1]; c += k[2];
+		__jhash_mix(a, b, c);
+		length -= 3;
+		k += 3;
+	}
+	switch(length)
+	{
+		case 3: c += k[2];
+		case 2: b += k[1];
+		case 1: a += k[0];
+			__jhash_final(a, b, c);
+		case 0:
+			break;
+	}
+	return c;
+}
+static inline u32 jhash(const void *key, u32 length, u32 initval)
+{
+	const unsigned char *k = (const unsigned char *)key;
+	u32 a, b, c;
+	a = b = c = JHASH_INITVAL + length + initval;
+	while(length > 12)
+	{
+		a += k[0] + ((u32)k[1] << 8) + ((u32)k[2] << 16) + ((u32)k[3] << 24);
+		b += k[4] + ((u32)k[5] << 8) + ((u32)k[6] << 16) + ((u32)k[7] << 24);
+		c += k[8] + ((u32)k[9] << 8) + ((u32)k[10] << 16) + ((u32)k[11] << 24);
+		__jhash_mix(a, b, c);
+		length -= 12;
+		k += 12;
+	}
+	switch(length)
+	{
+		case 12: c += (u32)k[11] << 24;
+		case 11: c += (u32)k[10] << 16;
+		case 10: c += (u32)k[9] << 8;
+		case 9:  c += k[8];
+		case 8:  b += (u32)k[7] << 24;
+		case 7:  b += (u32)k[6] << 16;
+		case 6:  b += (u32)k[5] << 8;
+		case 5:  b += k[4];
+		case 4:  a += (u32)k[3] << 24;
+		case 3:  a += (u32)k[2] << 16;
+		case 2:  a += (u32)k[1] << 8;
+		case 1:  a += k[0];
+			__jhash_final(a, b, c);
+		case 0:
+			break;
+	}
+	return c;
+}
+void sort(void *base, size_t num, size_t size, int (*cmp)(const void *, const void *), void (*swap)(void *, void *, int));
+#define get_random_bytes(buf, n)	do { memset((buf), 0x5a, (n)); } while(0)
+
+/* modules */
+struct module { int unused; };
+#define THIS_MODULE			((struct module *)0)
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_ALIAS(x)
+#define MODULE_VERSION(x)
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+#define EXPORT_SYMBOL(x)
+#define EXPORT_SYMBOL_GPL(x)
+#ifndef KSHIM_MODULE
+	#define KSHIM_MODULE module
+#endif
+#define KSHIM_CAT2(a, b)	a##b
+#define KSHIM_CAT(a, b)		KSHIM_CAT2(a, b)
+#define module_init(fn)		int KSHIM_CAT(KSHIM_MODULE, _init)(void) { return fn(); }
+#define module_exit(fn)		void KSHIM_CAT(KSHIM_MODULE, _exit)(void) { fn(); }
+
+/* sk_buff, holding a single linear packet starting at the network header */
+struct sk_buff
+{
+	unsigned int len;
+	unsigned int data_len;
+	unsigned char *head;
+	unsigned char *data;
+	unsigned int network_header;
+	unsigned int transport_header;
+	uint32_t mark;
+	void *nfct;
+	unsigned int nfctinfo;
+	char cb[48];
+};
+static inline unsigned char *skb_network_header(const struct sk_buff *skb) { return skb->head + skb->network_header; }
+static inline unsigned char *skb_transport_header(const struct sk_buff *skb) { return skb->head + skb->transport_header; }
+static inline int skb_network_offset(const struct sk_buff *skb) { return (int)(skb_network_header(skb) - skb->data); }
+static inline int skb_is_nonlinear(const struct sk_buff *skb) { return skb->data_len != 0; }
+static inline unsigned int skb_headlen(const struct sk_buff *skb) { return skb->len - skb->data_len; }
+static inline unsigned char *skb_tail_pointer(const struct sk_buff *skb) { return skb->data + skb_headlen(skb); }
+static inline int skb_linearize(struct sk_buff *skb) { skb->data_len = 0; return 0; }
+static inline struct iphdr *ip_hdr(const struct sk_buff *skb) { return (struct iphdr *)skb_network_header(skb); }
+static inline struct ipv6hdr *ipv6_hdr(const struct sk_buff *skb) { return (struct ipv6hdr *)skb_network_header(skb); }
+static inline unsigned int ip_hdrlen(const struct sk_buff *skb) { return ip_hdr(skb)->ihl * 4; }
+static inline struct tcphdr *tcp_hdr(const struct sk_buff *skb) { return (struct tcphdr *)skb_transport_header(skb); }
+struct sk_buff *skb_copy(const struct sk_buff *skb, gfp_t flags);
+void kfree_skb(struct sk_buff *skb);
+void *skb_header_pointer(const struct sk_buff *skb, int offset, int len, void *buffer);
+int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len);
+
+/* x_tables */
+struct net_device { char name[16]; };
+struct net { int unused; };
+struct sock { int unused; };
+struct xt_match;
+struct xt_action_param
+{
+	const struct xt_match *match;
+	const void *matchinfo;
+	const struct net_device *in, *out;
+	int fragoff;
+	unsigned int thoff;
+	unsigned int hooknum;
+	u_int8_t family;
+	bool hotdrop;
+};
+struct xt_mtchk_param
+{
+	struct net *net;
+	const char *table;
+	const void *entryinfo;
+	const struct xt_match *match;
+	void *matchinfo;
+	unsigned int hook_mask;
+	u_int8_t family;
+};
+struct xt_mtdtor_param
+{
+	struct net *net;
+	const struct xt_match *match;
+	void *matchinfo;
+	u_int8_t family;
+};
+struct xt_match
+{
+	struct list_head list;
+	const char name[29];
+	u_int8_t revision;
+	bool (*match)(const struct sk_buff *skb, struct xt_action_param *par);
+	int (*checkentry)(const struct xt_mtchk_param *par);
+	void (*destroy)(const struct xt_mtdtor_param *par);
+	struct module *me;
+	const char *table;
+	unsigned int matchsize;
+	unsigned int hooks;
+	unsigned short proto;
+	unsigned short family;
+};
+int xt_register_match(struct xt_match *match);
+void xt_unregister_match(struct xt_match *match);
+int xt_register_matches(struct xt_match *match, unsigned int n);
+void xt_unregister_matches(struct xt_match *match, unsigned int n);
+const struct xt_match *kshim_find_match(const char *name, unsigned short family);
+#define XT_ALIGN(s)	(((s) + (__alignof__(uint64_t) - 1)) & ~(__alignof__(uint64_t) - 1))
+
+struct nf_sockopt_ops
+{
+	struct list_head list;
+	u_int8_t pf;
+	int set_optmin;
+	int set_optmax;
+	int (*set)(struct sock *sk, int optval, void __user *user, unsigned int len);
+	int get_optmin;
+	int get_optmax;
+	int (*get)(struct sock *sk, int optval, void __user *user, int *len);
+	struct module *owner;
+};
+int nf_register_sockopt(struct nf_sockopt_ops *reg);
+void nf_unregister_sockopt(struct nf_sockopt_ops *reg);
+int kshim_getsockopt(int optval, void *buf, int *len);
+int kshim_setsockopt(int optval, void *buf, unsigned int len);
+
+/* conntrack, just enough for a per-connection lookup */
+enum ip_conntrack_info
+{
+	IP_CT_ESTABLISHED,
+	IP_CT_RELATED,
+	IP_CT_NEW,
+	IP_CT_IS_REPLY,
+	IP_CT_ESTABLISHED_REPLY = IP_CT_ESTABLISHED + IP_CT_IS_REPLY,
+	IP_CT_RELATED_REPLY = IP_CT_RELATED + IP_CT_IS_REPLY,
+	IP_CT_NUMBER = IP_CT_IS_REPLY * 2 - 1
+};
+struct nf_conn_counter
+{
+	atomic64_t packets;
+	atomic64_t bytes;
+};
+struct nf_conn
+{
+	atomic_t use;
+	u_int32_t mark;
+	unsigned long status;
+	u_int32_t id;
+	struct nf_conn *master;
+	struct nf_conn_counter acct[2];
+	struct
+	{
+		char *app_proto;
+		char *app_data;
+		unsigned int app_data_len;
+	} layer7;
+	spinlock_t lock;
+	void *tls_sni;
+	struct
+	{
+		u_int32_t request_end;
+		u_int8_t state;
+	} weburl;
+};
+extern atomic_t nf_ct_tls_sni_count;
+extern struct nf_conn nf_conntrack_untracked;
+static inline int nf_ct_is_untracked(const struct nf_conn *ct) { return ct == &nf_conntrack_untracked; }
+static inline struct nf_conn *master_ct(const struct nf_conn *ct) { return ct->master; }
+static inline struct nf_conn_counter *nf_conn_acct_find(const struct nf_conn *ct) { return (struct nf_conn_counter *)ct->acct; }
+static inline int nf_ct_l3proto_try_module_get(unsigned short l3proto) { return 0; }
+static inline void nf_ct_l3proto_module_put(unsigned short l3proto) { }
+static inline void need_conntrack(void) { }
+static inline struct nf_conn *nf_ct_get(const struct sk_buff *skb, enum ip_conntrack_info *ctinfo)
+{
+	*ctinfo = (enum ip_conntrack_info)skb->nfctinfo;
+	return (struct nf_conn *)skb->nfct;
+}
+#define IP_CT_DIR_ORIGINAL	0
+#define IP_CT_DIR_REPLY		1
+#define CTINFO2DIR(ctinfo)	((ctinfo) >= IP_CT_IS_REPLY ? 1 : 0)
+
+/* proc / seq_file */
+struct inode { void *private_data; };
+struct file { void *private_data; unsigned int f_flags; };
+struct vm_area_struct { unsigned long vm_start, vm_end, vm_pgoff, vm_flags; };
+#define VM_WRITE	0x2
+struct poll_table_struct;
+struct file_operations
+{
+	struct module *owner;
+	loff_t (*llseek)(struct file *, loff_t, int);
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+	int (*mmap)(struct file *, struct vm_area_struct *);
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+};
+struct seq_file
+{
+	char *buf;
+	size_t size;
+	size_t count;
+	loff_t index;
+	const struct seq_operations *op;
+	void *private;
+};
+struct seq_operations
+{
+	void *(*start)(struct seq_file *m, loff_t *pos);
+	void (*stop)(struct seq_file *m, void *v);
+	void *(*next)(struct seq_file *m, void *v, loff_t *pos);
+	int (*show)(struct seq_file *m, void *v);
+};
+struct proc_dir_entry { const char *name; const struct file_operations *fops; void *data; };
+struct proc_dir_entry *proc_create(const char *name, unsigned short mode, struct proc_dir_entry *parent, const struct file_operations *fops);
+struct proc_dir_entry *proc_create_data(const char *name, unsigned short mode, struct proc_dir_entry *parent, const struct file_operations *fops, void *data);
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent);
+void *PDE_DATA(const struct inode *inode);
+int seq_open(struct file *file, const struct seq_operations *op);
+int single_open(struct file *file, int (*show)(struct seq_file *, void *), void *data);
+ssize_t seq_read(struct file *file, char __user *buf, size_t size, loff_t *ppos);
+loff_t seq_lseek(struct file *file, loff_t offset, int whence);
+int seq_release(struct inode *inode, struct file *file);
+int single_release(struct inode *inode, struct file *file);
+int seq_printf(struct seq_file *m, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int seq_puts(struct seq_file *m, const char *s);
+int seq_write(struct seq_file *m, const void *data, size_t len);
+int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff);
+const struct file_operations *kshim_find_proc(const char *name);
+ssize_t simple_read_from_buffer(void __user *to, size_t count, loff_t *ppos, const void *from, size_t available);
+
+#endif /* _KSHIM_H */
@@ -0,0 +1 @@
+#include "../../../../../bandwidth/header/ipt_bandwidth.h"
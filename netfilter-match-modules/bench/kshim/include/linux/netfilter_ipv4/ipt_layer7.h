@@ -0,0 +1 @@
+#include "../../../../../layer7/header/ipt_layer7.h"
@@ -0,0 +1 @@
+#include "../../../../../timerange/header/ipt_timerange.h"
@@ -0,0 +1 @@
+#include "../../../../../webmon/header/ipt_webmon.h"
@@ -0,0 +1 @@
+#include "../../../../../weburl/header/ipt_weburl.h"
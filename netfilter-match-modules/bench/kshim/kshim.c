@@ -0,0 +1,671 @@
+/*  kshim --	runtime half of the userspace kernel API stand-ins */
+
+#include "kshim.h"
+
+int kshim_quiet = 0;
+unsigned long kshim_alloc_count = 0;
+unsigned long kshim_free_count = 0;
+unsigned long kshim_lock_count = 0;
+int kshim_lock_timing = 0;
+unsigned long long kshim_lock_hold_ns = 0;
+int kshim_nr_cpus = 1;
+int kshim_cpu = 0;
+unsigned long volatile jiffies = 0;
+time_t kshim_now = 1262304000; /* 2010-01-01 00:00:00 UTC */
+struct timezone sys_tz = { 0, 0 };
+atomic_t nf_ct_tls_sni_count = { 0 };
+struct nf_conn nf_conntrack_untracked;
+
+int printk(const char *fmt, ...)
+{
+	int ret = 0;
+	if(!kshim_quiet)
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		ret = vfprintf(stderr, fmt, ap);
+		va_end(ap);
+	}
+	return ret;
+}
+
+void *kmalloc(size_t size, gfp_t flags)
+{
+	void *p = malloc(size == 0 ? 1 : size);
+	if(p != NULL)
+	{
+		kshim_alloc_count++;
+		if(flags & __GFP_ZERO)
+		{
+			memset(p, 0, size);
+		}
+	}
+	return p;
+}
+void *kzalloc(size_t size, gfp_t flags)
+{
+	return kmalloc(size, flags | __GFP_ZERO);
+}
+void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	return kzalloc(n * size, flags);
+}
+void kfree(const void *p)
+{
+	if(p != NULL)
+	{
+		kshim_free_count++;
+		free((void *)p);
+	}
+}
+void *vmalloc(unsigned long size) { return kmalloc(size, GFP_KERNEL); }
+void *vzalloc(unsigned long size) { return kzalloc(size, GFP_KERNEL); }
+void *vmalloc_user(unsigned long size) { return kzalloc(PAGE_ALIGN(size), GFP_KERNEL); }
+void vfree(const void *p) { kfree(p); }
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, unsigned long flags, void (*ctor)(void *))
+{
+	struct kmem_cache *cache = kzalloc(sizeof(struct kmem_cache), GFP_KERNEL);
+	if(cache != NULL)
+	{
+		cache->name = name;
+		cache->size = size;
+	}
+	return cache;
+}
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	if(cache != NULL && cache->in_use != 0)
+	{
+		printk("kshim: kmem_cache %s destroyed with %lu objects in use\n", cache->name, cache->in_use);
+	}
+	kfree(cache);
+}
+void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
+{
+	void *p = kmalloc(cache->size, flags);
+	if(p != NULL)
+	{
+		cache->in_use++;
+	}
+	return p;
+}
+void *kmem_cache_zalloc(struct kmem_cache *cache, gfp_t flags)
+{
+	return kmem_cache_alloc(cache, flags | __GFP_ZERO);
+}
+void kmem_cache_free(struct kmem_cache *cache, void *p)
+{
+	if(p != NULL)
+	{
+		cache->in_use--;
+		kfree(p);
+	}
+}
+
+static int kshim_locks_held = 0;
+static struct timespec kshim_hold_start;
+void kshim_lock(int *l)
+{
+	if(*l)
+	{
+		fprintf(stderr, "kshim: deadlock, lock %p already held\n", (void *)l);
+		abort();
+	}
+	*l = 1;
+	kshim_lock_count++;
+	if(kshim_locks_held++ == 0 && kshim_lock_timing)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &kshim_hold_start);
+	}
+}
+void kshim_unlock(int *l)
+{
+	if(!*l)
+	{
+		fprintf(stderr, "kshim: unlocking lock %p that is not held\n", (void *)l);
+		abort();
+	}
+	*l = 0;
+	if(--kshim_locks_held == 0 && kshim_lock_timing)
+	{
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		kshim_lock_hold_ns += (unsigned long long)((end.tv_sec - kshim_hold_start.tv_sec) * NSEC_PER_SEC + (end.tv_nsec - kshim_hold_start.tv_nsec));
+	}
+}
+int kshim_trylock(int *l)
+{
+	if(*l)
+	{
+		return 0;
+	}
+	kshim_lock(l);
+	return 1;
+}
+
+void down(struct semaphore *s)
+{
+	if(s->count <= 0)
+	{
+		fprintf(stderr, "kshim: deadlock, semaphore %p already taken\n", (void *)s);
+		abort();
+	}
+	s->count--;
+}
+int down_trylock(struct semaphore *s)
+{
+	if(s->count <= 0)
+	{
+		return 1;
+	}
+	s->count--;
+	return 0;
+}
+int down_interruptible(struct semaphore *s)
+{
+	down(s);
+	return 0;
+}
+int down_timeout(struct semaphore *s, long j)
+{
+	return down_trylock(s) ? -ETIME : 0;
+}
+void up(struct semaphore *s)
+{
+	s->count++;
+}
+
+static struct work_struct *pending_work = NULL;
+static struct timer_list *pending_timers = NULL;
+static int queue_pending_work(struct work_struct *work, unsigned long expires)
+{
+	if(work->pending)
+	{
+		return 0;
+	}
+	work->expires = expires;
+	work->pending = 1;
+	work->next_pending = pending_work;
+	pending_work = work;
+	return 1;
+}
+int schedule_work(struct work_struct *work)
+{
+	return queue_pending_work(work, jiffies);
+}
+int schedule_delayed_work(struct delayed_work *work, unsigned long delay)
+{
+	return queue_pending_work(&work->work, jiffies + delay);
+}
+int queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	return schedule_work(work);
+}
+int queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *work, unsigned long delay)
+{
+	return schedule_delayed_work(work, delay);
+}
+static int unlink_work(struct work_struct *work)
+{
+	struct work_struct **w;
+	for(w = &pending_work; *w != NULL; w = &((*w)->next_pending))
+	{
+		if(*w == work)
+		{
+			*w = work->next_pending;
+			work->pending = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+int cancel_work_sync(struct work_struct *work)
+{
+	return unlink_work(work);
+}
+int cancel_delayed_work(struct delayed_work *work)
+{
+	return unlink_work(&work->work);
+}
+int cancel_delayed_work_sync(struct delayed_work *work)
+{
+	return unlink_work(&work->work);
+}
+/* nothing runs concurrently here, so flushing just runs pending work now */
+int flush_delayed_work(struct delayed_work *work)
+{
+	if(!unlink_work(&work->work))
+	{
+		return 0;
+	}
+	work->work.func(&work->work);
+	return 1;
+}
+void flush_scheduled_work(void)
+{
+	kshim_run_work();
+}
+void setup_timer(struct timer_list *timer, void (*function)(unsigned long), unsigned long data)
+{
+	timer->function = function;
+	timer->data = data;
+	timer->pending = 0;
+	timer->next_pending = NULL;
+}
+int mod_timer(struct timer_list *timer, unsigned long expires)
+{
+	timer->expires = expires;
+	if(timer->pending)
+	{
+		return 1;
+	}
+	timer->pending = 1;
+	timer->next_pending = pending_timers;
+	pending_timers = timer;
+	return 0;
+}
+int del_timer_sync(struct timer_list *timer)
+{
+	struct timer_list **t;
+	for(t = &pending_timers; *t != NULL; t = &((*t)->next_pending))
+	{
+		if(*t == timer)
+		{
+			*t = timer->next_pending;
+			timer->pending = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* run every work item / timer that has come due, including ones re-armed while running */
+void kshim_run_work(void)
+{
+	int ran = 1;
+	while(ran)
+	{
+		struct work_struct **w;
+		struct timer_list **t;
+		ran = 0;
+		for(w = &pending_work; *w != NULL; w = &((*w)->next_pending))
+		{
+			struct work_struct *work = *w;
+			if(time_after_eq(jiffies, work->expires))
+			{
+				*w = work->next_pending;
+				work->pending = 0;
+				work->func(work);
+				ran = 1;
+				break;
+			}
+		}
+		for(t = &pending_timers; ran == 0 && *t != NULL; t = &((*t)->next_pending))
+		{
+			struct timer_list *timer = *t;
+			if(time_after_eq(jiffies, timer->expires))
+			{
+				*t = timer->next_pending;
+				timer->pending = 0;
+				timer->function(timer->data);
+				ran = 1;
+				break;
+			}
+		}
+	}
+}
+
+void sort(void *base, size_t num, size_t size, int (*cmp)(const void *, const void *), void (*swap)(void *, void *, int))
+{
+	qsort(base, num, size, cmp);
+}
+
+struct sk_buff *skb_copy(const struct sk_buff *skb, gfp_t flags)
+{
+	struct sk_buff *copy = kmalloc(sizeof(struct sk_buff), flags);
+	if(copy != NULL)
+	{
+		*copy = *skb;
+		copy->head = kmalloc(skb->network_header + skb->len, flags);
+		if(copy->head == NULL)
+		{
+			kfree(copy);
+			return NULL;
+		}
+		memcpy(copy->head, skb->head, skb->network_header + skb->len);
+		copy->data = copy->head + (skb->data - skb->head);
+		copy->data_len = 0;
+	}
+	return copy;
+}
+void kfree_skb(struct sk_buff *skb)
+{
+	if(skb != NULL)
+	{
+		kfree(skb->head);
+		kfree(skb);
+	}
+}
+void *skb_header_pointer(const struct sk_buff *skb, int offset, int len, void *buffer)
+{
+	if(offset < 0 || len < 0 || (unsigned int)(offset + len) > skb->len)
+	{
+		return NULL;
+	}
+	if((unsigned int)(offset + len) <= skb_headlen(skb))
+	{
+		return skb->data + offset;
+	}
+	memcpy(buffer, skb->data + offset, len);
+	return buffer;
+}
+int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
+{
+	if(offset < 0 || len < 0 || (unsigned int)(offset + len) > skb->len)
+	{
+		return -EFAULT;
+	}
+	memcpy(to, skb->data + offset, len);
+	return 0;
+}
+
+#define KSHIM_MAX_REGISTERED 32
+static struct xt_match *registered_matches[KSHIM_MAX_REGISTERED];
+static struct nf_sockopt_ops *registered_sockopts[KSHIM_MAX_REGISTERED];
+static struct
+{
+	const char *name;
+	const struct file_operations *fops;
+	void *data;
+} registered_proc[KSHIM_MAX_REGISTERED];
+
+int xt_register_match(struct xt_match *match)
+{
+	int i;
+	for(i = 0; i < KSHIM_MAX_REGISTERED; i++)
+	{
+		if(registered_matches[i] == NULL)
+		{
+			registered_matches[i] = match;
+			return 0;
+		}
+	}
+	return -ENOMEM;
+}
+void xt_unregister_match(struct xt_match *match)
+{
+	int i;
+	for(i = 0; i < KSHIM_MAX_REGISTERED; i++)
+	{
+		if(registered_matches[i] == match)
+		{
+			registered_matches[i] = NULL;
+		}
+	}
+}
+int xt_register_matches(struct xt_match *match, unsigned int n)
+{
+	unsigned int i;
+	for(i = 0; i < n; i++)
+	{
+		int ret = xt_register_match(match + i);
+		if(ret != 0)
+		{
+			return ret;
+		}
+	}
+	return 0;
+}
+void xt_unregister_matches(struct xt_match *match, unsigned int n)
+{
+	unsigned int i;
+	for(i = 0; i < n; i++)
+	{
+		xt_unregister_match(match + i);
+	}
+}
+const struct xt_match *kshim_find_match(const char *name, unsigned short family)
+{
+	int i;
+	for(i = 0; i < KSHIM_MAX_REGISTERED; i++)
+	{
+		struct xt_match *m = registered_matches[i];
+		if(m != NULL && strcmp(m->name, name) == 0 && (m->family == family || m->family == NFPROTO_UNSPEC))
+		{
+			return m;
+		}
+	}
+	return NULL;
+}
+
+int nf_register_sockopt(struct nf_sockopt_ops *reg)
+{
+	int i;
+	for(i = 0; i < KSHIM_MAX_REGISTERED; i++)
+	{
+		if(registered_sockopts[i] == NULL)
+		{
+			registered_sockopts[i] = reg;
+			return 0;
+		}
+	}
+	return -ENOMEM;
+}
+void nf_unregister_sockopt(struct nf_sockopt_ops *reg)
+{
+	int i;
+	for(i = 0; i < KSHIM_MAX_REGISTERED; i++)
+	{
+		if(registered_sockopts[i] == reg)
+		{
+			registered_sockopts[i] = NULL;
+		}
+	}
+}
+int kshim_getsockopt(int optval, void *buf, int *len)
+{
+	int i;
+	for(i = 0; i < KSHIM_MAX_REGISTERED; i++)
+	{
+		struct nf_sockopt_ops *ops = registered_sockopts[i];
+		if(ops != NULL && ops->get != NULL && optval >= ops->get_optmin && optval < ops->get_optmax)
+		{
+			return ops->get(NULL, optval, buf, len);
+		}
+	}
+	return -ENOPROTOOPT;
+}
+int kshim_setsockopt(int optval, void *buf, unsigned int len)
+{
+	int i;
+	for(i = 0; i < KSHIM_MAX_REGISTERED; i++)
+	{
+		struct nf_sockopt_ops *ops = registered_sockopts[i];
+		if(ops != NULL && ops->set != NULL && optval >= ops->set_optmin && optval < ops->set_optmax)
+		{
+			return ops->set(NULL, optval, buf, len);
+		}
+	}
+	return -ENOPROTOOPT;
+}
+
+static struct proc_dir_entry kshim_pde;
+struct proc_dir_entry *proc_create_data(const char *name, unsigned short mode, struct proc_dir_entry *parent, const struct file_operations *fops, void *data)
+{
+	int i;
+	for(i = 0; i < KSHIM_MAX_REGISTERED; i++)
+	{
+		if(registered_proc[i].name == NULL)
+		{
+			registered_proc[i].name = name;
+			registered_proc[i].fops = fops;
+			registered_proc[i].data = data;
+			return &kshim_pde;
+		}
+	}
+	return NULL;
+}
+struct proc_dir_entry *proc_create(const char *name, unsigned short mode, struct proc_dir_entry *parent, const struct file_operations *fops)
+{
+	return proc_create_data(name, mode, parent, fops, NULL);
+}
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent)
+{
+	int i;
+	for(i = 0; i < KSHIM_MAX_REGISTERED; i++)
+	{
+		if(registered_proc[i].name != NULL && strcmp(registered_proc[i].name, name) == 0)
+		{
+			registered_proc[i].name = NULL;
+		}
+	}
+}
+void *PDE_DATA(const struct inode *inode)
+{
+	return inode->private_data;
+}
+const struct file_operations *kshim_find_proc(const char *name)
+{
+	int i;
+	for(i = 0; i < KSHIM_MAX_REGISTERED; i++)
+	{
+		if(registered_proc[i].name != NULL && strcmp(registered_proc[i].name, name) == 0)
+		{
+			return registered_proc[i].fops;
+		}
+	}
+	return NULL;
+}
+
+int seq_open(struct file *file, const struct seq_operations *op)
+{
+	struct seq_file *m = kzalloc(sizeof(struct seq_file), GFP_KERNEL);
+	if(m == NULL)
+	{
+		return -ENOMEM;
+	}
+	m->op = op;
+	file->private_data = m;
+	return 0;
+}
+static int single_show_start_done = 0;
+static int (*single_show_fn)(struct seq_file *, void *);
+static void *single_start(struct seq_file *m, loff_t *pos) { return *pos == 0 ? (void *)1 : NULL; }
+static void *single_next(struct seq_file *m, void *v, loff_t *pos) { ++*pos; return NULL; }
+static void single_stop(struct seq_file *m, void *v) { }
+static int single_show(struct seq_file *m, void *v) { return single_show_fn(m, v); }
+static const struct seq_operations single_ops = { single_start, single_stop, single_next, single_show };
+int single_open(struct file *file, int (*show)(struct seq_file *, void *), void *data)
+{
+	int ret;
+	single_show_fn = show;
+	single_show_start_done = 0;
+	ret = seq_open(file, &single_ops);
+	if(ret == 0)
+	{
+		((struct seq_file *)file->private_data)->private = data;
+	}
+	return ret;
+}
+ssize_t seq_read(struct file *file, char __user *buf, size_t size, loff_t *ppos)
+{
+	/* render everything on the first read, then hand it out in pieces */
+	struct seq_file *m = (struct seq_file *)file->private_data;
+	size_t avail;
+	if(m->buf == NULL)
+	{
+		loff_t pos = 0;
+		void *v;
+		m->size = 1 << 20;
+		m->buf = kmalloc(m->size, GFP_KERNEL);
+		m->count = 0;
+		v = m->op->start(m, &pos);
+		while(v != NULL)
+		{
+			m->op->show(m, v);
+			v = m->op->next(m, v, &pos);
+		}
+		m->op->stop(m, v);
+	}
+	avail = m->count > (size_t)*ppos ? m->count - (size_t)*ppos : 0;
+	size = size < avail ? size : avail;
+	memcpy(buf, m->buf + *ppos, size);
+	*ppos += size;
+	return (ssize_t)size;
+}
+loff_t seq_lseek(struct file *file, loff_t offset, int whence)
+{
+	return offset;
+}
+int seq_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = (struct seq_file *)file->private_data;
+	if(m != NULL)
+	{
+		kfree(m->buf);
+		kfree(m);
+	}
+	return 0;
+}
+int single_release(struct inode *inode, struct file *file)
+{
+	return seq_release(inode, file);
+}
+int seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+	va_start(ap, fmt);
+	n = vsnprintf(m->buf + m->count, m->size - m->count, fmt, ap);
+	va_end(ap);
+	if(n > 0 && m->count + n < m->size)
+	{
+		m->count += n;
+		return 0;
+	}
+	return -1;
+}
+int seq_puts(struct seq_file *m, const char *s)
+{
+	return seq_write(m, s, strlen(s));
+}
+int seq_write(struct seq_file *m, const void *data, size_t len)
+{
+	if(m->count + len < m->size)
+	{
+		memcpy(m->buf + m->count, data, len);
+		m->count += len;
+		return 0;
+	}
+	return -1;
+}
+int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff)
+{
+	return 0;
+}
+ssize_t simple_read_from_buffer(void __user *to, size_t count, loff_t *ppos, const void *from, size_t available)
+{
+	loff_t pos = *ppos;
+	if(pos < 0)
+	{
+		return -EINVAL;
+	}
+	if((size_t)pos >= available || count == 0)
+	{
+		return 0;
+	}
+	if(count > available - (size_t)pos)
+	{
+		count = available - (size_t)pos;
+	}
+	memcpy(to, (const char *)from + pos, count);
+	*ppos = pos + count;
+	return (ssize_t)count;
+}
+
+struct task_struct kshim_current = { 100, 100 };
+void down_read(struct rw_semaphore *s) { if(s->count < 0) { fprintf(stderr, "down_read while write locked\n"); abort(); } s->count++; }
+void up_read(struct rw_semaphore *s) { s->count--; }
+void down_write(struct rw_semaphore *s) { if(s->count != 0) { fprintf(stderr, "down_write while locked\n"); abort(); } s->count = -1; }
+void up_write(struct rw_semaphore *s) { s->count = 0; }
@@ -0,0 +1,884 @@
+/*  mbench --	userspace microbenchmark for the Gargoyle netfilter match modules
+ *
+ *  Runs a module's checkentry/match/destroy against synthetic traffic or a
+ *  capture file (classic pcap, not pcapng) and reports, per rule scenario:
+ *
+ *  	ns/pkt		wall clock time spent in match(), per packet
+ *  	allocs/pkt	kmalloc/kmem_cache_alloc/vmalloc calls made by match()
+ *  	frees/pkt	the matching kfree/kmem_cache_free/vfree calls
+ *  	locks/pkt	spinlock/rwlock/mutex acquisitions made by match()
+ *  	lock-ns/pkt	time match() spent with at least one lock held (-l only,
+ *  			timing the locks adds a little to ns/pkt)
+ *
+ *  The harness is single threaded, so locks are counted and timed but never
+ *  contended. Multiple cpus (-C) are simulated by switching the cpu the
+ *  per-cpu data is taken from by flow, the way RSS would spread flows.
+ *  Deferred work (e.g. bandwidth resets) runs between packets as the virtual
+ *  clock advances, and work queued without a delay also runs between batches
+ *  of BENCH_BATCH packets, the way a worker thread gets to run between
+ *  softirq polls.  Neither is included in any of the numbers.
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include <unistd.h>
+
+typedef struct bench_packet_struct
+{
+	struct sk_buff skb;
+	uint32_t flow;
+	unsigned char reply;
+	time_t ts; /* seconds since start of one pass over all packets */
+} bench_packet;
+
+static bench_packet* packets = NULL;
+static unsigned long num_packets = 0;
+static struct nf_conn* flows = NULL;
+static uint32_t num_flows = 0;
+static time_t pass_length = 1;
+
+#define BENCH_BATCH 64 /* packets per timed batch, the usual NAPI poll budget */
+static unsigned int linear_length = 0; /* 0 = all linear */
+
+static void usage(const char* prog)
+{
+	const bench_scenario* s;
+	printf("usage: %s [options]\n", prog);
+	printf("  -s SCENARIO   only run this scenario (default all)\n");
+	printf("  -r FILE       replay IPv4 packets from a pcap file instead of synthetic traffic\n");
+	printf("  -p PACKETS    packets to match per scenario (default 1000000)\n");
+	printf("  -n PACKETS    distinct synthetic packets to generate (default 4096)\n");
+	printf("  -f FLOWS      synthetic flows (default 256)\n");
+	printf("  -H HOSTS      synthetic local hosts, at most 250 (default 64)\n");
+	printf("  -t RATE       synthetic packets per second of virtual time (default 10000)\n");
+	printf("  -C CPUS       simulated cpus, at most %d (default 1)\n", NR_CPUS);
+	printf("  -L BYTES      leave only the first BYTES of each packet linear, the rest as\n");
+	printf("                paged data the way GRO/scatter-gather would (default all linear)\n");
+	printf("  -l            time lock holds\n");
+	printf("  -v            show module printk output\n");
+	printf("scenarios for %s:\n", mbench_module.match_name);
+	for(s = mbench_module.scenarios; s->name != NULL; s++)
+	{
+		printf("  %-12s  %s\n", s->name, s->description);
+	}
+}
+
+static double elapsed_ns(struct timespec* start, struct timespec* end)
+{
+	return (double)(end->tv_sec - start->tv_sec) * NSEC_PER_SEC + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void put16(unsigned char* p, uint16_t v)
+{
+	p[0] = (unsigned char)(v >> 8);
+	p[1] = (unsigned char)(v & 0xFF);
+}
+
+static void put24(unsigned char* p, uint32_t v)
+{
+	p[0] = (unsigned char)((v >> 16) & 0xFF);
+	put16(p+1, (uint16_t)(v & 0xFFFF));
+}
+
+static void add_packet(const unsigned char* ip_packet, unsigned int length, unsigned int captured, uint32_t flow, unsigned char reply, time_t ts)
+{
+	bench_packet* p;
+	unsigned char* data;
+	if(num_packets % 1024 == 0)
+	{
+		packets = (bench_packet*)realloc(packets, (num_packets + 1024) * sizeof(bench_packet));
+		if(packets == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+
+	/*
+	 * modules trust the ip total length, so truncated captures are zero padded
+	 * out to it, and a little extra covers the fixed size header reads
+	 */
+	data = (unsigned char*)calloc(1, (length > captured ? length : captured) + 64);
+	if(data == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memcpy(data, ip_packet, captured);
+
+	p = packets + num_packets;
+	memset(p, 0, sizeof(bench_packet));
+	p->skb.head = data;
+	p->skb.data = data;
+	p->skb.len = length;
+	p->skb.data_len = linear_length > 0 && length > linear_length ? length - linear_length : 0;
+	p->skb.network_header = 0;
+	p->skb.transport_header = ((struct iphdr*)data)->ihl * 4;
+	p->flow = flow;
+	p->reply = reply;
+	p->ts = ts;
+	num_packets++;
+}
+
+static unsigned int build_ipv4(unsigned char* buf, uint32_t src, uint32_t dst, unsigned char protocol, uint16_t sport, uint16_t dport, uint32_t tcp_seq, const unsigned char* payload, unsigned int payload_length)
+{
+	struct iphdr* iph = (struct iphdr*)buf;
+	unsigned int header_length = protocol == IPPROTO_TCP ? 20 : 8;
+	unsigned int length = 20 + header_length + payload_length;
+
+	memset(buf, 0, 20 + header_length);
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->tot_len = htons((uint16_t)length);
+	iph->ttl = 64;
+	iph->protocol = protocol;
+	iph->saddr = src;
+	iph->daddr = dst;
+	if(protocol == IPPROTO_TCP)
+	{
+		struct tcphdr* tcph = (struct tcphdr*)(buf + 20);
+		tcph->source = htons(sport);
+		tcph->dest = htons(dport);
+		tcph->seq = htonl(tcp_seq);
+		tcph->doff = 5;
+		tcph->ack = 1;
+		tcph->psh = payload_length > 0 ? 1 : 0;
+		tcph->window = htons(65535);
+	}
+	else
+	{
+		struct udphdr* udph = (struct udphdr*)(buf + 20);
+		udph->source = htons(sport);
+		udph->dest = htons(dport);
+		udph->len = htons((uint16_t)(8 + payload_length));
+	}
+	memcpy(buf + 20 + header_length, payload, payload_length);
+	return length;
+}
+
+static unsigned int build_http_request(unsigned char* buf, uint32_t flow, uint32_t seq)
+{
+	static const char* domains[] = { "www.google.com", "www.example.com", "www.bing.com", "cdn.example.net", "search.yahoo.com", "news.example.org", "www.facebook.com", "duckduckgo.com" };
+	const char* domain = domains[(flow/4) % (sizeof(domains)/sizeof(domains[0]))];
+	char path[128];
+	if(strstr(domain, "yahoo.") != NULL)
+	{
+		sprintf(path, "/search?p=term+%u&fr=yfp", flow + seq);
+	}
+	else if(strstr(domain, "example") != NULL || strstr(domain, "facebook") != NULL)
+	{
+		sprintf(path, "/static/%u/img/%u.png", flow, seq);
+	}
+	else
+	{
+		sprintf(path, "/search?q=term+%u&ie=utf-8", flow + seq);
+	}
+	return (unsigned int)sprintf((char*)buf,
+		"GET %s HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:60.0) Gecko/20100101 Firefox/60.0\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Connection: keep-alive\r\n"
+		"\r\n",
+		path, domain);
+}
+
+static unsigned int build_http_response(unsigned char* buf, unsigned int length)
+{
+	unsigned int header_length = (unsigned int)sprintf((char*)buf,
+		"HTTP/1.1 200 OK\r\n"
+		"Date: Fri, 01 Jan 2010 00:00:00 GMT\r\n"
+		"Content-Type: text/html; charset=UTF-8\r\n"
+		"Content-Length: 48213\r\n"
+		"Connection: keep-alive\r\n"
+		"\r\n"
+		"<!DOCTYPE html><html><head><title>bench</title></head><body>");
+	memset(buf + header_length, 'x', length - header_length);
+	return length;
+}
+
+static unsigned int build_client_hello(unsigned char* buf, uint32_t flow)
+{
+	static const char* names[] = { "www.google.com", "mail.example.com", "www.facebook.com", "api.example.net", "www.youtube.com", "static.example.org" };
+	const char* name = names[(flow/4) % (sizeof(names)/sizeof(names[0]))];
+	unsigned int name_length = strlen(name);
+	unsigned int pos = 0;
+	unsigned int extensions_start;
+	int i;
+
+	buf[pos++] = 0x16; /* handshake record */
+	buf[pos++] = 0x03;
+	buf[pos++] = 0x01;
+	pos += 2;          /* record length */
+	buf[pos++] = 0x01; /* client hello */
+	pos += 3;          /* handshake length */
+	buf[pos++] = 0x03;
+	buf[pos++] = 0x03;
+	for(i = 0; i < 32; i++)
+	{
+		buf[pos++] = (unsigned char)(flow * 31 + i);
+	}
+	buf[pos++] = 32; /* session id */
+	for(i = 0; i < 32; i++)
+	{
+		buf[pos++] = (unsigned char)(flow * 17 + i);
+	}
+	put16(buf + pos, 16*2);
+	pos += 2;
+	for(i = 0; i < 16; i++)
+	{
+		put16(buf + pos, (uint16_t)(0xC02B + i));
+		pos += 2;
+	}
+	buf[pos++] = 1; /* compression methods */
+	buf[pos++] = 0;
+
+	pos += 2; /* extensions length */
+	extensions_start = pos;
+	put16(buf + pos, 0x0000); /* server name */
+	put16(buf + pos + 2, (uint16_t)(name_length + 5));
+	put16(buf + pos + 4, (uint16_t)(name_length + 3));
+	buf[pos + 6] = 0;
+	put16(buf + pos + 7, (uint16_t)name_length);
+	memcpy(buf + pos + 9, name, name_length);
+	pos += 9 + name_length;
+	put16(buf + pos, 0x000A); /* supported groups */
+	put16(buf + pos + 2, 8);
+	put16(buf + pos + 4, 6);
+	put16(buf + pos + 6, 0x001D);
+	put16(buf + pos + 8, 0x0017);
+	put16(buf + pos + 10, 0x0018);
+	pos += 12;
+	put16(buf + pos, 0x0010); /* alpn */
+	put16(buf + pos + 2, 14);
+	put16(buf + pos + 4, 12);
+	memcpy(buf + pos + 6, "\x02h2\x08http/1.1", 12);
+	pos += 18;
+
+	put16(buf + extensions_start - 2, (uint16_t)(pos - extensions_start));
+	put16(buf + 3, (uint16_t)(pos - 5));
+	put24(buf + 6, pos - 9);
+	return pos;
+}
+
+static unsigned int build_dns(unsigned char* buf, uint32_t flow, int reply)
+{
+	unsigned int pos = 12;
+	memset(buf, 0, 12);
+	put16(buf, (uint16_t)flow);
+	put16(buf + 2, reply ? 0x8180 : 0x0100);
+	put16(buf + 4, 1);
+	pos += (unsigned int)sprintf((char*)buf + pos, "%chost%05u%cexample%ccom", 9, flow % 100000, 7, 3) + 1;
+	put16(buf + pos, 1);
+	put16(buf + pos + 2, 1);
+	return pos + 4;
+}
+
+/*
+ * Builds count packets over num_synthetic_flows flows from num_hosts local
+ * hosts. Flows are (by flow number % 4) HTTP, HTTPS, bulk TCP and DNS, and
+ * alternate between the request and reply direction, so every flow starts
+ * with a request the web and layer7 modules can classify, followed by
+ * replies, further requests and pure ACKs.  TCP sequence numbers count the
+ * bytes each side has sent.
+ */
+static void generate_traffic(unsigned long count, uint32_t num_synthetic_flows, uint32_t num_hosts, unsigned long rate)
+{
+	unsigned char payload[1500];
+	unsigned char packet[1600];
+	uint32_t local_base = ntohl(inet_addr(BENCH_LOCAL_SUBNET));
+	unsigned long index;
+	uint32_t* tcp_seqs = (uint32_t*)calloc(num_synthetic_flows * 2, sizeof(uint32_t));
+
+	if(tcp_seqs == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	num_flows = num_synthetic_flows;
+	for(index = 0; index < count; index++)
+	{
+		uint32_t flow = (uint32_t)(index % num_flows);
+		uint32_t seq = (uint32_t)(index / num_flows);
+		uint32_t local_ip = htonl(local_base + 2 + (flow % num_hosts));
+		uint32_t remote_ip = htonl(0x5D000000 | ((flow * 40503) & 0x00FFFFFF));
+		uint16_t local_port = (uint16_t)(32768 + (flow % 28000));
+		unsigned char reply = (unsigned char)(seq % 2);
+		unsigned char protocol = IPPROTO_TCP;
+		uint16_t remote_port;
+		unsigned int payload_length;
+		unsigned int length;
+
+		switch(flow % 4)
+		{
+			case 0:
+				remote_port = 80;
+				if(reply)
+				{
+					payload_length = build_http_response(payload, 1400);
+				}
+				else
+				{
+					payload_length = seq % 4 == 0 ? build_http_request(payload, flow, seq) : 0;
+				}
+				break;
+			case 1:
+				remote_port = 443;
+				if(reply)
+				{
+					/* server hello (a handshake record) first, then application data records */
+					payload_length = 1400;
+					memset(payload, 0x17, payload_length);
+					if(seq == 1)
+					{
+						payload[0] = 0x16;
+						payload[5] = 0x02;
+					}
+					payload[1] = 0x03;
+					payload[2] = 0x03;
+				}
+				else
+				{
+					payload_length = seq == 0 ? build_client_hello(payload, flow) : 0;
+				}
+				break;
+			case 2:
+				remote_port = 8443;
+				payload_length = reply ? 1400 : (seq % 4 == 0 ? 200 : 0);
+				memset(payload, (int)(flow & 0xFF), payload_length);
+				break;
+			default:
+				protocol = IPPROTO_UDP;
+				remote_port = 53;
+				payload_length = build_dns(payload, flow, reply);
+				break;
+		}
+		if(reply)
+		{
+			length = build_ipv4(packet, remote_ip, local_ip, protocol, remote_port, local_port, tcp_seqs[flow*2 + 1], payload, payload_length);
+		}
+		else
+		{
+			length = build_ipv4(packet, local_ip, remote_ip, protocol, local_port, remote_port, tcp_seqs[flow*2], payload, payload_length);
+		}
+		tcp_seqs[flow*2 + reply] += payload_length;
+		add_packet(packet, length, length, flow, reply, (time_t)(index / rate));
+	}
+	pass_length = (time_t)(count / rate) + 1;
+	free(tcp_seqs);
+}
+
+typedef struct flow_key_struct
+{
+	uint32_t ip1;
+	uint32_t ip2;
+	uint16_t port1;
+	uint16_t port2;
+	uint32_t protocol;
+} flow_key;
+
+/*
+ * Loads every IPv4 packet of a classic pcap file, with ethernet, raw ip or
+ * linux cooked framing. Packets are grouped into flows by protocol, addresses
+ * and ports, with the first packet seen deciding which direction is the reply.
+ */
+static int load_pcap(const char* path)
+{
+	FILE* in = fopen(path, "rb");
+	unsigned char header[24];
+	unsigned char record[16];
+	unsigned char* frame = NULL;
+	uint32_t magic, link_type;
+	int swapped, nanoseconds;
+	long first_sec = -1;
+	long last_sec = 0;
+	unsigned long skipped = 0;
+	flow_key* keys = NULL;
+	uint32_t* key_flows = NULL;
+	uint32_t table_size = 0;
+
+	if(in == NULL)
+	{
+		fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if(fread(header, 1, 24, in) != 24)
+	{
+		fprintf(stderr, "%s: not a pcap file\n", path);
+		fclose(in);
+		return -1;
+	}
+	magic = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+	swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+	nanoseconds = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+	if(!swapped && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d)
+	{
+		fprintf(stderr, "%s: not a classic pcap file (pcapng captures need converting with editcap -F pcap)\n", path);
+		fclose(in);
+		return -1;
+	}
+	#define PCAP_U32(p) (swapped ? (((uint32_t)(p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3]) : ((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((uint32_t)(p)[3] << 24)))
+	link_type = PCAP_U32(header + 20);
+	if(link_type != 1 && link_type != 101 && link_type != 113 && link_type != 228)
+	{
+		fprintf(stderr, "%s: unsupported link type %u\n", path, link_type);
+		fclose(in);
+		return -1;
+	}
+	(void)nanoseconds; /* only whole seconds are used */
+
+	while(fread(record, 1, 16, in) == 16)
+	{
+		long sec = (long)PCAP_U32(record);
+		uint32_t captured = PCAP_U32(record + 8);
+		unsigned char* ip;
+		unsigned int offset = 0;
+		unsigned int ip_length;
+		unsigned int ip_captured;
+		struct iphdr* iph;
+		flow_key key;
+		uint32_t hash, slot;
+		unsigned char reply = 0;
+
+		frame = (unsigned char*)realloc(frame, captured + 1);
+		if(frame == NULL || fread(frame, 1, captured, in) != captured)
+		{
+			break;
+		}
+		if(link_type == 1)
+		{
+			uint16_t ether_type = captured >= 14 ? (uint16_t)((frame[12] << 8) | frame[13]) : 0;
+			offset = 14;
+			while(ether_type == 0x8100 && captured >= offset + 4)
+			{
+				ether_type = (uint16_t)((frame[offset+2] << 8) | frame[offset+3]);
+				offset = offset + 4;
+			}
+			if(ether_type != 0x0800)
+			{
+				skipped++;
+				continue;
+			}
+		}
+		else if(link_type == 113)
+		{
+			offset = 16;
+		}
+		if(captured < offset + 20 || (frame[offset] >> 4) != 4)
+		{
+			skipped++;
+			continue;
+		}
+		ip = frame + offset;
+		iph = (struct iphdr*)ip;
+		ip_captured = captured - offset;
+		ip_length = ntohs(iph->tot_len);
+		if(ip_length < iph->ihl * 4 || ip_captured < iph->ihl * 4 + 4)
+		{
+			skipped++;
+			continue;
+		}
+		ip_captured = ip_captured < ip_length ? ip_captured : ip_length;
+
+		memset(&key, 0, sizeof(key));
+		key.protocol = iph->protocol;
+		key.ip1 = iph->saddr;
+		key.ip2 = iph->daddr;
+		if(iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP)
+		{
+			key.port1 = *(uint16_t*)(ip + iph->ihl*4);
+			key.port2 = *(uint16_t*)(ip + iph->ihl*4 + 2);
+		}
+		if(key.ip1 > key.ip2 || (key.ip1 == key.ip2 && key.port1 > key.port2))
+		{
+			uint32_t tmp_ip = key.ip1;
+			uint16_t tmp_port = key.port1;
+			key.ip1 = key.ip2;
+			key.ip2 = tmp_ip;
+			key.port1 = key.port2;
+			key.port2 = tmp_port;
+			reply = 1;
+		}
+
+		if(num_flows * 2 >= table_size)
+		{
+			/* grow & rehash */
+			uint32_t old_size = table_size;
+			flow_key* old_keys = keys;
+			uint32_t* old_flows = key_flows;
+			uint32_t old_slot;
+			table_size = table_size == 0 ? 1024 : table_size * 2;
+			keys = (flow_key*)calloc(table_size, sizeof(flow_key));
+			key_flows = (uint32_t*)malloc(table_size * sizeof(uint32_t));
+			if(keys == NULL || key_flows == NULL)
+			{
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+			memset(key_flows, 0xFF, table_size * sizeof(uint32_t));
+			for(old_slot = 0; old_slot < old_size; old_slot++)
+			{
+				if(old_flows[old_slot] != 0xFFFFFFFF)
+				{
+					slot = jhash2((u32*)(old_keys + old_slot), sizeof(flow_key)/4, 0) & (table_size - 1);
+					while(key_flows[slot] != 0xFFFFFFFF)
+					{
+						slot = (slot + 1) & (table_size - 1);
+					}
+					keys[slot] = old_keys[old_slot];
+					key_flows[slot] = old_flows[old_slot];
+				}
+			}
+			free(old_keys);
+			free(old_flows);
+		}
+		hash = jhash2((u32*)&key, sizeof(flow_key)/4, 0);
+		slot = hash & (table_size - 1);
+		while(key_flows[slot] != 0xFFFFFFFF && memcmp(keys + slot, &key, sizeof(flow_key)) != 0)
+		{
+			slot = (slot + 1) & (table_size - 1);
+		}
+		if(key_flows[slot] == 0xFFFFFFFF)
+		{
+			keys[slot] = key;
+			key_flows[slot] = num_flows++;
+			/* first direction seen is the original one, store the first reply bit in the high bit */
+			key_flows[slot] = key_flows[slot] | (reply ? 0x80000000 : 0);
+		}
+
+		first_sec = first_sec < 0 ? sec : first_sec;
+		last_sec = sec > last_sec ? sec : last_sec;
+		add_packet(ip, ip_length, ip_captured, key_flows[slot] & 0x7FFFFFFF, (unsigned char)(reply != ((key_flows[slot] & 0x80000000) != 0)), (time_t)(sec - first_sec));
+	}
+	#undef PCAP_U32
+
+	free(frame);
+	free(keys);
+	free(key_flows);
+	fclose(in);
+
+	if(num_packets == 0)
+	{
+		fprintf(stderr, "%s: no IPv4 packets found\n", path);
+		return -1;
+	}
+	if(skipped > 0)
+	{
+		fprintf(stderr, "%s: skipped %lu non-IPv4 or truncated packets\n", path, skipped);
+	}
+	pass_length = (time_t)(last_sec - first_sec) + 1;
+	return 0;
+}
+
+/* forget all connection state, as if every flow were new */
+static void reset_flows(void)
+{
+	uint32_t flow;
+	for(flow = 0; flow < num_flows; flow++)
+	{
+		kfree(flows[flow].layer7.app_proto);
+		kfree(flows[flow].layer7.app_data);
+		if(flows[flow].tls_sni != NULL)
+		{
+			kfree(flows[flow].tls_sni);
+			atomic_dec(&nf_ct_tls_sni_count);
+		}
+		memset(flows + flow, 0, sizeof(struct nf_conn));
+		flows[flow].id = flow;
+	}
+}
+
+/*
+ * (re)builds the synthetic traffic for num_synthetic_flows flows with
+ * packets_per_flow packets each, throwing away any built before
+ */
+static void use_synthetic_traffic(uint32_t num_synthetic_flows, unsigned long packets_per_flow, uint32_t num_hosts, unsigned long rate)
+{
+	unsigned long index;
+	if(flows != NULL)
+	{
+		reset_flows();
+		free(flows);
+	}
+	for(index = 0; index < num_packets; index++)
+	{
+		free(packets[index].skb.head);
+	}
+	num_packets = 0;
+
+	generate_traffic(packets_per_flow * num_synthetic_flows, num_synthetic_flows, num_hosts, rate);
+	flows = (struct nf_conn*)calloc(num_flows, sizeof(struct nf_conn));
+	if(flows == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+}
+
+static void advance_clock(time_t now)
+{
+	if(now > kshim_now)
+	{
+		jiffies = jiffies + (unsigned long)(now - kshim_now) * HZ;
+		kshim_now = now;
+	}
+	kshim_run_work();
+}
+
+static void run_scenario(const bench_scenario* scenario, unsigned long total_packets, int num_cpus)
+{
+	const struct xt_match* match = kshim_find_match(mbench_module.match_name, mbench_module.family);
+	void* info = calloc(1, mbench_module.info_size);
+	struct xt_mtchk_param check_par;
+	struct xt_action_param par;
+	unsigned long check_allocs;
+	unsigned long allocs = 0;
+	unsigned long frees = 0;
+	unsigned long locks = 0;
+	unsigned long long lock_ns = 0;
+	unsigned long matched = 0;
+	unsigned long done = 0;
+	unsigned long index = 0;
+	time_t pass_start = kshim_now;
+	double ns = 0;
+
+	if(match == NULL || info == NULL)
+	{
+		fprintf(stderr, "%s match not registered\n", mbench_module.match_name);
+		exit(1);
+	}
+
+	scenario->fill_info(info);
+	memset(&check_par, 0, sizeof(check_par));
+	check_par.table = "filter";
+	check_par.match = match;
+	check_par.matchinfo = info;
+	check_par.family = (u_int8_t)mbench_module.family;
+	check_allocs = kshim_alloc_count;
+	if(match->checkentry != NULL && match->checkentry(&check_par) != 0)
+	{
+		fprintf(stderr, "%s: checkentry rejected scenario %s\n", mbench_module.match_name, scenario->name);
+		free(info);
+		return;
+	}
+	check_allocs = kshim_alloc_count - check_allocs;
+
+	memset(&par, 0, sizeof(par));
+	par.match = match;
+	par.matchinfo = info;
+	par.family = (u_int8_t)mbench_module.family;
+
+	reset_flows();
+	while(done < total_packets)
+	{
+		time_t segment_time = pass_start + packets[index].ts;
+		unsigned long segment_allocs;
+		unsigned long segment_frees;
+		unsigned long segment_locks;
+		unsigned long long segment_lock_ns;
+		struct timespec start, end;
+		int batch;
+
+		advance_clock(segment_time);
+		segment_allocs = kshim_alloc_count;
+		segment_frees = kshim_free_count;
+		segment_locks = kshim_lock_count;
+		segment_lock_ns = kshim_lock_hold_ns;
+
+		/* time up to BENCH_BATCH packets from the same virtual second together */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(batch = 0; batch < BENCH_BATCH && done < total_packets && index < num_packets && pass_start + packets[index].ts == segment_time; batch++)
+		{
+			bench_packet* p = packets + index;
+			struct nf_conn* ct = flows + p->flow;
+			int direction = p->reply ? IP_CT_DIR_REPLY : IP_CT_DIR_ORIGINAL;
+
+			/* conntrack has already accounted for the packet by the time rules see it */
+			atomic64_inc(&ct->acct[direction].packets);
+			atomic64_add(p->skb.len, &ct->acct[direction].bytes);
+			p->skb.nfct = ct;
+			p->skb.nfctinfo = p->reply ? IP_CT_ESTABLISHED_REPLY : (atomic64_read(&ct->acct[IP_CT_DIR_ORIGINAL].packets) == 1 ? IP_CT_NEW : IP_CT_ESTABLISHED);
+			p->skb.cb[0] = 0;
+			kshim_cpu = (int)(p->flow % num_cpus);
+
+			matched += match->match(&(p->skb), &par) ? 1 : 0;
+			index++;
+			done++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		ns += elapsed_ns(&start, &end);
+		allocs += kshim_alloc_count - segment_allocs;
+		frees += kshim_free_count - segment_frees;
+		locks += kshim_lock_count - segment_locks;
+		lock_ns += kshim_lock_hold_ns - segment_lock_ns;
+
+		if(index == num_packets)
+		{
+			index = 0;
+			pass_start = pass_start + pass_length;
+			reset_flows();
+		}
+	}
+	kshim_cpu = 0;
+	advance_clock(kshim_now + 1);
+
+	if(match->destroy != NULL)
+	{
+		struct xt_mtdtor_param destroy_par;
+		memset(&destroy_par, 0, sizeof(destroy_par));
+		destroy_par.match = match;
+		destroy_par.matchinfo = info;
+		destroy_par.family = (u_int8_t)mbench_module.family;
+		match->destroy(&destroy_par);
+	}
+	reset_flows();
+	free(info);
+
+	printf("%-10s %-12s %10lu %9.1f %10.3f %10.3f %9.3f %11.1f %10lu %10lu\n",
+		mbench_module.match_name,
+		scenario->name,
+		done,
+		ns / done,
+		(double)allocs / done,
+		(double)frees / done,
+		(double)locks / done,
+		kshim_lock_timing ? (double)lock_ns / done : 0.0,
+		matched,
+		check_allocs
+		);
+}
+
+int main(int argc, char** argv)
+{
+	const char* only_scenario = NULL;
+	const char* pcap_file = NULL;
+	unsigned long total_packets = 1000000;
+	unsigned long synthetic_packets = 4096;
+	unsigned long synthetic_flows = 256;
+	unsigned long synthetic_hosts = 64;
+	unsigned long rate = 10000;
+	int num_cpus = 1;
+	const bench_scenario* s;
+	int ran = 0;
+	int c;
+
+	kshim_quiet = 1;
+	while((c = getopt(argc, argv, "s:r:p:n:f:H:t:C:L:lvh")) != -1)
+	{
+		switch(c)
+		{
+			case 's':
+				only_scenario = optarg;
+				break;
+			case 'r':
+				pcap_file = optarg;
+				break;
+			case 'p':
+				total_packets = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				synthetic_packets = strtoul(optarg, NULL, 10);
+				break;
+			case 'f':
+				synthetic_flows = strtoul(optarg, NULL, 10);
+				break;
+			case 'H':
+				synthetic_hosts = strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				rate = strtoul(optarg, NULL, 10);
+				break;
+			case 'C':
+				num_cpus = atoi(optarg);
+				break;
+			case 'L':
+				linear_length = (unsigned int)strtoul(optarg, NULL, 10);
+				break;
+			case 'l':
+				kshim_lock_timing = 1;
+				break;
+			case 'v':
+				kshim_quiet = 0;
+				break;
+			default:
+				usage(argv[0]);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+	if(total_packets == 0 || synthetic_packets == 0 || synthetic_flows == 0 || synthetic_hosts == 0 || synthetic_hosts > 250 || rate == 0 || num_cpus < 1 || num_cpus > NR_CPUS)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	kshim_nr_cpus = num_cpus;
+
+	if(pcap_file != NULL)
+	{
+		if(load_pcap(pcap_file) != 0)
+		{
+			return 1;
+		}
+	}
+	else
+	{
+		synthetic_packets = synthetic_packets < synthetic_flows ? 1 : synthetic_packets / synthetic_flows;
+		use_synthetic_traffic((uint32_t)synthetic_flows, synthetic_packets, (uint32_t)synthetic_hosts, rate);
+	}
+	if(flows == NULL)
+	{
+		flows = (struct nf_conn*)calloc(num_flows, sizeof(struct nf_conn));
+		if(flows == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+
+	if(mbench_module.init() != 0)
+	{
+		fprintf(stderr, "%s: module init failed\n", mbench_module.match_name);
+		return 1;
+	}
+
+	printf("# %lu distinct packets in %u flows from %s, %d cpu%s\n", num_packets, num_flows, pcap_file != NULL ? pcap_file : "synthetic traffic", num_cpus, num_cpus == 1 ? "" : "s");
+	printf("%-10s %-12s %10s %9s %10s %10s %9s %11s %10s %10s\n", "module", "scenario", "packets", "ns/pkt", "allocs/pkt", "frees/pkt", "locks/pkt", "lock-ns/pkt", "matched", "chk-allocs");
+	for(s = mbench_module.scenarios; s->name != NULL; s++)
+	{
+		if(only_scenario == NULL || strcmp(only_scenario, s->name) == 0)
+		{
+			/* scenarios asking for more flows get as many packets per flow, and the next gets -f back */
+			uint32_t scenario_flows = s->flows != 0 ? s->flows : (uint32_t)synthetic_flows;
+			if(pcap_file == NULL && scenario_flows != num_flows)
+			{
+				use_synthetic_traffic(scenario_flows, synthetic_packets, (uint32_t)synthetic_hosts, rate);
+			}
+			run_scenario(s, total_packets, num_cpus);
+			ran++;
+		}
+	}
+	mbench_module.exit();
+	if(ran == 0)
+	{
+		fprintf(stderr, "no scenario named %s\n", only_scenario);
+		return 1;
+	}
+	if(kshim_alloc_count != kshim_free_count)
+	{
+		printf("# %lu allocations still outstanding after module exit\n", kshim_alloc_count - kshim_free_count);
+	}
+	return 0;
+}
@@ -310,7 +310,12 @@ for new_d in $new_module_dirs ; do
 		echo "\$(call Package/iptables/Module, +kmod-ipt-$lower_name)" >>../"$iptables_makefile" 
 		echo "  TITLE:=$lower_name" >>../"$iptables_makefile" 
 		echo "endef" >>../"$iptables_makefile" 
-		echo "\$(eval \$(call BuildPlugin,iptables-mod-$lower_name,\$(IPT_$upper_name-m)))" >>../"$iptables_makefile" 
+		#the match handles IPv6 itself, so there's an ip6tables extension but no ip6t module to load
+		plugin_files="\$(IPT_$upper_name-m)"
+		if [ -e "$new_d/extension/libip6t_$lower_name.c" ] ; then
+			plugin_files="$plugin_files ip6t_$lower_name"
+		fi
+		echo "\$(eval \$(call BuildPlugin,iptables-mod-$lower_name,$plugin_files))" >>../"$iptables_makefile" 
 	
 	
 		#update include/netfilter.mk with new module
@@ -97,6 +97,7 @@ static struct option opts[] =
 	{ .name = "include_ips",        .has_arg = 1, .flag = 0, .val = WEBMON_INCLUDE },
 	{ .name = "max_domains",        .has_arg = 1, .flag = 0, .val = WEBMON_MAXDOMAIN },
 	{ .name = "max_searches",       .has_arg = 1, .flag = 0, .val = WEBMON_MAXSEARCH },
+	{ .name = "max_memory",         .has_arg = 1, .flag = 0, .val = WEBMON_MAXMEMORY },
 	{ .name = "search_load_file",   .has_arg = 1, .flag = 0, .val = SEARCH_LOAD_FILE },
 	{ .name = "domain_load_file",   .has_arg = 1, .flag = 0, .val = DOMAIN_LOAD_FILE },
 	{ .name = "clear_search",       .has_arg = 0, .flag = 0, .val = CLEAR_SEARCH },
@@ -116,7 +117,7 @@ static void webmon_init(
 	struct ipt_webmon_info *info = (struct ipt_webmon_info *)match->data;
 	info->max_domains=DEFAULT_MAX;
 	info->max_searches=DEFAULT_MAX;
-	info->num_exclude_ips=0;
+	info->max_memory=0;
 	info->num_exclude_ranges=0;
 	info->exclude_type = WEBMON_EXCLUDE;
 	info->ref_count = NULL;
@@ -174,6 +175,17 @@ static int parse(	int c,
 				global_max_domains = info->max_domains;
 			}
 			break;
+		case WEBMON_MAXMEMORY:
+			if( sscanf(argv[optind-1], "%ld", &max) == 0 || max < 0 || max > WEBMON_MAX_MEMORY)
+			{
+				info->max_memory = 0;
+				valid_arg = 0;
+			}
+			else
+			{
+				info->max_memory = (uint32_t)max;
+			}
+			break;
 		case SEARCH_LOAD_FILE:
 			search_load_file = strdup(optarg);
 			break;
@@ -199,20 +211,38 @@ static void print_webmon_args(	struct ipt_webmon_info* info )
 {
 	printf("--max_domains %ld ", (unsigned long int)info->max_domains);
 	printf("--max_searches %ld ", (unsigned long int)info->max_searches);
-	if(info->num_exclude_ips > 0 || info->num_exclude_ranges > 0)
+	if(info->max_memory > 0)
+	{
+		printf("--max_memory %ld ", (unsigned long int)info->max_memory);
+	}
+	if(info->num_exclude_ranges > 0)
 	{
 		int ip_index = 0;
 		char comma[3] = "";
 		printf("--%s ", (info->exclude_type == WEBMON_EXCLUDE ? "exclude_ips" : "include_ips"));
-		for(ip_index=0; ip_index < info->num_exclude_ips; ip_index++)
-		{
-			printf("%s"STRIP, comma, NIPQUAD((info->exclude_ips)[ip_index]) );
-			sprintf(comma, ",");
-		}
 		for(ip_index=0; ip_index < info->num_exclude_ranges; ip_index++)
 		{
 			struct ipt_webmon_ip_range r = (info->exclude_ranges)[ip_index];
-			printf("%s"STRIP"-"STRIP, comma, NIPQUAD(r.start), NIPQUAD(r.end) );
+			uint32_t size = ntohl(r.end) - ntohl(r.start);
+			if(r.start == r.end)
+			{
+				printf("%s"STRIP, comma, NIPQUAD(r.start) );
+			}
+			else if( (size & (size+1)) == 0 && (ntohl(r.start) & size) == 0 )
+			{
+				/* an aligned power of two block, print it in CIDR notation */
+				int mask_bits = 32;
+				while(size > 0)
+				{
+					size = size >> 1;
+					mask_bits--;
+				}
+				printf("%s"STRIP"/%d", comma, NIPQUAD(r.start), mask_bits );
+			}
+			else
+			{
+				printf("%s"STRIP"-"STRIP, comma, NIPQUAD(r.start), NIPQUAD(r.end) );
+			}
 			sprintf(comma, ",");
 		}
 		printf(" ");
@@ -347,11 +377,88 @@ static void param_problem_exit_error(char* msg)
 }
 
 
+static void add_range(struct ipt_webmon_info *info, uint32_t start, uint32_t end)
+{
+	if(info->num_exclude_ranges >= WEBMON_MAX_IP_RANGES)
+	{
+		param_problem_exit_error("Too many ips/ranges specified for webmon");
+	}
+	(info->exclude_ranges)[ info->num_exclude_ranges ].start = start;
+	(info->exclude_ranges)[ info->num_exclude_ranges ].end   = end;
+	info->num_exclude_ranges = info->num_exclude_ranges + 1;
+}
+
+static int compare_ranges(const void* a, const void* b)
+{
+	uint32_t a_start = ntohl( ((const struct ipt_webmon_ip_range*)a)->start );
+	uint32_t b_start = ntohl( ((const struct ipt_webmon_ip_range*)b)->start );
+	return a_start < b_start ? -1 : (a_start > b_start ? 1 : 0);
+}
+
+/* 
+ * sort & merge the same way the kernel module does when the rule is inserted,
+ * so what is listed is what was saved
+ */
+static void normalize_ranges(struct ipt_webmon_info *info)
+{
+	struct ipt_webmon_ip_range* ranges = info->exclude_ranges;
+	uint32_t num_merged = 0;
+	uint32_t range_index;
+
+	qsort(ranges, info->num_exclude_ranges, sizeof(struct ipt_webmon_ip_range), compare_ranges);
+	for(range_index = 0; range_index < info->num_exclude_ranges; range_index++)
+	{
+		uint32_t start = ntohl(ranges[range_index].start);
+		uint32_t end = ntohl(ranges[range_index].end);
+		uint32_t prev_end = num_merged > 0 ? ntohl(ranges[num_merged-1].end) : 0;
+		if(num_merged > 0 && (start <= prev_end || start - 1 == prev_end))
+		{
+			if(end > prev_end)
+			{
+				ranges[num_merged-1].end = ranges[range_index].end;
+			}
+		}
+		else
+		{
+			ranges[num_merged] = ranges[range_index];
+			num_merged++;
+		}
+	}
+	info->num_exclude_ranges = num_merged;
+}
+
+static void free_split_pieces(char** pieces)
+{
+	int piece_index;
+	for(piece_index=0; pieces[piece_index] != NULL; piece_index++)
+	{
+		free(pieces[piece_index]);
+	}
+	free(pieces);
+}
+
+static int parse_ip(char* ip_str, uint32_t* ip)
+{
+	int parsed_ip[4];
+	struct in_addr addr;
+	trim_flanking_whitespace(ip_str);
+	if(sscanf(ip_str, "%d.%d.%d.%d", parsed_ip, parsed_ip+1, parsed_ip+2, parsed_ip+3) != 4 || inet_pton(AF_INET, ip_str, &addr) != 1)
+	{
+		return 0;
+	}
+	*ip = (uint32_t)addr.s_addr;
+	return 1;
+}
+
+/*
+ * addr_str is a comma separated list of single ips, start-end ranges and 
+ * CIDR blocks, where the mask can be a number of bits or a dotted quad.
+ * Pieces that don't parse are skipped.
+ */
 void parse_ips_and_ranges(char* addr_str, struct ipt_webmon_info *info)
 {
 	char** addr_parts = split_on_separators(addr_str, ",", 1, -1, 0);
 
-	info->num_exclude_ips=0;
 	info->num_exclude_ranges = 0;
 
 	int ip_part_index;
@@ -361,122 +468,56 @@ void parse_ips_and_ranges(char* addr_str, struct ipt_webmon_info *info)
 		if(strchr(next_str, '-') != NULL)
 		{
 			char** range_parts = split_on_separators(next_str, "-", 1, 2, 1);
-			char* start = trim_flanking_whitespace(range_parts[0]);
-			char* end = trim_flanking_whitespace(range_parts[1]);
-			int start_ip[4];
-			int end_ip[4];
-			int start_valid = sscanf(start, "%d.%d.%d.%d", start_ip, start_ip+1, start_ip+2, start_ip+3);
-			int end_valid = sscanf(end, "%d.%d.%d.%d", end_ip, end_ip+1, end_ip+2, end_ip+3);
-			
-			if(start_valid == 4 && end_valid == 4)
+			uint32_t start;
+			uint32_t end;
+			if(range_parts[0] != NULL && range_parts[1] != NULL && parse_ip(range_parts[0], &start) && parse_ip(range_parts[1], &end) && ntohl(start) <= ntohl(end))
 			{
-				struct ipt_webmon_ip_range r;
-				struct in_addr sip, eip;
-				inet_pton(AF_INET, start, &sip);
-				inet_pton(AF_INET, end, &eip);
-				r.start = (uint32_t)sip.s_addr;
-				r.end   = (uint32_t)eip.s_addr;
-
-				if(info->num_exclude_ranges <  WEBMON_MAX_IP_RANGES  && (unsigned long)ntohl(r.start) < (unsigned long)ntohl(r.end) )
-				{
-					(info->exclude_ranges)[ info->num_exclude_ranges ] = r;
-					info->num_exclude_ranges = info->num_exclude_ranges + 1;
-				}
+				add_range(info, start, end);
 			}
-
-			free(start);
-			free(end);	
-			free(range_parts);
+			free_split_pieces(range_parts);
 		}
 		else if(strchr(next_str, '/') != NULL)
 		{
 			char** range_parts = split_on_separators(next_str, "/", 1, 2, 1);
-			char* start = trim_flanking_whitespace(range_parts[0]);
-			char* end = trim_flanking_whitespace(range_parts[1]);
-			int base_ip[4];
-			int base_valid = sscanf(start, "%d.%d.%d.%d", base_ip, base_ip+1, base_ip+2, base_ip+3);
-			if(base_valid == 4)
+			uint32_t base;
+			uint32_t mask;
+			int mask_valid = 0;
+			if(range_parts[0] != NULL && range_parts[1] != NULL && parse_ip(range_parts[0], &base))
 			{
-				int mask_valid = 0;
-				uint32_t mask;
+				char* end = trim_flanking_whitespace(range_parts[1]);
 				if(strchr(end, '.') != NULL)
 				{
-					uint32_t mask_ip[4];
-					int mask_test = sscanf(end, "%d.%d.%d.%d", mask_ip, mask_ip+1, mask_ip+2, mask_ip+3);
-					if(mask_test == 4)
-					{
-						struct in_addr mask_add;
-						inet_pton(AF_INET, end, &mask_add);
-						mask = (uint32_t)mask_add.s_addr;
-						mask_valid = 1;
-					}
+					mask_valid = parse_ip(end, &mask);
 				}
 				else
 				{
 					int mask_bits;
-					if( sscanf(end, "%d", &mask_bits) > 0)
-					{
-						if(mask_bits >=0 && mask_bits <= 32)
-						{
-							uint32_t byte = 0;
-							mask = 0;
-							for(byte=0; byte < 4; byte++)
-							{
-								unsigned char byte_bits = mask_bits > 8 ? 8 : mask_bits;
-								uint32_t byte_mask = 0;
-								mask_bits = mask_bits - byte_bits;
-								
-								while(byte_bits > 0)
-								{
-									byte_mask = byte_mask | (256 >> byte_bits);
-									byte_bits--;
-								}
-								mask = mask | ((uint32_t)byte_mask << (byte*8));
-								printf("mask = "STRIP"\n", NIPQUAD(mask));	
-							}
-							mask_valid = 1;
-						}
-					}
-				}
-				if(mask_valid)
-				{
-					struct ipt_webmon_ip_range r;
-					struct in_addr bip;
-					inet_pton(AF_INET, start, &bip);
-					r.start = ( ((uint32_t)bip.s_addr) & mask );
-					r.end   = ( ((uint32_t)bip.s_addr) | (~mask) );
-					if(info->num_exclude_ranges <  WEBMON_MAX_IP_RANGES && ntohl(r.start) <= ntohl(r.end) )
+					if( sscanf(end, "%d", &mask_bits) > 0 && mask_bits >= 0 && mask_bits <= 32)
 					{
-						(info->exclude_ranges)[ info->num_exclude_ranges ] = r;
-						info->num_exclude_ranges = info->num_exclude_ranges + 1;
+						mask = htonl( mask_bits == 0 ? 0 : (0xFFFFFFFF << (32 - mask_bits)) );
+						mask_valid = 1;
 					}
 				}
 			}
-			free(start);
-			free(end);	
-			free(range_parts);
+			if(mask_valid)
+			{
+				add_range(info, base & mask, base | (~mask));
+			}
+			free_split_pieces(range_parts);
 		}
 		else
 		{
-			int parsed_ip[4];
-			int valid = sscanf(next_str, "%d.%d.%d.%d", parsed_ip, parsed_ip+1, parsed_ip+2, parsed_ip+3);
-			if(valid == 4)
+			uint32_t ip;
+			if(parse_ip(next_str, &ip))
 			{
-				struct in_addr ip;
-				trim_flanking_whitespace(next_str);
-				inet_pton(AF_INET, next_str, &ip);
-				
-				if(info->num_exclude_ranges <  WEBMON_MAX_IPS)
-				{
-					(info->exclude_ips)[ info->num_exclude_ips ] = (uint32_t)ip.s_addr;
-					info->num_exclude_ips = info->num_exclude_ips + 1;
-				}
+				add_range(info, ip, ip);
 			}
 		}
 		free(next_str);
 	}
 	free(addr_parts);
-	
+
+	normalize_ranges(info);
 }
 
 
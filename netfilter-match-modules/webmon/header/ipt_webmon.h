@@ -26,14 +26,19 @@
 #define _IPT_WEBMON_H
 
 
-#define WEBMON_MAX_IPS           256
-#define WEBMON_MAX_IP_RANGES      16
+/* single ips, CIDR blocks and start-end ranges all share this limit */
+#define WEBMON_MAX_IP_RANGES    2048
 
 #define WEBMON_EXCLUDE             1
 #define WEBMON_INCLUDE             2
 
 #define WEBMON_MAXDOMAIN           4
 #define WEBMON_MAXSEARCH           8
+#define WEBMON_MAXMEMORY          64
+
+/* largest --max_domains/--max_searches, and --max_memory in KB */
+#define WEBMON_MAX_ENTRIES   1048576
+#define WEBMON_MAX_MEMORY     262144
 
 #define WEBMON_DOMAIN             16
 #define WEBMON_SEARCH             32
@@ -41,6 +46,10 @@
 
 #define WEBMON_SET              3064
 
+/* the recent domain or search history, in chunks if it is large, see get_snapshot in ipt_webmon.c */
+#define WEBMON_GET_SNAPSHOT     3065
+
+/* network byte order, a single ip has start == end */
 struct ipt_webmon_ip_range
 {
 	uint32_t start;
@@ -51,9 +60,8 @@ struct ipt_webmon_info
 {
 	uint32_t max_domains;
 	uint32_t max_searches;
-	uint32_t exclude_ips[WEBMON_MAX_IPS];
-	struct ipt_webmon_ip_range exclude_ranges[WEBMON_MAX_IP_RANGES];
-	uint32_t num_exclude_ips;
+	uint32_t max_memory; //KB shared by the domain & search history, 0 to size it for max_domains + max_searches
+	struct ipt_webmon_ip_range exclude_ranges[WEBMON_MAX_IP_RANGES]; //sorted & merged by checkentry, so match can binary search them
 	uint32_t num_exclude_ranges;
 	unsigned char exclude_type;
 	uint32_t* ref_count;
@@ -32,11 +32,17 @@
 #include <linux/time.h>
 #include <linux/spinlock.h>
 #include <linux/proc_fs.h>
+#include <linux/sort.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
 
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netfilter_ipv4/ipt_webmon.h>
 
 #include "webmon_deps/tree_map.h"
+#include "webmon_deps/tls_sni.h"
 
 
 #include <linux/ktime.h>
@@ -57,132 +63,532 @@ MODULE_DESCRIPTION("Monitor URL in HTTP(S) Requests, designed for use with Gargo
 	((unsigned char *)&addr)[3]
 #define STRIP "%u.%u.%u.%u"
 
-typedef struct qn
+/* what the rules last asked for, see resize_stores */
+static uint32_t max_domain_queue_length   = 5;
+static uint32_t max_search_queue_length   = 5;
+static uint32_t max_memory                = 0;
+
+static spinlock_t webmon_lock = __SPIN_LOCK_UNLOCKED(webmon_lock);;
+
+/*
+ * Requests are parsed from at most the first MAX_PAYLOAD_READ bytes of
+ * the payload.  When those aren't all in the linear part of the skb
+ * (GRO, scatter-gather NICs) they are copied here rather than copying
+ * the whole skb.  match() runs with bottom halves disabled, so one
+ * buffer per cpu is enough.
+ */
+#define MAX_PAYLOAD_READ 2048
+typedef struct
+{
+	unsigned char data[MAX_PAYLOAD_READ+1];
+} payload_buffer;
+static payload_buffer __percpu* payload_buffers = NULL;
+
+/*
+ * match() doesn't touch the queues or maps.  It pushes what it finds onto
+ * a ring for the cpu it runs on, and drain_worker merges the rings into
+ * domain_store/search_store shortly afterwards, so recording a request
+ * never takes webmon_lock or allocates.  Each ring has one producer (match,
+ * which runs with bottom halves disabled) and one consumer (drain_rings,
+ * under webmon_lock), so head and tail only need barriers.  When a ring is
+ * full new records are dropped until it has been drained.
+ */
+#define WEBMON_RING_SIZE		64	/* must be a power of 2 */
+#define WEBMON_RECORD_VALUE_LENGTH	256	/* any DNS name fits, longer searches are truncated */
+
+typedef struct
 {
-	uint32_t src_ip;
-	char* value;
 	struct timeval time;
-	struct qn* next;
-	struct qn* previous;	
-} queue_node;
+	uint32_t src_ip;
+	unsigned char type;
+	char value[WEBMON_RECORD_VALUE_LENGTH];
+} webmon_record;
 
 typedef struct
 {
-	queue_node* first;
-	queue_node* last;
-	int length;
-} queue;
+	unsigned int head;	/* next record to write, only changed by match */
+	webmon_record records[WEBMON_RING_SIZE];
+	unsigned int tail;	/* next record to read, only changed by drain_rings */
+} webmon_ring;
 
-static string_map* domain_map = NULL;
-static queue* recent_domains  = NULL;
+static webmon_ring __percpu* rings = NULL;
 
-static string_map* search_map = NULL;
-static queue* recent_searches = NULL;
+static void drain_worker(struct work_struct* work);
+static DECLARE_WORK(drain_work, drain_worker);
 
 
-static int max_domain_queue_length   = 5;
-static int max_search_queue_length   = 5;
+/*
+ * The recent domains and recent searches each live in a webmon_store,
+ * one vmalloc'd block carved up into:
+ *
+ *   entries         compact records, linked newest to oldest by index
+ *   entry_buckets   hash of (src_ip, value) to entry, so a repeated
+ *                   request just moves its entry to the front
+ *   string_buckets  hash of value to string
+ *   heap            the values, each stored once however many hosts
+ *                   request it, and reference counted by the entries
+ *
+ * The heap is handed out in WEBMON_CHUNK_SIZE byte chunks, and freed
+ * strings go on a free list for their number of chunks, so nothing is
+ * allocated after a store is set up.  When the entries or the heap run
+ * out, the oldest entries are evicted, and once an eighth of the heap
+ * is free but in pieces too small to use it is compacted.  How big a
+ * store is comes from the max_memory of the rule, see store_init.
+ */
+#define WEBMON_NONE		0xFFFFFFFF
+#define WEBMON_CHUNK_SIZE	16
+#define WEBMON_STRING_HEADER	(offsetof(webmon_string, value))
+#define WEBMON_MAX_CHUNKS	((WEBMON_STRING_HEADER + WEBMON_RECORD_VALUE_LENGTH + WEBMON_CHUNK_SIZE - 1) / WEBMON_CHUNK_SIZE)
+#define WEBMON_STRING_BYTES	48	/* heap per entry when there is no max_memory */
+#define WEBMON_MAX_EVICTIONS	32	/* most entries evicted to make room for one string */
 
-static spinlock_t webmon_lock = __SPIN_LOCK_UNLOCKED(webmon_lock);;
+typedef struct
+{
+	uint32_t time;
+	uint32_t src_ip;
+	uint32_t value;		/* heap offset of the string */
+	uint32_t newer;
+	uint32_t older;
+	uint32_t hash_next;	/* next entry in the bucket, or next free entry */
+} webmon_entry;
 
+typedef struct
+{
+	uint32_t hash_next;	/* next string in the bucket, or next free chunk */
+	uint32_t refs;
+	unsigned char length;
+	unsigned char chunks;
+	char value[1];		/* length bytes and a NUL */
+} webmon_string;
 
-static void update_queue_node_time(queue_node* update_node, queue* full_queue)
+typedef struct
 {
-	struct timeval t;
-	do_gettimeofday(&t);
-	update_node->time = t;
-	
-	/* move to front of queue if not already at front of queue */
-	if(update_node->previous != NULL)
+	unsigned char* arena;
+	webmon_entry* entries;
+	uint32_t* entry_buckets;
+	uint32_t* string_buckets;
+	unsigned char* heap;
+	uint32_t max_entries;
+	uint32_t bucket_mask;
+	uint32_t heap_length;
+	uint32_t heap_used;	/* heap past this has never been handed out */
+	uint32_t heap_live;	/* bytes of heap_used that hold strings */
+	uint32_t free_chunks[WEBMON_MAX_CHUNKS+1];
+	uint32_t free_entries;
+	uint32_t newest;
+	uint32_t oldest;
+	uint32_t length;
+} webmon_store;
+
+static webmon_store domain_store;
+static webmon_store search_store;
+
+
+static webmon_string* store_string(webmon_store* store, uint32_t offset)
+{
+	return (webmon_string*)(store->heap + offset);
+}
+
+static uint32_t string_bucket(webmon_store* store, const char* value, uint32_t length)
+{
+	return jhash(value, length, 0) & store->bucket_mask;
+}
+
+static uint32_t entry_bucket(webmon_store* store, uint32_t src_ip, uint32_t value)
+{
+	return jhash_2words(src_ip, value, 0) & store->bucket_mask;
+}
+
+static void store_clear(webmon_store* store)
+{
+	uint32_t index;
+	for(index = 0; index < store->max_entries; index++)
 	{
-		queue_node* p = update_node->previous;
-		queue_node* n = update_node->next;
-		p->next = n;
-		if(n != NULL)
+		(store->entries)[index].hash_next = index+1 < store->max_entries ? index+1 : WEBMON_NONE;
+	}
+	memset(store->entry_buckets, 0xFF, (store->bucket_mask+1)*sizeof(uint32_t));
+	memset(store->string_buckets, 0xFF, (store->bucket_mask+1)*sizeof(uint32_t));
+	memset(store->free_chunks, 0xFF, sizeof(store->free_chunks));
+	store->heap_used = 0;
+	store->heap_live = 0;
+	store->free_entries = 0;
+	store->newest = WEBMON_NONE;
+	store->oldest = WEBMON_NONE;
+	store->length = 0;
+}
+
+/*
+ * sets up an empty store for max_entries in budget bytes, or with
+ * WEBMON_STRING_BYTES of heap per entry if budget is 0.  If the budget
+ * can't give each entry two chunks of heap it holds fewer entries,
+ * check max_entries afterwards.  Can sleep, so call without the lock.
+ */
+static int store_init(webmon_store* store, uint32_t max_entries, uint32_t budget)
+{
+	unsigned long fixed_length;
+	unsigned long heap_length;
+	uint32_t num_buckets;
+
+	memset(store, 0, sizeof(webmon_store));
+	max_entries = max_entries > 0 ? max_entries : 1;
+	max_entries = max_entries < WEBMON_MAX_ENTRIES ? max_entries : WEBMON_MAX_ENTRIES;
+	while(1)
+	{
+		for(num_buckets = 16; num_buckets < max_entries; num_buckets = num_buckets*2){}
+		fixed_length = (max_entries*sizeof(webmon_entry)) + (2*num_buckets*sizeof(uint32_t));
+		if(budget == 0)
 		{
-			n->previous = p;
+			heap_length = max_entries*WEBMON_STRING_BYTES;
 		}
 		else
 		{
-			full_queue->last = p;
+			heap_length = budget > fixed_length ? budget - fixed_length : 0;
+		}
+		if(heap_length >= max_entries*2*WEBMON_CHUNK_SIZE || max_entries == 1)
+		{
+			break;
 		}
-		update_node->previous = NULL;
-		update_node->next = full_queue->first;
-		full_queue->first->previous = update_node;
-		full_queue->first = update_node;
+		max_entries = max_entries - ((max_entries+3)/4);
+	}
+
+	/* however small the budget, the longest value has to fit */
+	heap_length = heap_length > WEBMON_MAX_CHUNKS*WEBMON_CHUNK_SIZE ? heap_length : WEBMON_MAX_CHUNKS*WEBMON_CHUNK_SIZE;
+	heap_length = heap_length - (heap_length % WEBMON_CHUNK_SIZE);
+
+	store->arena = (unsigned char*)vmalloc(fixed_length + heap_length);
+	if(store->arena == NULL)
+	{
+		return -ENOMEM;
 	}
+	store->entries = (webmon_entry*)store->arena;
+	store->entry_buckets = (uint32_t*)(store->arena + (max_entries*sizeof(webmon_entry)));
+	store->string_buckets = store->entry_buckets + num_buckets;
+	store->heap = store->arena + fixed_length;
+	store->max_entries = max_entries;
+	store->bucket_mask = num_buckets-1;
+	store->heap_length = (uint32_t)heap_length;
+	store_clear(store);
+
+	return 0;
 }
 
-void add_queue_node(uint32_t src_ip, char* value, queue* full_queue, string_map* queue_index, char* queue_index_key, uint32_t max_queue_length )
+static void store_free(webmon_store* store)
 {
+	if(store->arena != NULL)
+	{
+		vfree(store->arena);
+	}
+	memset(store, 0, sizeof(webmon_store));
+}
 
-	queue_node *new_node = (queue_node*)kmalloc(sizeof(queue_node), GFP_ATOMIC);
-	char* dyn_value = kernel_strdup(value);
-	struct timeval t;
+static void free_chunks(webmon_store* store, uint32_t offset, uint32_t chunks)
+{
+	webmon_string* s = store_string(store, offset);
+	s->refs = 0;
+	s->chunks = (unsigned char)chunks;
+	s->hash_next = (store->free_chunks)[chunks];
+	(store->free_chunks)[chunks] = offset;
+}
 
+/* a free string of exactly this size, then unused heap, then part of a bigger free string */
+static uint32_t alloc_chunks(webmon_store* store, uint32_t chunks)
+{
+	uint32_t offset = (store->free_chunks)[chunks];
+	uint32_t size;
+	if(offset != WEBMON_NONE)
+	{
+		(store->free_chunks)[chunks] = store_string(store, offset)->hash_next;
+		return offset;
+	}
+	if(store->heap_length - store->heap_used >= chunks*WEBMON_CHUNK_SIZE)
+	{
+		offset = store->heap_used;
+		store->heap_used = store->heap_used + (chunks*WEBMON_CHUNK_SIZE);
+		return offset;
+	}
+	for(size = chunks+1; size <= WEBMON_MAX_CHUNKS; size++)
+	{
+		offset = (store->free_chunks)[size];
+		if(offset != WEBMON_NONE)
+		{
+			(store->free_chunks)[size] = store_string(store, offset)->hash_next;
+			free_chunks(store, offset + (chunks*WEBMON_CHUNK_SIZE), size - chunks);
+			return offset;
+		}
+	}
+	return WEBMON_NONE;
+}
 
-	if(new_node == NULL || dyn_value == NULL)
+static uint32_t find_string(webmon_store* store, const char* value, uint32_t length)
+{
+	uint32_t offset = (store->string_buckets)[string_bucket(store, value, length)];
+	while(offset != WEBMON_NONE)
 	{
-		if(dyn_value) { kfree(dyn_value); }
-		if(new_node) { kfree(new_node); };
+		webmon_string* s = store_string(store, offset);
+		if(s->length == length && memcmp(s->value, value, length) == 0)
+		{
+			return offset;
+		}
+		offset = s->hash_next;
+	}
+	return WEBMON_NONE;
+}
 
-		return;
+static void release_string(webmon_store* store, uint32_t offset)
+{
+	webmon_string* s = store_string(store, offset);
+	s->refs--;
+	if(s->refs == 0)
+	{
+		uint32_t* link = &((store->string_buckets)[string_bucket(store, s->value, s->length)]);
+		while(*link != offset)
+		{
+			link = &(store_string(store, *link)->hash_next);
+		}
+		*link = s->hash_next;
+		store->heap_live = store->heap_live - (s->chunks*WEBMON_CHUNK_SIZE);
+		free_chunks(store, offset, s->chunks);
 	}
-	set_map_element(queue_index, queue_index_key, (void*)new_node);
+}
 
+static void unlink_entry(webmon_store* store, uint32_t index)
+{
+	webmon_entry* e = &((store->entries)[index]);
+	if(e->newer != WEBMON_NONE)
+	{
+		(store->entries)[e->newer].older = e->older;
+	}
+	else
+	{
+		store->newest = e->older;
+	}
+	if(e->older != WEBMON_NONE)
+	{
+		(store->entries)[e->older].newer = e->newer;
+	}
+	else
+	{
+		store->oldest = e->newer;
+	}
+}
 
-	do_gettimeofday(&t);
-	new_node->time = t;
-	new_node->src_ip = src_ip;
-	new_node->value = dyn_value;
-	new_node->previous = NULL;
-	
-	new_node->next = full_queue->first;
-	if(full_queue->first != NULL)
+static void push_newest(webmon_store* store, uint32_t index)
+{
+	webmon_entry* e = &((store->entries)[index]);
+	e->newer = WEBMON_NONE;
+	e->older = store->newest;
+	if(store->newest != WEBMON_NONE)
+	{
+		(store->entries)[store->newest].newer = index;
+	}
+	else
 	{
-		full_queue->first->previous = new_node;
+		store->oldest = index;
 	}
-	full_queue->first = new_node;
-	full_queue->last = (full_queue->last == NULL) ? new_node : full_queue->last ;
-	full_queue->length = full_queue->length + 1;
+	store->newest = index;
+}
 
-	if( full_queue->length > max_queue_length )
+static void remove_entry(webmon_store* store, uint32_t index)
+{
+	webmon_entry* e = &((store->entries)[index]);
+	uint32_t* link = &((store->entry_buckets)[entry_bucket(store, e->src_ip, e->value)]);
+	while(*link != index)
 	{
-		queue_node *old_node = full_queue->last;
-		full_queue->last = old_node->previous;
-		full_queue->last->next = NULL;
-		full_queue->first = old_node->previous == NULL ? NULL : full_queue->first; /*shouldn't be needed, but just in case...*/
-		full_queue->length = full_queue->length - 1;
-		
-		sprintf(queue_index_key, STRIP"@%s", NIPQUAD(old_node->src_ip), old_node->value);
-		remove_map_element(queue_index, queue_index_key);
+		link = &((store->entries)[*link].hash_next);
+	}
+	*link = e->hash_next;
+	unlink_entry(store, index);
+	release_string(store, e->value);
+
+	e->hash_next = store->free_entries;
+	store->free_entries = index;
+	store->length--;
+}
 
-		kfree(old_node->value);
-		kfree(old_node);
+/*
+ * slides the strings down to the start of the heap, leaving all of the
+ * free space in one piece after them.  The entries refer to strings by
+ * offset, so they are pointed at the new ones and both hashes rebuilt.
+ */
+static void compact_heap(webmon_store* store)
+{
+	uint32_t offset;
+	uint32_t next_offset;
+	uint32_t new_offset = 0;
+	uint32_t index;
+
+	/* every chunk run starts with a header, free ones have no refs */
+	for(offset = 0; offset < store->heap_used; offset = offset + (store_string(store, offset)->chunks*WEBMON_CHUNK_SIZE))
+	{
+		webmon_string* s = store_string(store, offset);
+		if(s->refs > 0)
+		{
+			s->hash_next = new_offset; /* the buckets are rebuilt anyway */
+			new_offset = new_offset + (s->chunks*WEBMON_CHUNK_SIZE);
+		}
 	}
 
-	/*
-	queue_node* n = full_queue->first;
-	while(n != NULL)
+	memset(store->entry_buckets, 0xFF, (store->bucket_mask+1)*sizeof(uint32_t));
+	for(index = store->newest; index != WEBMON_NONE; index = (store->entries)[index].older)
+	{
+		webmon_entry* e = &((store->entries)[index]);
+		uint32_t bucket;
+		e->value = store_string(store, e->value)->hash_next;
+		bucket = entry_bucket(store, e->src_ip, e->value);
+		e->hash_next = (store->entry_buckets)[bucket];
+		(store->entry_buckets)[bucket] = index;
+	}
+
+	memset(store->string_buckets, 0xFF, (store->bucket_mask+1)*sizeof(uint32_t));
+	for(offset = 0; offset < store->heap_used; offset = next_offset)
+	{
+		webmon_string* s = store_string(store, offset);
+		next_offset = offset + (s->chunks*WEBMON_CHUNK_SIZE);
+		if(s->refs > 0)
+		{
+			uint32_t to = s->hash_next;
+			uint32_t bucket;
+			memmove(store->heap + to, s, next_offset - offset);
+			s = store_string(store, to);
+			bucket = string_bucket(store, s->value, s->length);
+			s->hash_next = (store->string_buckets)[bucket];
+			(store->string_buckets)[bucket] = to;
+		}
+	}
+
+	memset(store->free_chunks, 0xFF, sizeof(store->free_chunks));
+	store->heap_used = new_offset;
+}
+
+/* returns a new string holding value with one reference, making room in the heap if it's full */
+static uint32_t add_string(webmon_store* store, const char* value, uint32_t length)
+{
+	uint32_t chunks = (WEBMON_STRING_HEADER + length + WEBMON_CHUNK_SIZE) / WEBMON_CHUNK_SIZE;
+	uint32_t offset = alloc_chunks(store, chunks);
+	uint32_t evictions = 0;
+	uint32_t bucket;
+	webmon_string* s;
+
+	while(offset == WEBMON_NONE)
+	{
+		/* compacting is only worth it when it frees a good part of the heap */
+		uint32_t heap_free = store->heap_length - store->heap_live;
+		if(heap_free >= chunks*WEBMON_CHUNK_SIZE && heap_free >= store->heap_length/8)
+		{
+			compact_heap(store);
+		}
+		else if(store->oldest != WEBMON_NONE && evictions < WEBMON_MAX_EVICTIONS)
+		{
+			remove_entry(store, store->oldest);
+			evictions++;
+		}
+		else
+		{
+			return WEBMON_NONE;
+		}
+		offset = alloc_chunks(store, chunks);
+	}
+	store->heap_live = store->heap_live + (chunks*WEBMON_CHUNK_SIZE);
+
+	bucket = string_bucket(store, value, length);
+	s = store_string(store, offset);
+	s->refs = 1;
+	s->length = (unsigned char)length;
+	s->chunks = (unsigned char)chunks;
+	memcpy(s->value, value, length);
+	s->value[length] = '\0';
+	s->hash_next = (store->string_buckets)[bucket];
+	(store->string_buckets)[bucket] = offset;
+
+	return offset;
+}
+
+/* records that src_ip requested value, moving it to the front if it's already there */
+static void store_add(webmon_store* store, uint32_t src_ip, const char* value, uint32_t time)
+{
+	uint32_t length = strlen(value);
+	uint32_t offset;
+	uint32_t index;
+	uint32_t bucket;
+	webmon_entry* e;
+
+	length = length < WEBMON_RECORD_VALUE_LENGTH ? length : WEBMON_RECORD_VALUE_LENGTH-1;
+	offset = find_string(store, value, length);
+	if(offset != WEBMON_NONE)
+	{
+		bucket = entry_bucket(store, src_ip, offset);
+		for(index = (store->entry_buckets)[bucket]; index != WEBMON_NONE; index = (store->entries)[index].hash_next)
+		{
+			e = &((store->entries)[index]);
+			if(e->src_ip == src_ip && e->value == offset)
+			{
+				e->time = time;
+				unlink_entry(store, index);
+				push_newest(store, index);
+				return;
+			}
+		}
+		store_string(store, offset)->refs++; /* so evicting below can't free it */
+	}
+	else
+	{
+		offset = add_string(store, value, length);
+		if(offset == WEBMON_NONE)
+		{
+			return;
+		}
+	}
+
+	if(store->free_entries == WEBMON_NONE)
+	{
+		remove_entry(store, store->oldest);
+	}
+	index = store->free_entries;
+	e = &((store->entries)[index]);
+	store->free_entries = e->hash_next;
+
+	bucket = entry_bucket(store, src_ip, offset);
+	e->time = time;
+	e->src_ip = src_ip;
+	e->value = offset;
+	e->hash_next = (store->entry_buckets)[bucket];
+	(store->entry_buckets)[bucket] = index;
+	push_newest(store, index);
+	store->length++;
+}
+
+/* adds the entries of from to store, oldest first, so the newest ones are kept if it's smaller */
+static void store_copy(webmon_store* store, webmon_store* from)
+{
+	uint32_t index;
+	for(index = from->oldest; index != WEBMON_NONE; index = (from->entries)[index].newer)
 	{
-		printf("%ld\t%s\t%s\t%s\n", (unsigned long)n->time, n->src_ip, n->dst_ip, n->domain);
-		n = (queue_node*)n->next;
+		webmon_entry* e = &((from->entries)[index]);
+		store_add(store, e->src_ip, store_string(from, e->value)->value, e->time);
 	}
-	printf("\n\n");
-	*/
 }
 
-void destroy_queue(queue* q)
-{	
-	queue_node *last_node = q->last;
-	while(last_node != NULL)
+/*
+ * the share of max_memory (in KB) for a store of max_entries, in bytes,
+ * the rest going to the other store, 0 if there's no max_memory
+ */
+static uint32_t store_budget(uint32_t memory_kb, uint32_t max_entries, uint32_t other_max_entries)
+{
+	uint32_t total = max_entries + other_max_entries;
+	uint32_t share;
+	if(memory_kb == 0 || total == 0)
 	{
-		queue_node *previous_node = last_node->previous;
-		free(last_node->value);
-		free(last_node);
-		last_node = previous_node;
+		return 0;
 	}
-	free(q);
+
+	/* scale the counts down so memory_kb*max_entries can't overflow */
+	while(total > 0xFFF)
+	{
+		max_entries = max_entries >> 1;
+		total = total >> 1;
+	}
+	share = ((memory_kb * max_entries) / total) << 10;
+	return share > 0 ? share : 1;
 }
 
 
@@ -502,174 +908,384 @@ static void extract_url(const unsigned char* packet_data, int packet_length, cha
 	}
 }
 
-static void extract_url_https(const unsigned char* packet_data, int packet_length, char* domain)
+static void record_domain(uint32_t src_ip, char* domain, struct timeval* t)
 {
-	//TLSv1.2 Record Layer - All calculations based on this
-	//We want to abuse the SNI (Server Name Indication) extension to harvest likely URLs
-	//Content Type = 0x16 (22) is a "Handshake", HandShake Type 0x01 (1) is a "Client Hello"
-	int x, packet_limit;
-	unsigned short cslen, ext_type, ext_len, maxextlen;
-	unsigned char conttype, hndshktype, sidlen, cmplen;
-	unsigned char* packet_ptr;
+	store_add(&domain_store, src_ip, domain, (uint32_t)t->tv_sec);
+}
 
-	domain[0] = '\0';
-	packet_ptr = packet_data;
+static void record_search(uint32_t src_ip, char* search, struct timeval* t)
+{
+	/* Often times search engines will initiate a search as you type it in, but these intermediate queries aren't the real search query
+	 * So, if the most recent query is a substring of the current one, discard it in favor of this one
+	 */
+	if(search_store.newest != WEBMON_NONE)
+	{
+		webmon_entry* recent = &((search_store.entries)[search_store.newest]);
+		if(recent->src_ip == src_ip)
+		{
+			if( (long)recent->time + 1 >= t->tv_sec || ((long)recent->time + 5 >= t->tv_sec && within_edit_distance(search, store_string(&search_store, recent->value)->value, 2)))
+			{
+				remove_entry(&search_store, search_store.newest);
+			}
+		}
+	}
+	store_add(&search_store, src_ip, search, (uint32_t)t->tv_sec);
+}
 
-	if (packet_length < 43)
+/* called from match, see the comment above webmon_ring */
+static void push_record(unsigned char type, uint32_t src_ip, const char* value, struct timeval* t)
+{
+	webmon_ring* ring = this_cpu_ptr(rings);
+	unsigned int head = ring->head;
+	webmon_record* record;
+	size_t value_length;
+
+	if(head - ACCESS_ONCE(ring->tail) >= WEBMON_RING_SIZE)
 	{
-		/*printk("Packet less than 43 bytes, exiting\n");*/
 		return;
 	}
-	conttype = packet_data[0];
-	hndshktype = packet_data[5];
-	sidlen = packet_data[43];
-	/*printk("conttype=%d, hndshktype=%d, sidlen=%d ",conttype,hndshktype,sidlen);*/
-	if(conttype != 22)
+
+	record = &((ring->records)[head & (WEBMON_RING_SIZE-1)]);
+	value_length = strlen(value);
+	value_length = value_length < WEBMON_RECORD_VALUE_LENGTH ? value_length : WEBMON_RECORD_VALUE_LENGTH-1;
+	memcpy(record->value, value, value_length);
+	record->value[value_length] = '\0';
+	record->time = *t;
+	record->src_ip = src_ip;
+	record->type = type;
+
+	smp_wmb(); /* record is complete before head says so */
+	ACCESS_ONCE(ring->head) = head + 1;
+
+	/*
+	 * If the ring was empty, drain_rings may already be done with it, so
+	 * make sure it runs again.  Paired with the barrier in drain_rings:
+	 * either it sees the new head or we see its tail and schedule it.
+	 */
+	smp_mb();
+	if(ACCESS_ONCE(ring->tail) == head)
 	{
-		/*printk("conttype not 22, exiting\n");*/
-		return;
+		schedule_work(&drain_work);
 	}
-	if(hndshktype != 1)
-	{
-		/*printk("hndshktype not 1, exiting\n");*/
-		return;		//We aren't in a Client Hello
-	}
-
-	packet_ptr = packet_data + 1 + 43 + sidlen;		//Skip to Cipher Suites Length
-	cslen = ntohs(*(unsigned short*)packet_ptr);	//Length of Cipher Suites (2 byte)
-	packet_ptr = packet_ptr + 2 + cslen;	//Skip to Compression Methods
-	cmplen = *packet_ptr;	//Length of Compression Methods (1 byte)
-	packet_ptr = packet_ptr + 1 + cmplen;	//Skip to Extensions Length **IMPORTANT**
-	maxextlen = ntohs(*(unsigned short*)packet_ptr);	//Length of extensions (2 byte)
-	packet_ptr = packet_ptr + 2;	//Skip to beginning of first extension and start looping
-	ext_type = 1;
-	/*printk("cslen=%d, cmplen=%d, maxextlen=%d, pktlen=%d,ptrpos=%d\n",cslen,cmplen,maxextlen,packet_length,packet_ptr - packet_data);*/
-	//Limit the pointer bounds to the smaller of either the extensions length or the packet length
-	packet_limit = ((packet_ptr - packet_data) + maxextlen) < packet_length ? ((packet_ptr - packet_data) + maxextlen) : packet_length;
-
-	//Extension Type and Extension Length are both 2 byte. SNI Extension is "0"
-	while(((packet_ptr - packet_data) < packet_limit) && (ext_type != 0))
-	{
-		ext_type = ntohs(*(unsigned short*)packet_ptr);
-		packet_ptr = packet_ptr + 2;
-		ext_len = ntohs(*(unsigned short*)packet_ptr);
-		packet_ptr = packet_ptr + 2;
-		/*printk("ext_type=%d, ext_len=%d\n",ext_type,ext_len);*/
-		if(ext_type == 0)
+}
+
+/* merges every ring into the stores, call with webmon_lock held */
+static void drain_rings(void)
+{
+	int cpu;
+	for_each_possible_cpu(cpu)
+	{
+		webmon_ring* ring = per_cpu_ptr(rings, cpu);
+		unsigned int tail = ring->tail;
+		unsigned int head = ACCESS_ONCE(ring->head);
+		while(tail != head)
 		{
-			unsigned short snilen;
-			/*printk("FOUND SNI EXT\n");*/
-			packet_ptr = packet_ptr + 3;	//Skip to length of SNI
-			snilen = ntohs(*(unsigned short*)packet_ptr);
-			/*printk("snilen=%d\n",snilen);*/
-			packet_ptr = packet_ptr + 2;	//Skip to beginning of SNI
-			if((((packet_ptr - packet_data) + snilen) < packet_limit) && (snilen > 0))
+			smp_rmb(); /* read head before the records it covers */
+			for( ; tail != head; tail++)
 			{
-				/*printk("FOUND SNI\n");*/
-				snilen = snilen < 625 ? snilen : 624; // prevent overflow
-				memcpy(domain, packet_ptr, snilen);
-				domain[snilen] = '\0';
-				for(x=0; domain[x] != '\0'; x++)
+				webmon_record* record = &((ring->records)[tail & (WEBMON_RING_SIZE-1)]);
+				if(record->type == WEBMON_DOMAIN)
 				{
-					domain[x] = (char)tolower(domain[x]);
+					record_domain(record->src_ip, record->value, &(record->time));
+				}
+				else
+				{
+					record_search(record->src_ip, record->value, &(record->time));
 				}
-				/*printk("sni=%s\n",domain);*/
 			}
-		}
-		else
-		{
-			packet_ptr = packet_ptr + ext_len;
+			smp_mb(); /* done with the records before handing them back */
+			ACCESS_ONCE(ring->tail) = tail;
+			smp_mb(); /* see push_record */
+			head = ACCESS_ONCE(ring->head);
 		}
 	}
 }
 
-#ifdef CONFIG_PROC_FS
+static void drain_worker(struct work_struct* work)
+{
+	spin_lock_bh(&webmon_lock);
+	drain_rings();
+	spin_unlock_bh(&webmon_lock);
+}
 
-static void *webmon_proc_start(struct seq_file *seq, loff_t *loff_pos)
+
+/*
+ * WEBMON_GET_SNAPSHOT returns the recent domain or search history,
+ * as many whole entries as fit in the caller's buffer, each call filled
+ * in under a single hold of webmon_lock.  A history larger than one
+ * buffer (or SNAPSHOT_MAX_LENGTH) is read in chunks, by calling again
+ * with the first entry set to the number of entries read so far.  The
+ * history can change between calls, so a chunked read may repeat or
+ * miss an entry that was requested again while it was being read.
+ *
+ * request structure:
+ * byte  1     : WEBMON_DOMAIN or WEBMON_SEARCH
+ * bytes 2-5   : index of the first entry to return, 0 for the oldest
+ *
+ * response structure:
+ * byte  1     : error code (0 for ok, ERROR_BUFFER_TOO_SHORT if not even the first entry fit)
+ * bytes 2-5   : length of the snapshot from the first entry on, a buffer this long gets the rest in one call
+ * bytes 6-13  : time snapshot was taken (UTC seconds)
+ * bytes 14-17 : number of entries in response
+ * bytes 18-21 : number of entries in the whole history
+ * remaining bytes contain the entries, oldest first, which aren't aligned:
+ * bytes 1-8   : time of the last request (UTC seconds, uint64_t)
+ * bytes 9-12  : src ip (network order)
+ * byte  13    : length of the value
+ * followed by the value, without a NUL
+ */
+#define ERROR_NONE			0
+#define ERROR_BUFFER_TOO_SHORT		1
+#define SNAPSHOT_HEADER_LENGTH		21
+#define SNAPSHOT_ENTRY_HEADER_LENGTH	13
+#define SNAPSHOT_MAX_LENGTH		(16*1024*1024)
+
+/*
+ * writes the entries of store from the first_entry'th on after the
+ * header, stopping at the first one that doesn't fit in buffer_length.
+ * Sets the length and number of the entries written, and returns the
+ * length the rest of the snapshot needs.  Call with webmon_lock held.
+ */
+static uint32_t write_snapshot_entries(webmon_store* store, uint32_t first_entry, unsigned char* buffer, uint32_t buffer_length, uint32_t* written_length, uint32_t* num_written)
 {
-	static unsigned long counter = 0;
+	uint32_t output_index = SNAPSHOT_HEADER_LENGTH;
+	uint32_t entry_number = 0;
+	uint32_t index;
+	*written_length = SNAPSHOT_HEADER_LENGTH;
+	*num_written = 0;
+	for(index = store->oldest; index != WEBMON_NONE; index = (store->entries)[index].newer)
+	{
+		webmon_entry* e;
+		webmon_string* s;
+		uint32_t entry_length;
+		if(entry_number < first_entry)
+		{
+			entry_number++;
+			continue;
+		}
+		e = &((store->entries)[index]);
+		s = store_string(store, e->value);
+		entry_length = SNAPSHOT_ENTRY_HEADER_LENGTH + s->length;
+		if(output_index + entry_length <= buffer_length && *written_length == output_index)
+		{
+			uint64_t time = (uint64_t)e->time;
+			memcpy(buffer + output_index, &time, sizeof(uint64_t));
+			memcpy(buffer + output_index + 8, &(e->src_ip), sizeof(uint32_t));
+			buffer[output_index + 12] = s->length;
+			memcpy(buffer + output_index + SNAPSHOT_ENTRY_HEADER_LENGTH, s->value, s->length);
+			*written_length = output_index + entry_length;
+			*num_written = *num_written + 1;
+		}
+		output_index = output_index + entry_length;
+	}
+	return output_index;
+}
 
-	/* beginning a new sequence ? */	
-	if ( *loff_pos == 0 )
-	{	
-		/* yes => return a non null value to begin the sequence */
-		return &counter;
+static int get_snapshot(void* user, int* len)
+{
+	unsigned char request[5];
+	unsigned char type;
+	uint32_t first_entry;
+	unsigned char* buffer;
+	uint32_t buffer_length;
+	uint32_t snapshot_length;
+	uint32_t written_length;
+	uint32_t num_written;
+	uint32_t num_entries;
+	webmon_store* store;
+
+	if(*len < SNAPSHOT_HEADER_LENGTH)
+	{
+		return -EINVAL;
 	}
-	else
+	copy_from_user(request, user, 5);
+	type = request[0];
+	memcpy(&first_entry, request+1, sizeof(uint32_t));
+	if(type != WEBMON_DOMAIN && type != WEBMON_SEARCH)
 	{
-		/* no => it's the end of the sequence, return end to stop reading */
-		*loff_pos = 0;
-		return NULL;
+		return -EINVAL;
+	}
+
+	buffer_length = *len < SNAPSHOT_MAX_LENGTH ? *len : SNAPSHOT_MAX_LENGTH;
+	buffer = vmalloc(buffer_length);
+	if(buffer == NULL)
+	{
+		return -ENOMEM;
 	}
+
+	spin_lock_bh(&webmon_lock);
+	drain_rings();
+	store = type == WEBMON_DOMAIN ? &domain_store : &search_store;
+	snapshot_length = write_snapshot_entries(store, first_entry, buffer, buffer_length, &written_length, &num_written);
+	num_entries = store->length;
+	spin_unlock_bh(&webmon_lock);
+
+	buffer[0] = num_written > 0 || snapshot_length == SNAPSHOT_HEADER_LENGTH ? ERROR_NONE : ERROR_BUFFER_TOO_SHORT;
+	*( (uint32_t*)(buffer+1) ) = snapshot_length;
+	*( (uint64_t*)(buffer+5) ) = (uint64_t)get_seconds();
+	*( (uint32_t*)(buffer+13) ) = num_written;
+	*( (uint32_t*)(buffer+17) ) = num_entries;
+
+	copy_to_user(user, buffer, written_length);
+	*len = written_length;
+	vfree(buffer);
+
+	return 0;
 }
 
-static void *webmon_proc_next(struct seq_file *seq, void *v, loff_t *pos)
+static int ipt_webmon_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 {
-	return NULL;
+	if(cmd == WEBMON_GET_SNAPSHOT)
+	{
+		return get_snapshot(user, len);
+	}
+	return -EINVAL;
 }
 
 
-static void webmon_proc_stop(struct seq_file *seq, void *v)
+#ifdef CONFIG_PROC_FS
+
+/*
+ * The proc files print a snapshot taken when they are opened, so
+ * webmon_lock isn't held while the text is formatted and read.
+ */
+typedef struct
 {
-	//don't need to do anything
-}
+	unsigned char* data;
+	uint32_t length;
+	loff_t pos;		/* entry at offset, so each read carries on from there */
+	uint32_t offset;
+} proc_snapshot;
+
+/* a complete snapshot of the entries, vmalloc'd since it can be large, NULL if there's no memory for it */
+static unsigned char* take_snapshot(webmon_store* store, uint32_t* snapshot_length)
+{
+	unsigned char* buffer = NULL;
+	uint32_t buffer_length = 0;
+	while(1)
+	{
+		uint32_t needed;
+		uint32_t written_length;
+		uint32_t num_written;
+		uint32_t num_entries;
+		spin_lock_bh(&webmon_lock);
+		drain_rings();
+		needed = write_snapshot_entries(store, 0, buffer, buffer_length, &written_length, &num_written);
+		num_entries = store->length;
+		spin_unlock_bh(&webmon_lock);
+		if(buffer != NULL && num_written == num_entries)
+		{
+			*snapshot_length = written_length;
+			return buffer;
+		}
 
+		/* allocate outside the lock, with room for whatever arrives meanwhile */
+		if(buffer != NULL)
+		{
+			vfree(buffer);
+		}
+		buffer_length = needed + (needed/8);
+		buffer = vmalloc(buffer_length);
+		if(buffer == NULL)
+		{
+			return NULL;
+		}
+	}
+}
 
-static int webmon_proc_domain_show(struct seq_file *s, void *v)
+static void *webmon_proc_start(struct seq_file *seq, loff_t *loff_pos)
 {
-	queue_node* next_node;
-	spin_lock_bh(&webmon_lock);
-
-	next_node = recent_domains->last;
-	while(next_node != NULL)
+	proc_snapshot* snapshot = (proc_snapshot*)seq->private;
+	if(*loff_pos < snapshot->pos)
 	{
-		seq_printf(s, "%ld\t"STRIP"\t%s\n", (unsigned long)(next_node->time).tv_sec, NIPQUAD(next_node->src_ip), next_node->value);
-		next_node = (queue_node*)next_node->previous;
+		snapshot->pos = 0;
+		snapshot->offset = SNAPSHOT_HEADER_LENGTH;
 	}
-	spin_unlock_bh(&webmon_lock);
+	while(snapshot->pos < *loff_pos && snapshot->offset < snapshot->length)
+	{
+		snapshot->offset = snapshot->offset + SNAPSHOT_ENTRY_HEADER_LENGTH + (snapshot->data)[snapshot->offset + 12];
+		snapshot->pos++;
+	}
+	return snapshot->offset < snapshot->length ? snapshot->data + snapshot->offset : NULL;
+}
 
-	return 0;
+static void *webmon_proc_next(struct seq_file *seq, void *v, loff_t *pos)
+{
+	*pos = *pos + 1;
+	return webmon_proc_start(seq, pos);
 }
 
-static int webmon_proc_search_show(struct seq_file *s, void *v)
+
+static void webmon_proc_stop(struct seq_file *seq, void *v)
 {
-	queue_node* next_node;
-	spin_lock_bh(&webmon_lock);
+	//don't need to do anything
+}
 
-	next_node = recent_searches->last;
-	while(next_node != NULL)
-	{
-		seq_printf(s, "%ld\t"STRIP"\t%s\n", (unsigned long)(next_node->time).tv_sec, NIPQUAD(next_node->src_ip), next_node->value);
-		next_node = (queue_node*)next_node->previous;
-	}
-	spin_unlock_bh(&webmon_lock);
+
+static int webmon_proc_show(struct seq_file *s, void *v)
+{
+	unsigned char* entry = (unsigned char*)v;
+	uint64_t time;
+	uint32_t src_ip;
+	memcpy(&time, entry, sizeof(uint64_t));
+	memcpy(&src_ip, entry + 8, sizeof(uint32_t));
+	seq_printf(s, "%ld\t"STRIP"\t%.*s\n", (unsigned long)time, NIPQUAD(src_ip), (int)entry[12], (char*)(entry + SNAPSHOT_ENTRY_HEADER_LENGTH));
 
 	return 0;
 }
 
 
-static struct seq_operations webmon_proc_domain_sops = {
+static struct seq_operations webmon_proc_sops = {
 	.start = webmon_proc_start,
 	.next  = webmon_proc_next,
 	.stop  = webmon_proc_stop,
-	.show  = webmon_proc_domain_show
+	.show  = webmon_proc_show
 };
 
-static struct seq_operations webmon_proc_search_sops = {
-	.start = webmon_proc_start,
-	.next  = webmon_proc_next,
-	.stop  = webmon_proc_stop,
-	.show  = webmon_proc_search_show
-};
 
+static int webmon_proc_open(struct file* file, webmon_store* store)
+{
+	int ret;
+	proc_snapshot* snapshot = (proc_snapshot*)kmalloc(sizeof(proc_snapshot), GFP_KERNEL);
+	if(snapshot == NULL)
+	{
+		return -ENOMEM;
+	}
+	snapshot->data = take_snapshot(store, &(snapshot->length));
+	if(snapshot->data == NULL)
+	{
+		kfree(snapshot);
+		return -ENOMEM;
+	}
+	snapshot->pos = 0;
+	snapshot->offset = SNAPSHOT_HEADER_LENGTH;
 
+	ret = seq_open(file, &webmon_proc_sops);
+	if(ret == 0)
+	{
+		((struct seq_file*)file->private_data)->private = snapshot;
+	}
+	else
+	{
+		vfree(snapshot->data);
+		kfree(snapshot);
+	}
+	return ret;
+}
 static int webmon_proc_domain_open(struct inode *inode, struct file* file)
 {
-	return seq_open(file, &webmon_proc_domain_sops);
+	return webmon_proc_open(file, &domain_store);
 }
 static int webmon_proc_search_open(struct inode *inode, struct file* file)
 {
-	return seq_open(file, &webmon_proc_search_sops);
+	return webmon_proc_open(file, &search_store);
+}
+static int webmon_proc_release(struct inode *inode, struct file* file)
+{
+	proc_snapshot* snapshot = (proc_snapshot*)((struct seq_file*)file->private_data)->private;
+	vfree(snapshot->data);
+	kfree(snapshot);
+	return seq_release(inode, file);
 }
 
 
@@ -679,14 +1295,14 @@ static struct file_operations webmon_proc_domain_fops = {
 	.open    = webmon_proc_domain_open,
 	.read    = seq_read,
 	.llseek  = seq_lseek,
-	.release = seq_release
+	.release = webmon_proc_release
 };
 static struct file_operations webmon_proc_search_fops = {
 	.owner   = THIS_MODULE,
 	.open    = webmon_proc_search_open,
 	.read    = seq_read,
 	.llseek  = seq_lseek,
-	.release = seq_release
+	.release = webmon_proc_release
 };
 
 
@@ -699,111 +1315,99 @@ static struct file_operations webmon_proc_search_fops = {
 
 static int ipt_webmon_set_ctl(struct sock *sk, int cmd, void *user, u_int32_t len)
 {
+	char* buffer;
+	if(len <= 1 + sizeof(uint32_t))
+	{
+		return 1;
+	}
 
-	char* buffer = kmalloc(len, GFP_ATOMIC);
+	/* the history is loaded into a new store before taking the lock, then swapped in */
+	buffer = kmalloc(len+1, GFP_KERNEL);
 	if(buffer == NULL) /* check for malloc failure */
 	{
 		return 0;
 	}
-	spin_lock_bh(&webmon_lock);
 	copy_from_user(buffer, user, len);
+	buffer[len] = '\0';
 
-	if(len > 1 + sizeof(uint32_t)) 
+	if(buffer[0] == WEBMON_DOMAIN || buffer[0] == WEBMON_SEARCH)
 	{
 		unsigned char type = buffer[0];
 		uint32_t max_queue_length = *((uint32_t*)(buffer+1));
 		char* data = buffer+1+sizeof(uint32_t);
 		char newline_terminator[] = { '\n', '\r' };
 		char whitespace_chars[] = { '\t', ' ' };
+		uint32_t other_max_length = type == WEBMON_DOMAIN ? max_search_queue_length : max_domain_queue_length;
+		webmon_store loaded;
+		webmon_store replaced;
+		webmon_store* store;
 
-		if(type == WEBMON_DOMAIN || type == WEBMON_SEARCH )
+		if(store_init(&loaded, max_queue_length, store_budget(max_memory, max_queue_length, other_max_length)) != 0)
 		{
-			unsigned long num_destroyed;
-			
+			printk("ipt_webmon: Can't allocate %u entries\n", max_queue_length);
+			kfree(buffer);
+			return 0;
+		}
 
-			/* destroy and re-initialize queue and map */
-			if(type == WEBMON_DOMAIN )
+		if(data[0] != '\0')
+		{
+			unsigned long num_lines;
+			unsigned long line_index;
+			char** lines = split_on_separators(data, newline_terminator, 2, -1, 0, &num_lines);
+			for(line_index=0; line_index < num_lines; line_index++)
 			{
-				destroy_map(domain_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
-				destroy_queue(recent_domains);
-				recent_domains = (queue*)malloc(sizeof(queue));
-				recent_domains->first = NULL;
-				recent_domains->last = NULL;
-				recent_domains->length = 0;
-				domain_map = initialize_map(0);
+				char* line = lines[line_index];
+				unsigned long num_pieces;
+				char** split = split_on_separators(line, whitespace_chars, 2, -1, 0, &num_pieces);
 			
-				max_domain_queue_length = max_queue_length;
-			}
-			else if(type == WEBMON_SEARCH)
-			{
-				destroy_map(search_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
-				destroy_queue(recent_searches);
-				recent_searches = (queue*)malloc(sizeof(queue));
-				recent_searches->first = NULL;
-				recent_searches->last = NULL;
-				recent_searches->length = 0;
-				search_map = initialize_map(0);
-				
-				max_search_queue_length = max_queue_length;
-			}
-			
-			if(data[0] != '\0')
-			{
-				unsigned long num_lines;
-				unsigned long line_index;
-				char** lines = split_on_separators(data, newline_terminator, 2, -1, 0, &num_lines);
-				for(line_index=0; line_index < num_lines; line_index++)
+				//check that there are 3 pieces (time, src_ip, value)
+				int length;
+				for(length=0; split[length] != NULL ; length++){}
+				if(length == 3)
 				{
-					char* line = lines[line_index];
-					unsigned long num_pieces;
-					char** split = split_on_separators(line, whitespace_chars, 2, -1, 0, &num_pieces);
-				
-					//check that there are 3 pieces (time, src_ip, value)
-					int length;
-					for(length=0; split[length] != NULL ; length++){}
-					if(length == 3)
+					time_t time;
+					int parsed_ip[4];
+					int valid_ip = sscanf(split[1], "%d.%d.%d.%d", parsed_ip, parsed_ip+1, parsed_ip+2, parsed_ip+3);
+					if(valid_ip == 4)
 					{
-						time_t time;
-						int parsed_ip[4];
-						int valid_ip = sscanf(split[1], "%d.%d.%d.%d", parsed_ip, parsed_ip+1, parsed_ip+2, parsed_ip+3);
-						if(valid_ip == 4)
-						{
-							valid_ip = parsed_ip[0] <= 255 && parsed_ip[1] <= 255 && parsed_ip[2] <= 255 && parsed_ip[3] <= 255 ? valid_ip : 0;
-						}
-						if(sscanf(split[0], "%ld", &time) > 0 && valid_ip == 4)
-						{
-							char* value = split[2];
-							char value_key[700];
-							uint32_t ip = (parsed_ip[0]<<24) + (parsed_ip[1]<<16) + (parsed_ip[2]<<8) +  (parsed_ip[3]) ;
-							ip = htonl(ip);
-							sprintf(value_key, STRIP"@%s", NIPQUAD(ip), value);
-							if(type == WEBMON_DOMAIN)
-							{
-								add_queue_node(ip, value, recent_domains, domain_map, value_key, max_domain_queue_length );
-								(recent_domains->first->time).tv_sec = time;
-							}
-							else if(type == WEBMON_SEARCH)
-							{
-								add_queue_node(ip, value, recent_searches, search_map, value_key, max_search_queue_length );
-								(recent_searches->first->time).tv_sec = time;
-							}
-						}
+						valid_ip = parsed_ip[0] <= 255 && parsed_ip[1] <= 255 && parsed_ip[2] <= 255 && parsed_ip[3] <= 255 ? valid_ip : 0;
 					}
-					
-					for(length=0; split[length] != NULL ; length++)
+					if(sscanf(split[0], "%ld", &time) > 0 && valid_ip == 4)
 					{
-						free(split[length]);
+						uint32_t ip = (parsed_ip[0]<<24) + (parsed_ip[1]<<16) + (parsed_ip[2]<<8) +  (parsed_ip[3]) ;
+						ip = htonl(ip);
+						store_add(&loaded, ip, split[2], (uint32_t)time);
 					}
-					free(split);
-					free(line);
 				}
-				free(lines);
+				
+				for(length=0; split[length] != NULL ; length++)
+				{
+					free(split[length]);
+				}
+				free(split);
+				free(line);
 			}
+			free(lines);
 		}
+
+		spin_lock_bh(&webmon_lock);
+		drain_rings(); /* so nothing recorded before this turns up after it */
+		store = type == WEBMON_DOMAIN ? &domain_store : &search_store;
+		replaced = *store;
+		*store = loaded;
+		if(type == WEBMON_DOMAIN)
+		{
+			max_domain_queue_length = max_queue_length;
+		}
+		else
+		{
+			max_search_queue_length = max_queue_length;
+		}
+		spin_unlock_bh(&webmon_lock);
+
+		store_free(&replaced);
 	}
 	kfree(buffer);
-	spin_unlock_bh(&webmon_lock);
-		
 	
 	return 1;
 }
@@ -813,101 +1417,208 @@ static struct nf_sockopt_ops ipt_webmon_sockopts =
 	.set_optmin = WEBMON_SET,
 	.set_optmax = WEBMON_SET+1,
 	.set        = ipt_webmon_set_ctl,
+	.get_optmin = WEBMON_GET_SNAPSHOT,
+	.get_optmax = WEBMON_GET_SNAPSHOT+1,
+	.get        = ipt_webmon_get_ctl
 };
 
+/*
+ * called from checkentry when a rule changes the limits, keeping what
+ * has been recorded.  The new stores are set up before taking the lock.
+ */
+static int resize_stores(uint32_t max_domains, uint32_t max_searches, uint32_t memory_kb)
+{
+	webmon_store domains;
+	webmon_store searches;
+	webmon_store replaced_domains;
+	webmon_store replaced_searches;
 
+	if(max_domains == max_domain_queue_length && max_searches == max_search_queue_length && memory_kb == max_memory)
+	{
+		return 0;
+	}
+	if(store_init(&domains, max_domains, store_budget(memory_kb, max_domains, max_searches)) != 0)
+	{
+		return -ENOMEM;
+	}
+	if(store_init(&searches, max_searches, store_budget(memory_kb, max_searches, max_domains)) != 0)
+	{
+		store_free(&domains);
+		return -ENOMEM;
+	}
+	if(domains.max_entries < max_domains || searches.max_entries < max_searches)
+	{
+		printk("ipt_webmon: max_memory of %u KB only fits %u domains and %u searches\n", memory_kb, domains.max_entries, searches.max_entries);
+	}
 
+	spin_lock_bh(&webmon_lock);
+	drain_rings();
+	store_copy(&domains, &domain_store);
+	store_copy(&searches, &search_store);
+	replaced_domains = domain_store;
+	replaced_searches = search_store;
+	domain_store = domains;
+	search_store = searches;
+	max_domain_queue_length = max_domains;
+	max_search_queue_length = max_searches;
+	max_memory = memory_kb;
+	spin_unlock_bh(&webmon_lock);
 
-static bool match(const struct sk_buff *skb, struct xt_action_param *par)
+	store_free(&replaced_domains);
+	store_free(&replaced_searches);
+	return 0;
+}
+
+
+/*
+ * exclude_ranges are sorted and merged into disjoint ranges when the
+ * rule is inserted (see normalize_ranges), so a binary search finds
+ * whether an ip is in the list
+ */
+static int ip_in_ranges(const struct ipt_webmon_info* info, uint32_t ip)
 {
+	uint32_t host_ip = (uint32_t)ntohl(ip);
+	uint32_t low = 0;
+	uint32_t high = info->num_exclude_ranges;
+	while(low < high)
+	{
+		uint32_t mid = low + ((high - low) >> 1);
+		const struct ipt_webmon_ip_range* r = &((info->exclude_ranges)[mid]);
+		if(host_ip < (uint32_t)ntohl(r->start))
+		{
+			high = mid;
+		}
+		else if(host_ip > (uint32_t)ntohl(r->end))
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	const struct ipt_webmon_info *info = (const struct ipt_webmon_info*)(par->matchinfo);
+static unsigned char should_save(const struct ipt_webmon_info* info, uint32_t src_ip)
+{
+	unsigned char in_list = ip_in_ranges(info, src_ip) ? 1 : 0;
+	return info->exclude_type == WEBMON_EXCLUDE ? !in_list : in_list;
+}
 
-	
-	struct iphdr* iph;
+static int compare_ranges(const void* a, const void* b)
+{
+	uint32_t a_start = (uint32_t)ntohl( ((const struct ipt_webmon_ip_range*)a)->start );
+	uint32_t b_start = (uint32_t)ntohl( ((const struct ipt_webmon_ip_range*)b)->start );
+	return a_start < b_start ? -1 : (a_start > b_start ? 1 : 0);
+}
 
-	/* linearize skb if necessary */
-	struct sk_buff *linear_skb;
-	int skb_copied;
-	if(skb_is_nonlinear(skb))
+static void normalize_ranges(struct ipt_webmon_info* info)
+{
+	struct ipt_webmon_ip_range* ranges = info->exclude_ranges;
+	uint32_t num_merged = 0;
+	uint32_t range_index;
+
+	sort(ranges, info->num_exclude_ranges, sizeof(struct ipt_webmon_ip_range), compare_ranges, NULL);
+	for(range_index = 0; range_index < info->num_exclude_ranges; range_index++)
 	{
-		linear_skb = skb_copy(skb, GFP_ATOMIC);
-		skb_copied = 1;
+		uint32_t start = (uint32_t)ntohl(ranges[range_index].start);
+		uint32_t end = (uint32_t)ntohl(ranges[range_index].end);
+		uint32_t prev_end = num_merged > 0 ? (uint32_t)ntohl(ranges[num_merged-1].end) : 0;
+
+		/* merge ranges that overlap or touch the previous one */
+		if(num_merged > 0 && (start <= prev_end || start - 1 == prev_end))
+		{
+			if(end > prev_end)
+			{
+				ranges[num_merged-1].end = ranges[range_index].end;
+			}
+		}
+		else
+		{
+			ranges[num_merged] = ranges[range_index];
+			num_merged++;
+		}
 	}
-	else
+	info->num_exclude_ranges = num_merged;
+}
+
+
+/*
+ * returns the start of the TCP payload that lies between payload_offset and
+ * payload_end (from the ip total length), setting payload_length to how much
+ * of it can be read, at most MAX_PAYLOAD_READ bytes.  The url parsers use
+ * str* functions, so a payload copied to the per-cpu buffer is NUL terminated.
+ */
+static const unsigned char* get_payload(const struct sk_buff* skb, int payload_offset, int payload_end, int* payload_length)
+{
+	unsigned char* buffer = this_cpu_ptr(payload_buffers)->data;
+	const unsigned char* payload;
+	int length;
+
+	payload_end = payload_end < (int)skb->len ? payload_end : (int)skb->len;
+	length = payload_end - payload_offset;
+	length = length < MAX_PAYLOAD_READ ? length : MAX_PAYLOAD_READ;
+	*payload_length = 0;
+	if(length <= 0)
+	{
+		return NULL;
+	}
+
+	payload = skb_header_pointer(skb, payload_offset, length, buffer);
+	if(payload == buffer)
 	{
-		linear_skb = (struct sk_buff*)skb;
-		skb_copied = 0;
+		buffer[length] = '\0';
 	}
+	*payload_length = payload == NULL ? 0 : length;
+	return payload;
+}
+
+static bool match(const struct sk_buff *skb, struct xt_action_param *par)
+{
+
+	const struct ipt_webmon_info *info = (const struct ipt_webmon_info*)(par->matchinfo);
 
 	
+	struct iphdr _iph;
+	const struct iphdr* iph;
 
 	/* ignore packets that are not TCP */
-	iph = (struct iphdr*)(skb_network_header(skb));
-	if(iph->protocol == IPPROTO_TCP)
+	iph = skb_header_pointer(skb, skb_network_offset(skb), sizeof(_iph), &_iph);
+	if(iph != NULL && iph->protocol == IPPROTO_TCP)
 	{
-		/* get payload */
-		struct tcphdr* tcp_hdr		= (struct tcphdr*)( ((unsigned char*)iph) + (iph->ihl*4) );
-		unsigned short payload_offset 	= (tcp_hdr->doff*4) + (iph->ihl*4);
-		unsigned char* payload 		= ((unsigned char*)iph) + payload_offset;
-		unsigned short payload_length	= ntohs(iph->tot_len) - payload_offset;
+		/* get payload, reading just the headers and the start of it, so nonlinear skbs need no copy */
+		struct tcphdr _tcph;
+		int tcp_offset			= skb_network_offset(skb) + (iph->ihl*4);
+		const struct tcphdr* tcp_hdr	= skb_header_pointer(skb, tcp_offset, sizeof(_tcph), &_tcph);
+		int payload_offset		= tcp_hdr == NULL ? 0 : tcp_offset + (tcp_hdr->doff*4);
+		int payload_end			= skb_network_offset(skb) + ntohs(iph->tot_len);
+		int payload_length		= 0;
+		const unsigned char* payload	= tcp_hdr == NULL ? NULL : get_payload(skb, payload_offset, payload_end, &payload_length);
 
 	
 
-		/* if payload length <= 10 bytes don't bother doing a check, otherwise check for match */
-		if(payload_length > 10)
+		if(payload != NULL)
 		{
-			/* are we dealing with a web page request */
-			if(strnicmp((char*)payload, "GET ", 4) == 0 || strnicmp(  (char*)payload, "POST ", 5) == 0 || strnicmp((char*)payload, "HEAD ", 5) == 0)
+			/* are we dealing with a web page request (if payload length <= 10 bytes don't bother) */
+			if(payload_length > 10 && (strnicmp((char*)payload, "GET ", 4) == 0 || strnicmp(  (char*)payload, "POST ", 5) == 0 || strnicmp((char*)payload, "HEAD ", 5) == 0))
 			{
 				char domain[650];
 				char path[650];
-				char domain_key[700];
-				unsigned char save = info->exclude_type == WEBMON_EXCLUDE ? 1 : 0;
-				uint32_t ip_index;
-
-			
-				for(ip_index = 0; ip_index < info->num_exclude_ips; ip_index++)
-				{
-					if( (info->exclude_ips)[ip_index] == iph->saddr )
-					{
-						save = info->exclude_type == WEBMON_EXCLUDE ? 0 : 1;
-					}
-				}
-				for(ip_index=0; ip_index < info->num_exclude_ranges; ip_index++)
-				{
-					struct ipt_webmon_ip_range r = (info->exclude_ranges)[ip_index];
-					if( (unsigned long)ntohl( r.start) <= (unsigned long)ntohl(iph->saddr) && (unsigned long)ntohl(r.end) >= (unsigned long)ntohl(iph->saddr) )
-					{
-						save = info->exclude_type == WEBMON_EXCLUDE ? 0 : 1;
-					}
-				}
+				unsigned char save = should_save(info, iph->saddr);
 
 
 				if(save)
 				{
 					extract_url(payload, payload_length, domain, path);
 
-					
-					sprintf(domain_key, STRIP"@%s", NIPQUAD(iph->saddr), domain);
-					
 					if(strlen(domain) > 0)
 					{
 						char *search_part = NULL;
-						spin_lock_bh(&webmon_lock);
+						struct timeval t;
+						do_gettimeofday(&t);
 
-						
-
-						if(get_string_map_element(domain_map, domain_key))
-						{
-							//update time
-							update_queue_node_time( (queue_node*)get_map_element(domain_map, domain_key), recent_domains );
-						}
-						else
-						{
-							//add
-							add_queue_node(iph->saddr, domain, recent_domains, domain_map, domain_key, max_domain_queue_length );
-						}
+						push_record(WEBMON_DOMAIN, iph->saddr, domain, &t);
 						
 							
 						/* printk("domain,path=\"%s\", \"%s\"\n", domain, path); */
@@ -1040,9 +1751,7 @@ static bool match(const struct sk_buff *skb, struct xt_action_param *par)
 						if(search_part != NULL)
 						{
 							int spi, si;
-							char search_key[700];
 							char search[650];
-							queue_node *recent_node = recent_searches->first;
 							
 							/*unescape, replacing whitespace with + */
 							si = 0;
@@ -1076,115 +1785,25 @@ static bool match(const struct sk_buff *skb, struct xt_action_param *par)
 								si++;
 							}
 							search[si] = '\0';
-							
-							
-							
-							sprintf(search_key, STRIP"@%s", NIPQUAD(iph->saddr), search);
-							
-							
-							/* Often times search engines will initiate a search as you type it in, but these intermediate queries aren't the real search query
-							 * So, if the most recent query is a substring of the current one, discard it in favor of this one
-							 */
-							if(recent_node != NULL)
-							{
-								if(recent_node->src_ip == iph->saddr)
-								{
-									struct timeval t;
-									do_gettimeofday(&t);
-									if( (recent_node->time).tv_sec + 1 >= t.tv_sec || ((recent_node->time).tv_sec + 5 >= t.tv_sec && within_edit_distance(search, recent_node->value, 2)))
-									{
-										char recent_key[700];
-										
-										sprintf(recent_key, STRIP"@%s", NIPQUAD(recent_node->src_ip), recent_node->value);
-										remove_map_element(search_map, recent_key);
-										
-										recent_searches->first = recent_node->next;
-										recent_searches->last = recent_searches->first == NULL ? NULL : recent_searches->last;
-										if(recent_searches->first != NULL)
-										{
-											recent_searches->first->previous = NULL;
-										}
-										recent_searches->length = recent_searches->length - 1 ;
-										free(recent_node->value);
-										free(recent_node);
-									}
-								}
-							}
-
 
-							
-							if(get_string_map_element(search_map, search_key))
-							{
-								//update time
-								update_queue_node_time( (queue_node*)get_map_element(search_map, search_key), recent_searches );
-							}
-							else
-							{
-								//add
-								add_queue_node(iph->saddr, search, recent_searches, search_map, search_key, max_search_queue_length );
-							}
+							push_record(WEBMON_SEARCH, iph->saddr, search, &t);
 						}
-						spin_unlock_bh(&webmon_lock);
 					}
 				}
 			}
-			else if ((unsigned short)ntohs(tcp_hdr->dest) == 443)	// broad assumption that traffic on 443 is HTTPS. make effort to return fast as soon as we know we are wrong to not slow down processing
+			else if(should_save(info, iph->saddr))
 			{
+				/* a TLS ClientHello on any port, or the segment completing one */
 				char domain[650];
-				char domain_key[700];
-				unsigned char save = info->exclude_type == WEBMON_EXCLUDE ? 1 : 0;
-				uint32_t ip_index;
-
-				for(ip_index = 0; ip_index < info->num_exclude_ips; ip_index++)
-				{
-					if( (info->exclude_ips)[ip_index] == iph->saddr )
-					{
-						save = info->exclude_type == WEBMON_EXCLUDE ? 0 : 1;
-					}
-				}
-				for(ip_index=0; ip_index < info->num_exclude_ranges; ip_index++)
+				if(tls_sni_extract(skb, tcp_hdr, payload_offset, payload_end, payload, payload_length, domain, sizeof(domain)) & TLS_SNI_FOUND)
 				{
-					struct ipt_webmon_ip_range r = (info->exclude_ranges)[ip_index];
-					if( (unsigned long)ntohl( r.start) <= (unsigned long)ntohl(iph->saddr) && (unsigned long)ntohl(r.end) >= (unsigned long)ntohl(iph->saddr) )
-					{
-						save = info->exclude_type == WEBMON_EXCLUDE ? 0 : 1;
-					}
-				}
-
-
-				if(save)
-				{
-					extract_url_https(payload, payload_length, domain);
-
-					sprintf(domain_key, STRIP"@%s", NIPQUAD(iph->saddr), domain);
-
-					if(strlen(domain) > 0)
-					{
-						spin_lock_bh(&webmon_lock);
-
-						if(get_string_map_element(domain_map, domain_key))
-						{
-							//update time
-							update_queue_node_time( (queue_node*)get_map_element(domain_map, domain_key), recent_domains );
-						}
-						else
-						{
-							//add
-							add_queue_node(iph->saddr, domain, recent_domains, domain_map, domain_key, max_domain_queue_length );
-						}
-
-						spin_unlock_bh(&webmon_lock);
-					}
+					struct timeval t;
+					do_gettimeofday(&t);
+					push_record(WEBMON_DOMAIN, iph->saddr, domain, &t);
 				}
 			}
 		}
 	}
-	
-	/* free skb if we made a copy to linearize it */
-	if(skb_copied == 1)
-	{
-		kfree_skb(linear_skb);
-	}
 
 
 	/* printk("returning %d from webmon\n\n\n", test); */
@@ -1197,6 +1816,42 @@ static int checkentry(const struct xt_mtchk_param *par)
 {
 
 	struct ipt_webmon_info *info = (struct ipt_webmon_info*)(par->matchinfo);
+	uint32_t range_index;
+
+	if(info->num_exclude_ranges > WEBMON_MAX_IP_RANGES)
+	{
+		printk("ipt_webmon: too many ip ranges in rule\n");
+		return -EINVAL;
+	}
+	for(range_index = 0; range_index < info->num_exclude_ranges; range_index++)
+	{
+		if( (uint32_t)ntohl((info->exclude_ranges)[range_index].start) > (uint32_t)ntohl((info->exclude_ranges)[range_index].end) )
+		{
+			printk("ipt_webmon: ip range start is after its end\n");
+			return -EINVAL;
+		}
+	}
+	if(info->max_domains > WEBMON_MAX_ENTRIES || info->max_searches > WEBMON_MAX_ENTRIES)
+	{
+		printk("ipt_webmon: at most %d domains and searches can be kept\n", WEBMON_MAX_ENTRIES);
+		return -EINVAL;
+	}
+	if(info->max_memory > WEBMON_MAX_MEMORY)
+	{
+		printk("ipt_webmon: max_memory can be at most %d KB\n", WEBMON_MAX_MEMORY);
+		return -EINVAL;
+	}
+	normalize_ranges(info);
+
+	if(info->ref_count == NULL) /* first instance, we're inserting rule */
+	{
+		/* vmalloc can sleep, so this is done before we lock */
+		if(resize_stores(info->max_domains, info->max_searches, info->max_memory) != 0)
+		{
+			printk("ipt_webmon: Can't allocate %u domains and %u searches\n", info->max_domains, info->max_searches);
+			return -ENOMEM;
+		}
+	}
 
 
 	spin_lock_bh(&webmon_lock);
@@ -1205,16 +1860,11 @@ static int checkentry(const struct xt_mtchk_param *par)
 		info->ref_count = (uint32_t*)kmalloc(sizeof(uint32_t), GFP_ATOMIC);
 		if(info->ref_count == NULL) /* deal with kmalloc failure */
 		{
+			spin_unlock_bh(&webmon_lock);
 			printk("ipt_webmon: kmalloc failure in checkentry!\n");
-			return 0;
+			return -ENOMEM;
 		}
 		*(info->ref_count) = 1;
-
-		
-		max_search_queue_length = info->max_searches;
-		max_domain_queue_length = info->max_domains;
-	
-
 	}
 	else
 	{
@@ -1259,19 +1909,31 @@ static int __init init(void)
 		struct proc_dir_entry *proc_webmon_recent_searches;
 	#endif
 
-	spin_lock_bh(&webmon_lock);
+	/* alloc_percpu can sleep, so allocate before taking the lock */
+	payload_buffers = alloc_percpu(payload_buffer);
+	if(payload_buffers == NULL)
+	{
+		printk("ipt_webmon: Can't allocate payload buffers. Aborting\n");
+		return -ENOMEM;
+	}
+	rings = alloc_percpu(webmon_ring);
+	if(rings == NULL)
+	{
+		printk("ipt_webmon: Can't allocate record rings. Aborting\n");
+		free_percpu(payload_buffers);
+		return -ENOMEM;
+	}
 
-	recent_domains = (queue*)malloc(sizeof(queue));
-	recent_domains->first = NULL;
-	recent_domains->last = NULL;
-	recent_domains->length = 0;
-	domain_map = initialize_string_map(0);
+	if(store_init(&domain_store, max_domain_queue_length, 0) != 0 || store_init(&search_store, max_search_queue_length, 0) != 0)
+	{
+		printk("ipt_webmon: Can't allocate history. Aborting\n");
+		store_free(&domain_store);
+		free_percpu(payload_buffers);
+		free_percpu(rings);
+		return -ENOMEM;
+	}
 
-	recent_searches = (queue*)malloc(sizeof(queue));
-	recent_searches->first = NULL;
-	recent_searches->last = NULL;
-	recent_searches->length = 0;
-	search_map = initialize_string_map(0);
+	spin_lock_bh(&webmon_lock);
 
 
 
@@ -1284,6 +1946,10 @@ static int __init init(void)
 	{
 		printk("ipt_webmon: Can't register sockopts. Aborting\n");
 		spin_unlock_bh(&webmon_lock);
+		store_free(&domain_store);
+		store_free(&search_store);
+		free_percpu(payload_buffers);
+		free_percpu(rings);
 		return -1;
 	}
 	spin_unlock_bh(&webmon_lock);
@@ -1294,7 +1960,8 @@ static int __init init(void)
 static void __exit fini(void)
 {
 
-	unsigned long num_destroyed;
+	/* no rules are left to push records, anything not yet drained is dropped */
+	cancel_work_sync(&drain_work);
 
 	spin_lock_bh(&webmon_lock);
 
@@ -1305,14 +1972,13 @@ static void __exit fini(void)
 	#endif
 	nf_unregister_sockopt(&ipt_webmon_sockopts);
 	xt_unregister_match(&webmon_match);
-	destroy_map(domain_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
-	destroy_map(search_map, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
-	destroy_queue(recent_domains);
-	destroy_queue(recent_searches);
 
 	spin_unlock_bh(&webmon_lock);
 
-
+	store_free(&domain_store);
+	store_free(&search_store);
+	free_percpu(payload_buffers);
+	free_percpu(rings);
 }
 
 module_init(init);
@@ -25,6 +25,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 
 /*
@@ -56,13 +61,24 @@
 /* utility functions necessary for module to work across multiple iptables versions */
 static int  my_check_inverse(const char option[], int* invert, int *my_optind, int argc);
 static void param_problem_exit_error(char* msg);
+static void normalize_domain(char* domain);
 
+#define SET_FILE 9
+
+/* --set_file is loaded into the kernel in final_check, once the set name is known */
+static char* set_name = NULL;
+static char* set_load_file = NULL;
 
 
 /* Function which prints out usage message. */
 static void help(void)
 {
-	printf(	"weburl options:\n  --contains [!] [STRING]\n  --contains_regex [!] [REGEX]\n --matches_exactly [!] [STRING]\n --domain_only\n --path_only\n");
+	printf(	"weburl options:\n  --contains [!] [STRING]\n  --contains_regex [!] [REGEX]\n --matches_exactly [!] [STRING]\n --domain_suffix [!] [DOMAIN]\n --set [!] [NAME]\n --set_file [FILE]\n --domain_only\n --path_only\n");
+	printf(	"\n--domain_suffix matches the domain and its subdomains, and implies --domain_only\n");
+	printf(	"\n--set matches against a named set of patterns, --set_file loads the set from\n"
+		"a file with one pattern per line, optionally preceded by contains, exact,\n"
+		"domain_contains, domain_exact, domain_suffix, path_contains or path_exact\n"
+		"(default contains)\n");
 }
 
 static struct option opts[] = 
@@ -70,6 +86,9 @@ static struct option opts[] =
 	{ .name = "contains", 		.has_arg = 1, .flag = 0, .val = WEBURL_CONTAINS_TYPE },	//string
 	{ .name = "contains_regex", 	.has_arg = 1, .flag = 0, .val = WEBURL_REGEX_TYPE },	//regex
 	{ .name = "matches_exactly",	.has_arg = 1, .flag = 0, .val = WEBURL_EXACT_TYPE },	//exact string match
+	{ .name = "domain_suffix",	.has_arg = 1, .flag = 0, .val = WEBURL_SUFFIX_TYPE },	//domain and its subdomains
+	{ .name = "set",		.has_arg = 1, .flag = 0, .val = WEBURL_SET_TYPE },	//named pattern set
+	{ .name = "set_file",		.has_arg = 1, .flag = 0, .val = SET_FILE },		//file to load set from
 	{ .name = "domain_only",	.has_arg = 0, .flag = 0, .val = WEBURL_DOMAIN_PART },	//only match domain portion of url
 	{ .name = "path_only",		.has_arg = 0, .flag = 0, .val = WEBURL_PATH_PART },	//only match path portion of url
 	{ .name = 0 }
@@ -94,7 +113,7 @@ static int parse(	int c,
 	struct ipt_weburl_info *info = (struct ipt_weburl_info *)(*match)->data;
 	int valid_arg = 0;
 
-	if(*flags < 10)
+	if(*flags % 100 < 10)
 	{
 		info->match_part = WEBURL_ALL_PART;
 	}
@@ -104,6 +123,8 @@ static int parse(	int c,
 		case WEBURL_CONTAINS_TYPE:
 		case WEBURL_REGEX_TYPE:
 		case WEBURL_EXACT_TYPE:
+		case WEBURL_SUFFIX_TYPE:
+		case WEBURL_SET_TYPE:
 			info->match_type = c;
 
 			//test whether to invert rule
@@ -112,14 +133,15 @@ static int parse(	int c,
 	
 			//test that test string is reasonable length, then to info
 			int testlen = strlen(argv[optind-1]);
-			if(testlen > 0 && testlen < MAX_TEST_STR)
+			int maxlen = c == WEBURL_SET_TYPE ? WEBURL_MAX_SET_NAME : MAX_TEST_STR;
+			if(testlen > 0 && testlen < maxlen)
 			{
 				strcpy(info->test_str, argv[optind-1]);
 			}
-			else if(testlen >= MAX_TEST_STR)
+			else if(testlen >= maxlen)
 			{
 				char err[100];
-				sprintf(err, "Parameter definition is too long, must be less than %d characters", MAX_TEST_STR);
+				sprintf(err, "Parameter definition is too long, must be less than %d characters", maxlen);
 				param_problem_exit_error(err);
 			}
 			else
@@ -131,15 +153,42 @@ static int parse(	int c,
 			{
 				param_problem_exit_error("You may only specify one string/pattern to match");
 			}
-			*flags = *flags + 1;
+			if(c == WEBURL_SUFFIX_TYPE)
+			{
+				/* only the domain has suffixes */
+				normalize_domain(info->test_str);
+				if(info->test_str[0] == '\0')
+				{
+					param_problem_exit_error("Parameter definition is incomplete");
+				}
+				if(*flags % 100 >= 10 && info->match_part != WEBURL_DOMAIN_PART)
+				{
+					param_problem_exit_error("--domain_suffix can't be used with --path_only");
+				}
+				*flags = *flags % 100 < 10 ? *flags + 10 : *flags;
+				info->match_part = WEBURL_DOMAIN_PART;
+			}
+			*flags = *flags + (c == WEBURL_SET_TYPE ? 101 : 1);
+			set_name = c == WEBURL_SET_TYPE ? info->test_str : set_name;
 			
 			valid_arg = 1;
 			break;
 
+		case SET_FILE:
+			set_load_file = strdup(optarg);
+			valid_arg = 1;
+			break;
+
 		case WEBURL_DOMAIN_PART:
 		case WEBURL_PATH_PART:
+			if(c == WEBURL_DOMAIN_PART && info->match_type == WEBURL_SUFFIX_TYPE)
+			{
+				/* already implied */
+				valid_arg = 1;
+				break;
+			}
 			info->match_part = c;
-			if(*flags >= 10)
+			if(*flags % 100 >= 10)
 			{
 				param_problem_exit_error("You may specify at most one part of the url to match:\n\t--domain_only, --path_only or neither (to match full url)\n");
 			}
@@ -173,12 +222,18 @@ static void print_weburl_args(	struct ipt_weburl_info* info )
 		case WEBURL_EXACT_TYPE:
 			printf("--matches_exactly ");
 			break;
+		case WEBURL_SUFFIX_TYPE:
+			printf("--domain_suffix ");
+			break;
+		case WEBURL_SET_TYPE:
+			printf("--set ");
+			break;
 	}
 	//test string
 	printf("%s ", info->test_str);
 
-	//match part
-	switch(info->match_part)
+	//match part, implied by --domain_suffix
+	switch(info->match_type == WEBURL_SUFFIX_TYPE ? WEBURL_ALL_PART : info->match_part)
 	{
 		case WEBURL_DOMAIN_PART:
 			printf("--domain_only ");
@@ -193,12 +248,191 @@ static void print_weburl_args(	struct ipt_weburl_info* info )
 	
 }
 
+/*
+ * lower cases a domain and drops the "*." or "." in front and the "."
+ * after it, so blocklist entries can be used as they are
+ */
+static void normalize_domain(char* domain)
+{
+	char* start = domain;
+	size_t length;
+	if(strncmp(start, "*.", 2) == 0)
+	{
+		start = start + 2;
+	}
+	start = *start == '.' ? start+1 : start;
+	memmove(domain, start, strlen(start)+1);
+	length = strlen(domain);
+	if(length > 0 && domain[length-1] == '.')
+	{
+		domain[length-1] = '\0';
+	}
+	for(start = domain; *start != '\0'; start++)
+	{
+		*start = (char)tolower((unsigned char)*start);
+	}
+}
+
+/* returns the match type and part for a set file keyword, 0 if it isn't one */
+static int set_keyword(const char* keyword, unsigned char* type, unsigned char* part)
+{
+	if(strcmp(keyword, "domain_suffix") == 0)
+	{
+		*type = WEBURL_SUFFIX_TYPE;
+		*part = WEBURL_DOMAIN_PART;
+		return 1;
+	}
+	static const char* keywords[] = { "contains", "exact", "domain_contains", "domain_exact", "path_contains", "path_exact", NULL };
+	static const unsigned char parts[] = { WEBURL_ALL_PART, WEBURL_DOMAIN_PART, WEBURL_PATH_PART };
+	int keyword_index;
+	for(keyword_index = 0; keywords[keyword_index] != NULL; keyword_index++)
+	{
+		if(strcmp(keyword, keywords[keyword_index]) == 0)
+		{
+			*type = keyword_index % 2 == 0 ? WEBURL_CONTAINS_TYPE : WEBURL_EXACT_TYPE;
+			*part = parts[keyword_index/2];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * reads a set file, one pattern per line, optionally preceded by a
+ * keyword (see set_keyword).  Empty lines and lines starting with # are
+ * skipped.  The patterns are sent to the kernel in the format described
+ * at ipt_weburl_set_ctl.
+ */
+static void do_set_load(char* name, char* file)
+{
+	FILE* in;
+	char line[MAX_TEST_STR+64];
+	unsigned char* data;
+	unsigned long data_length = WEBURL_MAX_SET_NAME + sizeof(uint32_t);
+	unsigned long data_size = 4096;
+	uint32_t num_patterns = 0;
+	int sockfd;
+	int result = -1;
+
+	in = strcmp(file, "/dev/null") == 0 ? NULL : fopen(file, "r");
+	if(in == NULL && strcmp(file, "/dev/null") != 0)
+	{
+		param_problem_exit_error("Can't read set file");
+	}
+	data = (unsigned char*)malloc(data_size);
+	if(data == NULL)
+	{
+		param_problem_exit_error("Memory allocation failure loading set file");
+	}
+	memset(data, 0, WEBURL_MAX_SET_NAME);
+	strcpy((char*)data, name);
+
+	while(in != NULL && fgets(line, sizeof(line), in) != NULL)
+	{
+		char* start = line;
+		char* pattern;
+		char* end;
+		unsigned char type = WEBURL_CONTAINS_TYPE;
+		unsigned char part = WEBURL_ALL_PART;
+		uint16_t pattern_length;
+
+		while(isspace((unsigned char)*start))
+		{
+			start++;
+		}
+		for(end = start + strlen(start); end > start && isspace((unsigned char)*(end-1)); end--) {}
+		*end = '\0';
+		if(*start == '\0' || *start == '#')
+		{
+			continue;
+		}
+
+		/* a first word followed by more is a keyword */
+		for(pattern = start; *pattern != '\0' && !isspace((unsigned char)*pattern); pattern++) {}
+		if(*pattern != '\0')
+		{
+			*pattern = '\0';
+			if(!set_keyword(start, &type, &part))
+			{
+				param_problem_exit_error("Invalid pattern type in set file");
+			}
+			for(pattern++; isspace((unsigned char)*pattern); pattern++) {}
+		}
+		else
+		{
+			pattern = start;
+		}
+
+		if(type == WEBURL_SUFFIX_TYPE)
+		{
+			normalize_domain(pattern);
+		}
+		pattern_length = (uint16_t)strlen(pattern);
+		if(pattern_length == 0)
+		{
+			continue;
+		}
+		if(pattern_length >= MAX_TEST_STR)
+		{
+			param_problem_exit_error("Pattern in set file is too long");
+		}
+		if(data_length + 4 + pattern_length > data_size)
+		{
+			data_size = data_size*2;
+			data = (unsigned char*)realloc(data, data_size);
+			if(data == NULL)
+			{
+				param_problem_exit_error("Memory allocation failure loading set file");
+			}
+		}
+		data[data_length] = type;
+		data[data_length+1] = part;
+		memcpy(data+data_length+2, &pattern_length, sizeof(uint16_t));
+		memcpy(data+data_length+4, pattern, pattern_length);
+		data_length = data_length + 4 + pattern_length;
+		num_patterns++;
+	}
+	if(in != NULL)
+	{
+		fclose(in);
+	}
+	memcpy(data+WEBURL_MAX_SET_NAME, &num_patterns, sizeof(uint32_t));
+
+	if(data_length > WEBURL_MAX_SET_LENGTH)
+	{
+		param_problem_exit_error("Set file is too large");
+	}
+	sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	if(sockfd >= 0)
+	{
+		result = setsockopt(sockfd, IPPROTO_IP, WEBURL_SET_PATTERNS, data, data_length);
+		close(sockfd);
+	}
+	free(data);
+	if(result != 0)
+	{
+		param_problem_exit_error("Can't load set into the kernel");
+	}
+}
+
 /* Final check; must have specified a test string with either --contains or --contains_regex. */
 static void final_check(unsigned int flags)
 {
 	if (flags %10 == 0)
 	{
-		param_problem_exit_error("You must specify '--contains' or '--contains_regex' or '--matches_exactly'");
+		param_problem_exit_error("You must specify '--contains' or '--contains_regex' or '--matches_exactly' or '--set'");
+	}
+	if(flags >= 100 && flags % 100 >= 10)
+	{
+		param_problem_exit_error("--domain_only and --path_only can't be used with --set, each pattern in a set has its own part");
+	}
+	if(set_load_file != NULL)
+	{
+		if(flags < 100)
+		{
+			param_problem_exit_error("--set_file requires --set");
+		}
+		do_set_load(set_name, set_load_file);
 	}
 }
 
@@ -236,7 +470,7 @@ static struct iptables_match weburl =
 		.version = IPTABLES_VERSION,
 	#endif
 	.size		= XT_ALIGN(sizeof(struct ipt_weburl_info)),
-	.userspacesize	= XT_ALIGN(sizeof(struct ipt_weburl_info)),
+	.userspacesize	= offsetof(struct ipt_weburl_info, set),
 	.help		= &help,
 	.parse		= &parse,
 	.final_check	= &final_check,
@@ -35,11 +35,31 @@
 #define WEBURL_DOMAIN_PART 5
 #define WEBURL_PATH_PART 6
 
+/*
+ * a --set rule matches against a named set of patterns, loaded with
+ * WEBURL_SET_PATTERNS, instead of test_str, which holds the set name
+ */
+#define WEBURL_SET_TYPE 7
+#define WEBURL_MAX_SET_NAME 32
+#define WEBURL_MAX_SET_LENGTH 16777216
+
+/*
+ * matches the domain and its subdomains: example.com matches
+ * example.com and www.example.com but not badexample.com
+ */
+#define WEBURL_SUFFIX_TYPE 8
+
+#define WEBURL_SET_PATTERNS 3072
+
 struct ipt_weburl_info
 {
 	char test_str[MAX_TEST_STR];
 	unsigned char match_type;
 	unsigned char match_part;
 	unsigned char invert;
+
+	/* set up by checkentry, not part of the rule as userspace sees it */
+	void* set;
+	void* regex;
 };
 #endif /*_IPT_WEBURL_H*/
@@ -29,12 +29,18 @@
 #include <net/sock.h>
 #include <net/ip.h>
 #include <net/tcp.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <net/netfilter/nf_conntrack.h>
 
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netfilter_ipv4/ipt_weburl.h>
 
 #include "weburl_deps/regexp.c"
 #include "weburl_deps/tree_map.h"
+#include "weburl_deps/tls_sni.h"
 
 
 #include <linux/ip.h>
@@ -48,7 +54,19 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Eric Bishop");
 MODULE_DESCRIPTION("Match URL in HTTP(S) requests, designed for use with Gargoyle web interface (www.gargoyle-router.com)");
 
-string_map* compiled_map = NULL;
+/*
+ * Requests are matched against at most the first MAX_PAYLOAD_READ bytes
+ * of the payload.  When those aren't all in the linear part of the skb
+ * (GRO, scatter-gather NICs) they are copied here rather than copying
+ * the whole skb.  match() runs with bottom halves disabled, so one
+ * buffer per cpu is enough.
+ */
+#define MAX_PAYLOAD_READ 2048
+typedef struct
+{
+	unsigned char data[MAX_PAYLOAD_READ+1];
+} payload_buffer;
+static payload_buffer __percpu* payload_buffers = NULL;
 
 int strnicmp(const char * cs,const char * ct,size_t count)
 {
@@ -99,44 +117,685 @@ char *strnistr(const char *s, const char *find, size_t slen)
       	return ((char *)s);
 }
 
+/* whether host is domain or one of its subdomains, ignoring case */
+static int domain_suffix_match(const char* host, const char* domain)
+{
+	size_t host_length = strlen(host);
+	size_t domain_length = strlen(domain);
+	if(host_length > 0 && host[host_length-1] == '.')
+	{
+		host_length--;
+	}
+	if(domain_length == 0 || domain_length > host_length)
+	{
+		return 0;
+	}
+	if(domain_length < host_length && host[host_length - domain_length - 1] != '.')
+	{
+		return 0;
+	}
+	return strnicmp(host + host_length - domain_length, domain, domain_length) == 0;
+}
+
 
-int do_match_test(unsigned char match_type,  const char* reference, char* query)
+/*
+ * regexes are compiled by checkentry, one per rule.  regexec keeps its
+ * state on the stack and only writes the sub-match pointers, which
+ * nothing here reads, into the compiled regex, so cpus can share it.
+ */
+int do_match_test(const struct ipt_weburl_info* info, char* query)
 {
 	int matches = 0;
-	struct regexp* r;
-	switch(match_type)
+	const char* reference = info->test_str;
+	switch(info->match_type)
 	{
 		case WEBURL_CONTAINS_TYPE:
 			matches = (strstr(query, reference) != NULL);
 			break;
 		case WEBURL_REGEX_TYPE:
+			matches = regexec((struct regexp*)info->regex, query);
+			break;
+		case WEBURL_EXACT_TYPE:
+			matches = (strstr(query, reference) != NULL) && strlen(query) == strlen(reference);
+			break;
+		case WEBURL_SUFFIX_TYPE:
+			matches = domain_suffix_match(query, reference);
+			break;
+	}
+	return matches;
+}
+
+/*
+ * A --set rule matches against a named set of contains and exact
+ * patterns, loaded with WEBURL_SET_PATTERNS, so that one rule can stand
+ * in for thousands of single pattern rules.  The contains patterns are
+ * compiled into an Aho-Corasick automaton, so a url is scanned once
+ * however many patterns the set has, and the exact patterns go in a
+ * hash table.
+ *
+ * Like --domain_only and --path_only, each pattern applies to the
+ * domain, the path or the whole url, so every node of the automaton
+ * records which parts the patterns ending there (or at any node on its
+ * fail chain) apply to, and only those count when scanning each part.
+ *
+ * Domain suffix patterns go in a trie of domain labels, last label
+ * first, so a host is looked up one label at a time from the right and
+ * matches when it reaches the end of a pattern.  The children of every
+ * node share one hash table keyed on the parent and the label, so each
+ * label costs 12 bytes plus its characters, whatever its fan out.
+ */
+#define SET_ALL_PART	1
+#define SET_DOMAIN_PART	2
+#define SET_PATH_PART	4
+
+#define AC_NONE		0xFFFFFFFF
+
+typedef struct
+{
+	uint32_t fail;		/* node for the longest proper suffix that is also in the trie */
+	uint32_t first_edge;
+	uint16_t num_edges;
+	unsigned char parts;
+} ac_node;
+
+#define SUFFIX_END		0x80000000	/* set in parent when a pattern ends at the node */
+#define SUFFIX_LABEL_BITS	6		/* labels are at most 63 characters */
+#define SUFFIX_LABEL_MASK	0x3F
+
+typedef struct
+{
+	uint32_t hash_next;
+	uint32_t parent;
+	uint32_t label;		/* offset into suffix_labels << SUFFIX_LABEL_BITS | length */
+} suffix_node;
+
+typedef struct
+{
+	uint32_t hash_next;
+	uint32_t value;		/* offset into strings */
+	uint16_t length;
+	unsigned char parts;
+} exact_pattern;
+
+/*
+ * everything lives in one vmalloc block starting with this struct.
+ * The edges of each node are sorted by byte, and the root, where most
+ * transitions end up, has a transition for every byte.
+ */
+typedef struct
+{
+	ac_node* nodes;
+	uint32_t* edge_targets;
+	unsigned char* edge_bytes;
+	uint32_t* root_next;
+	exact_pattern* exact;
+	uint32_t* exact_buckets;
+	uint32_t exact_mask;
+	char* strings;
+	suffix_node* suffix_nodes;	/* node 0 is the root, with no label */
+	uint32_t* suffix_buckets;
+	uint32_t suffix_mask;
+	char* suffix_labels;
+	unsigned char contains_parts;
+	unsigned char exact_parts;
+	unsigned char suffix_parts;
+} weburl_patterns;
+
+typedef struct
+{
+	weburl_patterns* patterns; /* NULL until the set is loaded */
+} weburl_set;
+
+/*
+ * sets are created by the first rule or load that names them, and kept
+ * until the module is unloaded, so info->set never goes stale.  The lock
+ * covers the map and swapping in new patterns.
+ */
+static string_map* sets = NULL;
+static DEFINE_RWLOCK(sets_lock);
+
+static unsigned char set_part(unsigned char match_part)
+{
+	switch(match_part)
+	{
+		case WEBURL_ALL_PART:
+			return SET_ALL_PART;
+		case WEBURL_DOMAIN_PART:
+			return SET_DOMAIN_PART;
+		case WEBURL_PATH_PART:
+			return SET_PATH_PART;
+	}
+	return 0;
+}
+
+static uint32_t trie_child(const uint32_t* first_child, const uint32_t* next_sibling, const unsigned char* bytes, uint32_t node, unsigned char c)
+{
+	uint32_t child;
+	for(child = first_child[node]; child != AC_NONE && bytes[child] <= c; child = next_sibling[child])
+	{
+		if(bytes[child] == c)
+		{
+			return child;
+		}
+	}
+	return AC_NONE;
+}
+
+static exact_pattern* find_exact(const weburl_patterns* patterns, const char* value, uint32_t length)
+{
+	uint32_t index;
+	for(index = patterns->exact_buckets[ jhash(value, length, 0) & patterns->exact_mask ]; index != AC_NONE; index = patterns->exact[index].hash_next)
+	{
+		exact_pattern* e = patterns->exact + index;
+		if(e->length == length && memcmp(patterns->strings + e->value, value, length) == 0)
+		{
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* the child of parent for label, AC_NONE if there is none */
+static uint32_t find_label(const weburl_patterns* patterns, uint32_t parent, const char* label, uint32_t length)
+{
+	uint32_t index;
+	for(index = patterns->suffix_buckets[ jhash(label, length, parent) & patterns->suffix_mask ]; index != AC_NONE; index = patterns->suffix_nodes[index].hash_next)
+	{
+		const suffix_node* n = patterns->suffix_nodes + index;
+		if(	(n->parent & ~SUFFIX_END) == parent &&
+			(n->label & SUFFIX_LABEL_MASK) == length &&
+			memcmp(patterns->suffix_labels + (n->label >> SUFFIX_LABEL_BITS), label, length) == 0
+			)
+		{
+			return index;
+		}
+	}
+	return AC_NONE;
+}
+
+/*
+ * builds the patterns of a set from the pattern list of a
+ * WEBURL_SET_PATTERNS request, see ipt_weburl_set_ctl.  The trie is
+ * built with temporary child/sibling lists, then laid out with the
+ * edges of each node next to each other.
+ */
+static weburl_patterns* compile_patterns(unsigned char* data, uint32_t length, uint32_t num_patterns, int* error)
+{
+	uint32_t contains_bytes = 0;
+	uint32_t num_exact = 0;
+	uint32_t exact_bytes = 0;
+	uint32_t num_labels = 0;
+	uint32_t suffix_bytes = 0;
+	uint32_t num_suffix_buckets = 16;
+	uint32_t num_suffix_nodes = 1;
+	uint32_t label_offset = 0;
+	uint32_t num_buckets = 16;
+	uint32_t num_nodes = 1;
+	uint32_t num_edges = 0;
+	uint32_t num_stored = 0;
+	uint32_t string_offset = 0;
+	uint32_t offset;
+	uint32_t pattern_index;
+	uint32_t node;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t* first_child;
+	uint32_t* next_sibling;
+	uint32_t* fail;
+	uint32_t* queue;
+	unsigned char* bytes;
+	unsigned char* parts;
+	unsigned char* block;
+	unsigned long size;
+	weburl_patterns* patterns;
+
+	*error = -EINVAL;
+	for(offset = 0, pattern_index = 0; pattern_index < num_patterns; pattern_index++)
+	{
+		uint16_t pattern_length;
+		if(length - offset < 4)
+		{
+			return NULL;
+		}
+		memcpy(&pattern_length, data+offset+2, sizeof(uint16_t));
+		if( (data[offset] != WEBURL_CONTAINS_TYPE && data[offset] != WEBURL_EXACT_TYPE && data[offset] != WEBURL_SUFFIX_TYPE) || set_part(data[offset+1]) == 0 || pattern_length == 0 || pattern_length > length - offset - 4)
+		{
+			return NULL;
+		}
+		if(data[offset] == WEBURL_CONTAINS_TYPE)
+		{
+			contains_bytes = contains_bytes + pattern_length;
+		}
+		else if(data[offset] == WEBURL_EXACT_TYPE)
+		{
+			num_exact++;
+			exact_bytes = exact_bytes + pattern_length;
+		}
+		else
+		{
+			/* suffixes only apply to the domain, are lower case and have no empty labels */
+			unsigned char* value = data+offset+4;
+			uint32_t label_length = 0;
+			uint16_t byte_index;
+			if(data[offset+1] != WEBURL_DOMAIN_PART)
+			{
+				return NULL;
+			}
+			for(byte_index = 0; byte_index <= pattern_length; byte_index++)
+			{
+				if(byte_index == pattern_length || value[byte_index] == '.')
+				{
+					if(label_length == 0 || label_length > SUFFIX_LABEL_MASK)
+					{
+						return NULL;
+					}
+					label_length = 0;
+					num_labels++;
+				}
+				else
+				{
+					value[byte_index] = (unsigned char)tolower(value[byte_index]);
+					label_length++;
+				}
+			}
+			suffix_bytes = suffix_bytes + pattern_length;
+		}
+		offset = offset + 4 + pattern_length;
+	}
+	while(num_buckets < num_exact)
+	{
+		num_buckets = num_buckets*2;
+	}
+	while(num_suffix_buckets < num_labels)
+	{
+		num_suffix_buckets = num_suffix_buckets*2;
+	}
 
-			if(compiled_map == NULL)
+	*error = -ENOMEM;
+	block = vmalloc( (contains_bytes+1)*(4*sizeof(uint32_t) + 2) );
+	if(block == NULL)
+	{
+		return NULL;
+	}
+	first_child  = (uint32_t*)block;
+	next_sibling = first_child + contains_bytes + 1;
+	fail         = next_sibling + contains_bytes + 1;
+	queue        = fail + contains_bytes + 1;
+	bytes        = (unsigned char*)(queue + contains_bytes + 1);
+	parts        = bytes + contains_bytes + 1;
+	first_child[0] = AC_NONE;
+	parts[0] = 0;
+
+	/* build the trie, keeping the children of each node sorted */
+	for(offset = 0, pattern_index = 0; pattern_index < num_patterns; pattern_index++)
+	{
+		uint16_t pattern_length;
+		uint16_t byte_index;
+		memcpy(&pattern_length, data+offset+2, sizeof(uint16_t));
+		if(data[offset] == WEBURL_CONTAINS_TYPE)
+		{
+			node = 0;
+			for(byte_index = 0; byte_index < pattern_length; byte_index++)
 			{
-				compiled_map = initialize_map(0);
-				if(compiled_map == NULL) /* test for malloc failure */
+				unsigned char c = data[offset+4+byte_index];
+				uint32_t* link = first_child + node;
+				while(*link != AC_NONE && bytes[*link] < c)
 				{
-					return 0;
+					link = next_sibling + *link;
 				}
+				if(*link == AC_NONE || bytes[*link] != c)
+				{
+					bytes[num_nodes] = c;
+					parts[num_nodes] = 0;
+					first_child[num_nodes] = AC_NONE;
+					next_sibling[num_nodes] = *link;
+					*link = num_nodes;
+					num_nodes++;
+				}
+				node = *link;
 			}
-			r = (struct regexp*)get_map_element(compiled_map, reference);
-			if(r == NULL)
+			parts[node] = parts[node] | set_part(data[offset+1]);
+		}
+		offset = offset + 4 + pattern_length;
+	}
+
+	/* fail links, breadth first so the fail link of a node's parent is always set */
+	fail[0] = 0;
+	queue[0] = 0;
+	for(head = 0, tail = 1; head < tail; head++)
+	{
+		uint32_t child;
+		node = queue[head];
+		for(child = first_child[node]; child != AC_NONE; child = next_sibling[child])
+		{
+			uint32_t suffix = fail[node];
+			fail[child] = 0;
+			while(node != 0)
 			{
-				int rlen = strlen(reference);
-				r= regcomp((char*)reference, &rlen);
-				if(r == NULL) /* test for malloc failure */
+				uint32_t next = trie_child(first_child, next_sibling, bytes, suffix, bytes[child]);
+				if(next != AC_NONE || suffix == 0)
 				{
-					return 0;
+					fail[child] = next == AC_NONE ? 0 : next;
+					break;
 				}
-				set_map_element(compiled_map, reference, (void*)r);
+				suffix = fail[suffix];
 			}
-			matches = regexec(r, query);
-			break;
-		case WEBURL_EXACT_TYPE:
-			matches = (strstr(query, reference) != NULL) && strlen(query) == strlen(reference);
-			break;
+			parts[child] = parts[child] | parts[ fail[child] ];
+			queue[tail] = child;
+			tail++;
+		}
 	}
-	return matches;
+
+	size =	sizeof(weburl_patterns) +
+		num_nodes*(sizeof(ac_node) + sizeof(uint32_t)) +
+		256*sizeof(uint32_t) +
+		num_exact*sizeof(exact_pattern) +
+		num_buckets*sizeof(uint32_t) +
+		(num_labels+1)*sizeof(suffix_node) +
+		num_suffix_buckets*sizeof(uint32_t) +
+		num_nodes +
+		exact_bytes + num_exact +
+		suffix_bytes;
+	patterns = (weburl_patterns*)vmalloc(size);
+	if(patterns == NULL)
+	{
+		vfree(block);
+		return NULL;
+	}
+	patterns->nodes         = (ac_node*)(patterns + 1);
+	patterns->edge_targets  = (uint32_t*)(patterns->nodes + num_nodes);
+	patterns->root_next     = patterns->edge_targets + num_nodes;
+	patterns->exact         = (exact_pattern*)(patterns->root_next + 256);
+	patterns->exact_buckets = (uint32_t*)(patterns->exact + num_exact);
+	patterns->suffix_nodes  = (suffix_node*)(patterns->exact_buckets + num_buckets);
+	patterns->suffix_buckets = (uint32_t*)(patterns->suffix_nodes + num_labels + 1);
+	patterns->edge_bytes    = (unsigned char*)(patterns->suffix_buckets + num_suffix_buckets);
+	patterns->strings       = (char*)(patterns->edge_bytes + num_nodes);
+	patterns->suffix_labels = patterns->strings + exact_bytes + num_exact;
+	patterns->exact_mask    = num_buckets - 1;
+	patterns->suffix_mask   = num_suffix_buckets - 1;
+	patterns->contains_parts = 0;
+	patterns->exact_parts   = 0;
+	patterns->suffix_parts  = 0;
+
+	for(node = 0; node < num_nodes; node++)
+	{
+		uint32_t child;
+		ac_node* n = patterns->nodes + node;
+		n->fail = fail[node];
+		n->parts = parts[node];
+		n->first_edge = num_edges;
+		n->num_edges = 0;
+		for(child = first_child[node]; child != AC_NONE; child = next_sibling[child])
+		{
+			patterns->edge_bytes[num_edges] = bytes[child];
+			patterns->edge_targets[num_edges] = child;
+			num_edges++;
+			n->num_edges++;
+		}
+		patterns->contains_parts = patterns->contains_parts | parts[node];
+	}
+	memset(patterns->root_next, 0, 256*sizeof(uint32_t));
+	for(node = first_child[0]; node != AC_NONE; node = next_sibling[node])
+	{
+		patterns->root_next[ bytes[node] ] = node;
+	}
+	vfree(block);
+
+	/* exact patterns, the same pattern for several parts is stored once */
+	memset(patterns->exact_buckets, 0xFF, num_buckets*sizeof(uint32_t));
+	for(offset = 0, pattern_index = 0; pattern_index < num_patterns; pattern_index++)
+	{
+		uint16_t pattern_length;
+		memcpy(&pattern_length, data+offset+2, sizeof(uint16_t));
+		if(data[offset] == WEBURL_EXACT_TYPE)
+		{
+			const char* value = (const char*)(data+offset+4);
+			exact_pattern* e = find_exact(patterns, value, pattern_length);
+			if(e == NULL)
+			{
+				uint32_t bucket = jhash(value, pattern_length, 0) & patterns->exact_mask;
+				e = patterns->exact + num_stored;
+				e->value = string_offset;
+				e->length = pattern_length;
+				e->parts = 0;
+				e->hash_next = patterns->exact_buckets[bucket];
+				patterns->exact_buckets[bucket] = num_stored;
+				memcpy(patterns->strings + string_offset, value, pattern_length);
+				patterns->strings[string_offset + pattern_length] = '\0';
+				string_offset = string_offset + pattern_length + 1;
+				num_stored++;
+			}
+			e->parts = e->parts | set_part(data[offset+1]);
+			patterns->exact_parts = patterns->exact_parts | e->parts;
+		}
+		offset = offset + 4 + pattern_length;
+	}
+
+	/* domain suffixes, inserting labels from the right */
+	memset(patterns->suffix_buckets, 0xFF, num_suffix_buckets*sizeof(uint32_t));
+	memset(patterns->suffix_nodes, 0, sizeof(suffix_node));
+	for(offset = 0, pattern_index = 0; pattern_index < num_patterns; pattern_index++)
+	{
+		uint16_t pattern_length;
+		memcpy(&pattern_length, data+offset+2, sizeof(uint16_t));
+		if(data[offset] == WEBURL_SUFFIX_TYPE)
+		{
+			const char* value = (const char*)(data+offset+4);
+			uint32_t end = pattern_length;
+			node = 0;
+			while(1)
+			{
+				uint32_t start = end;
+				uint32_t child;
+				while(start > 0 && value[start-1] != '.')
+				{
+					start--;
+				}
+				child = find_label(patterns, node, value+start, end-start);
+				if(child == AC_NONE)
+				{
+					uint32_t bucket = jhash(value+start, end-start, node) & patterns->suffix_mask;
+					suffix_node* n = patterns->suffix_nodes + num_suffix_nodes;
+					n->parent = node;
+					n->label = (label_offset << SUFFIX_LABEL_BITS) | (end-start);
+					n->hash_next = patterns->suffix_buckets[bucket];
+					patterns->suffix_buckets[bucket] = num_suffix_nodes;
+					memcpy(patterns->suffix_labels + label_offset, value+start, end-start);
+					label_offset = label_offset + (end-start);
+					child = num_suffix_nodes;
+					num_suffix_nodes++;
+				}
+				node = child;
+				if(start == 0)
+				{
+					break;
+				}
+				end = start - 1;
+			}
+			patterns->suffix_nodes[node].parent = patterns->suffix_nodes[node].parent | SUFFIX_END;
+			patterns->suffix_parts = SET_DOMAIN_PART;
+		}
+		offset = offset + 4 + pattern_length;
+	}
+
+	*error = 0;
+	return patterns;
+}
+
+static uint32_t ac_next(const weburl_patterns* patterns, uint32_t state, unsigned char c)
+{
+	while(state != 0)
+	{
+		const ac_node* n = patterns->nodes + state;
+		uint32_t low = n->first_edge;
+		uint32_t high = n->first_edge + n->num_edges;
+		while(low < high)
+		{
+			uint32_t mid = (low + high) >> 1;
+			unsigned char edge_byte = patterns->edge_bytes[mid];
+			if(edge_byte == c)
+			{
+				return patterns->edge_targets[mid];
+			}
+			if(edge_byte < c)
+			{
+				low = mid + 1;
+			}
+			else
+			{
+				high = mid;
+			}
+		}
+		state = n->fail;
+	}
+	return patterns->root_next[c];
+}
+
+/* whether text contains a pattern for one of parts */
+static int set_contains(const weburl_patterns* patterns, const char* text, unsigned char parts)
+{
+	uint32_t state = 0;
+	if((patterns->contains_parts & parts) == 0)
+	{
+		return 0;
+	}
+	for( ; *text != '\0'; text++)
+	{
+		state = ac_next(patterns, state, (unsigned char)*text);
+		if(patterns->nodes[state].parts & parts)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int set_exact(const weburl_patterns* patterns, const char* text, uint32_t length, unsigned char parts)
+{
+	exact_pattern* e;
+	if((patterns->exact_parts & parts) == 0)
+	{
+		return 0;
+	}
+	e = find_exact(patterns, text, length);
+	return e != NULL && (e->parts & parts) != 0;
+}
+
+/* whether host, or a domain it is a subdomain of, is a suffix pattern */
+static int set_suffix(const weburl_patterns* patterns, const char* host)
+{
+	char lower[625];
+	uint32_t end;
+	uint32_t node = 0;
+
+	if(patterns->suffix_parts == 0)
+	{
+		return 0;
+	}
+	for(end = 0; host[end] != '\0' && end < sizeof(lower); end++)
+	{
+		lower[end] = (char)tolower(host[end]);
+	}
+	end = end > 0 && lower[end-1] == '.' ? end-1 : end;
+	while(end > 0)
+	{
+		uint32_t start = end;
+		while(start > 0 && lower[start-1] != '.')
+		{
+			start--;
+		}
+		node = end - start > SUFFIX_LABEL_MASK ? AC_NONE : find_label(patterns, node, lower+start, end-start);
+		if(node == AC_NONE)
+		{
+			return 0;
+		}
+		if(patterns->suffix_nodes[node].parent & SUFFIX_END)
+		{
+			return 1;
+		}
+		if(start == 0)
+		{
+			return 0;
+		}
+		end = start - 1;
+	}
+	return 0;
+}
+
+/*
+ * the set equivalent of testing every part in http_match and
+ * https_match.  path is NULL for https requests, which have none.
+ * Everything the single pattern tests look at -- the url without the
+ * prefix, without www. or without the / of an empty path, the path
+ * without its leading / -- is a substring of what is scanned here, so
+ * contains patterns need only one scan of each.
+ */
+static int set_match(const weburl_patterns* patterns, const char* prefix, char* host, char* path)
+{
+	char* www_host = strstr(host, "www.") == host ? host+4 : NULL;
+	char* hosts[2];
+	int host_index;
+	uint32_t host_length = strlen(host);
+
+	if(	set_contains(patterns, host, SET_DOMAIN_PART) ||
+		set_suffix(patterns, host) ||
+		set_exact(patterns, host, host_length, SET_DOMAIN_PART) ||
+		(www_host != NULL && set_exact(patterns, www_host, host_length-4, SET_DOMAIN_PART))
+		)
+	{
+		return 1;
+	}
+	if(path != NULL)
+	{
+		uint32_t path_length = strlen(path);
+		if(	set_contains(patterns, path, SET_PATH_PART) ||
+			set_exact(patterns, path, path_length, SET_PATH_PART) ||
+			(path[0] == '/' && set_exact(patterns, path+1, path_length-1, SET_PATH_PART))
+			)
+		{
+			return 1;
+		}
+	}
+
+	if(((patterns->contains_parts | patterns->exact_parts) & SET_ALL_PART) == 0)
+	{
+		return 0;
+	}
+	hosts[0] = host;
+	hosts[1] = www_host;
+	for(host_index = 0; host_index < 2 && hosts[host_index] != NULL; host_index++)
+	{
+		char test_url[1250];
+		uint32_t prefix_length = strlen(prefix);
+		uint32_t url_length = snprintf(test_url, sizeof(test_url), "%s%s%s", prefix, hosts[host_index], path == NULL ? "" : path);
+		int empty_path = path != NULL && strcmp(path, "/") == 0;
+		url_length = url_length < sizeof(test_url) ? url_length : sizeof(test_url)-1;
+
+		if(	set_contains(patterns, test_url, SET_ALL_PART) ||
+			set_exact(patterns, test_url, url_length, SET_ALL_PART) ||
+			set_exact(patterns, test_url+prefix_length, url_length-prefix_length, SET_ALL_PART) ||
+			(empty_path && set_exact(patterns, test_url, url_length-1, SET_ALL_PART)) ||
+			(empty_path && set_exact(patterns, test_url+prefix_length, url_length-prefix_length-1, SET_ALL_PART))
+			)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int match_set(const struct ipt_weburl_info* info, const char* prefix, char* host, char* path)
+{
+	weburl_set* set = (weburl_set*)info->set;
+	int test = 0;
+	read_lock_bh(&sets_lock);
+	if(set->patterns != NULL)
+	{
+		test = set_match(set->patterns, prefix, host, path);
+	}
+	read_unlock_bh(&sets_lock);
+	return info->invert ? !test : test;
 }
 
 int http_match(const struct ipt_weburl_info* info, const unsigned char* packet_data, int packet_length)
@@ -219,21 +878,25 @@ int http_match(const struct ipt_weburl_info* info, const unsigned char* packet_d
 
 	/* printk("host = \"%s\", path =\"%s\"\n", host, path); */
 	
+	if(info->match_type == WEBURL_SET_TYPE)
+	{
+		return match_set(info, "http://", host, path);
+	}
 
 	switch(info->match_part)
 	{
 		case WEBURL_DOMAIN_PART:
-			test = do_match_test(info->match_type, info->test_str, host);
+			test = do_match_test(info, host);
 			if(!test && strstr(host, "www.") == host)
 			{
-				test = do_match_test(info->match_type, info->test_str, ((char*)host+4) );	
+				test = do_match_test(info, ((char*)host+4) );	
 			}
 			break;
 		case WEBURL_PATH_PART:
-			test = do_match_test(info->match_type, info->test_str, path);
+			test = do_match_test(info, path);
 			if( !test && path[0] == '/' )
 			{
-				test = do_match_test(info->match_type, info->test_str, ((char*)path+1) );
+				test = do_match_test(info, ((char*)path+1) );
 			}
 			break;
 		case WEBURL_ALL_PART:
@@ -253,11 +916,11 @@ int http_match(const struct ipt_weburl_info* info, const unsigned char* packet_d
 				{
 					strcat(test_url, path);
 				}
-				test = do_match_test(info->match_type, info->test_str, test_url);
+				test = do_match_test(info, test_url);
 				if(!test && strcmp(path, "/") == 0)
 				{
 					strcat(test_url, path);
-					test = do_match_test(info->match_type, info->test_str, test_url);
+					test = do_match_test(info, test_url);
 				}
 				
 				/* printk("test_url = \"%s\", test=%d\n", test_url, test); */
@@ -275,11 +938,11 @@ int http_match(const struct ipt_weburl_info* info, const unsigned char* packet_d
 					{
 						strcat(test_url, path);
 					}
-					test = do_match_test(info->match_type, info->test_str, test_url);
+					test = do_match_test(info, test_url);
 					if(!test && strcmp(path, "/") == 0)
 					{
 						strcat(test_url, path);
-						test = do_match_test(info->match_type, info->test_str, test_url);
+						test = do_match_test(info, test_url);
 					}
 				
 					/* printk("test_url = \"%s\", test=%d\n", test_url, test); */
@@ -298,97 +961,27 @@ int http_match(const struct ipt_weburl_info* info, const unsigned char* packet_d
 	return test;
 }
 
-int https_match(const struct ipt_weburl_info* info, const unsigned char* packet_data, int packet_length)
+/* host is the server name of a TLS ClientHello, see tls_sni_extract */
+int https_match(const struct ipt_weburl_info* info, char* host)
 {
 	int test = 0;
-
-	/* printk("found a https web page request\n"); */
-	char host[625] = "";
 	char* test_prefixes[6];
-	int prefix_index, x, packet_limit;
-	unsigned short cslen, ext_type, ext_len, maxextlen;
-	unsigned char conttype, hndshktype, sidlen, cmplen;
-	unsigned char* packet_ptr;
-
-	host[0] = '\0';
-	packet_ptr = packet_data;
-
-	if (packet_length < 43)
-	{
-		/*printk("Packet less than 43 bytes, exiting\n");*/
-		return test;
-	}
-	conttype = packet_data[0];
-	hndshktype = packet_data[5];
-	sidlen = packet_data[43];
-	/*printk("conttype=%d, hndshktype=%d, sidlen=%d ",conttype,hndshktype,sidlen);*/
-	if(conttype != 22)
-	{
-		/*printk("conttype not 22, exiting\n");*/
-		return test;
-	}
-	if(hndshktype != 1)
-	{
-		/*printk("hndshktype not 1, exiting\n");*/
-		return test;		//We aren't in a Client Hello
-	}
-
-	packet_ptr = packet_data + 1 + 43 + sidlen;		//Skip to Cipher Suites Length
-	cslen = ntohs(*(unsigned short*)packet_ptr);	//Length of Cipher Suites (2 byte)
-	packet_ptr = packet_ptr + 2 + cslen;	//Skip to Compression Methods
-	cmplen = *packet_ptr;	//Length of Compression Methods (1 byte)
-	packet_ptr = packet_ptr + 1 + cmplen;	//Skip to Extensions Length **IMPORTANT**
-	maxextlen = ntohs(*(unsigned short*)packet_ptr);	//Length of extensions (2 byte)
-	packet_ptr = packet_ptr + 2;	//Skip to beginning of first extension and start looping
-	ext_type = 1;
-	/*printk("cslen=%d, cmplen=%d, maxextlen=%d, pktlen=%d,ptrpos=%d\n",cslen,cmplen,maxextlen,packet_length,packet_ptr - packet_data);*/
-	//Limit the pointer bounds to the smaller of either the extensions length or the packet length
-	packet_limit = ((packet_ptr - packet_data) + maxextlen) < packet_length ? ((packet_ptr - packet_data) + maxextlen) : packet_length;
-
-	//Extension Type and Extension Length are both 2 byte. SNI Extension is "0"
-	while(((packet_ptr - packet_data) < packet_limit) && (ext_type != 0))
-	{
-		ext_type = ntohs(*(unsigned short*)packet_ptr);
-		packet_ptr = packet_ptr + 2;
-		ext_len = ntohs(*(unsigned short*)packet_ptr);
-		packet_ptr = packet_ptr + 2;
-		/*printk("ext_type=%d, ext_len=%d\n",ext_type,ext_len);*/
-		if(ext_type == 0)
-		{
-			unsigned short snilen;
-			/*printk("FOUND SNI EXT\n");*/
-			packet_ptr = packet_ptr + 3;	//Skip to length of SNI
-			snilen = ntohs(*(unsigned short*)packet_ptr);
-			/*printk("snilen=%d\n",snilen);*/
-			packet_ptr = packet_ptr + 2;	//Skip to beginning of SNI
-			if((((packet_ptr - packet_data) + snilen) < packet_limit) && (snilen > 0))
-			{
-				/*printk("FOUND SNI\n");*/
-				snilen = snilen < 625 ? snilen : 624; // prevent overflow
-				memcpy(host, packet_ptr, snilen);
-				host[snilen] = '\0';
-				for(x=0; host[x] != '\0'; x++)
-				{
-					host[x] = (char)tolower(host[x]);
-				}
-				/*printk("sni=%s\n",host);*/
-			}
-		}
-		else
-		{
-			packet_ptr = packet_ptr + ext_len;
-		}
-	}
+	int prefix_index;
 
 	/* printk("host = \"%s\"\n", host); */
 
+	if(info->match_type == WEBURL_SET_TYPE)
+	{
+		return match_set(info, "https://", host, NULL);
+	}
+
 	switch(info->match_part)
 	{
 		case WEBURL_DOMAIN_PART:
-			test = do_match_test(info->match_type, info->test_str, host);
+			test = do_match_test(info, host);
 			if(!test && strstr(host, "www.") == host)
 			{
-				test = do_match_test(info->match_type, info->test_str, ((char*)host+4) );
+				test = do_match_test(info, ((char*)host+4) );
 			}
 			break;
 		case WEBURL_PATH_PART:
@@ -406,7 +999,7 @@ int https_match(const struct ipt_weburl_info* info, const unsigned char* packet_
 				strcat(test_url, test_prefixes[prefix_index]);
 				strcat(test_url, host);
 
-				test = do_match_test(info->match_type, info->test_str, test_url);
+				test = do_match_test(info, test_url);
 
 				/* printk("test_url = \"%s\", test=%d\n", test_url, test); */
 			}
@@ -420,7 +1013,7 @@ int https_match(const struct ipt_weburl_info* info, const unsigned char* packet_
 					strcat(test_url, test_prefixes[prefix_index]);
 					strcat(test_url, www_host);
 
-					test = do_match_test(info->match_type, info->test_str, test_url);
+					test = do_match_test(info, test_url);
 
 					/* printk("test_url = \"%s\", test=%d\n", test_url, test); */
 				}
@@ -437,62 +1030,139 @@ int https_match(const struct ipt_weburl_info* info, const unsigned char* packet_
 }
 
 
-static bool match(const struct sk_buff *skb, struct xt_action_param *par)
+/*
+ * returns the start of the TCP payload that lies between payload_offset and
+ * payload_end (from the ip total length), setting payload_length to how much
+ * of it can be read, at most MAX_PAYLOAD_READ bytes.  http_match and
+ * https_match use str* functions, so a payload copied to the per-cpu buffer
+ * is NUL terminated.
+ */
+static const unsigned char* get_payload(const struct sk_buff* skb, int payload_offset, int payload_end, int* payload_length)
 {
+	unsigned char* buffer = this_cpu_ptr(payload_buffers)->data;
+	const unsigned char* payload;
+	int length;
 
-	const struct ipt_weburl_info *info = (const struct ipt_weburl_info*)(par->matchinfo);
+	payload_end = payload_end < (int)skb->len ? payload_end : (int)skb->len;
+	length = payload_end - payload_offset;
+	length = length < MAX_PAYLOAD_READ ? length : MAX_PAYLOAD_READ;
+	*payload_length = 0;
+	if(length <= 0)
+	{
+		return NULL;
+	}
 
-	
-	int test = 0;
-	struct iphdr* iph;	
+	payload = skb_header_pointer(skb, payload_offset, length, buffer);
+	if(payload == buffer)
+	{
+		buffer[length] = '\0';
+	}
+	*payload_length = payload == NULL ? 0 : length;
+	return payload;
+}
 
-	/* linearize skb if necessary */
-	struct sk_buff *linear_skb;
-	int skb_copied;
-	if(skb_is_nonlinear(skb))
+/*
+ * How far a connection has been classified, in ct->weburl (see the
+ * weburl-conntrack-state kernel patch).  This is shared by every weburl
+ * rule, and only records what kind of connection it is, not whether a
+ * rule matched, since rules only ever match the packets carrying a
+ * request.  Once the client's first request or ClientHello has gone by,
+ * the packets that can't carry another are passed over without reading
+ * their payload: everything from the server, everything a TLS client
+ * sends after its hello, and anything from an HTTP client that doesn't
+ * start with a request method.
+ */
+#define WEBURL_FLOW_HTTP	1
+#define WEBURL_FLOW_TLS		2	/* request_end is the sequence number just past the hello */
+
+static int flow_skip(const struct nf_conn* ct, enum ip_conntrack_info ctinfo, const struct sk_buff* skb, const struct tcphdr* tcp_hdr, int payload_offset)
+{
+	unsigned char state = ACCESS_ONCE(ct->weburl.state);
+	unsigned char _method[5];
+	const unsigned char* method;
+
+	if(state == 0)
+	{
+		return 0;
+	}
+	if(CTINFO2DIR(ctinfo) == IP_CT_DIR_REPLY)
 	{
-		linear_skb = skb_copy(skb, GFP_ATOMIC);
-		skb_copied = 1;
+		return 1;
 	}
-	else
+	if(state == WEBURL_FLOW_TLS)
 	{
-		linear_skb = (struct sk_buff*)skb;
-		skb_copied = 0;
+		/* retransmissions of the hello are matched again, and a hello still being reassembled is left to free itself */
+		smp_rmb(); /* read state before request_end */
+		return ct->tls_sni == NULL && ntohl(tcp_hdr->seq) - ct->weburl.request_end < 0x80000000;
 	}
+	method = skb_header_pointer(skb, payload_offset, sizeof(_method), _method);
+	return method == NULL || (strnicmp((char*)method, "GET ", 4) != 0 && strnicmp((char*)method, "POST ", 5) != 0 && strnicmp((char*)method, "HEAD ", 5) != 0);
+}
+
+static bool match(const struct sk_buff *skb, struct xt_action_param *par)
+{
+
+	const struct ipt_weburl_info *info = (const struct ipt_weburl_info*)(par->matchinfo);
 
 	
+	int test = 0;
+	struct iphdr _iph;
+	const struct iphdr* iph;
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn* ct = nf_ct_get(skb, &ctinfo);
+
+	/* the untracked conntrack is shared by every untracked packet, so it can't hold flow state */
+	if(ct != NULL && nf_ct_is_untracked(ct))
+	{
+		ct = NULL;
+	}
 
 	/* ignore packets that are not TCP */
-	iph = (struct iphdr*)(skb_network_header(skb));
-	if(iph->protocol == IPPROTO_TCP)
+	iph = skb_header_pointer(skb, skb_network_offset(skb), sizeof(_iph), &_iph);
+	if(iph != NULL && iph->protocol == IPPROTO_TCP)
 	{
-		/* get payload */
-		struct tcphdr* tcp_hdr		= (struct tcphdr*)( ((unsigned char*)iph) + (iph->ihl*4) );
-		unsigned short payload_offset 	= (tcp_hdr->doff*4) + (iph->ihl*4);
-		unsigned char* payload 		= ((unsigned char*)iph) + payload_offset;
-		unsigned short payload_length	= ntohs(iph->tot_len) - payload_offset;
+		/* get payload, reading just the headers and the start of it, so nonlinear skbs need no copy */
+		struct tcphdr _tcph;
+		int tcp_offset			= skb_network_offset(skb) + (iph->ihl*4);
+		const struct tcphdr* tcp_hdr	= skb_header_pointer(skb, tcp_offset, sizeof(_tcph), &_tcph);
+		int payload_offset		= tcp_hdr == NULL ? 0 : tcp_offset + (tcp_hdr->doff*4);
+		int payload_end			= skb_network_offset(skb) + ntohs(iph->tot_len);
+		int payload_length		= 0;
+		const unsigned char* payload;
 
-	
+		if(tcp_hdr == NULL || (ct != NULL && flow_skip(ct, ctinfo, skb, tcp_hdr, payload_offset)))
+		{
+			return 0;
+		}
+		payload = get_payload(skb, payload_offset, payload_end, &payload_length);
 
-		/* if payload length <= 10 bytes don't bother doing a check, otherwise check for match */
-		if(payload_length > 10)
+
+		/* if payload length <= 10 bytes don't bother doing a http check */
+		if(payload != NULL && payload_length > 10 && (strnicmp((char*)payload, "GET ", 4) == 0 || strnicmp(  (char*)payload, "POST ", 5) == 0 || strnicmp((char*)payload, "HEAD ", 5) == 0))
 		{
-			if(strnicmp((char*)payload, "GET ", 4) == 0 || strnicmp(  (char*)payload, "POST ", 5) == 0 || strnicmp((char*)payload, "HEAD ", 5) == 0)
+			test = http_match(info, payload, payload_length);
+			if(ct != NULL && ct->weburl.state == 0 && CTINFO2DIR(ctinfo) == IP_CT_DIR_ORIGINAL)
 			{
-				test = http_match(info, payload, payload_length);
+				ACCESS_ONCE(ct->weburl.state) = WEBURL_FLOW_HTTP;
 			}
-			else if ((unsigned short)ntohs(tcp_hdr->dest) == 443)
+		}
+		else if(payload != NULL)
+		{
+			/* a TLS ClientHello on any port, or the segment completing one */
+			char host[625];
+			if(tls_sni_extract(skb, tcp_hdr, payload_offset, payload_end, payload, payload_length, host, sizeof(host)) & TLS_SNI_FOUND)
 			{
-				test = https_match(info, payload, payload_length);
+				test = https_match(info, host);
+				if(ct != NULL && ct->weburl.state == 0 && CTINFO2DIR(ctinfo) == IP_CT_DIR_ORIGINAL)
+				{
+					payload_end = payload_end < (int)skb->len ? payload_end : (int)skb->len;
+					ct->weburl.request_end = ntohl(tcp_hdr->seq) + (uint32_t)(payload_end - payload_offset);
+					smp_wmb(); /* request_end is set before state says it can be used */
+					ACCESS_ONCE(ct->weburl.state) = WEBURL_FLOW_TLS;
+				}
 			}
 		}
 	}
-	
-	/* free skb if we made a copy to linearize it */
-	if(skb_copied == 1)
-	{
-		kfree_skb(linear_skb);
-	}
 
 
 	/* printk("returning %d from weburl\n\n\n", test); */
@@ -500,12 +1170,151 @@ static bool match(const struct sk_buff *skb, struct xt_action_param *par)
 }
 
 
+/* returns the set named name, creating it if need be, NULL on kmalloc failure */
+static weburl_set* get_set(const char* name)
+{
+	weburl_set* set;
+	write_lock_bh(&sets_lock);
+	set = (weburl_set*)get_string_map_element(sets, name);
+	if(set == NULL)
+	{
+		set = (weburl_set*)kmalloc(sizeof(weburl_set), GFP_ATOMIC);
+		if(set != NULL)
+		{
+			set->patterns = NULL;
+			set_string_map_element(sets, name, set);
+			if(get_string_map_element(sets, name) != set) /* map malloc failure */
+			{
+				kfree(set);
+				set = NULL;
+			}
+		}
+	}
+	write_unlock_bh(&sets_lock);
+	return set;
+}
+
+/*
+ * WEBURL_SET_PATTERNS replaces the patterns of a set, creating it if
+ * need be.  The new patterns are compiled before taking the lock.
+ *
+ * request structure:
+ * bytes 1-32  : set name, NUL terminated
+ * bytes 33-36 : number of patterns (uint32_t)
+ * then for each pattern:
+ * byte  1     : WEBURL_CONTAINS_TYPE, WEBURL_EXACT_TYPE or WEBURL_SUFFIX_TYPE
+ * byte  2     : WEBURL_ALL_PART, WEBURL_DOMAIN_PART or WEBURL_PATH_PART,
+ *               always WEBURL_DOMAIN_PART for WEBURL_SUFFIX_TYPE
+ * bytes 3-4   : pattern length (uint16_t)
+ * then the pattern, without a NUL
+ */
+static int ipt_weburl_set_ctl(struct sock *sk, int cmd, void *user, u_int32_t len)
+{
+	unsigned char* buffer;
+	char name[WEBURL_MAX_SET_NAME];
+	uint32_t num_patterns;
+	weburl_patterns* patterns;
+	weburl_patterns* replaced;
+	weburl_set* set;
+	int error;
+
+	if(len < WEBURL_MAX_SET_NAME + sizeof(uint32_t) || len > WEBURL_MAX_SET_LENGTH)
+	{
+		return -EINVAL;
+	}
+	buffer = vmalloc(len);
+	if(buffer == NULL)
+	{
+		return -ENOMEM;
+	}
+	if(copy_from_user(buffer, user, len) != 0)
+	{
+		vfree(buffer);
+		return -EFAULT;
+	}
+	memcpy(name, buffer, WEBURL_MAX_SET_NAME);
+	name[WEBURL_MAX_SET_NAME-1] = '\0';
+	memcpy(&num_patterns, buffer + WEBURL_MAX_SET_NAME, sizeof(uint32_t));
+
+	patterns = compile_patterns(buffer + WEBURL_MAX_SET_NAME + sizeof(uint32_t), len - WEBURL_MAX_SET_NAME - sizeof(uint32_t), num_patterns, &error);
+	vfree(buffer);
+	if(patterns == NULL)
+	{
+		printk("ipt_weburl: Can't load set \"%s\" (%d)\n", name, error);
+		return error;
+	}
+
+	set = get_set(name);
+	if(set == NULL)
+	{
+		vfree(patterns);
+		return -ENOMEM;
+	}
+	write_lock_bh(&sets_lock);
+	replaced = set->patterns;
+	set->patterns = patterns;
+	write_unlock_bh(&sets_lock);
+
+	if(replaced != NULL)
+	{
+		vfree(replaced);
+	}
+	return 0;
+}
+
+static struct nf_sockopt_ops ipt_weburl_sockopts =
+{
+	.pf         = PF_INET,
+	.set_optmin = WEBURL_SET_PATTERNS,
+	.set_optmax = WEBURL_SET_PATTERNS+1,
+	.set        = ipt_weburl_set_ctl,
+};
+
 static int checkentry(const struct xt_mtchk_param *par)
 {
+	struct ipt_weburl_info *info = (struct ipt_weburl_info*)(par->matchinfo);
+	info->set = NULL;
+	info->regex = NULL;
+	if(info->match_type == WEBURL_SUFFIX_TYPE && info->match_part != WEBURL_DOMAIN_PART)
+	{
+		return -EINVAL;
+	}
+	if(info->match_type == WEBURL_REGEX_TYPE)
+	{
+		int rlen;
+		info->test_str[MAX_TEST_STR-1] = '\0';
+		rlen = strlen(info->test_str);
+		info->regex = regcomp(info->test_str, &rlen);
+		if(info->regex == NULL)
+		{
+			printk("ipt_weburl: Can't compile regex \"%s\"\n", info->test_str);
+			return -EINVAL;
+		}
+	}
+	if(info->match_type == WEBURL_SET_TYPE)
+	{
+		info->test_str[WEBURL_MAX_SET_NAME-1] = '\0';
+		info->set = get_set(info->test_str);
+		if(info->set == NULL)
+		{
+			printk("ipt_weburl: kmalloc failure in checkentry!\n");
+			return -ENOMEM;
+		}
+	}
 	return 0;
 }
 
 
+static void destroy(const struct xt_mtdtor_param *par)
+{
+	struct ipt_weburl_info *info = (struct ipt_weburl_info*)(par->matchinfo);
+	if(info->regex != NULL)
+	{
+		kfree(info->regex);
+		info->regex = NULL;
+	}
+}
+
 static struct xt_match weburl_match  __read_mostly  = 
 {
 	.name		= "weburl",
@@ -513,24 +1322,58 @@ static struct xt_match weburl_match  __read_mostly  =
 	.family		= AF_INET,
 	.matchsize	= sizeof(struct ipt_weburl_info),
 	.checkentry	= &checkentry,
+	.destroy	= &destroy,
 	.me		= THIS_MODULE,
 };
 
 static int __init init(void)
 {
-	compiled_map = NULL;
+	unsigned long num_destroyed;
+	payload_buffers = alloc_percpu(payload_buffer);
+	if(payload_buffers == NULL)
+	{
+		printk("ipt_weburl: Can't allocate payload buffers. Aborting\n");
+		return -ENOMEM;
+	}
+	sets = initialize_string_map(0);
+	if(sets == NULL)
+	{
+		free_percpu(payload_buffers);
+		return -ENOMEM;
+	}
+	if(nf_register_sockopt(&ipt_weburl_sockopts) < 0)
+	{
+		printk("ipt_weburl: Can't register sockopts. Aborting\n");
+		destroy_string_map(sets, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+		free_percpu(payload_buffers);
+		return -1;
+	}
 	return xt_register_match(&weburl_match);
 
 }
 
 static void __exit fini(void)
 {
+	unsigned long num_destroyed;
+	unsigned long set_index;
+	weburl_set** all_sets;
+
+	nf_unregister_sockopt(&ipt_weburl_sockopts);
 	xt_unregister_match(&weburl_match);
-	if(compiled_map != NULL)
+	all_sets = (weburl_set**)destroy_string_map(sets, DESTROY_MODE_RETURN_VALUES, &num_destroyed);
+	for(set_index = 0; set_index < num_destroyed; set_index++)
+	{
+		if(all_sets[set_index]->patterns != NULL)
+		{
+			vfree(all_sets[set_index]->patterns);
+		}
+		kfree(all_sets[set_index]);
+	}
+	if(all_sets != NULL)
 	{
-		unsigned long num_destroyed;
-		destroy_map(compiled_map, DESTROY_MODE_FREE_VALUES, &num_destroyed);
+		kfree(all_sets);
 	}
+	free_percpu(payload_buffers);
 }
 
 module_init(init);
@@ -0,0 +1,298 @@
+/*  tls_sni --	Finds the server name (SNI) in TLS ClientHellos on any port,
+ *  		reassembling hellos that are split over several TCP segments.
+ *  		Used by both weburl and webmon, which each keep a copy.
+ *
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TLS_SNI_H
+#define TLS_SNI_H
+
+#include <net/netfilter/nf_conntrack.h>
+
+/*
+ * A ClientHello bigger than the segment it starts in (post-quantum key
+ * shares alone are over 1KB) is reassembled in scratch space hung off
+ * its conntrack, ct->tls_sni, which conntrack frees (see the
+ * tls-sni-conntrack kernel patch) if the connection ends first.  At most
+ * TLS_SNI_MAX_HELLO bytes of a hello are kept, out of order segments are
+ * dropped rather than buffered, and at most TLS_SNI_MAX_FLOWS
+ * connections, counted in nf_ct_tls_sni_count across both modules,
+ * reassemble at once.  Past that, hellos are only parsed as far as
+ * their first segment goes, as they were before.
+ */
+#define TLS_SNI_MAX_HELLO	4096
+#define TLS_SNI_MAX_FLOWS	256
+
+/* tls_sni_extract result flags */
+#define TLS_SNI_FOUND		1
+#define TLS_SNI_ECH		2	/* encrypted client hello: the name found is the outer, public one */
+
+#define TLS_EXT_SERVER_NAME	0x0000
+#define TLS_EXT_ECH		0xfe0d
+#define TLS_EXT_ESNI		0xffce
+
+typedef struct
+{
+	uint32_t start_seq;	/* of the first byte of the record */
+	uint16_t wanted;	/* bytes of the record to reassemble */
+	uint16_t received;	/* contiguous bytes from start_seq */
+	unsigned char dir;
+	unsigned char done;
+	unsigned char result;
+	unsigned char data[0];	/* the hello, then the server name once done */
+} tls_sni_scratch;
+
+static inline uint16_t tls_get16(const unsigned char* p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/*
+ * finds the server name in the ClientHello record at data, of which
+ * length bytes are here, copying it to host in lower case.  Anything
+ * past length is treated as missing, so a truncated hello is parsed as
+ * far as it goes.
+ */
+static int tls_sni_parse(const unsigned char* data, int length, char* host, int host_size)
+{
+	int pos;
+	int end;
+	int extensions_end;
+	int result = 0;
+
+	host[0] = '\0';
+	if(length < 9 || data[0] != 22 || data[5] != 1)
+	{
+		return 0;
+	}
+	end = 5 + tls_get16(data+3);
+	end = end < length ? end : length;
+
+	pos = 9 + 2 + 32;	/* handshake header, version, random */
+	if(pos + 1 > end)
+	{
+		return 0;
+	}
+	pos = pos + 1 + data[pos];		/* session id */
+	if(pos + 2 > end)
+	{
+		return 0;
+	}
+	pos = pos + 2 + tls_get16(data+pos);	/* cipher suites */
+	if(pos + 1 > end)
+	{
+		return 0;
+	}
+	pos = pos + 1 + data[pos];		/* compression methods */
+	if(pos + 2 > end)
+	{
+		return 0;
+	}
+	extensions_end = pos + 2 + tls_get16(data+pos);
+	extensions_end = extensions_end < end ? extensions_end : end;
+	pos = pos + 2;
+
+	while(pos + 4 <= extensions_end)
+	{
+		uint16_t type = tls_get16(data+pos);
+		int extension_end = pos + 4 + tls_get16(data+pos+2);
+		extension_end = extension_end < extensions_end ? extension_end : extensions_end;
+		pos = pos + 4;
+		if(type == TLS_EXT_SERVER_NAME && (result & TLS_SNI_FOUND) == 0)
+		{
+			/* a list of (type, length, name), after the list length */
+			int name_pos = pos + 2;
+			while(name_pos + 3 <= extension_end)
+			{
+				int name_length = tls_get16(data+name_pos+1);
+				if(name_pos + 3 + name_length > extension_end)
+				{
+					break;
+				}
+				if(data[name_pos] == 0 && name_length > 0)
+				{
+					int x;
+					name_length = name_length < host_size ? name_length : host_size-1;
+					for(x = 0; x < name_length; x++)
+					{
+						host[x] = (char)tolower(data[name_pos+3+x]);
+					}
+					host[name_length] = '\0';
+					result = result | TLS_SNI_FOUND;
+					break;
+				}
+				name_pos = name_pos + 3 + name_length;
+			}
+		}
+		else if(type == TLS_EXT_ECH || type == TLS_EXT_ESNI)
+		{
+			result = result | TLS_SNI_ECH;
+		}
+		pos = extension_end;
+	}
+	return (result & TLS_SNI_FOUND) ? result : 0;
+}
+
+static void tls_sni_release(struct nf_conn* ct)
+{
+	kfree(ct->tls_sni);
+	ct->tls_sni = NULL;
+	atomic_dec(&nf_ct_tls_sni_count);
+}
+
+/*
+ * adds a segment to the hello being reassembled for ct, with ct->lock
+ * held.  The server name is returned for the segment that completes the
+ * hello, to every module that looks at it, and to retransmissions of
+ * it.  The scratch space goes once a segment past the hello turns up.
+ */
+static int tls_sni_add(struct nf_conn* ct, unsigned char dir, const struct sk_buff* skb, uint32_t seq, int payload_offset, int payload_length, char* host, int host_size)
+{
+	tls_sni_scratch* scratch = (tls_sni_scratch*)ct->tls_sni;
+	uint32_t offset = seq - scratch->start_seq;
+
+	host[0] = '\0';
+	if(dir != scratch->dir || payload_length <= 0 || offset >= 0x80000000)
+	{
+		return 0;
+	}
+	if(offset >= scratch->wanted)
+	{
+		tls_sni_release(ct);
+		return 0;
+	}
+
+	if(scratch->done)
+	{
+		if(offset + payload_length >= scratch->wanted)
+		{
+			strncpy(host, (char*)scratch->data, host_size);
+			host[host_size-1] = '\0';
+			return scratch->result;
+		}
+		return 0;
+	}
+
+	if(offset <= scratch->received && offset + payload_length > scratch->received)
+	{
+		uint32_t copy_end = offset + payload_length < scratch->wanted ? offset + payload_length : scratch->wanted;
+		if(skb_copy_bits(skb, payload_offset + (scratch->received - offset), scratch->data + scratch->received, copy_end - scratch->received) < 0)
+		{
+			tls_sni_release(ct);
+			return 0;
+		}
+		scratch->received = (uint16_t)copy_end;
+	}
+	if(scratch->received == scratch->wanted)
+	{
+		scratch->result = (unsigned char)tls_sni_parse(scratch->data, scratch->wanted, host, host_size);
+		scratch->done = 1;
+		strncpy((char*)scratch->data, host, scratch->wanted);
+		scratch->data[scratch->wanted-1] = '\0';
+		return scratch->result;
+	}
+	return 0;
+}
+
+/*
+ * Finds the server name of a ClientHello, returning TLS_SNI_FOUND (and
+ * TLS_SNI_ECH) with it in host, or 0.  payload is the first
+ * payload_length bytes of the tcp payload, which starts at
+ * payload_offset in skb and ends at payload_end.  A hello that fits in
+ * payload, or one on an untracked packet, is parsed from it directly,
+ * without touching conntrack.
+ */
+static int tls_sni_extract(const struct sk_buff* skb, const struct tcphdr* tcp_hdr, int payload_offset, int payload_end, const unsigned char* payload, int payload_length, char* host, int host_size)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn* ct = nf_ct_get(skb, &ctinfo);
+	unsigned char dir;
+	uint32_t seq = ntohl(tcp_hdr->seq);
+	int segment_length;
+	int record_length;
+	int wanted;
+	int result;
+	tls_sni_scratch* scratch;
+
+	/* every untracked packet shares one conntrack, so only its own segment is parsed */
+	if(ct != NULL && nf_ct_is_untracked(ct))
+	{
+		ct = NULL;
+	}
+	dir = ct == NULL ? IP_CT_DIR_ORIGINAL : (unsigned char)CTINFO2DIR(ctinfo);
+
+	host[0] = '\0';
+	payload_end = payload_end < (int)skb->len ? payload_end : (int)skb->len;
+	segment_length = payload_end - payload_offset;
+
+	if(ct != NULL && ct->tls_sni != NULL)
+	{
+		result = 0;
+		spin_lock_bh(&ct->lock);
+		if(ct->tls_sni != NULL)
+		{
+			result = tls_sni_add(ct, dir, skb, seq, payload_offset, segment_length, host, host_size);
+		}
+		spin_unlock_bh(&ct->lock);
+		return result;
+	}
+
+	if(payload_length < 6 || payload[0] != 22 || payload[1] != 3 || payload[5] != 1)
+	{
+		return 0;
+	}
+	record_length = 5 + tls_get16(payload+3);
+	if(record_length <= payload_length || ct == NULL)
+	{
+		return tls_sni_parse(payload, payload_length, host, host_size);
+	}
+
+	wanted = record_length < TLS_SNI_MAX_HELLO ? record_length : TLS_SNI_MAX_HELLO;
+	scratch = NULL;
+	if(atomic_inc_return(&nf_ct_tls_sni_count) <= TLS_SNI_MAX_FLOWS)
+	{
+		scratch = (tls_sni_scratch*)kmalloc(sizeof(tls_sni_scratch) + wanted, GFP_ATOMIC);
+	}
+	if(scratch == NULL)
+	{
+		atomic_dec(&nf_ct_tls_sni_count);
+		return tls_sni_parse(payload, payload_length, host, host_size);
+	}
+	scratch->start_seq = seq;
+	scratch->wanted = (uint16_t)wanted;
+	scratch->received = 0;
+	scratch->dir = dir;
+	scratch->done = 0;
+	scratch->result = 0;
+
+	spin_lock_bh(&ct->lock);
+	if(ct->tls_sni == NULL)
+	{
+		ct->tls_sni = scratch;
+		scratch = NULL;
+	}
+	result = tls_sni_add(ct, dir, skb, seq, payload_offset, segment_length, host, host_size);
+	spin_unlock_bh(&ct->lock);
+
+	if(scratch != NULL) /* another cpu started on it first */
+	{
+		kfree(scratch);
+		atomic_dec(&nf_ct_tls_sni_count);
+	}
+	return result;
+}
+
+#endif /* TLS_SNI_H */
@@ -3,23 +3,50 @@
 #include <string.h>
 #include <stdint.h>
 #include <erics_tools.h>
+#include <ipt_bwctl.h>
 
-/* possible reset intervals */
-#define BANDWIDTH_MINUTE		  80
-#define BANDWIDTH_HOUR			  81
-#define BANDWIDTH_DAY			  82
-#define BANDWIDTH_WEEK			  83
-#define BANDWIDTH_MONTH			  84
-#define BANDWIDTH_NEVER			  85
+/*
+ * usage: bw_convert [-6] IN_FILE OUT_FILE
+ *
+ * IN_FILE is either a single history from a very old bwmon (named 
+ * *-15m, *-15h, *-15d or *-1y), or a history file for a whole rule
+ * id in any format libiptbwctl can read (-6 for IPv6 rules).
+ * Either way OUT_FILE is written in the current history file format.
+ */
+static int convert_history_file(char* in_file, char* out_file, int is_ip6)
+{
+	unsigned long num_ips = 0;
+	int success = 0;
+	if(is_ip6)
+	{
+		ip6_bw_history* histories = load_history6_from_file(in_file, &num_ips);
+		if(histories != NULL)
+		{
+			success = save_history6_to_file(histories, num_ips, out_file);
+			free_ip6_bw_histories(histories, num_ips);
+		}
+	}
+	else
+	{
+		ip_bw_history* histories = load_history_from_file(in_file, &num_ips);
+		if(histories != NULL)
+		{
+			success = save_history_to_file(histories, num_ips, out_file);
+			free_ip_bw_histories(histories, num_ips);
+		}
+	}
+	return success;
+}
 
 int main(int argc, char** argv)
 {
-	if(argc < 3)
+	int is_ip6 = argc > 1 && strcmp(argv[1], "-6") == 0 ? 1 : 0;
+	if(argc < 3 + is_ip6)
 	{
 		return 1;
 	}
-	char* in_file = argv[1];
-	char* out_file = argv[2];
+	char* in_file = argv[1 + is_ip6];
+	char* out_file = argv[2 + is_ip6];
 
 	uint64_t interval = 0;
 	unsigned char is_const;
@@ -131,6 +158,14 @@ int main(int argc, char** argv)
 
 		unsigned long num_destroyed;
 		destroy_list(node_list, DESTROY_MODE_FREE_VALUES, &num_destroyed);
+
+		/* what we just wrote is in the old layout, rewrite it in the current one */
+		convert_history_file(out_file, out_file, 0);
+	}
+	else if(!convert_history_file(in_file, out_file, is_ip6))
+	{
+		fprintf(stderr, "ERROR: could not convert history file\n");
+		return 1;
 	}
 
 
@@ -0,0 +1,646 @@
+/*  bwmond --	A daemon that keeps bandwidth monitor data backed up, and serves it
+ *  		to the web interface without having to query the kernel every time
+ *  		Originally designed for use with Gargoyle router firmware (gargoyle-router.com)
+ *
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ipt_bwctl.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <syslog.h>
+#include <signal.h>
+#include <utime.h>
+
+#define DEFAULT_CONFIG_PATH		"/tmp/bw_backup/bwmond.conf"
+#define DEFAULT_SOCKET_PATH		"/var/run/bwmond.sock"
+#define PID_PATH			"/var/run/bwmond.pid"
+
+#define DEFAULT_BACKUP_SECONDS		(4*60*60)
+#define DEFAULT_MAX_CACHE_MILLISECONDS	1000
+#define MAX_REQUEST_LENGTH		8192
+#define MAX_CONFIG_LINE_LENGTH		1024
+
+/*
+ * config file has one line per monitor:
+ * ID BACKUP_FILE [RESTORE_FILE]
+ *
+ * data is restored from RESTORE_FILE if it is given and exists, otherwise from BACKUP_FILE
+ */
+typedef struct monitor_struct
+{
+	char* id;
+	char* backup_file;
+	char* restore_file;
+	unsigned long num_ips;
+	ip_bw_history* data;
+} monitor;
+
+/*
+ * request (one line):  history [h|m|t] ID[,ID...]
+ * response:            OK, followed by exactly what bw_get -h -i ID[,ID...] would print
+ *                      or ERROR [reason] if any ID isn't monitored, or the kernel couldn't be queried
+ */
+
+int daemon_pid_file;
+volatile sig_atomic_t terminated;
+volatile sig_atomic_t backup_requested;
+
+static monitor* load_config(char* config_path, unsigned long* num_monitors);
+static void free_monitors(monitor* monitors, unsigned long num_monitors);
+static void restore_monitors(monitor* monitors, unsigned long num_monitors);
+static int refresh_monitors(monitor* monitors, unsigned long num_monitors, unsigned long long* last_refresh, unsigned long long max_age);
+static void backup_monitors(monitor* monitors, unsigned long num_monitors, char* touch_file);
+static int open_server_socket(char* socket_path);
+static void handle_request(int client, monitor* monitors, unsigned long num_monitors, unsigned long long* last_refresh, unsigned long long max_age);
+static int run_request_through_daemon(char* socket_path, char* ids, char output_type);
+static unsigned long long milliseconds_now(void);
+
+static void daemonize(char run_in_background);
+static void signal_handler(int sig);
+
+int main(int argc, char** argv)
+{
+	char* config_path = DEFAULT_CONFIG_PATH;
+	char* socket_path = DEFAULT_SOCKET_PATH;
+	char* touch_file = NULL;
+	char* query_ids = NULL;
+	char output_type = 'm';
+	char run_in_background = 1;
+	unsigned long backup_seconds = DEFAULT_BACKUP_SECONDS;
+	unsigned long long max_cache_age = DEFAULT_MAX_CACHE_MILLISECONDS;
+
+	monitor* monitors;
+	unsigned long num_monitors;
+	unsigned long long last_refresh = 0;
+	time_t next_backup;
+	int server;
+
+	int c;
+	while((c = getopt(argc, argv, "c:C:s:S:b:B:r:R:t:T:q:Q:o:O:gGuU")) != -1)
+	{
+		switch(c)
+		{
+			case 'c':
+			case 'C':
+				config_path = optarg;
+				break;
+			case 's':
+			case 'S':
+				socket_path = optarg;
+				break;
+			case 'b':
+			case 'B':
+				if(sscanf(optarg, "%lu", &backup_seconds) == 0 || backup_seconds == 0)
+				{
+					backup_seconds = DEFAULT_BACKUP_SECONDS;
+				}
+				break;
+			case 'r':
+			case 'R':
+				if(sscanf(optarg, "%llu", &max_cache_age) == 0)
+				{
+					max_cache_age = DEFAULT_MAX_CACHE_MILLISECONDS;
+				}
+				break;
+			case 't':
+			case 'T':
+				touch_file = optarg;
+				break;
+			case 'q':
+			case 'Q':
+				query_ids = optarg;
+				break;
+			case 'o':
+			case 'O':
+				output_type = optarg[0] == 'h' || optarg[0] == 't' ? optarg[0] : 'm';
+				break;
+			case 'g':
+			case 'G':
+				run_in_background = 0;
+				break;
+			case 'u':
+			case 'U':
+			default:
+				fprintf(stderr, "USAGE: %s [OPTIONS]\n", argv[0]);
+				fprintf(stderr, "\t-c [CONFIG_FILE] file listing monitors to back up, one \"ID BACKUP_FILE [RESTORE_FILE]\" per line\n");
+				fprintf(stderr, "\t-s [SOCKET] path of socket to serve queries on\n");
+				fprintf(stderr, "\t-b [SECONDS] time between backups\n");
+				fprintf(stderr, "\t-r [MILLISECONDS] maximum age of data served from memory\n");
+				fprintf(stderr, "\t-t [FILE] file to touch after every backup\n");
+				fprintf(stderr, "\t-g run in foreground\n");
+				fprintf(stderr, "\t-q [ID[,ID...]] query history of monitors from running daemon, then exit\n");
+				fprintf(stderr, "\t-o [h|m|t] output type for query, default is m\n");
+				fprintf(stderr, "\t-u print usage and exit\n");
+				return 0;
+		}
+	}
+
+	if(query_ids != NULL)
+	{
+		return run_request_through_daemon(socket_path, query_ids, output_type);
+	}
+
+	monitors = load_config(config_path, &num_monitors);
+	if(num_monitors == 0)
+	{
+		fprintf(stderr, "ERROR: No monitors defined in %s\n", config_path);
+		free_monitors(monitors, num_monitors);
+		return 1;
+	}
+
+	daemon_pid_file = -1;
+	terminated = 0;
+	backup_requested = 0;
+	daemonize(run_in_background);
+	openlog("bwmond", LOG_NDELAY|LOG_PID, LOG_DAEMON );
+
+	restore_monitors(monitors, num_monitors);
+	next_backup = time(NULL) + backup_seconds;
+
+	server = open_server_socket(socket_path);
+	if(server < 0)
+	{
+		syslog(LOG_ERR, "could not open socket %s, queries will not be served", socket_path);
+	}
+
+	while(!terminated)
+	{
+		fd_set read_fds;
+		struct timeval timeout;
+		time_t now;
+
+		/* wake up at least once a second, so a change in system time can't postpone a backup for long */
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		FD_ZERO(&read_fds);
+		if(server >= 0)
+		{
+			FD_SET(server, &read_fds);
+		}
+		if(select(server+1, &read_fds, NULL, NULL, &timeout) > 0 && server >= 0 && FD_ISSET(server, &read_fds))
+		{
+			int client = accept(server, NULL, NULL);
+			if(client >= 0)
+			{
+				handle_request(client, monitors, num_monitors, &last_refresh, max_cache_age);
+			}
+		}
+
+		now = time(NULL);
+		if(backup_requested || now >= next_backup || now + (time_t)backup_seconds < next_backup)
+		{
+			if(refresh_monitors(monitors, num_monitors, &last_refresh, 0))
+			{
+				backup_monitors(monitors, num_monitors, touch_file);
+			}
+			backup_requested = 0;
+			next_backup = now + backup_seconds;
+		}
+	}
+
+	/* data gets backed up once more on the way out, so nothing is lost when the monitor rules are removed */
+	if(refresh_monitors(monitors, num_monitors, &last_refresh, 0))
+	{
+		backup_monitors(monitors, num_monitors, touch_file);
+	}
+
+	if(server >= 0)
+	{
+		close(server);
+		unlink(socket_path);
+	}
+	closelog();
+
+	if(daemon_pid_file >= 0)
+	{
+		// unlocked variable unused, but we get compilation warnings if we don't store return value
+		int unlocked = -1;
+		unlocked = lockf(daemon_pid_file,F_ULOCK,0);
+		unlocked++; //dummy, prevents compilation warnings
+
+		close(daemon_pid_file);
+	}
+	unlink(PID_PATH);
+
+	free_monitors(monitors, num_monitors);
+	return 0;
+}
+
+static monitor* load_config(char* config_path, unsigned long* num_monitors)
+{
+	monitor* monitors = NULL;
+	unsigned long max_monitors = 0;
+	char line[MAX_CONFIG_LINE_LENGTH];
+	FILE* config = fopen(config_path, "r");
+
+	*num_monitors = 0;
+	if(config == NULL)
+	{
+		return NULL;
+	}
+	while(fgets(line, MAX_CONFIG_LINE_LENGTH, config) != NULL)
+	{
+		char whitespace[] = " \t\r\n";
+		char* id          = strtok(line, whitespace);
+		char* backup_file = id == NULL ? NULL : strtok(NULL, whitespace);
+		char* restore     = backup_file == NULL ? NULL : strtok(NULL, whitespace);
+		if(id == NULL || backup_file == NULL || id[0] == '#' || strlen(id) >= BANDWIDTH_MAX_ID_LENGTH)
+		{
+			continue;
+		}
+		if(*num_monitors == max_monitors)
+		{
+			monitor* old_monitors = monitors;
+			max_monitors = max_monitors == 0 ? 16 : max_monitors*2;
+			monitors = (monitor*)malloc(max_monitors*sizeof(monitor));
+			if(old_monitors != NULL)
+			{
+				memcpy(monitors, old_monitors, (*num_monitors)*sizeof(monitor));
+				free(old_monitors);
+			}
+		}
+		monitors[*num_monitors].id           = strdup(id);
+		monitors[*num_monitors].backup_file  = strdup(backup_file);
+		monitors[*num_monitors].restore_file = restore == NULL ? NULL : strdup(restore);
+		monitors[*num_monitors].num_ips      = 0;
+		monitors[*num_monitors].data         = NULL;
+		*num_monitors = *num_monitors + 1;
+	}
+	fclose(config);
+	return monitors;
+}
+
+static void free_monitors(monitor* monitors, unsigned long num_monitors)
+{
+	unsigned long monitor_index;
+	for(monitor_index=0; monitor_index < num_monitors; monitor_index++)
+	{
+		free(monitors[monitor_index].id);
+		free(monitors[monitor_index].backup_file);
+		if(monitors[monitor_index].restore_file != NULL)
+		{
+			free(monitors[monitor_index].restore_file);
+		}
+		free_ip_bw_histories(monitors[monitor_index].data, monitors[monitor_index].num_ips);
+	}
+	if(monitors != NULL)
+	{
+		free(monitors);
+	}
+}
+
+static void restore_monitors(monitor* monitors, unsigned long num_monitors)
+{
+	unsigned long monitor_index;
+	set_kernel_timezone();
+	for(monitor_index=0; monitor_index < num_monitors; monitor_index++)
+	{
+		monitor* m = monitors + monitor_index;
+		char* restore_file = m->backup_file;
+		unsigned long num_ips = 0;
+		ip_bw_history* history_data;
+
+		if(m->restore_file != NULL && access(m->restore_file, R_OK) == 0)
+		{
+			restore_file = m->restore_file;
+		}
+		history_data = load_history_from_file(restore_file, &num_ips);
+		if(history_data != NULL)
+		{
+			if(!set_bandwidth_history_for_rule_id(m->id, 1, num_ips, history_data, 1000))
+			{
+				syslog(LOG_WARNING, "could not restore %s from %s", m->id, restore_file);
+			}
+			free_ip_bw_histories(history_data, num_ips);
+		}
+	}
+}
+
+/*
+ * reloads every monitor from a single kernel snapshot, unless the data
+ * already in memory is newer than max_age milliseconds
+ */
+static int refresh_monitors(monitor* monitors, unsigned long num_monitors, unsigned long long* last_refresh, unsigned long long max_age)
+{
+	unsigned long long now = milliseconds_now();
+	char** ids;
+	unsigned long* num_ips;
+	ip_bw_history** data;
+	time_t snapshot_time;
+	unsigned long monitor_index;
+	int query_succeeded;
+
+	/* if clock went backwards, the data in memory is of unknown age */
+	if(*last_refresh > 0 && now >= *last_refresh && now - *last_refresh <= max_age)
+	{
+		return 1;
+	}
+
+	ids     = (char**)malloc(num_monitors*sizeof(char*));
+	num_ips = (unsigned long*)malloc(num_monitors*sizeof(unsigned long));
+	data    = (ip_bw_history**)malloc(num_monitors*sizeof(ip_bw_history*));
+	for(monitor_index=0; monitor_index < num_monitors; monitor_index++)
+	{
+		ids[monitor_index] = monitors[monitor_index].id;
+	}
+
+	set_kernel_timezone();
+	query_succeeded = get_bandwidth_history_for_rule_ids(ids, num_monitors, num_ips, data, &snapshot_time, 1000);
+	if(query_succeeded)
+	{
+		for(monitor_index=0; monitor_index < num_monitors; monitor_index++)
+		{
+			monitor* m = monitors + monitor_index;
+			free_ip_bw_histories(m->data, m->num_ips);
+			m->data    = data[monitor_index];
+			m->num_ips = data[monitor_index] == NULL ? 0 : num_ips[monitor_index];
+		}
+		*last_refresh = milliseconds_now();
+	}
+	else
+	{
+		syslog(LOG_WARNING, "bandwidth query failed");
+	}
+
+	free(ids);
+	free(num_ips);
+	free(data);
+	return query_succeeded;
+}
+
+static void backup_monitors(monitor* monitors, unsigned long num_monitors, char* touch_file)
+{
+	unsigned long monitor_index;
+	for(monitor_index=0; monitor_index < num_monitors; monitor_index++)
+	{
+		monitor* m = monitors + monitor_index;
+		if(m->data != NULL && !save_history_to_file(m->data, m->num_ips, m->backup_file))
+		{
+			syslog(LOG_WARNING, "could not back up %s to %s", m->id, m->backup_file);
+		}
+	}
+	if(touch_file != NULL)
+	{
+		utime(touch_file, NULL);
+	}
+}
+
+static int open_server_socket(char* socket_path)
+{
+	struct sockaddr_un addr;
+	int server;
+
+	if(strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		return -1;
+	}
+	server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(server < 0)
+	{
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+	if(bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, 8) < 0)
+	{
+		close(server);
+		return -1;
+	}
+	chmod(socket_path, 0600);
+	return server;
+}
+
+static void handle_request(int client, monitor* monitors, unsigned long num_monitors, unsigned long long* last_refresh, unsigned long long max_age)
+{
+	char request[MAX_REQUEST_LENGTH];
+	unsigned long request_length = 0;
+	struct timeval timeout;
+	char* type;
+	char* output_type;
+	char* ids;
+	char* id;
+	FILE* out;
+
+	/* don't let a client that never finishes its request hold up backups */
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	while(request_length < MAX_REQUEST_LENGTH-1 && (request_length == 0 || request[request_length-1] != '\n'))
+	{
+		ssize_t read_length = read(client, request + request_length, MAX_REQUEST_LENGTH-1-request_length);
+		if(read_length <= 0)
+		{
+			break;
+		}
+		request_length = request_length + read_length;
+	}
+	request[request_length] = '\0';
+
+	out = fdopen(client, "w");
+	if(out == NULL)
+	{
+		close(client);
+		return;
+	}
+
+	type        = strtok(request, " \t\r\n");
+	output_type = type == NULL ? NULL : strtok(NULL, " \t\r\n");
+	ids         = output_type == NULL ? NULL : strtok(NULL, " \t\r\n");
+	if(ids == NULL || strcmp(type, "history") != 0)
+	{
+		fprintf(out, "ERROR invalid request\n");
+	}
+	else if(!refresh_monitors(monitors, num_monitors, last_refresh, max_age))
+	{
+		fprintf(out, "ERROR bandwidth query failed\n");
+	}
+	else
+	{
+		/* check every id is monitored before printing anything */
+		char* ids_copy = strdup(ids);
+		int all_found = 1;
+		for(id = strtok(ids_copy, ","); id != NULL && all_found; id = strtok(NULL, ","))
+		{
+			unsigned long monitor_index;
+			for(monitor_index=0; monitor_index < num_monitors && strcmp(monitors[monitor_index].id, id) != 0; monitor_index++){}
+			all_found = monitor_index < num_monitors;
+		}
+		free(ids_copy);
+
+		if(!all_found)
+		{
+			fprintf(out, "ERROR unknown id\n");
+		}
+		else
+		{
+			fprintf(out, "OK\n");
+			for(id = strtok(ids, ","); id != NULL; id = strtok(NULL, ","))
+			{
+				unsigned long monitor_index;
+				for(monitor_index=0; strcmp(monitors[monitor_index].id, id) != 0; monitor_index++){}
+				if(monitors[monitor_index].num_ips > 0)
+				{
+					print_histories(out, id, monitors[monitor_index].data, monitors[monitor_index].num_ips, output_type[0]);
+				}
+				fprintf(out, "\n");
+			}
+		}
+	}
+	fclose(out);
+}
+
+/* returns 0 and prints response if daemon answered, 1 if it couldn't (so caller can fall back to bw_get) */
+static int run_request_through_daemon(char* socket_path, char* ids, char output_type)
+{
+	struct sockaddr_un addr;
+	char status[MAX_CONFIG_LINE_LENGTH];
+	char buffer[4096];
+	size_t read_length;
+	int client;
+	FILE* in;
+
+	if(strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		return 1;
+	}
+	client = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(client < 0)
+	{
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if(connect(client, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		close(client);
+		return 1;
+	}
+
+	in = fdopen(client, "r+");
+	if(in == NULL)
+	{
+		close(client);
+		return 1;
+	}
+	fprintf(in, "history %c %s\n", output_type, ids);
+	fflush(in);
+
+	if(fgets(status, MAX_CONFIG_LINE_LENGTH, in) == NULL || strcmp(status, "OK\n") != 0)
+	{
+		fclose(in);
+		return 1;
+	}
+	while((read_length = fread(buffer, 1, sizeof(buffer), in)) > 0)
+	{
+		fwrite(buffer, 1, read_length, stdout);
+	}
+	fclose(in);
+	return 0;
+}
+
+static unsigned long long milliseconds_now(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (((unsigned long long)now.tv_sec)*1000) + (now.tv_usec/1000);
+}
+
+static void daemonize(char run_in_background) //background variable is useful for debugging, causes program to run in foreground if 0
+{
+	if(run_in_background != 0)
+	{
+		//fork and end parent process
+		FILE* reopened;
+		int i=fork();
+		if (i != 0)
+		{
+			if(i < 0) //exit on fork error
+			{
+				exit(1);
+			}
+			else //this is parent, exit cleanly
+			{
+				exit(0);
+			}
+		}
+
+		/********************************
+		* child continues as a daemon after parent exits
+		********************************/
+		// obtain a new process group & close all file descriptors
+		setsid();
+		for(i=getdtablesize();i>=0;--i)
+		{
+			close(i);
+		}
+
+		// close standard i/o
+		//
+		// reopened file handle doesn't do anything,
+		// but we get compilation warnings if we don't store/use return values
+		reopened = freopen( "/dev/null", "r", stdin);
+		reopened = freopen( "/dev/null", "w", stdout);
+		reopened = freopen( "/dev/null", "w", stderr);
+		if(reopened){ i++; } //dummy, prevents compilation warnings
+	}
+
+
+	// record pid to lockfile
+	daemon_pid_file = open(PID_PATH,O_RDWR|O_CREAT,0644);
+	if(daemon_pid_file<0) // exit if we can't open file
+	{
+		exit(1);
+	}
+	if(lockf(daemon_pid_file,F_TLOCK,0)<0) // try to lock file, exit if we can't
+	{
+		exit(1);
+	}
+	char pid_str[25];
+	sprintf(pid_str,"%d\n",getpid());
+	if( write(daemon_pid_file,pid_str,strlen(pid_str)) < strlen(pid_str))
+	{
+		exit(1);
+	}
+
+
+	//set signal handlers
+	signal(SIGTERM,signal_handler);
+	signal(SIGINT, signal_handler);
+	signal(SIGUSR1,signal_handler);
+	signal(SIGPIPE,SIG_IGN);
+}
+
+static void signal_handler(int sig)
+{
+	if(sig == SIGTERM || sig == SIGINT )
+	{
+		terminated = 1; //exit cleanly on SIGTERM signal
+	}
+	else if(sig == SIGUSR1)
+	{
+		backup_requested = 1; //back up now
+	}
+	else
+	{
+		//ignore other signals
+	}
+}
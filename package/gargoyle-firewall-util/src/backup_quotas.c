@@ -41,7 +41,6 @@ int main(void)
 	struct uci_context *ctx = uci_alloc_context();
 	list* quota_sections = get_all_sections_of_type(ctx, "firewall", "quota");
 	system("mkdir -p /usr/data/quotas");
-	unlock_bandwidth_semaphore_on_exit();
 	while(quota_sections->length > 0)
 	{
 		char* next_quota = shift_list(quota_sections);
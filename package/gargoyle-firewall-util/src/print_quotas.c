@@ -34,13 +34,23 @@ list* get_all_sections_of_type(struct uci_context *ctx, char* package, char* sec
 void  backup_quota(char* quota_id, char* quota_backup_dir);
 char* get_uci_option(struct uci_context* ctx,char* package_name, char* section_name, char* option_name);
 char* get_option_value_string(struct uci_option* uopt);
+char* get_quota_id(struct uci_context* ctx, char* quota_section, char** ip);
+string_map* get_all_quota_usage(struct uci_context* ctx, list* quota_sections);
+
+typedef struct
+{
+	unsigned long num_ips;
+	ip_bw* ip_buf;
+} quota_usage;
+
+static char* types[] = { "combined_limit", "ingress_limit", "egress_limit" };
+static char* postfixes[] = { "_combined", "_ingress", "_egress" };
 
 
 int main(void)
 {
 	struct uci_context *ctx = uci_alloc_context();
 	list* quota_sections = get_all_sections_of_type(ctx, "firewall", "quota");
-	unlock_bandwidth_semaphore_on_exit();
 
 	/* for each ip have uint64_t[6], */
 	string_map *id_ip_to_bandwidth = initialize_string_map(1);
@@ -48,33 +58,16 @@ int main(void)
 	string_map *id_ip_to_limits    = initialize_string_map(1);
 	list *id_to_time               = initialize_list();
 
+	/* all quota rules are read in one query, so usage for every quota is from the same instant */
+	string_map *type_id_to_usage   = get_all_quota_usage(ctx, quota_sections);
+
 	while(quota_sections->length > 0)
 	{
 		char* next_quota = shift_list(quota_sections);
 		
 
-		/* base id for quota is the ip associated with it*/
-		char *id = get_uci_option(ctx, "firewall", next_quota, "id");
-		char* ip = get_uci_option(ctx, "firewall", next_quota, "ip");	
-		if(ip == NULL)
-		{
-			ip = strdup("ALL");
-		}
-		else if(strcmp(ip, "") == 0)
-		{
-			free(ip);
-			ip = strdup("ALL");
-		}
-		if(id == NULL)
-		{
-			id = strdup(ip);
-		}
-		else if(strcmp(id, "") == 0)
-		{
-			free(id);
-			id = strdup(ip);
-		}
-
+		char* ip;
+		char* id = get_quota_id(ctx, next_quota, &ip);
 
 
 
@@ -125,10 +118,6 @@ int main(void)
 			push_list(id_to_time, dynamic_strcat(3, "quotaTimes[\"", id, "\"] = [\"\", \"\", \"\", \"always\"];"));
 		}
 
-		char* types[] = { "combined_limit", "ingress_limit", "egress_limit" };
-		char* postfixes[] = { "_combined", "_ingress", "_egress" };
-		
-		
 		int type_index;
 		for(type_index=0; type_index < 3; type_index++)
 		{
@@ -136,10 +125,10 @@ int main(void)
 			if(limit != NULL)
 			{
 				char* type_id = dynamic_strcat(2, id, postfixes[type_index]);
-				ip_bw* ip_buf;
-				unsigned long num_ips = 0;
-				int query_succeeded = get_all_bandwidth_usage_for_rule_id(type_id, &num_ips, &ip_buf, 5000);
-				if(query_succeeded && num_ips > 0)
+				quota_usage* usage = (quota_usage*)get_string_map_element(type_id_to_usage, type_id);
+				unsigned long num_ips = usage == NULL ? 0 : usage->num_ips;
+				ip_bw* ip_buf = usage == NULL ? NULL : usage->ip_buf;
+				if(num_ips > 0)
 				{
 					unsigned long ip_index = 0;
 					for(ip_index = 0; ip_index < num_ips; ip_index++)
@@ -342,6 +331,90 @@ int main(void)
 	return 0;
 }
 
+/* base id for quota is the ip associated with it*/
+char* get_quota_id(struct uci_context* ctx, char* quota_section, char** ip)
+{
+	char *id = get_uci_option(ctx, "firewall", quota_section, "id");
+	*ip = get_uci_option(ctx, "firewall", quota_section, "ip");	
+	if(*ip == NULL)
+	{
+		*ip = strdup("ALL");
+	}
+	else if(strcmp(*ip, "") == 0)
+	{
+		free(*ip);
+		*ip = strdup("ALL");
+	}
+	if(id == NULL)
+	{
+		id = strdup(*ip);
+	}
+	else if(strcmp(id, "") == 0)
+	{
+		free(id);
+		id = strdup(*ip);
+	}
+	return id;
+}
+
+/* maps each quota rule id (quota id + type postfix) to its quota_usage */
+string_map* get_all_quota_usage(struct uci_context* ctx, list* quota_sections)
+{
+	string_map* type_id_to_usage = initialize_string_map(1);
+	list* type_ids = initialize_list();
+	unsigned long num_sections;
+	unsigned long section_index;
+	char** sections = (char**)get_list_values(quota_sections, &num_sections);
+	for(section_index=0; section_index < num_sections; section_index++)
+	{
+		char* ip;
+		char* id = get_quota_id(ctx, sections[section_index], &ip);
+		int type_index;
+		for(type_index=0; type_index < 3; type_index++)
+		{
+			char* limit = get_uci_option(ctx, "firewall", sections[section_index], types[type_index]);
+			if(limit != NULL)
+			{
+				push_list(type_ids, dynamic_strcat(2, id, postfixes[type_index]));
+				free(limit);
+			}
+		}
+		free(id);
+		free(ip);
+	}
+	free(sections);
+
+	if(type_ids->length > 0)
+	{
+		unsigned long num_type_ids;
+		char** type_id_list = (char**)get_list_values(type_ids, &num_type_ids);
+		unsigned long* num_ips = (unsigned long*)malloc(num_type_ids*sizeof(unsigned long));
+		ip_bw** ip_bufs = (ip_bw**)malloc(num_type_ids*sizeof(ip_bw*));
+		time_t snapshot_time;
+		if(get_bandwidth_usage_for_rule_ids(type_id_list, num_type_ids, num_ips, ip_bufs, &snapshot_time, 5000))
+		{
+			unsigned long type_id_index;
+			for(type_id_index=0; type_id_index < num_type_ids; type_id_index++)
+			{
+				if(ip_bufs[type_id_index] != NULL)
+				{
+					quota_usage* usage = (quota_usage*)malloc(sizeof(quota_usage));
+					usage->num_ips = num_ips[type_id_index];
+					usage->ip_buf = ip_bufs[type_id_index];
+					set_string_map_element(type_id_to_usage, type_id_list[type_id_index], usage);
+				}
+			}
+		}
+		free(type_id_list);
+		free(num_ips);
+		free(ip_bufs);
+	}
+
+	unsigned long num_destroyed;
+	destroy_list(type_ids, DESTROY_MODE_FREE_VALUES, &num_destroyed);
+	return type_id_to_usage;
+}
+
 list* get_all_sections_of_type(struct uci_context *ctx, char* package, char* section_type)
 {
 
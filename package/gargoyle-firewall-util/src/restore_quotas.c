@@ -258,7 +258,6 @@ int main(int argc, char** argv)
 		list* other_quota_section_names = initialize_list();
 		list* defined_ip_groups = initialize_list();
 
-		unlock_bandwidth_semaphore_on_exit();
 		while(quota_sections->length > 0 || other_quota_section_names->length > 0)
 		{
 			char* next_quota = NULL;
@@ -13,8 +13,7 @@
 
 	if [ -n "$FORM_monitor" ] ; then
 		date -u "+%s"
-		for id in $FORM_monitor ; do
-			bw_get -i "$id" -h -m
-		done
+		monitor_ids="$(echo $FORM_monitor | tr ' ' ',')"
+		bwmond -q "$monitor_ids" 2>/dev/null || bw_get -i "$monitor_ids" -h -m
 	fi
 ?>
@@ -23,27 +23,27 @@
 #define malloc ipt_bwctl_safe_malloc
 #define strdup ipt_bwctl_safe_strdup
 
+#define SNAPSHOT_ERROR_BUFFER_TOO_SHORT 2
 
-static int bandwidth_semaphore = -1;
-
-union semun 
-{
-	int val; // Value for SETVAL 
-	struct semid_ds *buf; // Buffer for IPC_STAT, IPC_SET 
-	unsigned short *array; // Array for GETALL, SETALL 
-	struct seminfo *__buf; // Buffer for IPC_INFO (Linux specific) 
-};
-
+/* the kernel module never answers a snapshot with more than this */
+#define SNAPSHOT_MAX_LENGTH (16*1024*1024)
 
+/* get_history values, counters are only available through snapshots */
+#define GET_USAGE	0
+#define GET_HISTORY	1
+#define GET_COUNTERS	2
+#define ERROR_SET_IN_PROGRESS 6
+#define HIRES_HEADER_LENGTH 21
+#define TOPK_HEADER_LENGTH 9
 
-
-/* semaphore functions */
-static int get_sem_val(int sid, int member);
-static int get_sem(int *sid, key_t key);
-static int lock_sem(int sid);
-static int unlock_sem(int sid);
-static int lock(unsigned long max_wait_milliseconds);
-static int unlock(void);
+/*
+ * there is no userspace lock, the kernel module lets any number of
+ * readers in at once and keeps a set that spans several calls private 
+ * to the process doing it.  Anyone who runs into such a set waits
+ * BANDWIDTH_RETRY_MILLISECONDS and tries again, until max_wait_milliseconds is up
+ */
+#define BANDWIDTH_RETRY_MILLISECONDS 25
+static unsigned long wait_for_retry(unsigned long max_wait_milliseconds);
 
 
 /* needed to calculate history time intervals */
@@ -54,28 +54,88 @@ static time_t get_next_node_start_time(		time_t current_start_time,
 						);
 
 /* functions used to get data from kernel module */
+static void history6_to_history(ip6_bw_history* from, ip_bw_history* to);
+static void history_to_history6(ip_bw_history* from, unsigned char* ip, ip6_bw_history* to);
 static void parse_returned_ip_data(		void *out_data, 
 						uint32_t* out_index, 
 						unsigned char* in_buffer, 
 						uint32_t* in_index, 
 						unsigned char get_history, 
+						uint32_t ip_length,
 						time_t reset_interval, 
 						time_t reset_time, 
 						unsigned char is_constant_interval
 						);
 
+static size_t get_data_item_size(		unsigned char get_history, 
+						uint32_t ip_length
+						);
+
+static void free_bandwidth_data(		void* data, 
+						unsigned long num_ips, 
+						unsigned char get_history, 
+						uint32_t ip_length
+						);
+
+static int get_bandwidth_snapshot(		int sockfd, 
+						char** ids, 
+						unsigned long num_ids, 
+						unsigned char get_history, 
+						uint32_t ip_length, 
+						unsigned long* num_ips, 
+						void** data, 
+						time_t* snapshot_time,
+						unsigned char* set_in_progress
+						);
+
+static int get_paged_bandwidth_data(		int sockfd, 
+						char* id, 
+						unsigned char get_history, 
+						uint32_t ip_length,
+						char* ip, 
+						unsigned long* num_ips, 
+						void** data,
+						unsigned char* set_in_progress
+						);
+
 static int get_bandwidth_data(			char* id, 
 						unsigned char get_history, 
+						uint32_t ip_length,
 						char* ip, 
 						unsigned long* num_ips, 
 						void** data, 
 						unsigned long max_wait_milliseconds
 						);
 
+static int get_bandwidth_data_for_ids(		char** ids, 
+						unsigned long num_ids, 
+						unsigned char get_history, 
+						uint32_t ip_length, 
+						unsigned long* num_ips, 
+						void** data, 
+						time_t* snapshot_time, 
+						unsigned long max_wait_milliseconds
+						);
+
+static int get_hires_data(			char* id, 
+						uint32_t ip_length, 
+						unsigned long* num_ips, 
+						void** data, 
+						unsigned long max_wait_milliseconds
+						);
+static int get_topk_data(			char* id, 
+						uint32_t ip_length, 
+						unsigned long* num_ips, 
+						void** data, 
+						unsigned long max_wait_milliseconds
+						);
+static int ip_is_zero(unsigned char* ip, uint32_t ip_length);
+
 
 /* functions used to send/restore data to kernel module */
 static int set_ip_block(			void* ip_block_data, 
 						unsigned char is_history, 
+						uint32_t ip_length,
 						unsigned char* output_buffer, 
 						uint32_t* current_output_index, 
 						uint32_t output_buffer_length
@@ -84,6 +144,7 @@ static int set_ip_block(			void* ip_block_data,
 static int set_bandwidth_data(			char* id, 
 						unsigned char zero_unset, 
 						unsigned char set_history, 
+						uint32_t ip_length,
 						unsigned long num_ips, 
 						time_t last_backup, 
 						void* data, 
@@ -106,119 +167,15 @@ static char** split_on_separators(		char* line,
 
 
 
-static int get_sem_val(int sid, int member)
-{
-        int semval;
-        semval = semctl(sid, member, GETVAL, 0);
-        return(semval);
-}
-
-static int get_sem(int *sid, key_t key)
-{
-        int cntr;
-        union semun semopts;
-	int members = 1;
-
-	
-	int success = ((*sid = semget(key, members, IPC_CREAT|IPC_EXCL|0777))== -1) ? 0 : 1;
-	if(success)
-	{
-		semopts.val = 1;
-        	/* Initialize all members (could be done with SETALL) */        
-        	for(cntr=0; cntr<members; cntr++)
-		{
-			semctl(*sid, cntr, SETVAL, semopts);
-		}
-	}
-	else
-	{
-		success = ((*sid = semget(key, members, 0777)) == -1) ? 0 : 1;
-	}
-	return success;
-}
-
-
-static int lock_sem(int sid)
+/* returns how much of max_wait_milliseconds is left after waiting to retry, 0 if we're out of time */
+static unsigned long wait_for_retry(unsigned long max_wait_milliseconds)
 {
-	int member = 0;
-        struct sembuf sem_lock={ 0, -1, IPC_NOWAIT};
-	int success = 0;
-	
-	//printf("locking sem, member count = %d\n", get_sem_member_count(sid)  );
-
-       	/* Attempt to lock the semaphore set */
-	int semval = get_sem_val(sid, member);
-	if(semval > 0)
-       	{
-       		sem_lock.sem_num = member;
-       		if((semop(sid, &sem_lock, 1)) != -1)
-		{
-			success = 1;
-		}
-	}
-
-	return success;
-}
-
-static int unlock_sem(int sid)
-{
-	int member = 0;
-        struct sembuf sem_unlock={ member, 1, IPC_NOWAIT};
-	
-	/* will fail if we can't can't unlock semaphore for some reason, 
-	 * will NOT fail if semaphore is already unlocked
-	 */
-	int success = 1; 
-
-
-	/* Is the semaphore set locked? */
-	int semval = get_sem_val(sid, member);
-	if(semval == 0)
+	if(max_wait_milliseconds <= BANDWIDTH_RETRY_MILLISECONDS)
 	{
-		/* it's locked, unlock it */
-		sem_unlock.sem_num = member;
-        	success = ((semop(sid, &sem_unlock, 1)) == -1) ? 0 : 1;
+		return 0;
 	}
-	return success;
-}
-
-
-
-static int lock(unsigned long max_wait_milliseconds)
-{
-	int locked = 0;
-	if(bandwidth_semaphore == -1)
-	{
-		get_sem(&bandwidth_semaphore, (key_t)(BANDWIDTH_SEMAPHORE_KEY) );
-	}
-	if(bandwidth_semaphore != -1)
-	{
-		do
-		{
-			locked = lock_sem(bandwidth_semaphore);
-			if(locked == 0 && max_wait_milliseconds > 25)
-			{
-				usleep(1000*25);
-			}
-			max_wait_milliseconds = max_wait_milliseconds > 25 ? max_wait_milliseconds - 25 : 0;
-		} while(locked == 0 && max_wait_milliseconds > 0);
-	}
-	return locked;
-}
-
-static int unlock(void)
-{
-	int unlocked = 0;
-	if(bandwidth_semaphore == -1)
-	{
-		get_sem(&bandwidth_semaphore, (key_t)(BANDWIDTH_SEMAPHORE_KEY) );
-	}
-	if(bandwidth_semaphore != -1)
-	{
-		unlocked = unlock_sem(bandwidth_semaphore);
-	}
-	return unlocked;
-	
+	usleep(1000*BANDWIDTH_RETRY_MILLISECONDS);
+	return max_wait_milliseconds - BANDWIDTH_RETRY_MILLISECONDS;
 }
 
 
@@ -291,47 +248,112 @@ static time_t get_next_node_start_time(		time_t current_start_time,
 	return next;
 }
 
+/* 
+ * ip6_bw_history has the same fields as ip_bw_history except for the ip,
+ * so the kernel i/o code works on ip_bw_history and converts at the edges
+ */
+static void history6_to_history(ip6_bw_history* from, ip_bw_history* to)
+{
+	to->ip                   = 0;
+	to->num_nodes            = from->num_nodes;
+	to->reset_interval       = from->reset_interval;
+	to->reset_time           = from->reset_time;
+	to->is_constant_interval = from->is_constant_interval;
+	to->first_start          = from->first_start;
+	to->first_end            = from->first_end;
+	to->last_end             = from->last_end;
+	to->history_bws          = from->history_bws;
+}
+
+static void history_to_history6(ip_bw_history* from, unsigned char* ip, ip6_bw_history* to)
+{
+	memcpy(to->ip.s6_addr, ip, 16);
+	to->num_nodes            = from->num_nodes;
+	to->reset_interval       = from->reset_interval;
+	to->reset_time           = from->reset_time;
+	to->is_constant_interval = from->is_constant_interval;
+	to->first_start          = from->first_start;
+	to->first_end            = from->first_end;
+	to->last_end             = from->last_end;
+	to->history_bws          = from->history_bws;
+}
+
 static void parse_returned_ip_data(	void *out_data, 
 					uint32_t* out_index, 
 					unsigned char* in_buffer, 
 					uint32_t* in_index, 
 					unsigned char get_history, 
+					uint32_t ip_length,
 					time_t reset_interval, 
 					time_t reset_time, 
 					unsigned char is_constant_interval
 					)
 {
-	uint32_t ip = *( (uint32_t*)(in_buffer + *in_index) );
-    ip_bw_kernel_data_item* ip_bw_data = (ip_bw_kernel_data*)(in_buffer + *in_index);
-	if(get_history == 0)
+	unsigned char* ip = in_buffer + *in_index;
+	*in_index = *in_index + ip_length;
+	if(get_history == GET_COUNTERS)
 	{
-		(((ip_bw*)out_data)[*out_index]).ip = ip;
-		*in_index = *in_index + 4;
-		(((ip_bw*)out_data)[*out_index]).bw = *( (uint64_t*)(in_buffer + *in_index) );
+		uint64_t* counters = (uint64_t*)(in_buffer + *in_index);
+		*in_index = *in_index + 40;
+		if(ip_length == 4)
+		{
+			ip_bw_counters* out = ((ip_bw_counters*)out_data) + *out_index;
+			out->ip = *( (uint32_t*)ip );
+			out->bw = counters[0];
+			out->rx_bytes = counters[1];
+			out->tx_bytes = counters[2];
+			out->rx_packets = counters[3];
+			out->tx_packets = counters[4];
+		}
+		else
+		{
+			ip6_bw_counters* out = ((ip6_bw_counters*)out_data) + *out_index;
+			memcpy(out->ip.s6_addr, ip, 16);
+			out->bw = counters[0];
+			out->rx_bytes = counters[1];
+			out->tx_bytes = counters[2];
+			out->rx_packets = counters[3];
+			out->tx_packets = counters[4];
+		}
+	}
+	else if(get_history == GET_USAGE)
+	{
+		uint64_t bw = *( (uint64_t*)(in_buffer + *in_index) );
 		*in_index = *in_index + 8;
+		if(ip_length == 4)
+		{
+			(((ip_bw*)out_data)[*out_index]).ip = *( (uint32_t*)ip );
+			(((ip_bw*)out_data)[*out_index]).bw = bw;
+		}
+		else
+		{
+			memcpy( (((ip6_bw*)out_data)[*out_index]).ip.s6_addr, ip, 16);
+			(((ip6_bw*)out_data)[*out_index]).bw = bw;
+		}
 	}
 	else
 	{
-			ip_bw_history *history = ((ip_bw_history*)out_data) + *out_index;
+			ip_bw_history parsed;
+			ip_bw_history *history = ip_length == 4 ? ((ip_bw_history*)out_data) + *out_index : &parsed;
 			history->reset_interval = reset_interval;
 			history->reset_time = reset_time;
 			history->is_constant_interval = is_constant_interval;
 
-            history->ip = ip_bw_data->ip;
-			history->num_nodes = ip_bw_data->num_nodes;
-			history->first_start = ip_bw_data->first_start;
-			history->first_end   = ip_bw_data->first_end;
-			history->last_end    = ip_bw_data->last_end;
+			history->ip = ip_length == 4 ? *( (uint32_t*)ip ) : 0;
+			history->num_nodes   = *( (uint32_t*)(in_buffer + *in_index) );
+			history->first_start = (time_t)*( (uint64_t*)(in_buffer + *in_index + 4) );
+			history->first_end   = (time_t)*( (uint64_t*)(in_buffer + *in_index + 12) );
+			history->last_end    = (time_t)*( (uint64_t*)(in_buffer + *in_index + 20) );
+			*in_index = *in_index + 28;
 
 			history->history_bws =  (uint64_t*)malloc( (history->num_nodes+1)*sizeof(uint64_t) );
 			
 			/* read bws */
 			int node_index = 0;
-            *in_index += 32;
-            for (node_index = 0; node_index < history->num_nodes; node_index++)
+			for (node_index = 0; node_index < history->num_nodes; node_index++)
 			{
-                *in_index += 8;
-				(history->history_bws)[node_index] =  ip_bw_data->ipbw_data[node_index];
+				(history->history_bws)[node_index] = *( (uint64_t*)(in_buffer + *in_index) );
+				*in_index = *in_index + 8;
 			}
 
 
@@ -353,58 +375,214 @@ static void parse_returned_ip_data(	void *out_data,
 			history->first_start = history->first_start + (60*(get_minutes_west(history->first_start)-current_minutes_west));
 			history->first_end = history->first_end + (60*(get_minutes_west(history->first_end)-current_minutes_west));
 			history->last_end = history->last_end + (60*(get_minutes_west(history->last_end)-current_minutes_west));
+
+			if(ip_length != 4)
+			{
+				history_to_history6(history, ip, ((ip6_bw_history*)out_data) + *out_index);
+			}
 	}
 	*out_index = *out_index + 1;
 }
 
+static size_t get_data_item_size(unsigned char get_history, uint32_t ip_length)
+{
+	if(get_history == GET_COUNTERS)
+	{
+		return ip_length == 4 ? sizeof(ip_bw_counters) : sizeof(ip6_bw_counters);
+	}
+	if(get_history)
+	{
+		return ip_length == 4 ? sizeof(ip_bw_history) : sizeof(ip6_bw_history);
+	}
+	return ip_length == 4 ? sizeof(ip_bw) : sizeof(ip6_bw);
+}
+
+static void free_bandwidth_data(void* data, unsigned long num_ips, unsigned char get_history, uint32_t ip_length)
+{
+	if(data == NULL)
+	{
+		return;
+	}
+	if(get_history == GET_HISTORY && ip_length == 4)
+	{
+		free_ip_bw_histories( (ip_bw_history*)data, num_ips );
+	}
+	else if(get_history == GET_HISTORY)
+	{
+		free_ip6_bw_histories( (ip6_bw_history*)data, num_ips );
+	}
+	else
+	{
+		free(data);
+	}
+}
+
+/*
+ * Fetches every ip of each id with one BANDWIDTH_GET_SNAPSHOT call, 
+ * all ids come from the same consistent snapshot.  Caller must hold 
+ * the lock and pass an open socket.
+ *
+ * data[i] is NULL if ids[i] couldn't be queried.  Returns 1 on success,
+ * 0 on failure and -1 if the kernel module doesn't support snapshots
+ * or the snapshot won't fit in SNAPSHOT_MAX_LENGTH, in which case the
+ * caller should fall back to paging with BANDWIDTH_GET
+ */
+static int get_bandwidth_snapshot(int sockfd, char** ids, unsigned long num_ids, unsigned char get_history, uint32_t ip_length, unsigned long* num_ips, void** data, time_t* snapshot_time, unsigned char* set_in_progress)
+{
+	uint32_t request_length = 5 + (num_ids*BANDWIDTH_MAX_ID_LENGTH);
+	uint32_t buffer_length = request_length > BANDWIDTH_SNAPSHOT_LENGTH ? request_length : BANDWIDTH_SNAPSHOT_LENGTH;
+	unsigned char* buf = NULL;
+	unsigned char error = SNAPSHOT_ERROR_BUFFER_TOO_SHORT;
+	unsigned long id_index;
+	int tries;
+
+	*set_in_progress = 0;
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		data[id_index] = NULL;
+		num_ips[id_index] = 0;
+	}
+
+	/* snapshot can grow between calls, so try a few times before giving up */
+	for(tries=0; tries < 4 && error == SNAPSHOT_ERROR_BUFFER_TOO_SHORT; tries++)
+	{
+		socklen_t size = buffer_length;
+		buf = (unsigned char*)malloc(buffer_length);
+		memset(buf, 0, buffer_length);
+		buf[0] = (get_history == GET_HISTORY ? BANDWIDTH_SNAPSHOT_HISTORY : 0) | (get_history == GET_COUNTERS ? BANDWIDTH_SNAPSHOT_COUNTERS : 0) | (ip_length == 16 ? BANDWIDTH_SNAPSHOT_IP6 : 0);
+		*( (uint32_t*)(buf+1) ) = (uint32_t)num_ids;
+		for(id_index=0; id_index < num_ids; id_index++)
+		{
+			strncpy( (char*)(buf + 5 + (id_index*BANDWIDTH_MAX_ID_LENGTH)), ids[id_index], BANDWIDTH_MAX_ID_LENGTH-1);
+		}
+
+		if(getsockopt(sockfd, IPPROTO_IP, BANDWIDTH_GET_SNAPSHOT, buf, &size) < 0)
+		{
+			free(buf);
+			return -1;
+		}
+		error = buf[0];
+		if(error == SNAPSHOT_ERROR_BUFFER_TOO_SHORT)
+		{
+			uint32_t needed = *( (uint32_t*)(buf+1) );
+			free(buf);
+			buf = NULL;
+			if(needed > SNAPSHOT_MAX_LENGTH)
+			{
+				/* can never fit in one reply, page through it instead */
+				return -1;
+			}
+			buffer_length = needed > buffer_length ? needed + (needed/8) : buffer_length*2;
+			buffer_length = buffer_length > SNAPSHOT_MAX_LENGTH ? SNAPSHOT_MAX_LENGTH : buffer_length;
+		}
+	}
+	if(error == SNAPSHOT_ERROR_BUFFER_TOO_SHORT)
+	{
+		/* kept growing faster than we could catch up, page through it instead */
+		return -1;
+	}
+	if(error != 0)
+	{
+		if(buf != NULL) { free(buf); };
+		return 0;
+	}
+
+	*snapshot_time = (time_t)*( (uint64_t*)(buf+5) );
+	uint32_t buffer_index = 17;
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		unsigned char* rule = buf + buffer_index;
+		uint32_t rule_ips = *( (uint32_t*)(rule+51) );
+		time_t reset_interval = (time_t)*( (uint64_t*)(rule+55) );
+		time_t reset_time = (time_t)*( (uint64_t*)(rule+63) );
+		unsigned char is_constant_interval = rule[71];
+		buffer_index = buffer_index + BANDWIDTH_MAX_ID_LENGTH + 22;
+
+		if(rule[0] == 0)
+		{
+			size_t item_size = get_data_item_size(get_history, ip_length);
+			uint32_t data_index = 0;
+			uint32_t ip_index;
+			data[id_index] = malloc(item_size*(rule_ips+1));
+			memset(data[id_index], 0, item_size*(rule_ips+1));
+			for(ip_index=0; ip_index < rule_ips; ip_index++)
+			{
+				parse_returned_ip_data(data[id_index], &data_index, buf, &buffer_index, get_history, ip_length, reset_interval, reset_time, is_constant_interval);
+			}
+			num_ips[id_index] = rule_ips;
+		}
+		else if(rule[0] == ERROR_SET_IN_PROGRESS)
+		{
+			*set_in_progress = 1;
+		}
+	}
+	free(buf);
+	return 1;
+}
 
-static int get_bandwidth_data(char* id, unsigned char get_history, char* ip, unsigned long* num_ips, void** data, unsigned long max_wait_milliseconds)
+/*
+ * ip is a string for ip_length 4 and 16 ("ALL" requests every ip),
+ * ip_length 16 requests go through BANDWIDTH_GET6 and return ip6_bw/ip6_bw_history
+ *
+ * pages through the data BANDWIDTH_QUERY_LENGTH bytes at a time
+ * over the open socket passed in
+ */
+static int get_paged_bandwidth_data(int sockfd, char* id, unsigned char get_history, uint32_t ip_length, char* ip, unsigned long* num_ips, void** data, unsigned char* set_in_progress)
 {	
 	
 	unsigned char buf[BANDWIDTH_QUERY_LENGTH];
 	memset(buf, '\0',  BANDWIDTH_QUERY_LENGTH);
 	int done = 0;
-    ip_bw_kernel_data* ip_bw_data = (ip_bw_kernel_data*)(buf);
+	ip_bw_kernel_data* ip_bw_data = (ip_bw_kernel_data*)(buf);
 
 	*data = NULL;
 	*num_ips = 0;
-
-
-	int got_lock = lock(max_wait_milliseconds);
-	int sockfd = -1;
-	if(got_lock)
+	*set_in_progress = 0;
+	if(get_history == GET_COUNTERS)
 	{
-		sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+		/* BANDWIDTH_GET has no room for the counters */
+		return 0;
 	}
 
 
-	uint32_t* request_ip = (uint32_t*)buf;
-	uint32_t* request_index = (uint32_t*)(buf + 4);
-	unsigned char* request_history =(unsigned char*)(buf + 8);
-	char* request_id = (char*)(buf+9);
+	/* kept apart from buf, since each response overwrites the request that was sent */
+	unsigned char request[16 + 5 + BANDWIDTH_MAX_ID_LENGTH];
+	unsigned char* request_ip = request;
+	uint32_t* request_index = (uint32_t*)(request + ip_length);
+	unsigned char* request_history =(unsigned char*)(request + ip_length + 4);
+	char* request_id = (char*)(request + ip_length + 5);
+	memset(request, 0, sizeof(request));
 
-	if(strcmp(ip, "ALL") == 0)
-	{
-		*request_ip = 0;
-	}
-	else
+	if(strcmp(ip, "ALL") != 0)
 	{
-		struct in_addr addr;
-		inet_aton(ip, &addr);
-		*request_ip = (uint32_t)addr.s_addr;
+		if(ip_length == 4)
+		{
+			struct in_addr addr;
+			inet_aton(ip, &addr);
+			memcpy(request_ip, &(addr.s_addr), 4);
+		}
+		else
+		{
+			struct in6_addr addr;
+			memset(&addr, 0, sizeof(addr));
+			inet_pton(AF_INET6, ip, &addr);
+			memcpy(request_ip, addr.s6_addr, 16);
+		}
 	}
 	*request_index = 0;
 	*request_history = get_history;
-	sprintf(request_id, "%s", id);
+	snprintf(request_id, BANDWIDTH_MAX_ID_LENGTH, "%s", id);
 
 	unsigned char error = 0;
 	unsigned char data_initialized = 0;
 	uint32_t data_index = 0;
-	while(!done && sockfd >= 0 && got_lock)
+	while(!done)
 	{
 		uint32_t size = BANDWIDTH_QUERY_LENGTH;
 	
-		getsockopt(sockfd, IPPROTO_IP, BANDWIDTH_GET, buf, &size);
+		memset(buf, 0, BANDWIDTH_QUERY_LENGTH);
+		memcpy(buf, request, sizeof(request));
+		getsockopt(sockfd, IPPROTO_IP, (ip_length == 4 ? BANDWIDTH_GET : BANDWIDTH_GET6), buf, &size);
 		
 		error = (unsigned char)buf[0];
 		if(error != 0)
@@ -422,68 +600,353 @@ static int get_bandwidth_data(char* id, unsigned char get_history, char* ip, uns
 			
 			if(!data_initialized)
 			{
+				size_t item_size = get_data_item_size(get_history, ip_length);
 				*num_ips = total_ips;
-				if(get_history)
-				{
-					*data = (void*)malloc(sizeof(ip_bw_history)*(total_ips+1));
-					memset(*data, 0, sizeof(ip_bw_history)*(total_ips+1));
-				}
-				else
-				{
-					*data = (void*)malloc(sizeof(ip_bw)*(total_ips+1));
-					memset(*data, 0, sizeof(ip_bw)*(total_ips+1));
-				}
+				*data = (void*)malloc(item_size*(total_ips+1));
+				memset(*data, 0, item_size*(total_ips+1));
+				data_initialized = 1;
 			}
 
 			int response_index=0;
 			uint32_t buffer_index = 30;
 			for(response_index=0; response_index < response_ips; response_index++)
 			{
-				parse_returned_ip_data(*data, &data_index, buf, &buffer_index, get_history, reset_interval, reset_time, is_constant_interval);
+				parse_returned_ip_data(*data, &data_index, buf, &buffer_index, get_history, ip_length, reset_interval, reset_time, is_constant_interval);
+			}
+			*request_index= *request_index + response_ips;
+			done = *request_index < total_ips ? 0 : 1;
+		}
+	}
+	if( (error != 0) && data_initialized)
+	{
+		free_bandwidth_data(*data, *num_ips, get_history, ip_length);
+		*data = NULL;
+		*num_ips = 0;
+	}
+	*set_in_progress = error == ERROR_SET_IN_PROGRESS;
+	return error == 0;
+}
+
+static int get_bandwidth_data(char* id, unsigned char get_history, uint32_t ip_length, char* ip, unsigned long* num_ips, void** data, unsigned long max_wait_milliseconds)
+{
+	int success = 0;
+	int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	unsigned char set_in_progress = 1;
+
+	*data = NULL;
+	*num_ips = 0;
+	while(sockfd >= 0 && set_in_progress)
+	{
+		/* whole rule at once if the kernel module supports it, otherwise page through it */
+		int snapshot_status = -1;
+		if(strcmp(ip, "ALL") == 0)
+		{
+			time_t snapshot_time;
+			snapshot_status = get_bandwidth_snapshot(sockfd, &id, 1, get_history, ip_length, num_ips, data, &snapshot_time, &set_in_progress);
+			success = snapshot_status == 1 && *data != NULL;
+		}
+		if(snapshot_status < 0)
+		{
+			success = get_paged_bandwidth_data(sockfd, id, get_history, ip_length, ip, num_ips, data, &set_in_progress);
+		}
+		max_wait_milliseconds = set_in_progress ? wait_for_retry(max_wait_milliseconds) : max_wait_milliseconds;
+		set_in_progress = set_in_progress && max_wait_milliseconds > 0;
+	}
+
+	if(sockfd >= 0)
+	{
+		close(sockfd);
+	}
+	return success;
+}
+
+/*
+ * all ips of every id over one socket, 
+ * data[i] is left NULL if ids[i] couldn't be queried
+ */
+static int get_bandwidth_data_for_ids(char** ids, unsigned long num_ids, unsigned char get_history, uint32_t ip_length, unsigned long* num_ips, void** data, time_t* snapshot_time, unsigned long max_wait_milliseconds)
+{
+	int success = 0;
+	int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	unsigned char set_in_progress = 1;
+
+	while(sockfd >= 0 && set_in_progress)
+	{
+		unsigned long id_index;
+		int snapshot_status = get_bandwidth_snapshot(sockfd, ids, num_ids, get_history, ip_length, num_ips, data, snapshot_time, &set_in_progress);
+		success = snapshot_status == 1;
+		if(snapshot_status < 0)
+		{
+			/* older kernel module, rules aren't from the same instant */
+			time(snapshot_time);
+			set_in_progress = 0;
+			for(id_index=0; id_index < num_ids; id_index++)
+			{
+				unsigned char id_set_in_progress;
+				get_paged_bandwidth_data(sockfd, ids[id_index], get_history, ip_length, "ALL", num_ips + id_index, data + id_index, &id_set_in_progress);
+				set_in_progress = set_in_progress || id_set_in_progress;
+			}
+			success = 1;
+		}
+
+		/* if a rule was being set, ask for all of them again so they still come from one snapshot */
+		max_wait_milliseconds = set_in_progress ? wait_for_retry(max_wait_milliseconds) : max_wait_milliseconds;
+		if(set_in_progress && max_wait_milliseconds > 0)
+		{
+			for(id_index=0; id_index < num_ids; id_index++)
+			{
+				free_bandwidth_data(data[id_index], num_ips[id_index], get_history, ip_length);
+				data[id_index] = NULL;
+				num_ips[id_index] = 0;
+			}
+		}
+		set_in_progress = set_in_progress && max_wait_milliseconds > 0;
+	}
+
+	if(sockfd >= 0)
+	{
+		close(sockfd);
+	}
+	return success;
+}
+
+/*
+ * reads the hires rings of a --hires rule with BANDWIDTH_GET_HIRES,
+ * each ip comes back as a history with a constant interval, one node
+ * per slot, the last node being the slot that is still being counted.
+ * The kernel always sends 16 byte ips, for ip_length 4 they have to
+ * be v4-mapped (or the combined total)
+ */
+static int get_hires_data(char* id, uint32_t ip_length, unsigned long* num_ips, void** data, unsigned long max_wait_milliseconds)
+{
+	int success = 0;
+	int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	uint32_t buffer_length = BANDWIDTH_SNAPSHOT_LENGTH;
+	unsigned char* buf = NULL;
+	unsigned char error = SNAPSHOT_ERROR_BUFFER_TOO_SHORT;
+	int tries = 0;
+
+	*data = NULL;
+	*num_ips = 0;
+	if(sockfd < 0)
+	{
+		return 0;
+	}
+
+	/* rings can be handed to more ips between calls, so try a few times before giving up */
+	while( (error == SNAPSHOT_ERROR_BUFFER_TOO_SHORT && tries < 4) || (error == ERROR_SET_IN_PROGRESS && max_wait_milliseconds > 0) )
+	{
+		socklen_t size = buffer_length;
+		buf = (unsigned char*)malloc(buffer_length);
+		memset(buf, 0, buffer_length);
+		strncpy( (char*)buf, id, BANDWIDTH_MAX_ID_LENGTH-1);
+		if(getsockopt(sockfd, IPPROTO_IP, BANDWIDTH_GET_HIRES, buf, &size) < 0)
+		{
+			/* kernel module doesn't support hires */
+			free(buf);
+			buf = NULL;
+			error = 1;
+			break;
+		}
+		error = buf[0];
+		if(error == SNAPSHOT_ERROR_BUFFER_TOO_SHORT)
+		{
+			uint32_t needed = *( (uint32_t*)(buf+1) );
+			buffer_length = needed > buffer_length ? needed + (needed/8) : buffer_length*2;
+			buffer_length = buffer_length > SNAPSHOT_MAX_LENGTH ? SNAPSHOT_MAX_LENGTH : buffer_length;
+			tries++;
+		}
+		else if(error == ERROR_SET_IN_PROGRESS)
+		{
+			max_wait_milliseconds = wait_for_retry(max_wait_milliseconds);
+		}
+		if(error != 0)
+		{
+			free(buf);
+			buf = NULL;
+		}
+	}
+	close(sockfd);
+
+	if(error == 0)
+	{
+		uint32_t interval    = *( (uint32_t*)(buf+5) );
+		uint32_t num_slots   = *( (uint32_t*)(buf+9) );
+		uint32_t newest_tick = *( (uint32_t*)(buf+13) );
+		uint32_t response_ips = *( (uint32_t*)(buf+17) );
+		uint32_t buffer_index = HIRES_HEADER_LENGTH;
+		size_t item_size = get_data_item_size(1, ip_length);
+		uint32_t ip_index;
+
+		*data = malloc(item_size*(response_ips+1));
+		memset(*data, 0, item_size*(response_ips+1));
+		success = 1;
+		for(ip_index=0; ip_index < response_ips && success; ip_index++)
+		{
+			unsigned char* ip = buf + buffer_index;
+			uint64_t* counts = (uint64_t*)(buf + buffer_index + 16);
+			ip_bw_history history;
+			
+			history.ip = 0;
+			history.num_nodes = num_slots;
+			history.reset_interval = interval;
+			history.reset_time = 0;
+			history.is_constant_interval = 1;
+			history.first_start = ((time_t)newest_tick - (time_t)num_slots + 1)*interval;
+			history.first_end = history.first_start + interval;
+			history.last_end = ((time_t)newest_tick)*interval;
+			history.history_bws = (uint64_t*)malloc( (num_slots+1)*sizeof(uint64_t) );
+			memcpy(history.history_bws, counts, num_slots*sizeof(uint64_t));
+			buffer_index = buffer_index + 16 + (8*num_slots);
+
+			if(ip_length == 4)
+			{
+				/* only IPv4 (v4-mapped) addresses & the combined total fit in an ip_bw_history */
+				unsigned char mapped[12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+				success = memcmp(ip, mapped, 12) == 0 || ip_is_zero(ip, 16);
+				memcpy(&(history.ip), ip+12, 4);
+				((ip_bw_history*)*data)[ip_index] = history;
+			}
+			else
+			{
+				history_to_history6(&history, ip, ((ip6_bw_history*)*data) + ip_index);
+			}
+			*num_ips = ip_index+1;
+		}
+		free(buf);
+		if(!success)
+		{
+			free_bandwidth_data(*data, *num_ips, 1, ip_length);
+			*data = NULL;
+			*num_ips = 0;
+		}
+	}
+	return success;
+}
+
+static int compare_ip_bw_descending(const void* a, const void* b)
+{
+	uint64_t bw_a = ((ip_bw*)a)->bw;
+	uint64_t bw_b = ((ip_bw*)b)->bw;
+	return bw_a < bw_b ? 1 : (bw_a > bw_b ? -1 : 0);
+}
+static int compare_ip6_bw_descending(const void* a, const void* b)
+{
+	uint64_t bw_a = ((ip6_bw*)a)->bw;
+	uint64_t bw_b = ((ip6_bw*)b)->bw;
+	return bw_a < bw_b ? 1 : (bw_a > bw_b ? -1 : 0);
+}
+
+/*
+ * reads the ips a --topk rule has the highest totals for with 
+ * BANDWIDTH_GET_TOPK, returned highest first.  Like hires, the 
+ * kernel always sends 16 byte ips
+ */
+static int get_topk_data(char* id, uint32_t ip_length, unsigned long* num_ips, void** data, unsigned long max_wait_milliseconds)
+{
+	int success = 0;
+	int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	unsigned char* buf;
+	unsigned char error = ERROR_SET_IN_PROGRESS;
+
+	*data = NULL;
+	*num_ips = 0;
+	if(sockfd < 0)
+	{
+		return 0;
+	}
+
+	/* the heap is never bigger than BANDWIDTH_TOPK_MAX ips, so one buffer this size always fits it */
+	buf = (unsigned char*)malloc(BANDWIDTH_SNAPSHOT_LENGTH);
+	while(error == ERROR_SET_IN_PROGRESS)
+	{
+		socklen_t size = BANDWIDTH_SNAPSHOT_LENGTH;
+		memset(buf, 0, BANDWIDTH_SNAPSHOT_LENGTH);
+		strncpy( (char*)buf, id, BANDWIDTH_MAX_ID_LENGTH-1);
+		if(getsockopt(sockfd, IPPROTO_IP, BANDWIDTH_GET_TOPK, buf, &size) < 0)
+		{
+			/* kernel module doesn't support topk */
+			error = 1;
+			break;
+		}
+		error = buf[0];
+		if(error == ERROR_SET_IN_PROGRESS)
+		{
+			if(max_wait_milliseconds == 0)
+			{
+				break;
+			}
+			max_wait_milliseconds = wait_for_retry(max_wait_milliseconds);
+		}
+	}
+	close(sockfd);
+
+	if(error == 0)
+	{
+		uint32_t response_ips = *( (uint32_t*)(buf+5) );
+		uint32_t buffer_index = TOPK_HEADER_LENGTH;
+		size_t item_size = get_data_item_size(GET_USAGE, ip_length);
+		uint32_t ip_index;
+
+		*data = malloc(item_size*(response_ips+1));
+		memset(*data, 0, item_size*(response_ips+1));
+		success = 1;
+		for(ip_index=0; ip_index < response_ips && success; ip_index++)
+		{
+			unsigned char* ip = buf + buffer_index;
+			uint64_t bw = *( (uint64_t*)(buf + buffer_index + 16) );
+			buffer_index = buffer_index + 24;
+			if(ip_length == 4)
+			{
+				unsigned char mapped[12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+				success = memcmp(ip, mapped, 12) == 0;
+				memcpy(&(((ip_bw*)*data)[ip_index].ip), ip+12, 4);
+				((ip_bw*)*data)[ip_index].bw = bw;
+			}
+			else
+			{
+				memcpy( (((ip6_bw*)*data)[ip_index]).ip.s6_addr, ip, 16);
+				(((ip6_bw*)*data)[ip_index]).bw = bw;
 			}
-			*request_index= *request_index + response_ips;
-			done = *request_index < total_ips ? 0 : 1;
 		}
-	}
-	if( (error != 0) && data_initialized)
-	{
-		if(get_history)
+		if(success)
 		{
-			free_ip_bw_histories(  (ip_bw_history*)(*data), *num_ips );
+			*num_ips = response_ips;
+			qsort(*data, response_ips, item_size, ip_length == 4 ? compare_ip_bw_descending : compare_ip6_bw_descending);
 		}
 		else
 		{
 			free(*data);
+			*data = NULL;
 		}
-		*data = NULL;
-		*num_ips = 0;
-	}
-
-	if(sockfd >= 0)
-	{
-		close(sockfd);
-	}
-	if(got_lock)
-	{
-		unlock();
 	}
-	return got_lock && (error == 0);
+	free(buf);
+	return success;
 }
 
 
-static int set_ip_block(void* ip_block_data, unsigned char is_history, unsigned char* output_buffer, uint32_t* current_output_index, uint32_t output_buffer_length)
+static int set_ip_block(void* ip_block_data, unsigned char is_history, uint32_t ip_length, unsigned char* output_buffer, uint32_t* current_output_index, uint32_t output_buffer_length)
 {
 	if(is_history)
 	{
+		ip_bw_history converted;
 		ip_bw_history* history = (ip_bw_history*)ip_block_data;
-		uint32_t block_length = (2*4) + (3*8) + (8*history->num_nodes);
+		unsigned char* ip = (unsigned char*)(&(history->ip));
+		if(ip_length != 4)
+		{
+			history6_to_history((ip6_bw_history*)ip_block_data, &converted);
+			history = &converted;
+			ip = ((ip6_bw_history*)ip_block_data)->ip.s6_addr;
+		}
+
+		uint32_t block_length = ip_length + 4 + (3*8) + (8*history->num_nodes);
 		if(*current_output_index + block_length > output_buffer_length)
 		{
 			return 1;
 		}
 	
-		*( (uint32_t*)(output_buffer + *current_output_index) ) = history->ip;
-		*current_output_index = *current_output_index + 4;
+		memcpy(output_buffer + *current_output_index, ip, ip_length);
+		*current_output_index = *current_output_index + ip_length;
 
 		*( (uint32_t*)(output_buffer + *current_output_index) ) = history->num_nodes;
 		*current_output_index = *current_output_index + 4;
@@ -539,16 +1002,25 @@ static int set_ip_block(void* ip_block_data, unsigned char is_history, unsigned
 	}
 	else
 	{
-		if(*current_output_index + 12 > output_buffer_length)
+		if(*current_output_index + ip_length + 8 > output_buffer_length)
 		{
 			return 1;
 		}
 	
-
-		ip_bw* ib = (ip_bw*)ip_block_data;
-		*( (uint32_t*)(output_buffer + *current_output_index) ) = ib->ip;
-		*current_output_index = *current_output_index + 4;
-		*( (uint64_t*)(output_buffer + *current_output_index) ) = ib->bw;
+		if(ip_length == 4)
+		{
+			ip_bw* ib = (ip_bw*)ip_block_data;
+			*( (uint32_t*)(output_buffer + *current_output_index) ) = ib->ip;
+			*current_output_index = *current_output_index + 4;
+			*( (uint64_t*)(output_buffer + *current_output_index) ) = ib->bw;
+		}
+		else
+		{
+			ip6_bw* ib = (ip6_bw*)ip_block_data;
+			memcpy(output_buffer + *current_output_index, ib->ip.s6_addr, 16);
+			*current_output_index = *current_output_index + 16;
+			*( (uint64_t*)(output_buffer + *current_output_index) ) = ib->bw;
+		}
 		
 		/*
 		struct in_addr addr;
@@ -562,19 +1034,15 @@ static int set_ip_block(void* ip_block_data, unsigned char is_history, unsigned
 	return 0;
 }
 
-static int set_bandwidth_data(char* id, unsigned char zero_unset, unsigned char set_history, unsigned long num_ips, time_t last_backup, void* data, unsigned long max_wait_milliseconds)
+static int set_bandwidth_data(char* id, unsigned char zero_unset, unsigned char set_history, uint32_t ip_length, unsigned long num_ips, time_t last_backup, void* data, unsigned long max_wait_milliseconds)
 {
 	unsigned char buf[BANDWIDTH_QUERY_LENGTH];
 	memset(buf, 0, BANDWIDTH_QUERY_LENGTH);
 	int done = 0;
+	int success = 1;
 
 		
-	int got_lock = lock(max_wait_milliseconds);
-	int sockfd = -1;
-	if(got_lock)
-	{
-		sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
-	}
+	int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
 
 	uint32_t* total_ips = (uint32_t*)(buf+0);
 	uint32_t* next_ip_index = (uint32_t*)(buf+4);
@@ -594,7 +1062,7 @@ static int set_bandwidth_data(char* id, unsigned char zero_unset, unsigned char
 	memcpy(set_id, id, BANDWIDTH_MAX_ID_LENGTH);
 	set_id[BANDWIDTH_MAX_ID_LENGTH-1] = '\0';
 
-	while(!done && sockfd >= 0 && got_lock)
+	while(!done && sockfd >= 0 && success)
 	{
 		uint32_t buf_index = (3*4) + (2*1) + 8 + BANDWIDTH_MAX_ID_LENGTH;
 		uint32_t ip_index = *next_ip_index;
@@ -606,14 +1074,28 @@ static int set_bandwidth_data(char* id, unsigned char zero_unset, unsigned char
 
 		while( (!buffer_full) && (!done) )
 		{
-			void *next_data = set_history ? (void*)(((ip_bw_history*)data) + ip_index) : (void*)(((ip_bw*)data) + ip_index);
-			buffer_full = set_ip_block(next_data , set_history, buf, &buf_index, BANDWIDTH_QUERY_LENGTH);
+			void *next_data;
+			if(ip_length == 4)
+			{
+				next_data = set_history ? (void*)(((ip_bw_history*)data) + ip_index) : (void*)(((ip_bw*)data) + ip_index);
+			}
+			else
+			{
+				next_data = set_history ? (void*)(((ip6_bw_history*)data) + ip_index) : (void*)(((ip6_bw*)data) + ip_index);
+			}
+			buffer_full = set_ip_block(next_data , set_history, ip_length, buf, &buf_index, BANDWIDTH_QUERY_LENGTH);
 			ip_index = buffer_full ? ip_index : ip_index+1;
 			*num_ips_in_buffer = buffer_full ? *num_ips_in_buffer : *num_ips_in_buffer + 1;
 			done = (ip_index >= *total_ips);
 
 		}
-		setsockopt(sockfd, IPPROTO_IP, BANDWIDTH_SET, buf, BANDWIDTH_QUERY_LENGTH);
+
+		/* EBUSY means another process is part way through a set of its own */
+		while(success && setsockopt(sockfd, IPPROTO_IP, (ip_length == 4 ? BANDWIDTH_SET : BANDWIDTH_SET6), buf, BANDWIDTH_QUERY_LENGTH) < 0)
+		{
+			max_wait_milliseconds = errno == EBUSY ? wait_for_retry(max_wait_milliseconds) : 0;
+			success = max_wait_milliseconds > 0;
+		}
 
 		*next_ip_index = ip_index;
 	}
@@ -621,11 +1103,7 @@ static int set_bandwidth_data(char* id, unsigned char zero_unset, unsigned char
 	{
 		close(sockfd);
 	}
-	if(got_lock)
-	{
-		unlock();
-	}
-	return got_lock;
+	return sockfd >= 0 && success;
 }
 
 static unsigned char* read_entire_file(FILE* in, unsigned long read_block_size, unsigned long *length)
@@ -814,6 +1292,13 @@ time_t* get_interval_starts_for_history(ip_bw_history history)
 	return start_times;
 }
 
+time_t* get_interval_starts_for_history6(ip6_bw_history history)
+{
+	ip_bw_history converted;
+	history6_to_history(&history, &converted);
+	return get_interval_starts_for_history(converted);
+}
+
 
 
 void free_ip_bw_histories(ip_bw_history* histories, int num_histories)
@@ -833,6 +1318,23 @@ void free_ip_bw_histories(ip_bw_history* histories, int num_histories)
 	free(histories);
 }
 
+void free_ip6_bw_histories(ip6_bw_history* histories, int num_histories)
+{
+	if(histories == NULL)
+	{
+		return;
+	}
+	int history_index = 0;
+	for(history_index=0; history_index < num_histories; history_index++)
+	{
+		if((histories[history_index]).history_bws != NULL)
+		{
+			free( (histories[history_index]).history_bws );
+		}
+	}
+	free(histories);
+}
+
 
 
 
@@ -840,185 +1342,910 @@ void free_ip_bw_histories(ip_bw_history* histories, int num_histories)
 
 int get_all_bandwidth_history_for_rule_id(char* id, unsigned long* num_ips, ip_bw_history** data, unsigned long max_wait_milliseconds)
 {
-	return get_bandwidth_data(id, 1, "ALL", num_ips, (void*)data, max_wait_milliseconds);
+	return get_bandwidth_data(id, 1, 4, "ALL", num_ips, (void*)data, max_wait_milliseconds);
 }
 int get_ip_bandwidth_history_for_rule_id(char* id, char* ip, ip_bw_history** data, unsigned long max_wait_milliseconds)
 {
 	unsigned long num_ips;
-	return get_bandwidth_data(id, 1, ip, &num_ips, (void*)data, max_wait_milliseconds);
+	return get_bandwidth_data(id, 1, 4, ip, &num_ips, (void*)data, max_wait_milliseconds);
 }
 int get_all_bandwidth_usage_for_rule_id(char* id, unsigned long* num_ips, ip_bw** data, unsigned long max_wait_milliseconds)
 {
-	return get_bandwidth_data(id, 0, "ALL", num_ips, (void*)data, max_wait_milliseconds);
+	return get_bandwidth_data(id, 0, 4, "ALL", num_ips, (void*)data, max_wait_milliseconds);
 }
 int get_ip_bandwidth_usage_for_rule_id(char* id,  char* ip, ip_bw** data, unsigned long max_wait_milliseconds)
 {
 	unsigned long num_ips;
-	return get_bandwidth_data(id, 0, ip, &num_ips, (void*)data, max_wait_milliseconds);
+	return get_bandwidth_data(id, 0, 4, ip, &num_ips, (void*)data, max_wait_milliseconds);
+}
+
+int get_all_bandwidth_history6_for_rule_id(char* id, unsigned long* num_ips, ip6_bw_history** data, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data(id, 1, 16, "ALL", num_ips, (void*)data, max_wait_milliseconds);
+}
+int get_ip_bandwidth_history6_for_rule_id(char* id, char* ip, ip6_bw_history** data, unsigned long max_wait_milliseconds)
+{
+	unsigned long num_ips;
+	return get_bandwidth_data(id, 1, 16, ip, &num_ips, (void*)data, max_wait_milliseconds);
+}
+int get_all_bandwidth_usage6_for_rule_id(char* id, unsigned long* num_ips, ip6_bw** data, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data(id, 0, 16, "ALL", num_ips, (void*)data, max_wait_milliseconds);
+}
+int get_ip_bandwidth_usage6_for_rule_id(char* id,  char* ip, ip6_bw** data, unsigned long max_wait_milliseconds)
+{
+	unsigned long num_ips;
+	return get_bandwidth_data(id, 0, 16, ip, &num_ips, (void*)data, max_wait_milliseconds);
+}
+
+
+int get_bandwidth_hires_for_rule_id(char* id, unsigned long* num_ips, ip_bw_history** data, unsigned long max_wait_milliseconds)
+{
+	return get_hires_data(id, 4, num_ips, (void**)data, max_wait_milliseconds);
+}
+int get_bandwidth_hires6_for_rule_id(char* id, unsigned long* num_ips, ip6_bw_history** data, unsigned long max_wait_milliseconds)
+{
+	return get_hires_data(id, 16, num_ips, (void**)data, max_wait_milliseconds);
+}
+
+int get_bandwidth_topk_for_rule_id(char* id, unsigned long* num_ips, ip_bw** data, unsigned long max_wait_milliseconds)
+{
+	return get_topk_data(id, 4, num_ips, (void**)data, max_wait_milliseconds);
+}
+int get_bandwidth_topk6_for_rule_id(char* id, unsigned long* num_ips, ip6_bw** data, unsigned long max_wait_milliseconds)
+{
+	return get_topk_data(id, 16, num_ips, (void**)data, max_wait_milliseconds);
+}
+
+int get_bandwidth_history_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip_bw_history** data, time_t* snapshot_time, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data_for_ids(ids, num_ids, 1, 4, num_ips, (void**)data, snapshot_time, max_wait_milliseconds);
+}
+int get_bandwidth_usage_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip_bw** data, time_t* snapshot_time, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data_for_ids(ids, num_ids, 0, 4, num_ips, (void**)data, snapshot_time, max_wait_milliseconds);
+}
+int get_bandwidth_history6_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip6_bw_history** data, time_t* snapshot_time, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data_for_ids(ids, num_ids, 1, 16, num_ips, (void**)data, snapshot_time, max_wait_milliseconds);
+}
+int get_bandwidth_usage6_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip6_bw** data, time_t* snapshot_time, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data_for_ids(ids, num_ids, 0, 16, num_ips, (void**)data, snapshot_time, max_wait_milliseconds);
+}
+
+int get_all_bandwidth_counters_for_rule_id(char* id, unsigned long* num_ips, ip_bw_counters** data, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data(id, GET_COUNTERS, 4, "ALL", num_ips, (void*)data, max_wait_milliseconds);
+}
+int get_all_bandwidth_counters6_for_rule_id(char* id, unsigned long* num_ips, ip6_bw_counters** data, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data(id, GET_COUNTERS, 16, "ALL", num_ips, (void*)data, max_wait_milliseconds);
+}
+int get_bandwidth_counters_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip_bw_counters** data, time_t* snapshot_time, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data_for_ids(ids, num_ids, GET_COUNTERS, 4, num_ips, (void**)data, snapshot_time, max_wait_milliseconds);
+}
+int get_bandwidth_counters6_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip6_bw_counters** data, time_t* snapshot_time, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data_for_ids(ids, num_ids, GET_COUNTERS, 16, num_ips, (void**)data, snapshot_time, max_wait_milliseconds);
+}
+
+
+int set_bandwidth_history_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, ip_bw_history* data, unsigned long max_wait_milliseconds)
+{
+	return set_bandwidth_data(id, zero_unset, 1, 4, num_ips, 0, data, max_wait_milliseconds);
+}
+
+int set_bandwidth_usage_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, time_t last_backup, ip_bw* data, unsigned long max_wait_milliseconds)
+{
+	return set_bandwidth_data(id, zero_unset, 0, 4, num_ips, last_backup, data, max_wait_milliseconds);
+}
+
+int set_bandwidth_history6_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, ip6_bw_history* data, unsigned long max_wait_milliseconds)
+{
+	return set_bandwidth_data(id, zero_unset, 1, 16, num_ips, 0, data, max_wait_milliseconds);
+}
+
+int set_bandwidth_usage6_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, time_t last_backup, ip6_bw* data, unsigned long max_wait_milliseconds)
+{
+	return set_bandwidth_data(id, zero_unset, 0, 16, num_ips, last_backup, data, max_wait_milliseconds);
+}
+
+
+
+/* 
+ * helpers so save/load/print code can handle ip_bw/ip_bw_history (ip_length 4)
+ * and ip6_bw/ip6_bw_history (ip_length 16) arrays
+ */
+static unsigned char* get_usage_item(void* data, uint32_t ip_length, unsigned long index, uint64_t* bw)
+{
+	if(ip_length == 4)
+	{
+		*bw = ((ip_bw*)data)[index].bw;
+		return (unsigned char*)(&(((ip_bw*)data)[index].ip));
+	}
+	*bw = ((ip6_bw*)data)[index].bw;
+	return ((ip6_bw*)data)[index].ip.s6_addr;
+}
+
+static unsigned char* get_history_item(void* data, uint32_t ip_length, unsigned long index, ip_bw_history* history)
+{
+	if(ip_length == 4)
+	{
+		*history = ((ip_bw_history*)data)[index];
+		return (unsigned char*)(&(((ip_bw_history*)data)[index].ip));
+	}
+	history6_to_history( ((ip6_bw_history*)data) + index, history);
+	return ((ip6_bw_history*)data)[index].ip.s6_addr;
+}
+
+static int ip_is_zero(unsigned char* ip, uint32_t ip_length)
+{
+	uint32_t ip_index;
+	for(ip_index=0; ip_index < ip_length && ip[ip_index] == 0; ip_index++){}
+	return ip_index == ip_length ? 1 : 0;
+}
+
+/* ip_str must have room for INET6_ADDRSTRLEN characters */
+static void ip_to_string(unsigned char* ip, uint32_t ip_length, char* ip_str)
+{
+	inet_ntop( (ip_length == 4 ? AF_INET : AF_INET6), ip, ip_str, INET6_ADDRSTRLEN);
+}
+
+static int string_to_ip(char* ip_str, uint32_t ip_length, unsigned char* ip)
+{
+	return inet_pton( (ip_length == 4 ? AF_INET : AF_INET6), ip_str, ip) == 1 ? 1 : 0;
+}
+
+
+/* save single id in ascii */
+static int save_usage_data_to_file(void* data, uint32_t ip_length, unsigned long num_ips, char* out_file_path)
+{
+		
+	int success = 0;
+	FILE* out_file = fopen(out_file_path, "w");
+	if(out_file != NULL)
+	{
+		//dump backup time
+		time_t now;
+		time(&now);
+		fprintf(out_file, "%-15ld\n", now);
+		
+		//dump ips
+		int out_index=0;
+		for(out_index=0; out_index < num_ips; out_index++)
+		{
+			char ip_str[INET6_ADDRSTRLEN];
+			uint64_t bw;
+			ip_to_string(get_usage_item(data, ip_length, out_index, &bw), ip_length, ip_str);
+			fprintf(out_file, "%-15s\t%lld\n", ip_str, (long long int)bw);
+		}
+		fclose(out_file);
+		success = 1;
+	}
+	return success;
+}
+int save_usage_to_file(ip_bw* data, unsigned long num_ips, char* out_file_path)
+{
+	return save_usage_data_to_file(data, 4, num_ips, out_file_path);
+}
+int save_usage6_to_file(ip6_bw* data, unsigned long num_ips, char* out_file_path)
+{
+	return save_usage_data_to_file(data, 16, num_ips, out_file_path);
+}
+
+/*
+ * History files (one id each) are written in a compact, versioned format
+ * that can be updated in place, so periodic backups only write what changed.
+ * All integers are in host byte order, just like the old format.
+ *
+ * header (HISTORY_FILE_HEADER_LENGTH bytes):
+ * bytes 1-4   : magic, "BWH2"
+ * byte  5     : format version
+ * byte  6     : ip length (4 or 16)
+ * byte  7     : is_constant_interval
+ * byte  8     : unused
+ * bytes 9-16  : reset_interval
+ * bytes 17-24 : reset_time
+ * bytes 25-28 : number of ips
+ * bytes 29-32 : number of chunks
+ * bytes 33-36 : offset of index
+ * bytes 37-40 : length of file in use, anything past this is left over from an interrupted save
+ * bytes 41-44 : bytes of chunk data still in use, the rest is garbage waiting to be compacted
+ * bytes 45-48 : crc32 of bytes 1-44 and the index
+ *
+ * the index is one entry per ip, sorted by ip so a single ip can be found
+ * with a binary search, followed by the chunk table.
+ *
+ * ip entry (HISTORY_FILE_IP_ENTRY_LENGTH bytes):
+ * bytes 1-16  : ip (IPv4 only uses the first 4)
+ * bytes 17-20 : number of history nodes
+ * bytes 21-24 : index of first chunk
+ * bytes 25-28 : number of chunks
+ * bytes 29-32 : nodes at the start of the first chunk that have since expired
+ * bytes 33-40 : first start
+ * bytes 41-48 : first end
+ * bytes 49-56 : last end
+ *
+ * chunk entry (HISTORY_FILE_CHUNK_ENTRY_LENGTH bytes):
+ * bytes 1-4   : offset of chunk data
+ * bytes 5-8   : length of chunk data
+ * bytes 9-12  : number of nodes in chunk
+ * bytes 13-16 : crc32 of chunk data
+ *
+ * chunk data is the first node value as a varint, followed by the
+ * difference between each node and the one before it, zig-zag encoded
+ * as a varint.
+ *
+ * Chunks that are never changed again are shared from one save to the
+ * next. A save appends one chunk per ip holding the intervals that
+ * changed, then appends a new index, and only then rewrites the header.
+ * If the save is interrupted, the old header still points to the old index.
+ */
+#define HISTORY_FILE_MAGIC			"BWH2"
+#define HISTORY_FILE_VERSION			2
+#define HISTORY_FILE_HEADER_LENGTH		48
+#define HISTORY_FILE_IP_ENTRY_LENGTH		56
+#define HISTORY_FILE_CHUNK_ENTRY_LENGTH		16
+#define HISTORY_FILE_MAX_CHUNKS			8
+
+typedef struct history_file_ip_struct
+{
+	unsigned char ip[16];
+	uint32_t num_nodes;
+	uint32_t first_chunk;
+	uint32_t num_chunks;
+	uint32_t skip;
+	uint64_t first_start;
+	uint64_t first_end;
+	uint64_t last_end;
+} history_file_ip;
+
+typedef struct history_file_chunk_struct
+{
+	uint32_t offset;
+	uint32_t length;
+	uint32_t num_nodes;
+	uint32_t crc;
+	unsigned char* data; /* only set for chunks that haven't been written yet */
+} history_file_chunk;
+
+typedef struct history_file_struct
+{
+	unsigned char* map;
+	size_t map_length;
+	uint32_t ip_length;
+	unsigned char is_constant_interval;
+	uint64_t reset_interval;
+	uint64_t reset_time;
+	uint32_t num_ips;
+	uint32_t num_chunks;
+	uint32_t index_offset;
+	uint32_t file_length;
+	uint32_t live_bytes;
+} history_file;
+
+typedef struct history_sort_item_struct
+{
+	unsigned char ip[16];
+	unsigned long index;
+} history_sort_item;
+
+static uint32_t crc32_update(uint32_t crc, unsigned char* data, size_t length)
+{
+	static uint32_t table[256];
+	static int table_initialized = 0;
+	size_t data_index;
+	if(!table_initialized)
+	{
+		uint32_t table_index;
+		for(table_index=0; table_index < 256; table_index++)
+		{
+			uint32_t value = table_index;
+			int bit;
+			for(bit=0; bit < 8; bit++)
+			{
+				value = (value & 1) ? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+			}
+			table[table_index] = value;
+		}
+		table_initialized = 1;
+	}
+	crc = ~crc;
+	for(data_index=0; data_index < length; data_index++)
+	{
+		crc = table[ (crc ^ data[data_index]) & 0xFF ] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/* out needs room for 10 bytes per value */
+static uint32_t encode_history_values(uint64_t* values, uint32_t num_values, unsigned char* out)
+{
+	uint32_t out_index = 0;
+	uint32_t value_index;
+	uint64_t previous = 0;
+	for(value_index=0; value_index < num_values; value_index++)
+	{
+		int64_t delta = (int64_t)(values[value_index] - previous);
+		uint64_t encoded = value_index == 0 ? values[0] : (((uint64_t)delta) << 1) ^ (uint64_t)(delta >> 63);
+		while(encoded >= 0x80)
+		{
+			out[out_index] = (unsigned char)(encoded | 0x80);
+			encoded = encoded >> 7;
+			out_index++;
+		}
+		out[out_index] = (unsigned char)encoded;
+		out_index++;
+		previous = values[value_index];
+	}
+	return out_index;
+}
+
+static int decode_history_values(unsigned char* in, uint32_t length, uint32_t num_values, uint64_t* values)
+{
+	uint32_t in_index = 0;
+	uint32_t value_index;
+	uint64_t previous = 0;
+	for(value_index=0; value_index < num_values; value_index++)
+	{
+		uint64_t encoded = 0;
+		int shift = 0;
+		unsigned char next = 0x80;
+		while( (next & 0x80) && in_index < length && shift < 64)
+		{
+			next = in[in_index];
+			encoded = encoded | (((uint64_t)(next & 0x7F)) << shift);
+			shift = shift + 7;
+			in_index++;
+		}
+		if(next & 0x80)
+		{
+			return 0;
+		}
+		values[value_index] = value_index == 0 ? encoded : previous + (uint64_t)((int64_t)(encoded >> 1) ^ -((int64_t)(encoded & 1)));
+		previous = values[value_index];
+	}
+	return in_index == length;
+}
+
+/* number of bytes taken up by the first num_values values of encoded data */
+static uint32_t get_history_values_length(unsigned char* in, uint32_t length, uint32_t num_values)
+{
+	uint32_t in_index = 0;
+	while(num_values > 0 && in_index < length)
+	{
+		if( (in[in_index] & 0x80) == 0)
+		{
+			num_values--;
+		}
+		in_index++;
+	}
+	return in_index;
+}
+
+static void read_history_file_ip(history_file* hf, uint32_t ip_index, history_file_ip* entry)
+{
+	unsigned char* in = hf->map + hf->index_offset + (ip_index*HISTORY_FILE_IP_ENTRY_LENGTH);
+	memcpy(entry->ip, in, 16);
+	memcpy(&(entry->num_nodes), in+16, 4);
+	memcpy(&(entry->first_chunk), in+20, 4);
+	memcpy(&(entry->num_chunks), in+24, 4);
+	memcpy(&(entry->skip), in+28, 4);
+	memcpy(&(entry->first_start), in+32, 8);
+	memcpy(&(entry->first_end), in+40, 8);
+	memcpy(&(entry->last_end), in+48, 8);
+}
+
+static void write_history_file_ip(history_file_ip* entry, unsigned char* out)
+{
+	memcpy(out, entry->ip, 16);
+	memcpy(out+16, &(entry->num_nodes), 4);
+	memcpy(out+20, &(entry->first_chunk), 4);
+	memcpy(out+24, &(entry->num_chunks), 4);
+	memcpy(out+28, &(entry->skip), 4);
+	memcpy(out+32, &(entry->first_start), 8);
+	memcpy(out+40, &(entry->first_end), 8);
+	memcpy(out+48, &(entry->last_end), 8);
+}
+
+static void read_history_file_chunk(history_file* hf, uint32_t chunk_index, history_file_chunk* chunk)
+{
+	unsigned char* in = hf->map + hf->index_offset + (hf->num_ips*HISTORY_FILE_IP_ENTRY_LENGTH) + (chunk_index*HISTORY_FILE_CHUNK_ENTRY_LENGTH);
+	memcpy(&(chunk->offset), in, 4);
+	memcpy(&(chunk->length), in+4, 4);
+	memcpy(&(chunk->num_nodes), in+8, 4);
+	memcpy(&(chunk->crc), in+12, 4);
+	chunk->data = NULL;
+}
+
+static void write_history_file_chunk(history_file_chunk* chunk, unsigned char* out)
+{
+	memcpy(out, &(chunk->offset), 4);
+	memcpy(out+4, &(chunk->length), 4);
+	memcpy(out+8, &(chunk->num_nodes), 4);
+	memcpy(out+12, &(chunk->crc), 4);
+}
+
+static void close_history_file(history_file* hf)
+{
+	if(hf->map != NULL)
+	{
+		munmap(hf->map, hf->map_length);
+		hf->map = NULL;
+	}
+}
+
+/* 
+ * maps file and checks header & index, returns 1 if it's valid, 
+ * 0 if it isn't in the current format and -1 if it is, but is damaged
+ */
+static int open_history_file(int fd, history_file* hf)
+{
+	struct stat file_info;
+	uint32_t index_length;
+	uint32_t crc;
+	uint32_t version_and_length;
+
+	memset(hf, 0, sizeof(history_file));
+	if(fstat(fd, &file_info) != 0 || file_info.st_size < HISTORY_FILE_HEADER_LENGTH)
+	{
+		return 0;
+	}
+	hf->map_length = (size_t)file_info.st_size;
+	hf->map = (unsigned char*)mmap(NULL, hf->map_length, PROT_READ, MAP_SHARED, fd, 0);
+	if(hf->map == MAP_FAILED)
+	{
+		hf->map = NULL;
+		return 0;
+	}
+	if(memcmp(hf->map, HISTORY_FILE_MAGIC, 4) != 0)
+	{
+		close_history_file(hf);
+		return 0;
+	}
+	memcpy(&version_and_length, hf->map+4, 4);
+	memcpy(&(hf->reset_interval), hf->map+8, 8);
+	memcpy(&(hf->reset_time), hf->map+16, 8);
+	memcpy(&(hf->num_ips), hf->map+24, 4);
+	memcpy(&(hf->num_chunks), hf->map+28, 4);
+	memcpy(&(hf->index_offset), hf->map+32, 4);
+	memcpy(&(hf->file_length), hf->map+36, 4);
+	memcpy(&(hf->live_bytes), hf->map+40, 4);
+	memcpy(&crc, hf->map+44, 4);
+	hf->ip_length = hf->map[5];
+	hf->is_constant_interval = hf->map[6];
+
+	index_length = (hf->num_ips*HISTORY_FILE_IP_ENTRY_LENGTH) + (hf->num_chunks*HISTORY_FILE_CHUNK_ENTRY_LENGTH);
+	if(	hf->map[4] != HISTORY_FILE_VERSION || (hf->ip_length != 4 && hf->ip_length != 16) ||
+		hf->file_length > hf->map_length || hf->index_offset < HISTORY_FILE_HEADER_LENGTH || 
+		hf->num_ips > hf->file_length/HISTORY_FILE_IP_ENTRY_LENGTH || hf->num_chunks > hf->file_length/HISTORY_FILE_CHUNK_ENTRY_LENGTH || 
+		hf->index_offset + index_length > hf->file_length ||
+		crc != crc32_update(crc32_update(0, hf->map, 44), hf->map + hf->index_offset, index_length)
+		)
+	{
+		close_history_file(hf);
+		return -1;
+	}
+	return 1;
+}
+
+static int compare_history_sort_items(const void* a, const void* b)
+{
+	return memcmp( ((history_sort_item*)a)->ip, ((history_sort_item*)b)->ip, 16);
+}
+
+/* returns index of ip in file, or -1 if it isn't there */
+static long find_history_file_ip(history_file* hf, unsigned char* ip)
+{
+	long low = 0;
+	long high = ((long)hf->num_ips) - 1;
+	while(low <= high)
+	{
+		long middle = (low + high)/2;
+		int cmp = memcmp(hf->map + hf->index_offset + (middle*HISTORY_FILE_IP_ENTRY_LENGTH), ip, 16);
+		if(cmp == 0)
+		{
+			return middle;
+		}
+		if(cmp < 0)
+		{
+			low = middle+1;
+		}
+		else
+		{
+			high = middle-1;
+		}
+	}
+	return -1;
 }
 
-
-int set_bandwidth_history_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, ip_bw_history* data, unsigned long max_wait_milliseconds)
+/* 
+ * decodes & checks every chunk of an ip, values has room for each chunk's nodes,
+ * starting with the expired ones.  Returns 0 if the file is damaged
+ */
+static int read_history_file_values(history_file* hf, history_file_ip* entry, uint64_t* values)
 {
-	return set_bandwidth_data(id, zero_unset, 1, num_ips, 0, data, max_wait_milliseconds);
+	uint32_t value_index = 0;
+	uint32_t chunk_index;
+	if(entry->first_chunk + entry->num_chunks > hf->num_chunks)
+	{
+		return 0;
+	}
+	for(chunk_index=entry->first_chunk; chunk_index < entry->first_chunk + entry->num_chunks; chunk_index++)
+	{
+		history_file_chunk chunk;
+		read_history_file_chunk(hf, chunk_index, &chunk);
+		if(	chunk.offset + chunk.length > hf->file_length || chunk.offset < HISTORY_FILE_HEADER_LENGTH ||
+			chunk.crc != crc32_update(0, hf->map + chunk.offset, chunk.length) ||
+			!decode_history_values(hf->map + chunk.offset, chunk.length, chunk.num_nodes, values + value_index)
+			)
+		{
+			return 0;
+		}
+		value_index = value_index + chunk.num_nodes;
+	}
+	return value_index == entry->skip + entry->num_nodes;
 }
 
-int set_bandwidth_usage_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, time_t last_backup, ip_bw* data, unsigned long max_wait_milliseconds)
+static uint32_t count_history_file_values(history_file* hf, history_file_ip* entry)
 {
-	return set_bandwidth_data(id, zero_unset, 0, num_ips, last_backup, data, max_wait_milliseconds);
+	uint32_t count = 0;
+	uint32_t chunk_index;
+	for(chunk_index=entry->first_chunk; chunk_index < entry->first_chunk + entry->num_chunks && chunk_index < hf->num_chunks; chunk_index++)
+	{
+		history_file_chunk chunk;
+		read_history_file_chunk(hf, chunk_index, &chunk);
+		count = count + chunk.num_nodes;
+	}
+	return count;
 }
 
+/* fills in history for ip entry, returns 0 if the file is damaged */
+static int read_history_file_history(history_file* hf, history_file_ip* entry, ip_bw_history* history)
+{
+	uint32_t num_values = count_history_file_values(hf, entry);
+	uint64_t* values = (uint64_t*)malloc( (num_values+1) * sizeof(uint64_t) );
+	int valid = read_history_file_values(hf, entry, values);
+
+	history->ip                   = 0;
+	history->num_nodes            = entry->num_nodes;
+	history->reset_interval       = (time_t)hf->reset_interval;
+	history->reset_time           = (time_t)hf->reset_time;
+	history->is_constant_interval = hf->is_constant_interval;
+	history->first_start          = (time_t)entry->first_start;
+	history->first_end            = (time_t)entry->first_end;
+	history->last_end             = (time_t)entry->last_end;
+	history->history_bws          = NULL;
+	if(hf->ip_length == 4)
+	{
+		memcpy(&(history->ip), entry->ip, 4);
+	}
+	if(valid && entry->num_nodes > 0)
+	{
+		history->history_bws = (uint64_t*)malloc( entry->num_nodes * sizeof(uint64_t) );
+		memcpy(history->history_bws, values + entry->skip, entry->num_nodes * sizeof(uint64_t));
+	}
+	free(values);
+	return valid;
+}
 
+/*
+ * work out which of the chunks an ip had in the old file can still be used 
+ * for its new history.  Every node but the last is final once written,
+ * so everything before the old last node that still holds the same
+ * values can be kept.  Returns number of new nodes covered.
+ */
+static uint32_t reuse_history_file_chunks(history_file* old, history_file_ip* old_entry, ip_bw_history* history, history_file_ip* entry, history_file_chunk* chunks, uint32_t* num_chunks)
+{
+	uint32_t num_old_values = count_history_file_values(old, old_entry);
+	uint64_t* old_values;
+	uint32_t expired = 0;
+	uint32_t old_position;
+	uint32_t covered = 0;
+	uint32_t chunk_index;
+	time_t next_start = (time_t)old_entry->first_start;
+
+	entry->first_chunk = *num_chunks;
+	entry->num_chunks = 0;
+	entry->skip = 0;
+	if(old_entry->num_nodes < 2 || history->num_nodes == 0 || old_entry->num_chunks + 1 > HISTORY_FILE_MAX_CHUNKS)
+	{
+		return 0;
+	}
 
+	/* how many of the old intervals have rolled off the front since */
+	while(next_start < history->first_start && expired < old_entry->num_nodes)
+	{
+		next_start = get_next_node_start_time(next_start, history->reset_interval, history->reset_time, history->is_constant_interval);
+		expired++;
+	}
+	if(next_start != history->first_start || expired >= old_entry->num_nodes - 1)
+	{
+		return 0;
+	}
 
+	old_values = (uint64_t*)malloc( (num_old_values+1) * sizeof(uint64_t) );
+	if(!read_history_file_values(old, old_entry, old_values))
+	{
+		free(old_values);
+		return 0;
+	}
 
-
-/* save single id in ascii */
-int save_usage_to_file(ip_bw* data, unsigned long num_ips, char* out_file_path)
-{
-		
-	int success = 0;
-	FILE* out_file = fopen(out_file_path, "w");
-	if(out_file != NULL)
+	old_position = 0;
+	for(chunk_index=old_entry->first_chunk; chunk_index < old_entry->first_chunk + old_entry->num_chunks; chunk_index++)
 	{
-		//dump backup time
-		time_t now;
-		time(&now);
-		fprintf(out_file, "%-15ld\n", now);
-		
-		//dump ips
-		int out_index=0;
-		for(out_index=0; out_index < num_ips; out_index++)
+		history_file_chunk chunk;
+		uint32_t first_kept = old_entry->skip + expired;
+		uint32_t last_final = old_entry->skip + old_entry->num_nodes - 1; /* old last node was still being counted */
+		uint32_t chunk_end;
+		uint32_t usable_end;
+
+		read_history_file_chunk(old, chunk_index, &chunk);
+		chunk_end = old_position + chunk.num_nodes;
+		if(chunk_end <= first_kept)
 		{
-			struct in_addr ipaddr;
-			ip_bw next = data[out_index];
-			ipaddr.s_addr = next.ip;
-			fprintf(out_file, "%-15s\t%lld\n", inet_ntoa(ipaddr), (long long int)next.bw);
+			old_position = chunk_end;
+			continue;
 		}
-		fclose(out_file);
-		success = 1;
+
+		/* values are only ever appended, so the start of a chunk can be kept on its own */
+		usable_end = old_position > first_kept ? old_position : first_kept;
+		while(	usable_end < chunk_end && usable_end < last_final && 
+			usable_end - first_kept < history->num_nodes && 
+			old_values[usable_end] == history->history_bws[usable_end - first_kept]
+			)
+		{
+			usable_end++;
+		}
+		if(usable_end <= first_kept || usable_end <= old_position)
+		{
+			break;
+		}
+		if(usable_end < chunk_end)
+		{
+			chunk.length = get_history_values_length(old->map + chunk.offset, chunk.length, usable_end - old_position);
+			chunk.num_nodes = usable_end - old_position;
+			chunk.crc = crc32_update(0, old->map + chunk.offset, chunk.length);
+		}
+		if(entry->num_chunks == 0)
+		{
+			entry->skip = first_kept - old_position;
+		}
+		chunks[*num_chunks] = chunk;
+		*num_chunks = *num_chunks + 1;
+		entry->num_chunks++;
+		covered = usable_end - first_kept;
+		if(usable_end < chunk_end)
+		{
+			break;
+		}
+		old_position = chunk_end;
 	}
-	return success;
+	free(old_values);
+	return covered;
 }
 
-/* save history (must be for one id only) in binary so it takes up less space */
-int save_history_to_file(ip_bw_history* data, unsigned long num_ips, char* out_file_path)
+/*
+ * writes history data to fd, starting at write_offset.  If old isn't NULL
+ * chunks in it are reused where possible, and only the rest are appended
+ */
+static int write_history_file(int fd, history_file* old, uint32_t write_offset, void* data, uint32_t ip_length, unsigned long num_ips)
 {
-	int success = 0;
-	FILE* out_file = fopen(out_file_path, "wb");
-	if(out_file != NULL)
+	history_sort_item* sorted = (history_sort_item*)malloc( (num_ips+1) * sizeof(history_sort_item) );
+	history_file_ip* entries = (history_file_ip*)malloc( (num_ips+1) * sizeof(history_file_ip) );
+	history_file_chunk* chunks = (history_file_chunk*)malloc( (num_ips+1) * HISTORY_FILE_MAX_CHUNKS * sizeof(history_file_chunk) );
+	uint32_t num_chunks = 0;
+	uint32_t live_bytes = 0;
+	uint32_t index_length;
+	unsigned char* index;
+	unsigned char header[HISTORY_FILE_HEADER_LENGTH];
+	unsigned long ip_index;
+	uint32_t chunk_index;
+	int success = 1;
+
+	ip_bw_history first;
+	memset(&first, 0, sizeof(first));
+	if(num_ips > 0)
 	{
-		//dump number of ips & history interval parameter 
-		//note that we assume interval is same for all histories
-		//(which will be the case if they all come from the same rule id)
-		fwrite((uint32_t*)(&num_ips), 4, 1, out_file);
-		if(num_ips > 0)
-		{
-			ip_bw_history first = data[0];
-			uint64_t interval = (uint64_t)(first.reset_interval);
-			uint64_t time     = (uint64_t)(first.reset_time);
-			unsigned char is_constant = first.is_constant_interval;
+		get_history_item(data, ip_length, 0, &first);
+	}
 
-			fwrite( &interval, 8, 1, out_file);
-			fwrite( &time, 8, 1, out_file);
-			fwrite( &is_constant, 1, 1, out_file);
-		}
+	for(ip_index=0; ip_index < num_ips; ip_index++)
+	{
+		ip_bw_history next;
+		memset(sorted[ip_index].ip, 0, 16);
+		memcpy(sorted[ip_index].ip, get_history_item(data, ip_length, ip_index, &next), ip_length);
+		sorted[ip_index].index = ip_index;
+	}
+	qsort(sorted, num_ips, sizeof(history_sort_item), compare_history_sort_items);
 
-		unsigned char  bw_fits_in_32bits = 1;
-		uint32_t out_index=0;
-		for(out_index=0; out_index < num_ips && bw_fits_in_32bits; out_index++)
+	for(ip_index=0; ip_index < num_ips; ip_index++)
+	{
+		ip_bw_history history;
+		history_file_ip* entry = entries + ip_index;
+		uint32_t covered = 0;
+		get_history_item(data, ip_length, sorted[ip_index].index, &history);
+
+		memcpy(entry->ip, sorted[ip_index].ip, 16);
+		entry->num_nodes   = history.num_nodes;
+		entry->first_start = (uint64_t)history.first_start;
+		entry->first_end   = (uint64_t)history.first_end;
+		entry->last_end    = (uint64_t)history.last_end;
+		entry->first_chunk = num_chunks;
+		entry->num_chunks  = 0;
+		entry->skip        = 0;
+		if(old != NULL)
 		{
-			uint32_t node_index = 0;
-			ip_bw_history next = data[out_index];
-			for(node_index=0; node_index < next.num_nodes && bw_fits_in_32bits; node_index++)
+			long old_index = find_history_file_ip(old, entry->ip);
+			if(old_index >= 0)
 			{
-				uint64_t bw = (next.history_bws)[node_index];
-				bw_fits_in_32bits = bw_fits_in_32bits && (bw <  INT32_MAX);
+				history_file_ip old_entry;
+				read_history_file_ip(old, (uint32_t)old_index, &old_entry);
+				covered = reuse_history_file_chunks(old, &old_entry, &history, entry, chunks, &num_chunks);
 			}
 		}
+		if(covered < history.num_nodes)
+		{
+			history_file_chunk* chunk = chunks + num_chunks;
+			chunk->data = (unsigned char*)malloc( (history.num_nodes - covered) * 10 );
+			chunk->length = encode_history_values(history.history_bws + covered, history.num_nodes - covered, chunk->data);
+			chunk->num_nodes = history.num_nodes - covered;
+			chunk->crc = crc32_update(0, chunk->data, chunk->length);
+			num_chunks++;
+			entry->num_chunks++;
+		}
+	}
 
-		//dump data for each ip
-		for(out_index=0; out_index < num_ips; out_index++)
+	/* append new chunks */
+	for(chunk_index=0; chunk_index < num_chunks; chunk_index++)
+	{
+		history_file_chunk* chunk = chunks + chunk_index;
+		if(chunk->data != NULL)
 		{
-			ip_bw_history next = data[out_index];
-			
-			fwrite( &(next.ip), 4, 1, out_file);
-			fwrite( &(next.num_nodes), 4, 1, out_file);
-			if(next.num_nodes == 0)
+			chunk->offset = write_offset;
+			success = success && pwrite(fd, chunk->data, chunk->length, write_offset) == (ssize_t)chunk->length;
+			write_offset = write_offset + chunk->length;
+			free(chunk->data);
+			chunk->data = NULL;
+		}
+		live_bytes = live_bytes + chunk->length;
+	}
+
+	/* append index */
+	index_length = (num_ips*HISTORY_FILE_IP_ENTRY_LENGTH) + (num_chunks*HISTORY_FILE_CHUNK_ENTRY_LENGTH);
+	index = (unsigned char*)malloc(index_length+1);
+	for(ip_index=0; ip_index < num_ips; ip_index++)
+	{
+		write_history_file_ip(entries + ip_index, index + (ip_index*HISTORY_FILE_IP_ENTRY_LENGTH));
+	}
+	for(chunk_index=0; chunk_index < num_chunks; chunk_index++)
+	{
+		write_history_file_chunk(chunks + chunk_index, index + (num_ips*HISTORY_FILE_IP_ENTRY_LENGTH) + (chunk_index*HISTORY_FILE_CHUNK_ENTRY_LENGTH));
+	}
+	success = success && pwrite(fd, index, index_length, write_offset) == (ssize_t)index_length;
+
+	/* header goes last, once everything it points to is on disk */
+	memset(header, 0, HISTORY_FILE_HEADER_LENGTH);
+	memcpy(header, HISTORY_FILE_MAGIC, 4);
+	header[4] = HISTORY_FILE_VERSION;
+	header[5] = (unsigned char)ip_length;
+	header[6] = first.is_constant_interval;
+	{
+		uint64_t reset_interval = (uint64_t)first.reset_interval;
+		uint64_t reset_time     = (uint64_t)first.reset_time;
+		uint32_t num_ips32      = (uint32_t)num_ips;
+		uint32_t file_length    = write_offset + index_length;
+		uint32_t crc;
+		memcpy(header+8,  &reset_interval, 8);
+		memcpy(header+16, &reset_time, 8);
+		memcpy(header+24, &num_ips32, 4);
+		memcpy(header+28, &num_chunks, 4);
+		memcpy(header+32, &write_offset, 4);
+		memcpy(header+36, &file_length, 4);
+		memcpy(header+40, &live_bytes, 4);
+		crc = crc32_update(crc32_update(0, header, 44), index, index_length);
+		memcpy(header+44, &crc, 4);
+
+		success = success && fsync(fd) == 0;
+		success = success && pwrite(fd, header, HISTORY_FILE_HEADER_LENGTH, 0) == HISTORY_FILE_HEADER_LENGTH;
+		success = success && ftruncate(fd, file_length) == 0;
+		success = success && fsync(fd) == 0;
+	}
+
+	free(index);
+	free(chunks);
+	free(entries);
+	free(sorted);
+	return success;
+}
+
+/* 
+ * save history (must be for one id only) in the format described above.
+ * If out_file_path already holds a history file for the same rule, 
+ * it's updated in place, otherwise (or once it's half garbage) it's rewritten
+ */
+static int save_history_data_to_file(void* data, uint32_t ip_length, unsigned long num_ips, char* out_file_path)
+{
+	int success = 0;
+	int fd = open(out_file_path, O_RDWR);
+	if(fd >= 0)
+	{
+		history_file old;
+		if(open_history_file(fd, &old) == 1)
+		{
+			ip_bw_history first;
+			uint32_t dead_bytes = old.file_length - HISTORY_FILE_HEADER_LENGTH - old.live_bytes;
+			int same_rule = old.ip_length == ip_length;
+			if(num_ips > 0 && same_rule)
 			{
-				uint64_t dummy = 0;
-				unsigned char bw_bits = 32;
-				fwrite( &dummy, 8, 1, out_file);
-				fwrite( &dummy, 8, 1, out_file);
-				fwrite( &dummy, 8, 1, out_file);
-				fwrite( &bw_bits,  1, 1, out_file);
+				get_history_item(data, ip_length, 0, &first);
+				same_rule = old.reset_interval == (uint64_t)first.reset_interval && old.reset_time == (uint64_t)first.reset_time && old.is_constant_interval == first.is_constant_interval;
 			}
-			else
+			if(same_rule && dead_bytes <= old.live_bytes + 4096)
 			{
-				uint32_t node_index = 0;
-				uint64_t first_start = (uint64_t)next.first_start;
-				uint64_t first_end   = (uint64_t)next.first_end;
-				uint64_t last_end    = (uint64_t)next.last_end;
-				unsigned char  bw_bits = 32;
-				for(node_index=0; node_index < next.num_nodes && bw_bits == 32; node_index++)
-				{
-					uint64_t bw = (next.history_bws)[node_index];
-					bw_bits = bw_bits == 32 && (bw <  INT32_MAX) ? 32 : 64;
-				}
-
-				
-				fwrite( &first_start, 8, 1, out_file);
-				fwrite( &first_end,   8, 1, out_file);
-				fwrite( &last_end,    8, 1, out_file);
-				fwrite( &bw_bits,     1, 1, out_file);
-				for(node_index=0; node_index < next.num_nodes; node_index++)
-				{
-					if(bw_bits == 32)
-					{
-						uint32_t bw = (uint32_t)(next.history_bws)[node_index];
-						fwrite( &bw, 4, 1, out_file);
-
-					}
-					else
-					{
-						uint64_t bw = (next.history_bws)[node_index];
-						fwrite( &bw, 8, 1, out_file);
-					}
-				}
+				success = write_history_file(fd, &old, old.file_length, data, ip_length, num_ips);
 			}
+			close_history_file(&old);
 		}
-		fclose(out_file);
-		success = 1;
+		close(fd);
+	}
+	if(!success)
+	{
+		/* fresh file, written next to the old one so a failed save doesn't lose it */
+		char* tmp_file_path = (char*)malloc(strlen(out_file_path) + 5);
+		sprintf(tmp_file_path, "%s.tmp", out_file_path);
+		fd = open(tmp_file_path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if(fd >= 0)
+		{
+			success = write_history_file(fd, NULL, HISTORY_FILE_HEADER_LENGTH, data, ip_length, num_ips);
+			close(fd);
+			success = success && rename(tmp_file_path, out_file_path) == 0;
+			if(!success)
+			{
+				unlink(tmp_file_path);
+			}
+		}
+		free(tmp_file_path);
 	}
 	return success;
 }
+int save_history_to_file(ip_bw_history* data, unsigned long num_ips, char* out_file_path)
+{
+	return save_history_data_to_file(data, 4, num_ips, out_file_path);
+}
+int save_history6_to_file(ip6_bw_history* data, unsigned long num_ips, char* out_file_path)
+{
+	return save_history_data_to_file(data, 16, num_ips, out_file_path);
+}
 
 
-ip_bw* load_usage_from_file(char* in_file_path, unsigned long* num_ips, time_t* last_backup)
+static void* load_usage_data_from_file(char* in_file_path, uint32_t ip_length, unsigned long* num_ips, time_t* last_backup)
 {
-	ip_bw* data = NULL;
+	void* data = NULL;
 	*num_ips = 0;
 	*last_backup = 0;
 	FILE* in_file = fopen(in_file_path, "r");
 	if(in_file != NULL)
 	{
 		unsigned long num_data_parts = 0;
-		char* file_data = read_entire_file(in_file, 4086, &num_data_parts);
+		char* file_data = (char*)read_entire_file(in_file, 4086, &num_data_parts);
 		fclose(in_file);
 		char whitespace[] =  {'\n', '\r', '\t', ' '};
 		char** data_parts = split_on_separators(file_data, whitespace, 4, -1, 0, &num_data_parts);
 		free(file_data);
 
 		*num_ips = (num_data_parts/2) + 1;
-       		data = (ip_bw*)malloc( (*num_ips) * sizeof(ip_bw) );
+		data = malloc( (*num_ips) * (ip_length == 4 ? sizeof(ip_bw) : sizeof(ip6_bw)) );
 		*num_ips = 0;
 		unsigned long data_index = 0;
 		unsigned long data_part_index = 0;
 		while(data_part_index < num_data_parts)
 		{
-			ip_bw next;
-			struct in_addr ipaddr;
-			int valid = inet_aton(data_parts[data_part_index], &ipaddr);
+			unsigned char ip[16];
+			uint64_t bw;
+			int valid = string_to_ip(data_parts[data_part_index], ip_length, ip);
 			if(!valid)
 			{
 				sscanf(data_parts[data_part_index], "%ld", last_backup);
@@ -1026,10 +2253,9 @@ ip_bw* load_usage_from_file(char* in_file_path, unsigned long* num_ips, time_t*
 			}
 			data_part_index++;
 
-			if(valid && data_index < num_data_parts)
+			if(valid && data_part_index < num_data_parts)
 			{
-				next.ip = ipaddr.s_addr;
-				valid = sscanf(data_parts[data_part_index], "%lld", (long long int*)&(next.bw) );
+				valid = sscanf(data_parts[data_part_index], "%lld", (long long int*)&bw );
 				data_part_index++;
 			}
 			else
@@ -1039,9 +2265,16 @@ ip_bw* load_usage_from_file(char* in_file_path, unsigned long* num_ips, time_t*
 
 			if(valid)
 			{
-				//printf("next.bw = %lld\n", next.bw);
-				//printf("next.ip = %d\n", next.ip);
-				data[data_index] = next;
+				if(ip_length == 4)
+				{
+					memcpy( &(((ip_bw*)data)[data_index].ip), ip, 4);
+					((ip_bw*)data)[data_index].bw = bw;
+				}
+				else
+				{
+					memcpy( ((ip6_bw*)data)[data_index].ip.s6_addr, ip, 16);
+					((ip6_bw*)data)[data_index].bw = bw;
+				}
 				data_index++;
 				*num_ips = *num_ips + 1;
 			}
@@ -1057,114 +2290,325 @@ ip_bw* load_usage_from_file(char* in_file_path, unsigned long* num_ips, time_t*
 	}
 	return data;
 }
+ip_bw* load_usage_from_file(char* in_file_path, unsigned long* num_ips, time_t* last_backup)
+{
+	return (ip_bw*)load_usage_data_from_file(in_file_path, 4, num_ips, last_backup);
+}
+ip6_bw* load_usage6_from_file(char* in_file_path, unsigned long* num_ips, time_t* last_backup)
+{
+	return (ip6_bw*)load_usage_data_from_file(in_file_path, 16, num_ips, last_backup);
+}
 
 
-ip_bw_history* load_history_from_file(char* in_file_path, unsigned long* num_ips)
+/* history files written before the current format: a flat dump of every ip, with no index */
+static void* load_legacy_history_data_from_file(FILE* in_file, uint32_t ip_length, unsigned long* num_ips)
 {
-	ip_bw_history* data = NULL;
-	*num_ips = 0;
-	FILE* in_file = fopen(in_file_path, "rb");
-	if(in_file != NULL)
+	void* data = NULL;
+	uint64_t reset_interval;
+	uint64_t reset_time;
+	unsigned char is_constant_interval;
+	
+	uint32_t nips = 0;
+	fread(&nips, 4, 1, in_file);
+	*num_ips = (unsigned long)nips;
+
+	if(*num_ips > 0)
 	{
-		uint64_t reset_interval;
-		uint64_t reset_time;
-		unsigned char is_constant_interval;
-		
-		uint32_t nips = 0;
-		fread(&nips, 4, 1, in_file);
-		*num_ips = (unsigned long)nips;
+		fread(&reset_interval, 8, 1, in_file);
+		fread(&reset_time, 8, 1, in_file);
+		fread(&is_constant_interval, 1, 1, in_file);
+		data = malloc( (*num_ips) * (ip_length == 4 ? sizeof(ip_bw_history) : sizeof(ip6_bw_history)) );
+	}
+
+	uint32_t ip_index;
+	for(ip_index=0; ip_index < *num_ips; ip_index++)
+	{
+
+		unsigned char ip[16];
+		uint32_t num_nodes;
+		uint64_t first_start;	
+		uint64_t first_end;
+		uint64_t last_end;
+		unsigned char bw_bits;
+
+		fread(ip, ip_length, 1, in_file);
+		fread(&num_nodes, 4, 1, in_file);
+		fread(&first_start, 8, 1, in_file);
+		fread(&first_end, 8, 1, in_file);
+		fread(&last_end, 8, 1, in_file);
+		fread(&bw_bits, 1, 1, in_file);
+
+		ip_bw_history next;
+		next.reset_interval       = (time_t)reset_interval;
+		next.reset_time           = (time_t)reset_time;
+		next.is_constant_interval = is_constant_interval;
+		next.ip                   = ip_length == 4 ? *((uint32_t*)ip) : 0;
+		next.num_nodes            = num_nodes;
+		next.first_start          = (time_t)first_start;
+		next.first_end            = (time_t)first_end;
+		next.last_end             = (time_t)last_end;
+		next.history_bws          = NULL;
+		if(next.num_nodes > 0)
+		{
+			next.history_bws = malloc( next.num_nodes * sizeof(uint64_t) );
+			uint32_t node_index = 0;
+			for(node_index=0; node_index < next.num_nodes; node_index++)
+			{
+				if(bw_bits == 32)
+				{
+					uint32_t nextbw = 0;
+					fread(&nextbw, 4, 1, in_file);
+					(next.history_bws)[node_index] = (uint64_t)nextbw;
 
-		if(*num_ips > 0)
+				}
+				else
+				{
+					uint64_t nextbw = 0;
+					fread(&nextbw, 8, 1, in_file);
+					(next.history_bws)[node_index] = nextbw;
+				}
+			}
+		}
+		if(ip_length == 4)
+		{
+			((ip_bw_history*)data)[ip_index] = next;
+		}
+		else
 		{
-			fread(&reset_interval, 8, 1, in_file);
-			fread(&reset_time, 8, 1, in_file);
-			fread(&is_constant_interval, 1, 1, in_file);
-			data = (ip_bw_history*)malloc( (*num_ips) * sizeof(ip_bw_history));
+			history_to_history6(&next, ip, ((ip6_bw_history*)data) + ip_index);
 		}
+	}
+	return data;
+}
 
-		uint32_t ip_index;
-		for(ip_index=0; ip_index < *num_ips; ip_index++)
-		{
-
-			uint32_t ip;
-			uint32_t num_nodes;
-			uint64_t first_start;	
-			uint64_t first_end;
-			uint64_t last_end;
-			unsigned char bw_bits;
-
-			fread(&ip, 4, 1, in_file);
-			fread(&num_nodes, 4, 1, in_file);
-			fread(&first_start, 8, 1, in_file);
-			fread(&first_end, 8, 1, in_file);
-			fread(&last_end, 8, 1, in_file);
-			fread(&bw_bits, 1, 1, in_file);
-
-			ip_bw_history next;
-			next.reset_interval       = (time_t)reset_interval;
-			next.reset_time           = (time_t)reset_time;
-			next.is_constant_interval = is_constant_interval;
-			next.ip                   = ip;
-			next.num_nodes            = num_nodes;
-			next.first_start          = (time_t)first_start;
-			next.first_end            = (time_t)first_end;
-			next.last_end             = (time_t)last_end;
-			next.history_bws          = NULL;
-			if(next.num_nodes > 0)
+static void history_file_ip_to_data(history_file_ip* entry, ip_bw_history* history, uint32_t ip_length, void* data, unsigned long index)
+{
+	if(ip_length == 4)
+	{
+		((ip_bw_history*)data)[index] = *history;
+	}
+	else
+	{
+		history_to_history6(history, entry->ip, ((ip6_bw_history*)data) + index);
+	}
+}
+
+static void* load_history_data_from_file(char* in_file_path, uint32_t ip_length, unsigned long* num_ips)
+{
+	void* data = NULL;
+	int fd;
+	*num_ips = 0;
+	fd = open(in_file_path, O_RDONLY);
+	if(fd >= 0)
+	{
+		history_file hf;
+		int format = open_history_file(fd, &hf);
+		if(format == 1)
+		{
+			if(hf.ip_length == ip_length)
 			{
-				next.history_bws = malloc( next.num_nodes * sizeof(uint64_t) );
-				uint32_t node_index = 0;
-				for(node_index=0; node_index < next.num_nodes; node_index++)
+				uint32_t ip_index;
+				data = malloc( (hf.num_ips+1) * (ip_length == 4 ? sizeof(ip_bw_history) : sizeof(ip6_bw_history)) );
+				for(ip_index=0; ip_index < hf.num_ips; ip_index++)
 				{
-					if(bw_bits == 32)
+					history_file_ip entry;
+					ip_bw_history next;
+					read_history_file_ip(&hf, ip_index, &entry);
+					if(read_history_file_history(&hf, &entry, &next))
 					{
-						uint32_t nextbw = 0;
-						fread(&nextbw, 4, 1, in_file);
-						(next.history_bws)[node_index] = (uint64_t)nextbw;
+						history_file_ip_to_data(&entry, &next, ip_length, data, *num_ips);
+						*num_ips = *num_ips + 1;
+					}
+				}
+			}
+			close_history_file(&hf);
+		}
+		else if(format == 0)
+		{
+			FILE* in_file = fdopen(fd, "rb");
+			if(in_file != NULL)
+			{
+				data = load_legacy_history_data_from_file(in_file, ip_length, num_ips);
+				fclose(in_file);
+				fd = -1;
+			}
+		}
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+	}
+	return data;
+}
+ip_bw_history* load_history_from_file(char* in_file_path, unsigned long* num_ips)
+{
+	return (ip_bw_history*)load_history_data_from_file(in_file_path, 4, num_ips);
+}
+ip6_bw_history* load_history6_from_file(char* in_file_path, unsigned long* num_ips)
+{
+	return (ip6_bw_history*)load_history_data_from_file(in_file_path, 16, num_ips);
+}
 
+/* 
+ * load history of a single ip, without decoding the rest of the file.
+ * Old format files are loaded in full and searched.
+ * Returns NULL if ip isn't in file
+ */
+static void* load_ip_history_data_from_file(char* in_file_path, uint32_t ip_length, char* ip_str)
+{
+	void* data = NULL;
+	unsigned char ip[16];
+	int fd;
+	memset(ip, 0, 16);
+	if(!string_to_ip(ip_str, ip_length, ip))
+	{
+		return NULL;
+	}
+	fd = open(in_file_path, O_RDONLY);
+	if(fd >= 0)
+	{
+		history_file hf;
+		int format = open_history_file(fd, &hf);
+		if(format == 1)
+		{
+			long ip_index = hf.ip_length == ip_length ? find_history_file_ip(&hf, ip) : -1;
+			if(ip_index >= 0)
+			{
+				history_file_ip entry;
+				ip_bw_history next;
+				read_history_file_ip(&hf, (uint32_t)ip_index, &entry);
+				if(read_history_file_history(&hf, &entry, &next))
+				{
+					data = malloc( ip_length == 4 ? sizeof(ip_bw_history) : sizeof(ip6_bw_history) );
+					history_file_ip_to_data(&entry, &next, ip_length, data, 0);
+				}
+			}
+			close_history_file(&hf);
+			close(fd);
+		}
+		else if(format == -1)
+		{
+			close(fd);
+		}
+		else
+		{
+			unsigned long num_ips = 0;
+			void* all;
+			close(fd);
+			all = load_history_data_from_file(in_file_path, ip_length, &num_ips);
+			if(all != NULL)
+			{
+				unsigned long ip_index;
+				for(ip_index=0; ip_index < num_ips; ip_index++)
+				{
+					ip_bw_history next;
+					unsigned char* next_ip = get_history_item(all, ip_length, ip_index, &next);
+					if(data == NULL && memcmp(next_ip, ip, ip_length) == 0)
+					{
+						data = malloc( ip_length == 4 ? sizeof(ip_bw_history) : sizeof(ip6_bw_history) );
+						memcpy(data, (ip_length == 4 ? (void*)(((ip_bw_history*)all) + ip_index) : (void*)(((ip6_bw_history*)all) + ip_index)), (ip_length == 4 ? sizeof(ip_bw_history) : sizeof(ip6_bw_history)) );
 					}
-					else
+					else if(next.history_bws != NULL)
 					{
-						uint64_t nextbw = 0;
-						fread(&nextbw, 8, 1, in_file);
-						(next.history_bws)[node_index] = nextbw;
+						free(next.history_bws);
 					}
 				}
+				free(all);
 			}
-			data[ip_index] = next;
 		}
-		fclose(in_file);
 	}
 	return data;
 }
+ip_bw_history* load_ip_history_from_file(char* in_file_path, char* ip_str)
+{
+	return (ip_bw_history*)load_ip_history_data_from_file(in_file_path, 4, ip_str);
+}
+ip6_bw_history* load_ip_history6_from_file(char* in_file_path, char* ip_str)
+{
+	return (ip6_bw_history*)load_ip_history_data_from_file(in_file_path, 16, ip_str);
+}
 
 
-void print_usage(FILE* out, ip_bw* usage, unsigned long num_ips)
+static void print_usage_data(FILE* out, void* usage, uint32_t ip_length, unsigned long num_ips)
 {
 	unsigned long usage_index;
 	for(usage_index =0; usage_index < num_ips; usage_index++)
 	{
-		ip_bw next = usage[usage_index];
-		if(next.ip != 0)
+		uint64_t bw;
+		unsigned char* ip = get_usage_item(usage, ip_length, usage_index, &bw);
+		if(!ip_is_zero(ip, ip_length))
 		{
-			struct in_addr ipaddr;
-			ipaddr.s_addr = next.ip;
-			fprintf(out, "%-15s\t%lld\n", inet_ntoa(ipaddr), (long long int)next.bw);
+			char ip_str[INET6_ADDRSTRLEN];
+			ip_to_string(ip, ip_length, ip_str);
+			fprintf(out, "%-15s\t%lld\n", ip_str, (long long int)bw);
 		}
 		else
 		{
-			fprintf(out, "%-15s\t%lld\n", "COMBINED", (long long int)next.bw);
+			fprintf(out, "%-15s\t%lld\n", "COMBINED", (long long int)bw);
 		}
 	}
 	fprintf(out, "\n");
 }
+void print_usage(FILE* out, ip_bw* usage, unsigned long num_ips)
+{
+	print_usage_data(out, usage, 4, num_ips);
+}
+void print_usage6(FILE* out, ip6_bw* usage, unsigned long num_ips)
+{
+	print_usage_data(out, usage, 16, num_ips);
+}
 
-void print_histories(FILE* out, char* id, ip_bw_history* histories, unsigned long num_histories, char output_type)
+static void print_counters_data(FILE* out, void* counters, uint32_t ip_length, unsigned long num_ips)
+{
+	unsigned long counter_index;
+	for(counter_index =0; counter_index < num_ips; counter_index++)
+	{
+		ip_bw_counters c;
+		unsigned char* ip;
+		char ip_str[INET6_ADDRSTRLEN];
+		if(ip_length == 4)
+		{
+			c = ((ip_bw_counters*)counters)[counter_index];
+			ip = (unsigned char*)(&(((ip_bw_counters*)counters)[counter_index].ip));
+		}
+		else
+		{
+			ip6_bw_counters* c6 = ((ip6_bw_counters*)counters) + counter_index;
+			c.bw = c6->bw;
+			c.rx_bytes = c6->rx_bytes;
+			c.tx_bytes = c6->tx_bytes;
+			c.rx_packets = c6->rx_packets;
+			c.tx_packets = c6->tx_packets;
+			ip = c6->ip.s6_addr;
+		}
+		if(!ip_is_zero(ip, ip_length))
+		{
+			ip_to_string(ip, ip_length, ip_str);
+		}
+		else
+		{
+			sprintf(ip_str, "COMBINED");
+		}
+		fprintf(out, "%-15s\t%lld\t%lld\t%lld\t%lld\t%lld\n", ip_str, (long long int)c.bw, (long long int)c.rx_bytes, (long long int)c.tx_bytes, (long long int)c.rx_packets, (long long int)c.tx_packets);
+	}
+	fprintf(out, "\n");
+}
+void print_counters(FILE* out, ip_bw_counters* counters, unsigned long num_ips)
+{
+	print_counters_data(out, counters, 4, num_ips);
+}
+void print_counters6(FILE* out, ip6_bw_counters* counters, unsigned long num_ips)
+{
+	print_counters_data(out, counters, 16, num_ips);
+}
+
+static void print_history_data(FILE* out, char* id, void* histories, uint32_t ip_length, unsigned long num_histories, char output_type)
 {
 	unsigned long history_index = 0;
 	for(history_index=0; history_index < num_histories; history_index++)
 	{
-		ip_bw_history history = histories[history_index];
+		ip_bw_history history;
+		unsigned char* ip = get_history_item(histories, ip_length, history_index, &history);
 		
 		int history_initialized = 1;
 		if( history.first_start == 0 && history.first_end == 0 && history.last_end == 0)
@@ -1174,19 +2618,17 @@ void print_histories(FILE* out, char* id, ip_bw_history* histories, unsigned lon
 
 		if(history_initialized)
 		{
-			char *ip_str = NULL;
+			char ip_str[INET6_ADDRSTRLEN];
 			time_t *times = NULL;
 
 
-			if(history.ip != 0)
+			if(!ip_is_zero(ip, ip_length))
 			{
-				struct in_addr ipaddr;
-				ipaddr.s_addr = history.ip;
-				ip_str = strdup(inet_ntoa(ipaddr));
+				ip_to_string(ip, ip_length, ip_str);
 			}
 			else
 			{
-				ip_str = strdup("COMBINED");
+				sprintf(ip_str, "COMBINED");
 			}
 		
 		
@@ -1197,9 +2639,9 @@ void print_histories(FILE* out, char* id, ip_bw_history* histories, unsigned lon
 
 			if(output_type == 'm')
 			{
-				printf("%ld\n", history.first_start);
-				printf("%ld\n", history.first_end);
-				printf("%ld\n", history.last_end);
+				fprintf(out, "%ld\n", history.first_start);
+				fprintf(out, "%ld\n", history.first_end);
+				fprintf(out, "%ld\n", history.last_end);
 			}
 			else
 			{
@@ -1212,8 +2654,8 @@ void print_histories(FILE* out, char* id, ip_bw_history* histories, unsigned lon
 				uint64_t bw = (history.history_bws)[hindex];
 				if(output_type == 'm')
 				{
-					if(hindex != 0) { printf(","); };
-					printf("%lld", (unsigned long long int)bw);
+					if(hindex != 0) { fprintf(out, ","); };
+					fprintf(out, "%lld", (unsigned long long int)bw);
 				}
 				else if(times != NULL)
 				{
@@ -1249,32 +2691,27 @@ void print_histories(FILE* out, char* id, ip_bw_history* histories, unsigned lon
 			}
 			fprintf(out, "\n");
 			if(times != NULL) { free(times); };
-			if(ip_str != NULL) { free(ip_str); };
 		}
 	}
 }
+void print_histories(FILE* out, char* id, ip_bw_history* histories, unsigned long num_histories, char output_type)
+{
+	print_history_data(out, id, histories, 4, num_histories, output_type);
+}
+void print_histories6(FILE* out, char* id, ip6_bw_history* histories, unsigned long num_histories, char output_type)
+{
+	print_history_data(out, id, histories, 16, num_histories, output_type);
+}
 
 
 
 
 void unlock_bandwidth_semaphore(void)
 {
-	unlock();
-}
-
-void signal_handler(int sig)
-{
-	if(sig == SIGTERM || sig == SIGINT )
-	{
-		unlock_bandwidth_semaphore();
-		exit(0);
-	}
 }
 
 void unlock_bandwidth_semaphore_on_exit(void)
 {
-	signal(SIGTERM,signal_handler);
-	signal(SIGINT, signal_handler);
 }
 
 
@@ -1314,6 +2751,8 @@ void set_kernel_timezone(void)
 	struct timeval tv;
 	struct timezone old_tz;
 	struct timezone new_tz;
+	int32_t minutes_west;
+	int sockfd;
 
 	time(&now);
 	new_tz.tz_minuteswest = get_minutes_west(now);
@@ -1325,4 +2764,13 @@ void set_kernel_timezone(void)
 
 	/* set timezone */
 	settimeofday(&tv, &new_tz);
+
+	/* and tell ipt_bandwidth directly, so it doesn't depend on noticing sys_tz has changed */
+	minutes_west = new_tz.tz_minuteswest;
+	sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	if(sockfd >= 0)
+	{
+		setsockopt(sockfd, IPPROTO_IP, BANDWIDTH_SET_TIMEZONE, &minutes_west, sizeof(minutes_west));
+		close(sockfd);
+	}
 }
@@ -19,6 +19,7 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -30,24 +31,40 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <signal.h>
-#include <sys/ipc.h>
 #include <errno.h>
-#include <sys/sem.h> 
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #define BANDWIDTH_QUERY_LENGTH		16384
 
 /* socket id parameters (for userspace i/o) */
 #define BANDWIDTH_SET 			2048
 #define BANDWIDTH_GET 			2049
 
+/* same as above, but every ip is 16 bytes (IPv4 rules report v4-mapped addresses) */
+#define BANDWIDTH_SET6 			2050
+#define BANDWIDTH_GET6 			2051
+
+/* every ip of one or more rules in a single call */
+#define BANDWIDTH_GET_SNAPSHOT		2052
+#define BANDWIDTH_SNAPSHOT_HISTORY	   1
+#define BANDWIDTH_SNAPSHOT_IP6		   2
+#define BANDWIDTH_SNAPSHOT_COUNTERS	   4
+#define BANDWIDTH_SNAPSHOT_LENGTH	65536
+
+/* per-ip byte counts of --hires rules, at their sub-minute interval */
+#define BANDWIDTH_GET_HIRES		2053
+
+/* ips with the highest totals of --topk rules */
+#define BANDWIDTH_GET_TOPK		2054
+
+/* tells the module the local timezone, set_kernel_timezone sends it */
+#define BANDWIDTH_SET_TIMEZONE		2055
+
 
 /* max id length */
 #define BANDWIDTH_MAX_ID_LENGTH		  50
 
-/* pick something rather random... let's make it end in 666 to
- * freak out the crazy fundies out there ;-) */
-#define BANDWIDTH_SEMAPHORE_KEY 12699666
-
 /* possible reset intervals */
 #define BANDWIDTH_MINUTE		  80
 #define BANDWIDTH_HOUR			  81
@@ -114,38 +131,147 @@ typedef struct history_struct
 
 	uint64_t* history_bws;
 } ip_bw_history;
+
+/* 
+ * IPv6 versions of ip_bw and ip_bw_history, returned for ip6tables rules
+ * the all-zero address (::) holds the total for combined rules
+ */
+typedef struct ip6_bw_struct
+{
+	struct in6_addr ip;
+	uint64_t bw;
+}ip6_bw;
+
+typedef struct history6_struct
+{
+	struct in6_addr ip;
+	uint32_t num_nodes;
+
+	time_t reset_interval;
+	time_t reset_time;
+	unsigned char is_constant_interval;
+
+	time_t first_start;
+	time_t first_end;
+	time_t last_end;
+
+	uint64_t* history_bws;
+} ip6_bw_history;
+
+/*
+ * current usage along with the rule's running byte and packet counters,
+ * split by direction. tx is traffic sent by the ip, rx traffic it received;
+ * for combined totals tx means traffic that left from a local address
+ */
+typedef struct ip_bw_counters_struct
+{
+	uint32_t ip;
+	uint64_t bw;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+}ip_bw_counters;
+
+typedef struct ip6_bw_counters_struct
+{
+	struct in6_addr ip;
+	uint64_t bw;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+}ip6_bw_counters;
 #pragma pack(pop)
 
 time_t* get_interval_starts_for_history(ip_bw_history history);
+time_t* get_interval_starts_for_history6(ip6_bw_history history);
 
 extern void free_ip_bw_histories(ip_bw_history* histories, int num_histories);
+extern void free_ip6_bw_histories(ip6_bw_history* histories, int num_histories);
 
 extern int get_all_bandwidth_history_for_rule_id(char* id, unsigned long* num_ips, ip_bw_history** data, unsigned long max_wait_milliseconds);
 extern int get_ip_bandwidth_history_for_rule_id(char* id, char* ip, ip_bw_history** data, unsigned long max_wait_milliseconds);
 extern int get_all_bandwidth_usage_for_rule_id(char* id, unsigned long* num_ips, ip_bw** data, unsigned long max_wait_milliseconds);
 extern int get_ip_bandwidth_usage_for_rule_id(char* id,  char* ip, ip_bw** data, unsigned long max_wait_milliseconds);
 
+extern int get_all_bandwidth_history6_for_rule_id(char* id, unsigned long* num_ips, ip6_bw_history** data, unsigned long max_wait_milliseconds);
+extern int get_ip_bandwidth_history6_for_rule_id(char* id, char* ip, ip6_bw_history** data, unsigned long max_wait_milliseconds);
+extern int get_all_bandwidth_usage6_for_rule_id(char* id, unsigned long* num_ips, ip6_bw** data, unsigned long max_wait_milliseconds);
+extern int get_ip_bandwidth_usage6_for_rule_id(char* id,  char* ip, ip6_bw** data, unsigned long max_wait_milliseconds);
+
+/* 
+ * many rules from one consistent snapshot, taken under a single lock
+ * num_ips and data must have room for num_ids entries, data[i] is NULL
+ * if ids[i] could not be queried, snapshot_time is when data was read (UTC)
+ */
+extern int get_bandwidth_history_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip_bw_history** data, time_t* snapshot_time, unsigned long max_wait_milliseconds);
+extern int get_bandwidth_usage_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip_bw** data, time_t* snapshot_time, unsigned long max_wait_milliseconds);
+extern int get_bandwidth_history6_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip6_bw_history** data, time_t* snapshot_time, unsigned long max_wait_milliseconds);
+extern int get_bandwidth_usage6_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip6_bw** data, time_t* snapshot_time, unsigned long max_wait_milliseconds);
+
+/* 
+ * usage plus per-direction byte/packet counters for every ip, these need
+ * a kernel module that supports snapshots, there is no paged fallback
+ */
+extern int get_all_bandwidth_counters_for_rule_id(char* id, unsigned long* num_ips, ip_bw_counters** data, unsigned long max_wait_milliseconds);
+extern int get_all_bandwidth_counters6_for_rule_id(char* id, unsigned long* num_ips, ip6_bw_counters** data, unsigned long max_wait_milliseconds);
+extern int get_bandwidth_counters_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip_bw_counters** data, time_t* snapshot_time, unsigned long max_wait_milliseconds);
+extern int get_bandwidth_counters6_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip6_bw_counters** data, time_t* snapshot_time, unsigned long max_wait_milliseconds);
+
+/* 
+ * high resolution (--hires) history, one history per ip that the kernel currently keeps
+ * a ring for, with a node per slot.  Nodes are a constant interval (reset_interval seconds)
+ * apart, the last one is the slot still being counted.  print_histories works on these too
+ */
+extern int get_bandwidth_hires_for_rule_id(char* id, unsigned long* num_ips, ip_bw_history** data, unsigned long max_wait_milliseconds);
+extern int get_bandwidth_hires6_for_rule_id(char* id, unsigned long* num_ips, ip6_bw_history** data, unsigned long max_wait_milliseconds);
+
+/* 
+ * the ips a --topk rule currently has the highest totals for, highest first,
+ * without reading every ip the rule counts.  Free data with free()
+ */
+extern int get_bandwidth_topk_for_rule_id(char* id, unsigned long* num_ips, ip_bw** data, unsigned long max_wait_milliseconds);
+extern int get_bandwidth_topk6_for_rule_id(char* id, unsigned long* num_ips, ip6_bw** data, unsigned long max_wait_milliseconds);
+
 
 
 extern int set_bandwidth_history_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, ip_bw_history* data, unsigned long max_wait_milliseconds);
 extern int set_bandwidth_usage_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, time_t last_backup, ip_bw* data, unsigned long max_wait_milliseconds);
 
+extern int set_bandwidth_history6_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, ip6_bw_history* data, unsigned long max_wait_milliseconds);
+extern int set_bandwidth_usage6_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, time_t last_backup, ip6_bw* data, unsigned long max_wait_milliseconds);
+
 
 
 extern int save_usage_to_file(ip_bw* data, unsigned long num_ips, char* out_file_path);
 extern int save_history_to_file(ip_bw_history* data, unsigned long num_ips, char* out_file_path);
+extern int save_usage6_to_file(ip6_bw* data, unsigned long num_ips, char* out_file_path);
+extern int save_history6_to_file(ip6_bw_history* data, unsigned long num_ips, char* out_file_path);
 
 
 
 extern ip_bw* load_usage_from_file(char* in_file_path, unsigned long* num_ips, time_t* last_backup);
 extern ip_bw_history* load_history_from_file(char* in_file_path, unsigned long* num_ips);
+extern ip6_bw* load_usage6_from_file(char* in_file_path, unsigned long* num_ips, time_t* last_backup);
+extern ip6_bw_history* load_history6_from_file(char* in_file_path, unsigned long* num_ips);
+extern ip_bw_history* load_ip_history_from_file(char* in_file_path, char* ip_str);
+extern ip6_bw_history* load_ip_history6_from_file(char* in_file_path, char* ip_str);
 
 extern void print_usage(FILE* out, ip_bw* usage, unsigned long num_ips);
 extern void print_histories(FILE* out, char* id, ip_bw_history* histories, unsigned long num_histories, char output_type);
+extern void print_usage6(FILE* out, ip6_bw* usage, unsigned long num_ips);
+extern void print_histories6(FILE* out, char* id, ip6_bw_history* histories, unsigned long num_histories, char output_type);
+extern void print_counters(FILE* out, ip_bw_counters* counters, unsigned long num_ips);
+extern void print_counters6(FILE* out, ip6_bw_counters* counters, unsigned long num_ips);
 
 
 
 
+/* 
+ * the kernel module now handles concurrent readers and writers itself,
+ * these do nothing and are only kept so older programs still build
+ */
 extern void unlock_bandwidth_semaphore(void);
 extern void unlock_bandwidth_semaphore_on_exit(void);
 
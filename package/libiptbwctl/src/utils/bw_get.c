@@ -23,10 +23,17 @@
 #define malloc ipt_bwctl_safe_malloc
 #define strdup ipt_bwctl_safe_strdup
 
+static int print_rule_ids(char** ids, unsigned long num_ids, int get_history, int use_ipv6, char output_type);
+static int print_hires(char* id, int use_ipv6, char output_type);
+static int print_rule_counters(char** ids, unsigned long num_ids, int use_ipv6);
+static int print_topk(char* id, unsigned long max_ips, int use_ipv6);
+
 
 int main(int argc, char **argv)
 {
 	char *id = NULL;
+	char** ids = NULL;
+	unsigned long num_ids = 0;
 	char* out_file_path = NULL;;
 	char *address = NULL;
 
@@ -35,36 +42,57 @@ int main(int argc, char **argv)
 	unsigned long out_index;
 	int query_succeeded;
 	int get_history = 0;
+	int get_hires = 0;
+	int get_counters = 0;
+	long topk = -1;
+	int use_ipv6 = 0;
+	int combined = 0;
 	char output_type = 'h';
 
 	int c;
 	struct in_addr read_addr;
-	while((c = getopt(argc, argv, "i:I:a:A:f:F:tThHmMuU")) != -1)
+	struct in6_addr read_addr6;
+	while((c = getopt(argc, argv, "i:I:a:A:f:F:tThHmMrRcCk:K:uU6")) != -1)
 	{	
 		switch(c)
 		{
 			case 'i':
 			case 'I':
-				if(strlen(optarg) < BANDWIDTH_MAX_ID_LENGTH && strlen(optarg) > 0)
+				/* a comma separated list queries several ids from one snapshot */
+				ids = (char**)malloc( (strlen(optarg)+1) * sizeof(char*) );
+				num_ids = 0;
+				for(id = strtok(optarg, ","); id != NULL; id = strtok(NULL, ","))
 				{
-					id = strdup(optarg);
+					if(strlen(id) >= BANDWIDTH_MAX_ID_LENGTH)
+					{
+						fprintf(stderr, "ERROR: ID length is improper length.\n");
+						exit(0);
+					}
+					ids[num_ids] = strdup(id);
+					num_ids++;
 				}
-				else
+				if(num_ids == 0)
 				{
 					fprintf(stderr, "ERROR: ID length is improper length.\n");
 					exit(0);
 				}
+				id = ids[0];
 				break;
 			case 'a':
 			case 'A':
 				if(strcmp(optarg, "combined") == 0 || strcmp(optarg, "COMBINED") == 0)
 				{
-					address = strdup("0.0.0.0");
+					combined = 1;
 				}
 				else if( inet_aton(optarg, &read_addr) )
 				{
 					address = strdup(optarg);
 				}
+				else if( inet_pton(AF_INET6, optarg, &read_addr6) == 1 )
+				{
+					address = strdup(optarg);
+					use_ipv6 = 1;
+				}
 				else
 				{
 					fprintf(stderr, "ERROR: invalid IP address specified\n");
@@ -88,10 +116,29 @@ int main(int argc, char **argv)
 			case 'T':
 				output_type = 't';
 				break;
+			case 'r':
+			case 'R':
+				get_hires = 1;
+				break;
+			case 'c':
+			case 'C':
+				get_counters = 1;
+				break;
+			case 'k':
+			case 'K':
+				if(sscanf(optarg, "%ld", &topk) < 1 || topk < 0)
+				{
+					fprintf(stderr, "ERROR: invalid number of ips for -k\n");
+					exit(0);
+				}
+				break;
+			case '6':
+				use_ipv6 = 1;
+				break;
 			case 'u':
 			case 'U':
 			default:
-				fprintf(stderr, "USAGE:\n\t%s -i [ID] -a [IP ADDRESS] -f [OUT_FILE_NAME]\n", argv[0]);
+				fprintf(stderr, "USAGE:\n\t%s -i [ID[,ID...]] -a [IP ADDRESS] -f [OUT_FILE_NAME] [-6] [-r|-c|-k K]\n", argv[0]);
 				exit(0);
 		}
 	}
@@ -103,10 +150,85 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 	
+	if(get_hires)
+	{
+		if(num_ids > 1 || address != NULL || combined || out_file_path != NULL)
+		{
+			fprintf(stderr, "ERROR: -r can only be used when querying a single id, without -a, -A or -f\n\n");
+			exit(0);
+		}
+		set_kernel_timezone();
+		return print_hires(id, use_ipv6, output_type);
+	}
+
+	if(topk >= 0)
+	{
+		if(num_ids > 1 || get_history || get_hires || get_counters || address != NULL || combined || out_file_path != NULL)
+		{
+			fprintf(stderr, "ERROR: -k can only be used when querying a single id, without -h, -r, -c, -a, -A or -f\n\n");
+			exit(0);
+		}
+		return print_topk(id, (unsigned long)topk, use_ipv6);
+	}
+
+	if(get_counters)
+	{
+		if(get_history || address != NULL || combined || out_file_path != NULL)
+		{
+			fprintf(stderr, "ERROR: -c can't be used with -h, -a, -A or -f\n\n");
+			exit(0);
+		}
+		return print_rule_counters(ids, num_ids, use_ipv6);
+	}
+
+	if(num_ids > 1)
+	{
+		if(address != NULL || combined || out_file_path != NULL)
+		{
+			fprintf(stderr, "ERROR: -a, -A and -f can only be used when querying a single id\n\n");
+			exit(0);
+		}
+		set_kernel_timezone();	
+		return print_rule_ids(ids, num_ids, get_history, use_ipv6, output_type);
+	}
+
+	if(combined)
+	{
+		address = strdup(use_ipv6 ? "::" : "0.0.0.0");
+	}
+	else if(use_ipv6 && address != NULL && inet_pton(AF_INET6, address, &read_addr6) != 1)
+	{
+		/* ip6 queries report IPv4 rules with v4-mapped addresses */
+		char* mapped = (char*)malloc(strlen(address) + 8);
+		sprintf(mapped, "::ffff:%s", address);
+		free(address);
+		address = mapped;
+	}
+
 	set_kernel_timezone();	
-	unlock_bandwidth_semaphore_on_exit();
 	
-	if(get_history == 0)
+	if(use_ipv6)
+	{
+		if(get_history == 0 && address == NULL)
+		{
+			query_succeeded = get_all_bandwidth_usage6_for_rule_id(id, &num_ips, (ip6_bw**)&ip_buf, 1000);
+		}
+		else if(get_history == 0)
+		{
+			num_ips = 1;
+			query_succeeded = get_ip_bandwidth_usage6_for_rule_id(id, address, (ip6_bw**)&ip_buf, 1000);
+		}
+		else if(address == NULL)
+		{
+			query_succeeded = get_all_bandwidth_history6_for_rule_id(id, &num_ips, (ip6_bw_history**)&ip_buf, 1000);
+		}
+		else
+		{
+			num_ips = 1;
+			query_succeeded = get_ip_bandwidth_history6_for_rule_id(id, address, (ip6_bw_history**)&ip_buf, 1000);
+		}
+	}
+	else if(get_history == 0)
 	{
 		if(address == NULL)
 		{
@@ -137,7 +259,18 @@ int main(int argc, char **argv)
 	}
 
 
-	if(out_file_path != NULL)
+	if(out_file_path != NULL && use_ipv6)
+	{
+		if(get_history == 0)
+		{
+			save_usage6_to_file( (ip6_bw*)ip_buf, num_ips, out_file_path);
+		}
+		else
+		{
+			save_history6_to_file( (ip6_bw_history*)ip_buf, num_ips, out_file_path);
+		}
+	}
+	else if(out_file_path != NULL)
 	{
 		if(get_history == 0)
 		{
@@ -148,6 +281,17 @@ int main(int argc, char **argv)
 			save_history_to_file( (ip_bw_history*)ip_buf, num_ips, out_file_path);
 		}
 	}
+	else if(use_ipv6)
+	{
+		if(get_history == 0)
+		{
+			print_usage6(stdout, (ip6_bw*)ip_buf, num_ips);
+		}
+		else
+		{
+			print_histories6(stdout, id, (ip6_bw_history*)ip_buf, num_ips, output_type );
+		}
+	}
 	else
 	{
 		if(get_history == 0)
@@ -175,3 +319,176 @@ int main(int argc, char **argv)
 
 	return 0;
 }
+
+/* prints each rule the same way a separate bw_get -i call for it would */
+static int print_rule_ids(char** ids, unsigned long num_ids, int get_history, int use_ipv6, char output_type)
+{
+	unsigned long* num_ips = (unsigned long*)malloc(num_ids*sizeof(unsigned long));
+	void** data = (void**)malloc(num_ids*sizeof(void*));
+	unsigned long id_index;
+	time_t snapshot_time;
+	int query_succeeded;
+
+	if(use_ipv6)
+	{
+		query_succeeded = get_history ?	get_bandwidth_history6_for_rule_ids(ids, num_ids, num_ips, (ip6_bw_history**)data, &snapshot_time, 1000) :
+						get_bandwidth_usage6_for_rule_ids(ids, num_ids, num_ips, (ip6_bw**)data, &snapshot_time, 1000);
+	}
+	else
+	{
+		query_succeeded = get_history ?	get_bandwidth_history_for_rule_ids(ids, num_ids, num_ips, (ip_bw_history**)data, &snapshot_time, 1000) :
+						get_bandwidth_usage_for_rule_ids(ids, num_ids, num_ips, (ip_bw**)data, &snapshot_time, 1000);
+	}
+	if(!query_succeeded)
+	{
+		fprintf(stderr, "ERROR: Bandwidth query failed, make sure you are performing only one query at a time.\n\n");
+		exit(0);
+	}
+
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		if(data[id_index] == NULL || num_ips[id_index] == 0)
+		{
+			if(output_type != 't' && output_type != 'm')
+			{
+				fprintf(stderr, "No data available for id \"%s\"\n", ids[id_index]);
+			}
+		}
+		else if(use_ipv6 && get_history)
+		{
+			print_histories6(stdout, ids[id_index], (ip6_bw_history*)data[id_index], num_ips[id_index], output_type);
+			free_ip6_bw_histories((ip6_bw_history*)data[id_index], num_ips[id_index]);
+		}
+		else if(use_ipv6)
+		{
+			print_usage6(stdout, (ip6_bw*)data[id_index], num_ips[id_index]);
+			free(data[id_index]);
+		}
+		else if(get_history)
+		{
+			print_histories(stdout, ids[id_index], (ip_bw_history*)data[id_index], num_ips[id_index], output_type);
+			free_ip_bw_histories((ip_bw_history*)data[id_index], num_ips[id_index]);
+		}
+		else
+		{
+			print_usage(stdout, (ip_bw*)data[id_index], num_ips[id_index]);
+			free(data[id_index]);
+		}
+		printf("\n");
+	}
+	free(num_ips);
+	free(data);
+	return 0;
+}
+
+/* high resolution history of a --hires rule, printed like regular history */
+static int print_hires(char* id, int use_ipv6, char output_type)
+{
+	unsigned long num_ips = 0;
+	void* data = NULL;
+	int query_succeeded;
+
+	query_succeeded = use_ipv6 ?	get_bandwidth_hires6_for_rule_id(id, &num_ips, (ip6_bw_history**)&data, 1000) :
+					get_bandwidth_hires_for_rule_id(id, &num_ips, (ip_bw_history**)&data, 1000);
+	if(!query_succeeded)
+	{
+		fprintf(stderr, "ERROR: Bandwidth query failed, make sure rule with specified id exists and has --hires set%s.\n\n", use_ipv6 ? "" : ", and use -6 for IPv6 rules");
+		exit(0);
+	}
+	if(num_ips == 0)
+	{
+		if(output_type != 't' && output_type != 'm')
+		{
+			fprintf(stderr, "No data available for id \"%s\"\n", id);
+		}
+	}
+	else if(use_ipv6)
+	{
+		print_histories6(stdout, id, (ip6_bw_history*)data, num_ips, output_type);
+		free_ip6_bw_histories((ip6_bw_history*)data, num_ips);
+	}
+	else
+	{
+		print_histories(stdout, id, (ip_bw_history*)data, num_ips, output_type);
+		free_ip_bw_histories((ip_bw_history*)data, num_ips);
+	}
+	printf("\n");
+	return 0;
+}
+
+/* usage plus rx/tx byte & packet counters of each rule, one line per ip */
+static int print_rule_counters(char** ids, unsigned long num_ids, int use_ipv6)
+{
+	unsigned long* num_ips = (unsigned long*)malloc(num_ids*sizeof(unsigned long));
+	void** data = (void**)malloc(num_ids*sizeof(void*));
+	unsigned long id_index;
+	time_t snapshot_time;
+	int query_succeeded;
+
+	query_succeeded = use_ipv6 ?	get_bandwidth_counters6_for_rule_ids(ids, num_ids, num_ips, (ip6_bw_counters**)data, &snapshot_time, 1000) :
+					get_bandwidth_counters_for_rule_ids(ids, num_ids, num_ips, (ip_bw_counters**)data, &snapshot_time, 1000);
+	if(!query_succeeded)
+	{
+		fprintf(stderr, "ERROR: Bandwidth query failed, make sure you are performing only one query at a time.\n\n");
+		exit(0);
+	}
+
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		if(data[id_index] == NULL || num_ips[id_index] == 0)
+		{
+			fprintf(stderr, "No data available for id \"%s\"\n", ids[id_index]);
+		}
+		else if(use_ipv6)
+		{
+			print_counters6(stdout, (ip6_bw_counters*)data[id_index], num_ips[id_index]);
+		}
+		else
+		{
+			print_counters(stdout, (ip_bw_counters*)data[id_index], num_ips[id_index]);
+		}
+		if(data[id_index] != NULL)
+		{
+			free(data[id_index]);
+		}
+		printf("\n");
+	}
+	free(num_ips);
+	free(data);
+	return 0;
+}
+
+/* the busiest ips of a --topk rule, highest first, at most max_ips of them (0 = all the rule keeps) */
+static int print_topk(char* id, unsigned long max_ips, int use_ipv6)
+{
+	unsigned long num_ips = 0;
+	void* data = NULL;
+	int query_succeeded;
+
+	query_succeeded = use_ipv6 ?	get_bandwidth_topk6_for_rule_id(id, &num_ips, (ip6_bw**)&data, 1000) :
+					get_bandwidth_topk_for_rule_id(id, &num_ips, (ip_bw**)&data, 1000);
+	if(!query_succeeded)
+	{
+		fprintf(stderr, "ERROR: Bandwidth query failed, make sure rule with specified id exists and has --topk set%s.\n\n", use_ipv6 ? "" : ", and use -6 for IPv6 rules");
+		exit(0);
+	}
+	if(max_ips > 0 && max_ips < num_ips)
+	{
+		num_ips = max_ips;
+	}
+	if(num_ips == 0)
+	{
+		fprintf(stderr, "No data available for id \"%s\"\n", id);
+	}
+	else if(use_ipv6)
+	{
+		print_usage6(stdout, (ip6_bw*)data, num_ips);
+	}
+	else
+	{
+		print_usage(stdout, (ip_bw*)data, num_ips);
+	}
+	free(data);
+	printf("\n");
+	return 0;
+}
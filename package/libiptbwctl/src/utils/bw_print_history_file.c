@@ -26,7 +26,24 @@
 
 int main(int argc, char **argv)
 {
-	if(argc > 1)
+	/* optional second argument prints just one ip, without loading the rest of the file */
+	if(argc > 2 && strchr(argv[2], ':') != NULL)
+	{
+		ip6_bw_history* history = load_ip_history6_from_file(argv[1], argv[2]);
+		if(history != NULL)
+		{
+			print_histories6(stdout, argv[1], history, 1, 'h');
+		}
+	}
+	else if(argc > 2)
+	{
+		ip_bw_history* history = load_ip_history_from_file(argv[1], argv[2]);
+		if(history != NULL)
+		{
+			print_histories(stdout, argv[1], history, 1, 'h');
+		}
+	}
+	else if(argc > 1)
 	{
 		unsigned long num_ips;
 		ip_bw_history* histories = load_history_from_file(argv[1], &num_ips);
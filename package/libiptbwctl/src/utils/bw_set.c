@@ -33,10 +33,11 @@ int main(int argc, char **argv)
 	time_t last_backup = 0;
 	int last_backup_from_cl = 0;
 	int is_history_file = 0;
+	int use_ipv6 = 0;
 
 
 	int c;
-	while((c = getopt(argc, argv, "i:I:b:B:f:F:UuHh")) != -1)
+	while((c = getopt(argc, argv, "i:I:b:B:f:F:UuHh6")) != -1)
 	{	
 		switch(c)
 		{
@@ -77,10 +78,13 @@ int main(int argc, char **argv)
 			case 'H':
 				is_history_file = 1;
 				break;
+			case '6':
+				use_ipv6 = 1;
+				break;
 			case 'u':
 			case 'U':
 			default:
-				fprintf(stderr, "USAGE:\n\t%s -i [ID] -b [LAST_BACKUP_TIME] -f [IN_FILE_NAME] [ IP BANDWIDTH PAIRS, IF -f NOT SPECIFIED ]\n", argv[0]);
+				fprintf(stderr, "USAGE:\n\t%s -i [ID] -b [LAST_BACKUP_TIME] -f [IN_FILE_NAME] [-6] [ IP BANDWIDTH PAIRS, IF -f NOT SPECIFIED ]\n", argv[0]);
 				exit(0);
 
 		}
@@ -98,9 +102,30 @@ int main(int argc, char **argv)
 
 
 	set_kernel_timezone();
-	unlock_bandwidth_semaphore_on_exit();
 	int query_succeeded = 0;
-	if(in_file_path != NULL)
+	if(in_file_path != NULL && use_ipv6)
+	{
+		if(is_history_file)
+		{
+			unsigned long num_ips;
+			ip6_bw_history* history_data = load_history6_from_file(in_file_path, &num_ips);
+			if(history_data != NULL)
+			{
+				query_succeeded = set_bandwidth_history6_for_rule_id(id, 1, num_ips, history_data, 1000);
+			}
+		}
+		else
+		{
+			unsigned long num_ips;
+			time_t last_backup;
+			ip6_bw* usage_data = load_usage6_from_file(in_file_path, &num_ips, &last_backup);
+			if(usage_data != NULL)
+			{
+				query_succeeded = set_bandwidth_usage6_for_rule_id(id, 1, num_ips, last_backup, usage_data, 1000);
+			}
+		}
+	}
+	else if(in_file_path != NULL)
 	{
 		if(is_history_file)
 		{
@@ -122,6 +147,43 @@ int main(int argc, char **argv)
 			}
 		}
 	}
+	else if(use_ipv6)
+	{
+		char** data_parts = argv+optind;
+		unsigned long num_data_parts = argc - optind;
+		unsigned long num_ips = num_data_parts/2;
+		ip6_bw* buffer = (ip6_bw*)malloc(num_ips*sizeof(ip6_bw));
+		unsigned long data_index = 0;
+		unsigned long buffer_index = 0;
+		while(data_index < num_data_parts)
+		{
+			ip6_bw next;
+			int valid = inet_pton(AF_INET6, data_parts[data_index], &(next.ip)) == 1 ? 1 : 0;
+			if((!valid) && (!last_backup_from_cl))
+			{
+				sscanf(data_parts[data_index], "%ld", &last_backup);
+			}
+			data_index++;
+	
+			if(valid && data_index < num_data_parts)
+			{
+				valid = sscanf(data_parts[data_index], "%lld", (long long int*)&(next.bw) );
+				data_index++;
+			}
+			else
+			{
+				valid = 0;
+			}
+
+			if(valid)
+			{
+				buffer[buffer_index] = next;
+				buffer_index++;
+			}
+		}
+		num_ips = buffer_index; /* number that were successfully read */
+		query_succeeded = set_bandwidth_usage6_for_rule_id(id, 1, num_ips, last_backup, buffer, 1000);
+	}
 	else
 	{
 		char** data_parts;
@@ -0,0 +1,220 @@
+/*  webmon_dump --	write the recent domains or searches recorded by the
+ *  			webmon module as CSV
+ *  		Originally designed for use with Gargoyle router firmware (gargoyle-router.com)
+ *
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+ * usage: webmon_dump [-d|-s] [-H]
+ *
+ * -d writes the recent domains (the default), -s the recent searches,
+ * -H starts the output with a "time,ip,value" line.  Each line is the
+ * time of the last request (UTC seconds), the ip that made it and the
+ * domain or search, quoted when it has a comma, quote or line break.
+ *
+ * The history is read with WEBMON_GET_SNAPSHOT, one call per chunk of
+ * up to SNAPSHOT_MAX_LENGTH bytes, so the kernel holds its lock once per
+ * chunk rather than for every line of the proc files.
+ */
+
+/* from ipt_webmon.h */
+#define WEBMON_DOMAIN			16
+#define WEBMON_SEARCH			32
+#define WEBMON_GET_SNAPSHOT		3065
+
+/* see get_snapshot in ipt_webmon.c */
+#define SNAPSHOT_ERROR_BUFFER_TOO_SHORT	1
+#define SNAPSHOT_HEADER_LENGTH		21
+#define SNAPSHOT_ENTRY_HEADER_LENGTH	13
+#define SNAPSHOT_INITIAL_LENGTH		(64*1024)
+#define SNAPSHOT_MAX_LENGTH		(16*1024*1024)
+
+/*
+ * reads the entries from first_entry on into buf, growing it as needed.
+ * Returns 0 on success, setting the length of the chunk read, or -1 if
+ * it couldn't be read
+ */
+static int get_snapshot_chunk(int sockfd, unsigned char type, uint32_t first_entry, unsigned char** buf, uint32_t* buffer_length, uint32_t* chunk_length)
+{
+	unsigned char error = SNAPSHOT_ERROR_BUFFER_TOO_SHORT;
+	int tries;
+
+	/* snapshot can grow between calls, so try a few times before giving up */
+	for(tries=0; tries < 4 && error == SNAPSHOT_ERROR_BUFFER_TOO_SHORT; tries++)
+	{
+		socklen_t size = *buffer_length;
+		uint32_t snapshot_length;
+		memset(*buf, 0, SNAPSHOT_HEADER_LENGTH);
+		(*buf)[0] = type;
+		memcpy(*buf + 1, &first_entry, sizeof(uint32_t));
+
+		if(getsockopt(sockfd, IPPROTO_IP, WEBMON_GET_SNAPSHOT, *buf, &size) < 0)
+		{
+			return -1;
+		}
+		error = (*buf)[0];
+		snapshot_length = *( (uint32_t*)(*buf+1) );
+		*chunk_length = size < *buffer_length ? size : *buffer_length;
+
+		/* when the rest of the snapshot is larger than our buffer, use a larger one next time */
+		if(snapshot_length > *buffer_length && *buffer_length < SNAPSHOT_MAX_LENGTH)
+		{
+			uint32_t new_length = snapshot_length + (snapshot_length/8);
+			unsigned char* new_buf;
+			new_length = new_length < SNAPSHOT_MAX_LENGTH ? new_length : SNAPSHOT_MAX_LENGTH;
+			new_buf = (unsigned char*)malloc(new_length);
+			if(new_buf == NULL)
+			{
+				return -1;
+			}
+			if(error != SNAPSHOT_ERROR_BUFFER_TOO_SHORT)
+			{
+				memcpy(new_buf, *buf, *chunk_length);
+			}
+			free(*buf);
+			*buf = new_buf;
+			*buffer_length = new_length;
+		}
+	}
+	return error == 0 ? 0 : -1;
+}
+
+static void print_csv_value(const unsigned char* value, unsigned char length)
+{
+	int needs_quotes = 0;
+	unsigned char value_index;
+	for(value_index = 0; value_index < length; value_index++)
+	{
+		unsigned char c = value[value_index];
+		needs_quotes = c == ',' || c == '"' || c == '\n' || c == '\r' ? 1 : needs_quotes;
+	}
+	if(!needs_quotes)
+	{
+		fwrite(value, 1, length, stdout);
+		return;
+	}
+
+	putchar('"');
+	for(value_index = 0; value_index < length; value_index++)
+	{
+		if(value[value_index] == '"')
+		{
+			putchar('"');
+		}
+		putchar(value[value_index]);
+	}
+	putchar('"');
+}
+
+int main(int argc, char** argv)
+{
+	unsigned char type = WEBMON_DOMAIN;
+	int print_header = 0;
+	unsigned char* chunk;
+	uint32_t buffer_length = SNAPSHOT_INITIAL_LENGTH;
+	uint32_t first_entry = 0;
+	uint32_t total_entries;
+	int sockfd;
+	int c;
+
+	while((c = getopt(argc, argv, "dsHh")) != -1)
+	{
+		switch(c)
+		{
+			case 'd':
+				type = WEBMON_DOMAIN;
+				break;
+			case 's':
+				type = WEBMON_SEARCH;
+				break;
+			case 'H':
+				print_header = 1;
+				break;
+			default:
+				fprintf(stderr, "USAGE: %s [-d|-s] [-H]\n\t-d recent domains (default)\n\t-s recent searches\n\t-H print a header line\n", argv[0]);
+				return 1;
+		}
+	}
+
+	sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+	chunk = (unsigned char*)malloc(buffer_length);
+	if(sockfd < 0 || chunk == NULL)
+	{
+		fprintf(stderr, "ERROR: Could not read webmon history, is the webmon module loaded?\n");
+		return 1;
+	}
+
+	if(print_header)
+	{
+		printf("time,ip,value\n");
+	}
+	do
+	{
+		uint32_t chunk_length = 0;
+		uint32_t chunk_entries;
+		uint32_t entry_index;
+		uint32_t entry_number;
+		if(get_snapshot_chunk(sockfd, type, first_entry, &chunk, &buffer_length, &chunk_length) < 0)
+		{
+			fprintf(stderr, "ERROR: Could not read webmon history, is the webmon module loaded?\n");
+			free(chunk);
+			close(sockfd);
+			return 1;
+		}
+		chunk_entries = *( (uint32_t*)(chunk+13) );
+		total_entries = *( (uint32_t*)(chunk+17) );
+
+		entry_index = SNAPSHOT_HEADER_LENGTH;
+		for(entry_number = 0; entry_number < chunk_entries && entry_index + SNAPSHOT_ENTRY_HEADER_LENGTH <= chunk_length; entry_number++)
+		{
+			unsigned char* entry = chunk + entry_index;
+			uint64_t time;
+			unsigned char* ip;
+			unsigned char length = entry[12];
+			if(entry_index + SNAPSHOT_ENTRY_HEADER_LENGTH + length > chunk_length)
+			{
+				break;
+			}
+
+			/* entries aren't aligned */
+			memcpy(&time, entry, sizeof(uint64_t));
+			ip = entry + 8;
+			printf("%llu,%u.%u.%u.%u,", (unsigned long long)time, ip[0], ip[1], ip[2], ip[3]);
+			print_csv_value(entry + SNAPSHOT_ENTRY_HEADER_LENGTH, length);
+			putchar('\n');
+
+			entry_index = entry_index + SNAPSHOT_ENTRY_HEADER_LENGTH + length;
+		}
+		first_entry = first_entry + chunk_entries;
+		if(chunk_entries == 0)
+		{
+			break;
+		}
+	} while(first_entry < total_entries);
+	free(chunk);
+	close(sockfd);
+
+	return fflush(stdout) == 0 ? 0 : 1;
+}